@@ -16,7 +16,8 @@
 
 # define  GB_CREATE_HELP_STR  "gluster-block create <volname/blockname> "      \
                                 "[ha <count>] [auth <enable|disable>] "        \
-                                "[prealloc <full|no>] [storage <filename>] "   \
+                                "[prealloc <full|wait|no>] "                   \
+                                "[storage <filename>] "                        \
                                 "[ring-buffer <size-in-MB-units>] "            \
                                 "<HOST1[,HOST2,...]> [size] [--json*]"
 # define  GB_DELETE_HELP_STR  "gluster-block delete <volname/blockname> "      \
@@ -25,11 +26,21 @@
                                 "[auth <enable|disable>] [size <size>] "       \
                                 "[force] [--json*]"
 # define  GB_REPLACE_HELP_STR "gluster-block replace <volname/blockname> "     \
-                                "<old-node> <new-node> [force] [--json*]"
+                                "<old-node> <new-node> [force] [--json*]\n"   \
+                              "gluster-block replace <volname[,volname,...]> " \
+                                "<old-node> <new-node> [parallel <count>] "    \
+                                "[force] [--json*]"
 # define  GB_GENCONF_HELP_STR "gluster-block genconfig <volname[,volume2,volume3,...]> "\
                               "enable-tpg <host> [--json*]"
 # define  GB_INFO_HELP_STR    "gluster-block info <volname/blockname> [--json*]"
 # define  GB_LIST_HELP_STR    "gluster-block list <volname> [--json*]"
+# define  GB_STATUS_HELP_STR  "gluster-block status [--json*]"
+# define  GB_REBALANCE_HELP_STR "gluster-block rebalance <volname> [dry-run] "  \
+                                "[parallel <count>] [--json*]"
+# define  GB_DRAIN_HELP_STR   "gluster-block drain <node> "                   \
+                            "<volname[,volname,...]> [parallel <count>] [--json*]"
+# define  GB_UNDRAIN_HELP_STR "gluster-block undrain <node> "                 \
+                            "<volname[,volname,...]> [parallel <count>] [--json*]"
 
 
 # define  GB_ARGCHECK_OR_RETURN(argcount, count, cmd, helpstr)        \
@@ -50,7 +61,11 @@ typedef enum clioperations {
   MODIFY_CLI = 5,
   MODIFY_SIZE_CLI = 6,
   REPLACE_CLI = 7,
-  GENCONF_CLI = 8
+  GENCONF_CLI = 8,
+  STATUS_CLI = 9,
+  REBALANCE_CLI = 10,
+  DRAIN_CLI = 11,
+  REPLACE_BULK_CLI = 12
 } clioperations;
 
 
@@ -69,6 +84,10 @@ glusterBlockCliRPC_1(void *cobj, clioperations opt)
   blockModifySizeCli *modify_size_obj;
   blockReplaceCli *replace_obj;
   blockGenConfigCli *genconfig_obj;
+  blockStatusCli *status_obj;
+  blockRebalanceCli *rebalance_obj;
+  blockDrainCli *drain_obj;
+  blockReplaceBulkCli *replace_bulk_obj;
   blockResponse reply = {0,};
   char          errMsg[2048] = {0};
 
@@ -180,6 +199,40 @@ glusterBlockCliRPC_1(void *cobj, clioperations opt)
       goto out;
     }
     break;
+  case STATUS_CLI:
+    status_obj = cobj;
+    if (block_status_cli_1(status_obj, &reply, clnt) != RPC_SUCCESS) {
+      LOG("cli", GB_LOG_ERROR, "%sdaemon status failed",
+          clnt_sperror(clnt, "block_status_cli_1"));
+      goto out;
+    }
+    break;
+  case REBALANCE_CLI:
+    rebalance_obj = cobj;
+    if (block_rebalance_cli_1(rebalance_obj, &reply, clnt) != RPC_SUCCESS) {
+      LOG("cli", GB_LOG_ERROR, "%sblock rebalance on volume %s failed",
+          clnt_sperror(clnt, "block_rebalance_cli_1"), rebalance_obj->volume);
+      goto out;
+    }
+    break;
+  case DRAIN_CLI:
+    drain_obj = cobj;
+    if (block_drain_cli_1(drain_obj, &reply, clnt) != RPC_SUCCESS) {
+      LOG("cli", GB_LOG_ERROR, "%sblock %s of node %s failed",
+          clnt_sperror(clnt, "block_drain_cli_1"),
+          drain_obj->undrain ? "undrain" : "drain", drain_obj->node);
+      goto out;
+    }
+    break;
+  case REPLACE_BULK_CLI:
+    replace_bulk_obj = cobj;
+    if (block_replace_bulk_cli_1(replace_bulk_obj, &reply, clnt) != RPC_SUCCESS) {
+      LOG("cli", GB_LOG_ERROR, "%sreplace of node %s on volume %s failed",
+          clnt_sperror(clnt, "block_replace_bulk_cli_1"),
+          replace_bulk_obj->old_node, replace_bulk_obj->volume);
+      goto out;
+    }
+    break;
   }
 
  out:
@@ -227,12 +280,14 @@ glusterBlockHelp(void)
       "commands:\n"
       "  create  <volname/blockname> [ha <count>]\n"
       "                              [auth <enable|disable>]\n"
-      "                              [prealloc <full|no>]\n"
+      "                              [prealloc <full|wait|no>]\n"
       "                              [storage <filename>]\n"
       "                              [ring-buffer <size-in-MB-units>]\n"
       "                              <host1[,host2,...]> [size]\n"
       "        create block device [defaults: ha 1, auth disable, prealloc no, size in bytes,\n"
       "                             ring-buffer default size dependends on kernel]\n"
+      "        prealloc full returns once the target is exported and preallocates in\n"
+      "        the background, prealloc wait returns once preallocated\n"
       "\n"
       "  list    <volname>\n"
       "        list available block devices.\n"
@@ -249,9 +304,27 @@ glusterBlockHelp(void)
       "  replace <volname/blockname> <old-node> <new-node> [force]\n"
       "        replace operations.\n"
       "\n"
+      "  replace <volname[,volname,...]> <old-node> <new-node> [parallel <count>] [force]\n"
+      "        replace the node on every block of the volumes that has it\n"
+      "        [defaults: parallel 8].\n"
+      "\n"
       "  genconfig <volname[,volume2,volume3,...]> enable-tpg <host>\n"
       "        generate the block volumes target configuration.\n"
       "\n"
+      "  status\n"
+      "        show gluster-blockd internal statistics.\n"
+      "\n"
+      "  rebalance <volname> [dry-run] [parallel <count>]\n"
+      "        spread the active-optimized paths of the volume's blocks evenly\n"
+      "        over their HA nodes [defaults: parallel 8].\n"
+      "\n"
+      "  drain <node> <volname[,volname,...]> [parallel <count>]\n"
+      "        move the active-optimized paths off the node, for maintenance,\n"
+      "        and keep new ones off it [defaults: parallel 8].\n"
+      "\n"
+      "  undrain <node> <volname[,volname,...]> [parallel <count>]\n"
+      "        move back the active-optimized paths drained off the node.\n"
+      "\n"
       "  help\n"
       "        show this message and exit.\n"
       "\n"
@@ -539,6 +612,14 @@ glusterBlockCreate(int argcount, char **options, int json)
       }
       break;
     case GB_CLI_CREATE_PREALLOC:
+      /* full, returning once the storage is preallocated */
+      if (!strcmp(options[optind], "wait")) {
+        optind++;
+        cobj.prealloc = 1;
+        cobj.prealloc_wait = 1;
+        PREALLOC_OPT=true;
+        break;
+      }
       ret = convertStringToTrillianParse(options[optind++]);
       if(ret >= 0) {
         cobj.prealloc = ret;
@@ -589,7 +670,7 @@ glusterBlockCreate(int argcount, char **options, int json)
   } else {
     if (PREALLOC_OPT) {
       MSG(stderr, "Inadequate arguments for create:\n%s\n", GB_CREATE_HELP_STR);
-      MSG(stderr, "%s\n", "Hint: do not use [prealloc <full|no>] in combination with [storage <filename>] option");
+      MSG(stderr, "%s\n", "Hint: do not use [prealloc <full|wait|no>] in combination with [storage <filename>] option");
       LOG("cli", GB_LOG_ERROR,
           "failed with Inadequate args for create block %s on volume %s with hosts %s",
           cobj.block_name, cobj.volume, cobj.block_hosts);
@@ -758,6 +839,82 @@ glusterBlockInfo(int argcount, char **options, int json)
 }
 
 
+static int
+glusterBlockReplaceBulk(int argcount, char **options, int json)
+{
+  blockReplaceBulkCli robj = {0};
+  int ret = -1;
+  int optind = 5;
+  ssize_t parallel;
+
+
+  if (argcount < 5 || argcount > 8) {
+    MSG(stderr, "Inadequate arguments for replace:\n%s\n", GB_REPLACE_HELP_STR);
+    return -1;
+  }
+
+  if (!glusterBlockIsVolListAcceptable(options[2])) {
+    MSG(stderr, "volume list(%s) should be delimited by '%c' character only\n%s\n",
+        options[2], GB_VOLS_DELIMITER, GB_REPLACE_HELP_STR);
+    return -1;
+  }
+  GB_STRCPYSTATIC(robj.volume, options[2]);
+
+  if (!glusterBlockIsAddrAcceptable(options[3])) {
+    MSG(stderr, "host addr (%s) should be a valid ip address\n%s\n",
+        options[3], GB_REPLACE_HELP_STR);
+    return -1;
+  }
+  GB_STRCPYSTATIC(robj.old_node, options[3]);
+
+  if (!glusterBlockIsAddrAcceptable(options[4])) {
+    MSG(stderr, "host addr (%s) should be a valid ip address\n%s\n",
+        options[4], GB_REPLACE_HELP_STR);
+    return -1;
+  }
+  GB_STRCPYSTATIC(robj.new_node, options[4]);
+
+  if (!strcmp(robj.old_node, robj.new_node)) {
+    MSG(stderr, "<old-node> (%s) and <new-node> (%s) cannot be same\n%s\n",
+        robj.old_node, robj.new_node, GB_REPLACE_HELP_STR);
+    return -1;
+  }
+
+  while (optind < argcount) {
+    if (!strcmp(options[optind], "force")) {
+      robj.force = true;
+      optind++;
+    } else if (!strcmp(options[optind], "parallel") && optind + 1 < argcount) {
+      parallel = atoll(options[optind + 1]);
+      if (parallel < 1 || parallel > GB_REBALANCE_PARALLEL_MAX) {
+        MSG(stderr, "parallel count should be between 1 and %d\n%s\n",
+            GB_REBALANCE_PARALLEL_MAX, GB_REPLACE_HELP_STR);
+        return -1;
+      }
+      robj.parallel = parallel;
+      optind += 2;
+    } else {
+      MSG(stderr, "unknown option '%s' for replace:\n%s\n",
+          options[optind], GB_REPLACE_HELP_STR);
+      return -1;
+    }
+  }
+
+  robj.json_resp = json;
+
+  getCommandString(&robj.cmd, argcount, options);
+  ret = glusterBlockCliRPC_1(&robj, REPLACE_BULK_CLI);
+  if (ret) {
+    LOG("cli", GB_LOG_ERROR, "failed replace of node %s on volume %s",
+        robj.old_node, robj.volume);
+  }
+
+  GB_FREE(robj.cmd);
+
+  return ret;
+}
+
+
 static int
 glusterBlockReplace(int argcount, char **options, int json)
 {
@@ -765,6 +922,11 @@ glusterBlockReplace(int argcount, char **options, int json)
   int ret = -1;
 
 
+  /* no block name, replace on every block of the volumes */
+  if (argcount > 2 && !strchr(options[2], '/')) {
+    return glusterBlockReplaceBulk(argcount, options, json);
+  }
+
   if (argcount < 5 || argcount > 6) {
     MSG(stderr, "Inadequate arguments for replace:\n%s\n", GB_REPLACE_HELP_STR);
     return -1;
@@ -862,6 +1024,132 @@ glusterBlockGenConfig(int argcount, char **options, int json)
 }
 
 
+static int
+glusterBlockStatus(int argcount, char **options, int json)
+{
+  blockStatusCli robj = {0};
+  int ret;
+
+
+  GB_ARGCHECK_OR_RETURN(argcount, 2, "status", GB_STATUS_HELP_STR);
+
+  robj.json_resp = json;
+
+  ret = glusterBlockCliRPC_1(&robj, STATUS_CLI);
+  if (ret) {
+    LOG("cli", GB_LOG_ERROR, "%s", "failed getting daemon status");
+  }
+
+  return ret;
+}
+
+
+static int
+glusterBlockRebalance(int argcount, char **options, int json)
+{
+  blockRebalanceCli robj = {0};
+  int ret = -1;
+  int optind = 3;
+  ssize_t parallel;
+
+
+  if (argcount < 3 || argcount > 6) {
+    MSG(stderr, "Inadequate arguments for rebalance:\n%s\n",
+        GB_REBALANCE_HELP_STR);
+    return -1;
+  }
+
+  if (!glusterBlockIsNameAcceptable(options[2])) {
+    MSG(stderr, "volume name(%s) should contain only aplhanumeric,'-', '_' "
+        "characters and should be less than 255 characters long\n%s\n",
+        options[2], GB_REBALANCE_HELP_STR);
+    return -1;
+  }
+  GB_STRCPYSTATIC(robj.volume, options[2]);
+
+  while (optind < argcount) {
+    if (!strcmp(options[optind], "dry-run")) {
+      robj.dry_run = true;
+      optind++;
+    } else if (!strcmp(options[optind], "parallel") && optind + 1 < argcount) {
+      parallel = atoll(options[optind + 1]);
+      if (parallel < 1 || parallel > GB_REBALANCE_PARALLEL_MAX) {
+        MSG(stderr, "parallel count should be between 1 and %d\n%s\n",
+            GB_REBALANCE_PARALLEL_MAX, GB_REBALANCE_HELP_STR);
+        goto out;
+      }
+      robj.parallel = parallel;
+      optind += 2;
+    } else {
+      MSG(stderr, "unknown option '%s' for rebalance:\n%s\n",
+          options[optind], GB_REBALANCE_HELP_STR);
+      goto out;
+    }
+  }
+
+  robj.json_resp = json;
+
+  getCommandString(&robj.cmd, argcount, options);
+  ret = glusterBlockCliRPC_1(&robj, REBALANCE_CLI);
+  if (ret) {
+    LOG("cli", GB_LOG_ERROR, "failed rebalance on volume %s", robj.volume);
+  }
+
+ out:
+  GB_FREE(robj.cmd);
+
+  return ret;
+}
+
+
+static int
+glusterBlockDrain(int argcount, char **options, int json, bool undrain)
+{
+  blockDrainCli dobj = {0};
+  const char *helpStr = undrain ? GB_UNDRAIN_HELP_STR : GB_DRAIN_HELP_STR;
+  int ret = -1;
+  ssize_t parallel;
+
+
+  if (argcount != 4 && argcount != 6) {
+    MSG(stderr, "Inadequate arguments for %s:\n%s\n", options[1], helpStr);
+    return -1;
+  }
+
+  GB_STRCPYSTATIC(dobj.node, options[2]);
+  GB_STRCPYSTATIC(dobj.volume, options[3]);
+  dobj.undrain = undrain;
+
+  if (argcount == 6) {
+    if (strcmp(options[4], "parallel")) {
+      MSG(stderr, "unknown option '%s' for %s:\n%s\n",
+          options[4], options[1], helpStr);
+      return -1;
+    }
+    parallel = atoll(options[5]);
+    if (parallel < 1 || parallel > GB_REBALANCE_PARALLEL_MAX) {
+      MSG(stderr, "parallel count should be between 1 and %d\n%s\n",
+          GB_REBALANCE_PARALLEL_MAX, helpStr);
+      return -1;
+    }
+    dobj.parallel = parallel;
+  }
+
+  dobj.json_resp = json;
+
+  getCommandString(&dobj.cmd, argcount, options);
+  ret = glusterBlockCliRPC_1(&dobj, DRAIN_CLI);
+  if (ret) {
+    LOG("cli", GB_LOG_ERROR, "failed %s of node %s on volume %s",
+        options[1], dobj.node, dobj.volume);
+  }
+
+  GB_FREE(dobj.cmd);
+
+  return ret;
+}
+
+
 static int
 glusterBlockParseArgs(int count, char **options)
 {
@@ -931,6 +1219,34 @@ glusterBlockParseArgs(int count, char **options)
       }
       goto out;
 
+    case GB_CLI_STATUS:
+      ret = glusterBlockStatus(count, options, json);
+      if (ret) {
+        LOG("cli", GB_LOG_ERROR, "%s", FAILED_STATUS);
+      }
+      goto out;
+
+    case GB_CLI_REBALANCE:
+      ret = glusterBlockRebalance(count, options, json);
+      if (ret) {
+        LOG("cli", GB_LOG_ERROR, "%s", FAILED_REBALANCE);
+      }
+      goto out;
+
+    case GB_CLI_DRAIN:
+      ret = glusterBlockDrain(count, options, json, false);
+      if (ret) {
+        LOG("cli", GB_LOG_ERROR, "%s", FAILED_DRAIN);
+      }
+      goto out;
+
+    case GB_CLI_UNDRAIN:
+      ret = glusterBlockDrain(count, options, json, true);
+      if (ret) {
+        LOG("cli", GB_LOG_ERROR, "%s", FAILED_UNDRAIN);
+      }
+      goto out;
+
     case GB_CLI_DELETE:
       ret = glusterBlockDelete(count, options, json);
       if (ret) {
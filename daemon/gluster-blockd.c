@@ -23,16 +23,15 @@
 # include  "lru.h"
 # include  "block.h"
 # include  "block_svc.h"
+# include  "glfs-operations.h"
 # include  "capabilities.h"
+# include  "runner.h"
 
-# define   GB_TGCLI_GLOBALS     "targetcli set "                               \
-                                "global auto_add_default_portal=false "        \
-                                "auto_enable_tpgt=false loglevel_file=info "   \
-                                "logfile=%s auto_save_on_exit=false"
+# define   GB_TGCLI_LOGFILE     "logfile=%s"
 
 # define   VERNUM_BUFLEN        8
 
-# define   GB_DISTRO_CHECK      "grep -P '(^ID=)' /etc/os-release"
+# define   GB_OS_RELEASE        "/etc/os-release"
 
 extern const char *argp_program_version;
 static gbConfig *gbCfg;
@@ -279,31 +278,36 @@ static void
 gbMinKernelVersionCheck(void)
 {
   struct utsname verStr = {'\0', };
-  char distro[32] = {'\0', };
+  char line[256];
+  char distro[sizeof(line)] = {'\0', };
   size_t vNum[VERNUM_BUFLEN] = {0, };
   FILE *fp = NULL;
   int i = 0;
   char *tptr;
 
 
-  fp = popen(GB_DISTRO_CHECK, "r");
-  if (fp) {
-    size_t newLen = fread(distro, sizeof(char), 32, fp);
-    if (ferror(fp)) {
-      LOG("mgmt", GB_LOG_ERROR, "fread(%s) failed: %s",
-          GB_DISTRO_CHECK, strerror(errno));
-      goto fail;
-    }
-    distro[newLen++] = '\0';
-    tptr = strchr(distro,'\n');
-    if (tptr) {
-      *tptr = '\0';
+  fp = fopen(GB_OS_RELEASE, "r");
+  if (!fp) {
+    LOG("mgmt", GB_LOG_ERROR, "fopen(%s): failed: %s",
+        GB_OS_RELEASE, strerror(errno));
+    goto fail;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (!strncmp(line, "ID=", 3)) {
+      snprintf(distro, sizeof(distro), "%s", line);
+      break;
     }
-  } else {
-    LOG("mgmt", GB_LOG_ERROR, "popen(%s): failed: %s",
-        GB_DISTRO_CHECK, strerror(errno));
+  }
+  if (ferror(fp)) {
+    LOG("mgmt", GB_LOG_ERROR, "reading %s failed: %s",
+        GB_OS_RELEASE, strerror(errno));
     goto fail;
   }
+  tptr = strchr(distro, '\n');
+  if (tptr) {
+    *tptr = '\0';
+  }
 
   if (uname(&verStr) != 0) {
     LOG("mgmt", GB_LOG_ERROR, "uname() failed: %s", strerror(errno));
@@ -351,7 +355,7 @@ gbMinKernelVersionCheck(void)
   LOG("mgmt", GB_LOG_INFO, "Distro %s. Current kernel version: '%s'.",
       distro, verStr.release);
 
-  pclose(fp);
+  fclose(fp);
   return;
 
  out:
@@ -361,7 +365,9 @@ gbMinKernelVersionCheck(void)
       distro, tptr, verStr.release);
 
  fail:
-  pclose(fp);
+  if (fp) {
+    fclose(fp);
+  }
 
   exit(EXIT_FAILURE);
 }
@@ -371,21 +377,27 @@ static int
 blockNodeSanityCheck(void)
 {
   int ret;
-  char *global_opts;
+  char *logfile;
+  char *tcmuArgv[] = {"ps", "-C", "tcmu-runner", "-o", "pid=", NULL};
+  char *glfsArgv[] = {"targetcli", "/backstores/user:glfs", "ls", NULL};
+  char *globalsArgv[] = {"targetcli", "set", "global",
+                         "auto_add_default_portal=false",
+                         "auto_enable_tpgt=false", "loglevel_file=info",
+                         NULL /* logfile */, "auto_save_on_exit=false", NULL};
 
 
   /* Check minimum recommended kernel version */
   gbMinKernelVersionCheck();
 
   /* Check if tcmu-runner is running */
-  ret = gbRunner("ps aux ww | grep -w '[t]cmu-runner' > /dev/null");
+  ret = gbRunner(tcmuArgv, GB_RUNNER_TIMEOUT_DEF);
   if (ret) {
     LOG("mgmt", GB_LOG_ERROR, "%s", "tcmu-runner not running");
     return ESRCH;
   }
 
   /* Check targetcli has user:glfs handler listed */
-  ret = gbRunner("targetcli /backstores/user:glfs ls > /dev/null");
+  ret = gbRunner(glfsArgv, GB_TGCLI_QUERY_TIMEOUT);
   if (ret) {
     LOG("mgmt", GB_LOG_ERROR, "%s",
         "tcmu-runner running, but targetcli doesn't list user:glfs handler");
@@ -397,12 +409,14 @@ blockNodeSanityCheck(void)
     return EKEYEXPIRED;
   }
 
-  if (GB_ASPRINTF(&global_opts, GB_TGCLI_GLOBALS, gbConf.configShellLogFile) == -1) {
+  if (GB_ASPRINTF(&logfile, GB_TGCLI_LOGFILE, gbConf.configShellLogFile) == -1) {
     return ENOMEM;
   }
+  globalsArgv[6] = logfile;
+
   /* Set targetcli globals */
-  ret = gbRunner(global_opts);
-  GB_FREE(global_opts);
+  ret = gbRunner(globalsArgv, GB_TGCLI_QUERY_TIMEOUT);
+  GB_FREE(logfile);
   if (ret) {
     LOG("mgmt", GB_LOG_ERROR, "%s",
         "targetcli set global attr failed");
@@ -427,6 +441,36 @@ initDaemonCapabilities(void)
 }
 
 
+static void
+glusterBlockDSighupHandler(int sig)
+{
+  /* reopen the log files, after logrotate */
+  gbLogReopen();
+}
+
+
+/*
+ * SIGUSR1 is blocked in every thread and taken here, where it is safe to
+ * lock and log: it dumps the allocation accounting.
+ */
+static void *
+glusterBlockDSigusrThreadProc(void *data)
+{
+  sigset_t *set = data;
+  int sig;
+
+
+  while (1) {
+    if (sigwait(set, &sig)) {
+      continue;
+    }
+    gbAllocStatsLog();
+  }
+
+  return NULL;
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -435,11 +479,14 @@ main (int argc, char **argv)
   pthread_t server_thread;
   struct flock lock = {0, };
   int errnosv = 0;
+  pthread_t sigusr_thread;
+  static sigset_t sigusr;
 
 
-  if (pthread_mutex_init(&gbConf.lock, NULL) < 0) {
-    exit(EXIT_FAILURE);
-  }
+  /* before any thread is started, so that all of them inherit the mask */
+  sigemptyset(&sigusr);
+  sigaddset(&sigusr, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigusr, NULL);
 
   if(initLogging()) {
     exit(EXIT_FAILURE);
@@ -475,6 +522,13 @@ main (int argc, char **argv)
     exit(errnosv);
   }
 
+  if (gbLogStart()) {
+    LOG("mgmt", GB_LOG_WARNING, "%s",
+        "failed to start the log writer, logging synchronously");
+  }
+  signal(SIGHUP, glusterBlockDSighupHandler);
+  pthread_create(&sigusr_thread, NULL, glusterBlockDSigusrThreadProc, &sigusr);
+
   if (!gbConf.noRemoteRpc) {
     errnosv = blockNodeSanityCheck();
     if (errnosv) {
@@ -490,6 +544,10 @@ main (int argc, char **argv)
   }
 
   initCache();
+  glusterBlockPrewarmVolumes(gbCfg->GB_GLFS_PREWARM_VOLUMES);
+  glusterBlockPreallocResume();
+  glusterBlockTrashResume();
+  glusterBlockReplaceResume();
 
   /* set signal */
   signal(SIGPIPE, SIG_IGN);
@@ -508,6 +566,7 @@ main (int argc, char **argv)
 
 
   LOG("mgmt", GB_LOG_ERROR, "svc_run returned (%s)", strerror (errno));
+  gbLockStatsLog();
 
   lock.l_type = F_UNLCK;
   if (fcntl(fd, F_SETLK, &lock) == -1) {
@@ -12,6 +12,8 @@
 # include  "common.h"
 # include  "capabilities.h"
 # include  "glfs-operations.h"
+# include  "runner.h"
+# include  "block_svc.h"
 
 # include  <pthread.h>
 # include  <netdb.h>
@@ -27,8 +29,7 @@
 # define   GB_MSERVER_DELIMITER ","
 
 # define   GB_TGCLI_GLFS_PATH   "/backstores/user:glfs"
-# define   GB_TGCLI_GLFS        "targetcli " GB_TGCLI_GLFS_PATH
-# define   GB_TGCLI_CHECK       GB_TGCLI_GLFS " ls | grep ' %s ' | grep '/%s ' > " DEVNULLPATH
+# define   GB_TGCLI             "targetcli"
 # define   GB_TGCLI_ISCSI_PATH  "/iscsi"
 # define   GB_TGCLI_GLFS_SAVE   GB_TGCLI_GLFS_PATH "/%s saveconfig"
 # define   GB_TGCLI_ATTRIBUTES  "generate_node_acls=1 demo_mode_write_protect=0"
@@ -37,11 +38,7 @@
 # define   GB_JSON_OBJ_TO_STR(x) json_object_new_string(x?x:"")
 # define   GB_DEFAULT_ERRMSG    "Operation failed, please check the log "\
                                 "file to find the reason."
-# define   GB_GET_PORTAL_TPG    "targetcli /iscsi/" GB_TGCLI_IQN_PREFIX \
-                                "'%s' ls | grep -e tpg -e '%s' | grep -B1 '%s' | grep -o 'tpg\\w'"
-# define   GB_CHECK_PORTAL      "targetcli /iscsi/" GB_TGCLI_IQN_PREFIX \
-                                "'%s' ls | grep '%s' > " DEVNULLPATH
-# define   GB_SAVECONFIG_CHECK  "grep -m 1 '\"name\": \"%s\",' " GB_SAVECONFIG " > " DEVNULLPATH
+# define   GB_SAVECONFIG_NAME   "\"name\": \"%s\","
 
 # define   GB_ALUA_AO_TPG_NAME          "glfs_tg_pt_gp_ao"
 # define   GB_ALUA_ANO_TPG_NAME         "glfs_tg_pt_gp_ano"
@@ -57,6 +54,10 @@
 # define   GB_BLOCK_NOT_LOADED  225
 # define   GB_BLOCK_NOT_FOUND   226
 
+# define   GB_TARGET_CORE_DIR   "/sys/kernel/config/target/core"
+# define   GB_LOAD_SAMPLE_USEC  1000000    /* shortest window of the rates */
+# define   GB_LOAD_CACHE_USEC   5000000    /* how long a peer's load is reused */
+
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef enum operations {
@@ -70,7 +71,12 @@ typedef enum operations {
   LIST_SRV,
   INFO_SRV,
   VERSION_SRV,
-  GENCONFIG_SRV
+  GENCONFIG_SRV,
+  STATUS_SRV,
+  LOAD_SRV,
+  REBALANCE_SRV,
+  PRIO_PATH_SRV,
+  DRAIN_SRV
 } operations;
 
 
@@ -80,6 +86,7 @@ typedef struct blockRemoteObj {
     char *volume;
     char *addr;
     char *reply;
+    void *xdata;    /* decoded typed reply, if the peer sent one */
     int  exit;
 } blockRemoteObj;
 
@@ -131,6 +138,19 @@ typedef struct blockRemoteCreateResp {
 } blockRemoteCreateResp;
 
 
+static const char *const blockCreateStepLookup[] = {
+  [GB_CREATE_STEP_BACKSTORE]  = "backend creation",
+  [GB_CREATE_STEP_IQN]        = "target iqn creation",
+  [GB_CREATE_STEP_LUN]        = "LUN creation",
+  [GB_CREATE_STEP_PORTAL]     = "portal creation",
+  [GB_CREATE_STEP_TPG_ENABLE] = "TPGT enablement",
+  [GB_CREATE_STEP_ATTRIBUTES] = "attributes set",
+  [GB_CREATE_STEP_AUTH]       = "authentication set",
+
+  [GB_CREATE_STEP_MAX]        = NULL,
+};
+
+
 static char *
 getLastWordNoDot(char *line)
 {
@@ -262,20 +282,96 @@ blockStr2arrayAddToJsonObj(json_object *json_obj, char *string, char *label)
 }
 
 
+/*
+ * Run 'targetcli <path> ls' and look for a line holding both keys (key2 is
+ * optional). Like grep(1), returns 0 on match, 1 on no match and -1 if the
+ * command could not be run or exited abnormally.
+ */
+static int
+blockTgcliLsMatch(char *path, const char *key1, const char *key2)
+{
+  char *argv[] = {GB_TGCLI, path, "ls", NULL};
+  gbRunnerResult res;
+  char *line;
+  char *sptr = NULL;
+  int ret = -1;
+
+
+  if (gbRunnerExec(argv, NULL, GB_TGCLI_QUERY_TIMEOUT, &res) < 0 ||
+      res.exitStatus == -1) {
+    goto out;
+  }
+
+  ret = 1;
+  for (line = strtok_r(res.out, "\n", &sptr); line;
+       line = strtok_r(NULL, "\n", &sptr)) {
+    if (strstr(line, key1) && (!key2 || strstr(line, key2))) {
+      ret = 0;
+      break;
+    }
+  }
+
+ out:
+  GB_FREE(res.out);
+  return ret;
+}
+
+
+/*
+ * Look for the block in the saved targetcli config. Like grep(1), returns 0
+ * on match, 1 on no match and 2 if the config file can't be read.
+ */
+static int
+blockSaveConfigMatch(char *block_name)
+{
+  FILE *fp;
+  char *pattern = NULL;
+  char *line = NULL;
+  size_t len = 0;
+  int ret = 1;
+
+
+  if (GB_ASPRINTF(&pattern, GB_SAVECONFIG_NAME, block_name) == -1) {
+    return -1;
+  }
+
+  fp = fopen(GB_SAVECONFIG, "r");
+  if (!fp) {
+    GB_FREE(pattern);
+    return 2;
+  }
+
+  while (getline(&line, &len, fp) != -1) {
+    if (strstr(line, pattern)) {
+      ret = 0;
+      break;
+    }
+  }
+
+  fclose(fp);
+  GB_FREE(line);
+  GB_FREE(pattern);
+
+  return ret;
+}
+
+
 static int
 blockCheckBlockLoadedStatus(char *block_name, char *gbid, blockResponse *reply)
 {
 
   int ret = -1;
-  char *exec = NULL;
+  char *name = NULL;
+  char *wwn = NULL;
   int is_loaded = true;
 
 
-  if (GB_ASPRINTF(&exec, GB_TGCLI_CHECK, block_name, gbid) == -1) {
+  if (GB_ASPRINTF(&name, " %s ", block_name) == -1 ||
+      GB_ASPRINTF(&wwn, "/%s ", gbid) == -1) {
     goto out;
   }
 
-  ret = gbRunner(exec);
+  ret = blockTgcliLsMatch(GB_TGCLI_GLFS_PATH, name, wwn);
   if (ret == -1) {
     GB_ASPRINTF(&reply->out, "command exit abnormally for '%s'.", block_name);
     LOG("mgmt", GB_LOG_ERROR, "%s", reply->out);
@@ -290,14 +386,8 @@ blockCheckBlockLoadedStatus(char *block_name, char *gbid, blockResponse *reply)
   if (!ret) {
     goto out;
   }
-  GB_FREE(exec);
-
-  if (GB_ASPRINTF(&exec, GB_SAVECONFIG_CHECK, block_name) == -1) {
-    ret = -1;
-    goto out;
-  }
 
-  ret = gbRunner(exec);
+  ret = blockSaveConfigMatch(block_name);
   if (ret == -1) {
     GB_FREE(reply->out);
     GB_ASPRINTF(&reply->out, "command exit abnormally for '%s'.", block_name);
@@ -323,7 +413,8 @@ blockCheckBlockLoadedStatus(char *block_name, char *gbid, blockResponse *reply)
   }
 
  out:
-  GB_FREE(exec);
+  GB_FREE(name);
+  GB_FREE(wwn);
 
   return ret;
 }
@@ -364,7 +455,7 @@ blockRemoteCreateRespParse(char *output, blockRemoteCreateResp **savereply)
   char *line;
   blockRemoteCreateResp *local = *savereply;
   char *portal = NULL;
-  char *errMsg = NULL;
+  gbStrBuf sb;
   size_t i;
   bool dup;
 
@@ -435,13 +526,9 @@ blockRemoteCreateRespParse(char *output, blockRemoteCreateResp **savereply)
       }
       break;
     case GB_FAILED_RESP:
-      errMsg = local->errMsg;
-      if (errMsg == NULL) {
-        GB_ASPRINTF(&local->errMsg, "%s", line);
-      } else {
-        GB_ASPRINTF(&local->errMsg, "%s\n%s", errMsg, line);
-      }
-      GB_FREE (errMsg);
+      gbStrBufAttach(&sb, local->errMsg);
+      gbStrBufAppendf(&sb, "%s%s", sb.len ? "\n" : "", line);
+      local->errMsg = gbStrBufDetach(&sb);
       break;
     }
 
@@ -459,6 +546,95 @@ blockRemoteCreateRespParse(char *output, blockRemoteCreateResp **savereply)
 }
 
 
+/*
+ * Same as blockRemoteCreateRespParse(), for the peers which sent back a typed
+ * blockCreateResult, so nothing has to be scanned out of the text reply.
+ */
+static int
+blockRemoteCreateResultMerge(blockRemoteObj *arg,
+                             blockRemoteCreateResp **savereply)
+{
+  blockCreateResult *res = arg->xdata;
+  blockRemoteCreateResp *local = *savereply;
+  char *portal;
+  gbStrBuf sb;
+  size_t i, j;
+  bool dup;
+
+
+  if (!local) {
+    if (GB_ALLOC(local) < 0) {
+      goto out;
+    }
+    if (GB_ALLOC(local->obj) < 0) {
+      GB_FREE(local);
+      goto out;
+    }
+  }
+
+  if (!local->backend_size && res->backend_size) {
+    if (GB_ASPRINTF(&local->backend_size, "%llu",
+                    (unsigned long long)res->backend_size) == -1) {
+      local->backend_size = NULL;
+      goto out;
+    }
+  }
+
+  if (!local->iqn && res->iqn && res->iqn[0]) {
+    if (GB_STRDUP(local->iqn, res->iqn) < 0) {
+      goto out;
+    }
+  }
+
+  for (i = 0; i < res->portals.portals_len; i++) {
+    portal = res->portals.portals_val[i];
+    dup = false;
+    for (j = 0; j < local->nportal; j++) {
+      if (!strcmp(local->portal[j], portal)) {
+        dup = true;
+        break;
+      }
+    }
+    if (dup) {
+      continue;
+    }
+    if (GB_REALLOC_N(local->portal, local->nportal + 1) < 0) {
+      goto out;
+    }
+    if (GB_STRDUP(local->portal[local->nportal], portal) < 0) {
+      goto out;
+    }
+    local->nportal++;
+  }
+
+  for (i = 0; i < res->step_status.step_status_len && i < GB_CREATE_STEP_MAX; i++) {
+    if (res->step_status.step_status_val[i] == GB_STEP_FAILED) {
+      LOG("mgmt", GB_LOG_ERROR, "%s failed on host %s",
+          blockCreateStepLookup[i], arg->addr);
+    }
+  }
+  LOG("mgmt", GB_LOG_DEBUG, "targetcli on host %s: spawn %llu usec, exec %llu usec",
+      arg->addr, (unsigned long long)res->spawn_usec,
+      (unsigned long long)res->exec_usec);
+
+  if (arg->exit && arg->reply) {
+    gbStrBufAttach(&sb, local->errMsg);
+    gbStrBufAppendf(&sb, "%s%.*s", sb.len ? "\n" : "",
+                    (int)strcspn(arg->reply, "\n"), arg->reply);
+    local->errMsg = gbStrBufDetach(&sb);
+  }
+
+  *savereply = local;
+
+  return 0;
+
+ out:
+  *savereply = local;
+
+  return -1;
+}
+
+
 struct addrinfo *
 glusterBlockGetSockaddr(char *host)
 {
@@ -504,9 +680,66 @@ convertTypeCreate2ToCreate(blockCreate2 *blk_v2, blockCreate *blk_v1)
 }
 
 
+static blockCreateResult *
+blockCreateResultDecode(char *buf, u_int len)
+{
+  XDR xdrs;
+  blockCreateResult *res = NULL;
+
+
+  if (GB_ALLOC(res) < 0) {
+    return NULL;
+  }
+
+  xdrmem_create(&xdrs, buf, len, XDR_DECODE);
+  if (!xdr_blockCreateResult(&xdrs, res)) {
+    LOG("mgmt", GB_LOG_ERROR, "%s", "failed to decode create result");
+    xdr_free((xdrproc_t)xdr_blockCreateResult, (char *)res);
+    GB_FREE(res);
+  }
+  xdr_destroy(&xdrs);
+
+  return res;
+}
+
+
+static void
+blockCreateResultFree(blockCreateResult *res)
+{
+  if (!res) {
+    return;
+  }
+
+  xdr_free((xdrproc_t)xdr_blockCreateResult, (char *)res);
+  GB_FREE(res);
+}
+
+
+static blockNodeLoad *
+blockNodeLoadDecode(char *buf, u_int len)
+{
+  XDR xdrs;
+  blockNodeLoad *load = NULL;
+
+
+  if (GB_ALLOC(load) < 0) {
+    return NULL;
+  }
+
+  xdrmem_create(&xdrs, buf, len, XDR_DECODE);
+  if (!xdr_blockNodeLoad(&xdrs, load)) {
+    LOG("mgmt", GB_LOG_ERROR, "%s", "failed to decode node load");
+    GB_FREE(load);
+  }
+  xdr_destroy(&xdrs);
+
+  return load;
+}
+
+
 int
 glusterBlockCallRPC_1(char *host, void *cobj,
-                      operations opt, bool *rpc_sent, char **out)
+                      operations opt, bool *rpc_sent, char **out, void **xdata)
 {
   CLIENT *clnt = NULL;
   int ret = -1;
@@ -564,6 +797,16 @@ glusterBlockCallRPC_1(char *host, void *cobj,
       goto out;
     }
     break;
+  case LOAD_SRV:
+    *rpc_sent = TRUE;
+    ret = block_load_1((void*)cobj, &reply, clnt);
+    if (ret != RPC_SUCCESS) {
+      /* RPC_PROCUNAVAIL from older versions is expected */
+      LOG("mgmt", GB_LOG_DEBUG, "%son host %s",
+          clnt_sperror(clnt, "block remote load call failed"), host);
+      goto out;
+    }
+    break;
   case DELETE_SRV:
     *rpc_sent = TRUE;
     if (block_delete_1((blockDelete *)cobj, &reply, clnt) != RPC_SUCCESS) {
@@ -593,6 +836,9 @@ glusterBlockCallRPC_1(char *host, void *cobj,
   case INFO_SRV:
   case REPLACE_GET_PORTAL_TPG_SRV:
   case GENCONFIG_SRV:
+  case STATUS_SRV:
+  case REBALANCE_SRV:
+  case DRAIN_SRV:
       goto out;
   case REPLACE_SRV:
       *rpc_sent = TRUE;
@@ -602,6 +848,14 @@ glusterBlockCallRPC_1(char *host, void *cobj,
         goto out;
       }
       break;
+  case PRIO_PATH_SRV:
+      *rpc_sent = TRUE;
+      if (block_prio_path_1((blockPrioPath *)cobj, &reply, clnt) != RPC_SUCCESS) {
+        LOG("mgmt", GB_LOG_ERROR, "%son host %s",
+            clnt_sperror(clnt, "block remote prio path call failed"), host);
+        goto out;
+      }
+      break;
   }
   ret = -1;
 
@@ -609,6 +863,14 @@ glusterBlockCallRPC_1(char *host, void *cobj,
     if (GB_STRDUP(*out, reply.out) < 0) {
       goto out;
     }
+    if (opt == CREATE_SRV && xdata && reply.xdata.xdata_len) {
+      *xdata = blockCreateResultDecode(reply.xdata.xdata_val,
+                                       reply.xdata.xdata_len);
+    }
+    if (opt == LOAD_SRV && xdata && reply.xdata.xdata_len) {
+      *xdata = blockNodeLoadDecode(reply.xdata.xdata_val,
+                                   reply.xdata.xdata_len);
+    }
   } else {
     if (GB_ALLOC(obj) < 0) {
       goto out;
@@ -759,7 +1021,7 @@ glusterBlockCapabilitiesRemote(void *data)
 
   /* Get peers capabilities */
   ret = glusterBlockCallRPC_1(args->addr, NULL, VERSION_SRV, &rpc_sent,
-                              &args->reply);
+                              &args->reply, NULL);
   if (ret && ret != RPC_PROCUNAVAIL) {
     if (!rpc_sent) {
       LOG("mgmt", GB_LOG_ERROR, "%s hence %s on host %s",
@@ -862,6 +1124,7 @@ blockRemoteCapabilitiesRespParse(size_t count, blockRemoteObj *args,
         }
       }
       if (!CAP_MATCH) {
+        GB_FREE(*errMsg);  /* with resultCaps, more may go missing */
         GB_ASPRINTF(errMsg, "capability '%s' doesn't exit on %s",
                     gbCapabilitiesLookup[i], args[j].addr);
         if (resultCaps) {
@@ -956,7 +1219,7 @@ glusterBlockCreateRemote(void *data)
                         ret, errMsg, out, "%s: CONFIGINPROGRESS\n", args->addr);
 
   ret = glusterBlockCallRPC_1(args->addr, &cobj, CREATE_SRV, &rpc_sent,
-                              &args->reply);
+                              &args->reply, &args->xdata);
   if (ret) {
     saveret = ret;
     if (!rpc_sent) {
@@ -1038,8 +1301,12 @@ glusterBlockCreateRemoteAsync(blockServerDefPtr list,
   }
 
   for (i = 0; i < mpath; i++) {
-    /* TODO: use glusterBlockCollectAttemptSuccess */
-    ret = blockRemoteCreateRespParse(args[i].reply, savereply);
+    if (args[i].xdata) {
+      ret = blockRemoteCreateResultMerge(&args[i], savereply);
+    } else {
+      /* peers older than the typed create result only send text */
+      ret = blockRemoteCreateRespParse(args[i].reply, savereply);
+    }
     if (ret) {
       goto out;
     }
@@ -1054,6 +1321,9 @@ glusterBlockCreateRemoteAsync(blockServerDefPtr list,
   }
 
  out:
+  for (i = 0; args && i < mpath; i++) {
+    blockCreateResultFree(args[i].xdata);
+  }
   GB_FREE(args);
   GB_FREE(tid);
 
@@ -1076,7 +1346,7 @@ glusterBlockDeleteRemote(void *data)
                         ret, errMsg, out, "%s: CLEANUPINPROGRESS\n", args->addr);
 
   ret = glusterBlockCallRPC_1(args->addr, &dobj, DELETE_SRV, &rpc_sent,
-                              &args->reply);
+                              &args->reply, NULL);
   if (ret) {
     saveret = ret;
     if (!rpc_sent) {
@@ -1162,8 +1432,8 @@ glusterBlockCollectAttemptSuccess(blockRemoteObj *args, MetaInfo *info,
                                   operations opt, size_t count,
                                   char **attempt, char **success)
 {
-  char *a_tmp = NULL;
-  char *s_tmp = NULL;
+  gbStrBuf a_sb = {0, };
+  gbStrBuf s_sb = {0, };
   int i = 0;
 
   for (i = 0; i < count; i++) {
@@ -1176,29 +1446,25 @@ glusterBlockCollectAttemptSuccess(blockRemoteObj *args, MetaInfo *info,
      */
     if (args[i].exit &&
         !(args[i].exit == GB_BLOCK_NOT_FOUND && opt == DELETE_SRV)) {
-        if (GB_ASPRINTF(attempt, "%s %s",
-              (a_tmp==NULL?"":a_tmp), args[i].addr) == -1) {
+        if (gbStrBufAppendf(&a_sb, " %s", args[i].addr) < 0) {
           goto fail;
         }
-        GB_FREE(a_tmp);
-        a_tmp = *attempt;
         LOG("mgmt", GB_LOG_ERROR, "%s: on volume %s on host %s",
             args[i].reply, args[i].volume, args[i].addr);
     } else {
-      if (GB_ASPRINTF(success, "%s %s",
-            (s_tmp==NULL?"":s_tmp), args[i].addr) == -1) {
+      if (gbStrBufAppendf(&s_sb, " %s", args[i].addr) < 0) {
         goto fail;
       }
-      GB_FREE(s_tmp);
-      s_tmp = *success;
     }
   }
+  *attempt = gbStrBufDetach(&a_sb);
+  *success = gbStrBufDetach(&s_sb);
 
   return 0;
 
  fail:
-  GB_FREE(a_tmp);
-  GB_FREE(s_tmp);
+  gbStrBufFree(&a_sb);
+  gbStrBufFree(&s_sb);
   *attempt = NULL;
   *success = NULL;
   return -1;
@@ -1219,8 +1485,7 @@ glusterBlockDeleteRemoteAsync(char *blockname,
   blockRemoteObj *args = NULL;
   char *d_attempt = NULL;
   char *d_success = NULL;
-  char *a_tmp = NULL;
-  char *s_tmp = NULL;
+  gbStrBuf sb;
   int ret = -1;
   size_t i;
   MetaInfo *info_new = NULL;
@@ -1253,24 +1518,23 @@ glusterBlockDeleteRemoteAsync(char *blockname,
   ret = -1;
 
   if (d_attempt) {
-    a_tmp = local->d_attempt;
-    if (GB_ASPRINTF(&local->d_attempt, "%s %s",
-                    (a_tmp==NULL?"":a_tmp), d_attempt) == -1) {
+    gbStrBufAttach(&sb, local->d_attempt);
+    ret = gbStrBufAppendf(&sb, " %s", d_attempt);
+    local->d_attempt = gbStrBufDetach(&sb);
+    if (ret) {
       goto out;
     }
-    GB_FREE(a_tmp);
-    a_tmp = local->d_attempt;
   }
 
   if (d_success) {
-    s_tmp = local->d_success;
-    if (GB_ASPRINTF(&local->d_success, "%s %s",
-                    (s_tmp==NULL?"":s_tmp), d_success) == -1) {
+    gbStrBufAttach(&sb, local->d_success);
+    ret = gbStrBufAppendf(&sb, " %s", d_success);
+    local->d_success = gbStrBufDetach(&sb);
+    if (ret) {
       goto out;
     }
-    GB_FREE(s_tmp);
-    s_tmp = local->d_success;
   }
+  ret = -1;
 
   for (i = 0; i < count; i++) {
     if (args[i].exit){
@@ -1316,96 +1580,413 @@ glusterBlockDeleteRemoteAsync(char *blockname,
 }
 
 
-void *
-glusterBlockModifyRemote(void *data)
+/*
+ * A create issued to more hosts than the block needs. The first mpath
+ * hosts configured keep the target, the others configured before the
+ * create went on, and all hosts answering after that, are torn down in the
+ * background.
+ */
+typedef struct blockCreateWave {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct glfs *glfs;          /* a reference of our own */
+  blockCreate2 cobj;
+  size_t mpath;
+  size_t nhosts;
+  blockRemoteObj *args;
+  bool *done;
+  bool *kept;
+  size_t ndone;
+  size_t nkept;
+  bool closed;                /* the create went on without the rest */
+  size_t refs;
+} blockCreateWave;
+
+
+static void
+blockCreateWaveUnref(blockCreateWave *wave)
 {
-  int ret;
-  int saveret;
-  blockRemoteObj *args = (blockRemoteObj *)data;
-  blockModify cobj = *(blockModify *)args->obj;
+  size_t refs;
+  size_t i;
+
+
+  LOCK(wave->lock);
+  refs = --wave->refs;
+  UNLOCK(wave->lock);
+  if (refs) {
+    return;
+  }
+
+  for (i = 0; wave->args && i < wave->nhosts; i++) {
+    GB_FREE(wave->args[i].addr);
+    GB_FREE(wave->args[i].reply);
+    blockCreateResultFree(wave->args[i].xdata);
+  }
+  glusterBlockVolumeRelease(wave->cobj.volume, wave->glfs);
+  pthread_cond_destroy(&wave->cond);
+  pthread_mutex_destroy(&wave->lock);
+  GB_FREE(wave->cobj.block_hosts);
+  GB_FREE(wave->args);
+  GB_FREE(wave->done);
+  GB_FREE(wave->kept);
+  GB_FREE(wave);
+}
+
+
+/*
+ * Delete the target a host of the wave configured without keeping it. Its
+ * state is only recorded while the metafile still is that of this block,
+ * the create may have been rolled back, or the block deleted, meanwhile.
+ */
+static void
+blockCreateWaveTeardown(blockCreateWave *wave, blockRemoteObj *args)
+{
+  struct glfs_fd *lkfd;
+  blockRemoteObj dargs = {0, };
+  blockDelete dobj = {{0}, };
+  MetaInfo *info = NULL;
   char *errMsg = NULL;
+  char *reply = NULL;
+  int errCode = 0;
   bool rpc_sent = FALSE;
+  int ret = -1;
 
 
-  GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
-                        ret, errMsg, out, "%s: AUTH%sENFORCEING\n", args->addr,
-                        cobj.auth_mode?"":"CLEAR");
+  GB_STRCPYSTATIC(dobj.block_name, wave->cobj.block_name);
+  GB_STRCPYSTATIC(dobj.gbid, wave->cobj.gbid);
 
-  ret = glusterBlockCallRPC_1(args->addr, &cobj, MODIFY_SRV, &rpc_sent,
-                              &args->reply);
-  if (ret) {
-    saveret = ret;
-    if (!rpc_sent) {
-      GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
-      LOG("mgmt", GB_LOG_ERROR, "%s hence %s for block %s on "
-          "host %s volume %s", strerror(errno), FAILED_REMOTE_MODIFY,
-          cobj.block_name, args->addr, args->volume);
-      goto out;
-    } else if (args->reply) {
-      errMsg = args->reply;
-      args->reply = NULL;
-    }
+  lkfd = glusterBlockCreateMetaLockFile(wave->glfs, wave->cobj.volume,
+                                        &errCode, &errMsg);
+  if (!lkfd) {
+    goto out;
+  }
 
-    GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
-                          ret, errMsg, out, "%s: AUTH%sENFORCEFAIL\n",
-                          args->addr, cobj.auth_mode?"":"CLEAR");
-    LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
-        FAILED_REMOTE_MODIFY, cobj.block_name, args->addr, args->volume);
+  GB_METALOCK_OR_GOTO(lkfd, wave->cobj.volume, errCode, errMsg, out);
 
-    ret = saveret;
-    goto out;
+  if (GB_ALLOC(info) < 0) {
+    goto unlock;
+  }
+
+  if (!blockGetMetaInfo(wave->glfs, wave->cobj.block_name, info, NULL) &&
+      !strcmp(info->gbid, wave->cobj.gbid)) {
+    dargs.glfs = wave->glfs;
+    dargs.obj = (void *)&dobj;
+    dargs.volume = wave->cobj.volume;
+    dargs.addr = args->addr;
+    glusterBlockDeleteRemote(&dargs);
+    reply = dargs.reply;
+    ret = dargs.exit;
+  } else {
+    ret = glusterBlockCallRPC_1(args->addr, &dobj, DELETE_SRV, &rpc_sent,
+                                &reply, NULL);
   }
 
-  GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
-                        ret, errMsg, out, "%s: AUTH%sENFORCED\n", args->addr,
-                        cobj.auth_mode?"":"CLEAR");
+ unlock:
+  GB_METAUNLOCK(lkfd, wave->cobj.volume, errCode, errMsg);
 
  out:
-  if (!args->reply) {
-    if (GB_ASPRINTF(&args->reply, "failed to configure auth on %s %s",
-                 args->addr, errMsg?errMsg:"") == -1) {
-      ret = ret?ret:-1;
-    }
+  if (lkfd && glfs_close(lkfd) != 0) {
+    LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        GB_TXLOCKFILE, wave->cobj.volume, strerror(errno));
+  }
+  if (ret) {
+    LOG("mgmt", GB_LOG_WARNING, "deleting the surplus target of block %s "
+        "on host %s volume %s failed[%s]", wave->cobj.block_name, args->addr,
+        wave->cobj.volume,
+        reply ? reply : (errMsg ? errMsg : strerror(errCode)));
+  } else {
+    LOG("mgmt", GB_LOG_INFO, "deleted the surplus target of block %s on "
+        "host %s volume %s", wave->cobj.block_name, args->addr,
+        wave->cobj.volume);
   }
+  blockFreeMetaInfo(info);
+  GB_FREE(reply);
   GB_FREE(errMsg);
-  args->exit = ret;
-
-  return NULL;
 }
 
 
-void *
-glusterBlockModifySizeRemote(void *data)
+static void *
+blockCreateWaveHost(void *data)
 {
-  int ret;
-  int saveret;
   blockRemoteObj *args = (blockRemoteObj *)data;
-  blockModifySize mobj = *(blockModifySize *)args->obj;
+  blockCreateWave *wave = (blockCreateWave *)args->obj;
+  size_t i = args - wave->args;
+  blockCreate2 cobj = wave->cobj;
   char *errMsg = NULL;
   bool rpc_sent = FALSE;
+  bool teardown = FALSE;
+  int ret;
+  int status;
 
 
-  GB_METAUPDATE_OR_GOTO(lock, args->glfs, mobj.block_name, mobj.volume,
-                        ret, errMsg, out, "%s: RSINPROGRESS-%zu\n",
-                        args->addr, mobj.size);
-
-  ret = glusterBlockCallRPC_1(args->addr, &mobj, MODIFY_SIZE_SRV, &rpc_sent,
-                              &args->reply);
+  ret = glusterBlockCallRPC_1(args->addr, &cobj, CREATE_SRV, &rpc_sent,
+                              &args->reply, &args->xdata);
   if (ret) {
-    saveret = ret;
     if (!rpc_sent) {
       GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
-      LOG("mgmt", GB_LOG_ERROR,
-          "%s hence %s for block %s on volume %s for size %zu on host %s",
-          strerror(errno), FAILED_REMOTE_MODIFY_SIZE,
-          mobj.block_name, mobj.volume, mobj.size, args->addr);
-      goto out;
-    } else if (args->reply) {
+    } else {
       errMsg = args->reply;
       args->reply = NULL;
     }
-    GB_METAUPDATE_OR_GOTO(lock, args->glfs, mobj.block_name, mobj.volume,
-                          ret, errMsg, out, "%s: RSFAIL-%zu\n", args->addr, mobj.size);
+    LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
+        FAILED_REMOTE_CREATE, cobj.block_name, args->addr, cobj.volume);
+    if (GB_ASPRINTF(&args->reply, "failed to configure on %s %s\n",
+                    args->addr, errMsg?errMsg:"") == -1) {
+      args->reply = NULL;
+    }
+    GB_FREE(errMsg);
+  }
+
+  LOCK(wave->lock);
+  if (wave->closed) {
+    /* the create went on without this host */
+    teardown = rpc_sent;
+    goto unlock;
+  }
+
+  if (ret) {
+    if (rpc_sent) {
+      GB_METAUPDATE_OR_GOTO(lock, wave->glfs, cobj.block_name, cobj.volume,
+                            status, errMsg, done, "%s: CONFIGFAIL\n",
+                            args->addr);
+    }
+  } else if (wave->nkept < wave->mpath) {
+    GB_METAUPDATE_OR_GOTO(lock, wave->glfs, cobj.block_name, cobj.volume,
+                          status, errMsg, done, "%s: CONFIGSUCCESS\n",
+                          args->addr);
+    if (cobj.auth_mode) {
+      GB_METAUPDATE_OR_GOTO(lock, wave->glfs, cobj.block_name, cobj.volume,
+                            status, errMsg, done, "%s: AUTHENFORCED\n",
+                            args->addr);
+    }
+    wave->kept[i] = TRUE;
+    wave->nkept++;
+  }
+
+ done:
+  teardown = !ret && !wave->kept[i];
+  args->exit = ret;
+  wave->done[i] = TRUE;
+  wave->ndone++;
+  pthread_cond_signal(&wave->cond);
+
+ unlock:
+  UNLOCK(wave->lock);
+
+  if (teardown) {
+    blockCreateWaveTeardown(wave, args);
+  }
+
+  GB_FREE(errMsg);
+  blockCreateWaveUnref(wave);
+  return NULL;
+}
+
+
+/*
+ * Issue the create to the first nhosts hosts of list at once, and return as
+ * soon as mpath of them are configured or all of them answered. The hosts
+ * left unanswered stay CONFIGINPROGRESS, which the audit counts as spent.
+ */
+static int
+glusterBlockCreateRemoteWave(blockServerDefPtr list,
+                             size_t mpath, size_t nhosts,
+                             struct glfs *glfs,
+                             blockCreate2 *cobj,
+                             blockRemoteCreateResp **savereply)
+{
+  blockCreateWave *wave;
+  pthread_t tid;
+  int errCode = 0;
+  char *errMsg = NULL;
+  size_t i;
+  int ret = -1;
+
+
+  if (GB_ALLOC(wave) < 0) {
+    return -1;
+  }
+
+  pthread_mutex_init(&wave->lock, NULL);
+  pthread_cond_init(&wave->cond, NULL);
+  wave->cobj = *cobj;
+  wave->cobj.block_hosts = NULL;
+  wave->mpath = mpath;
+  wave->nhosts = nhosts;
+  wave->refs = 1;
+
+  if (GB_STRDUP(wave->cobj.block_hosts, cobj->block_hosts) < 0 ||
+      GB_ALLOC_N(wave->args, nhosts) < 0 ||
+      GB_ALLOC_N(wave->done, nhosts) < 0 ||
+      GB_ALLOC_N(wave->kept, nhosts) < 0) {
+    goto out;
+  }
+
+  /* hosts still busy outlive the request, and its reference */
+  wave->glfs = glusterBlockVolumeInit(wave->cobj.volume, &errCode, &errMsg);
+  if (!wave->glfs) {
+    goto out;
+  }
+
+  for (i = 0; i < nhosts; i++) {
+    if (GB_STRDUP(wave->args[i].addr, list->hosts[i]) < 0) {
+      goto out;
+    }
+    wave->args[i].glfs = wave->glfs;
+    wave->args[i].obj = (void *)wave;
+    wave->args[i].volume = wave->cobj.volume;
+  }
+
+  for (i = 0; i < nhosts; i++) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, cobj->block_name, cobj->volume,
+                          ret, errMsg, out, "%s: CONFIGINPROGRESS\n",
+                          wave->args[i].addr);
+  }
+
+  LOCK(wave->lock);
+  for (i = 0; i < nhosts; i++) {
+    wave->refs++;
+    errCode = pthread_create(&tid, NULL, blockCreateWaveHost, &wave->args[i]);
+    if (errCode) {
+      wave->refs--;
+      if (GB_ASPRINTF(&wave->args[i].reply, "failed to configure on %s : "
+                      "%s\n", wave->args[i].addr, strerror(errCode)) == -1) {
+        wave->args[i].reply = NULL;
+      }
+      wave->args[i].exit = -1;
+      wave->done[i] = TRUE;
+      wave->ndone++;
+      continue;
+    }
+    pthread_detach(tid);
+  }
+
+  while (wave->nkept < mpath && wave->ndone < nhosts) {
+    pthread_cond_wait(&wave->cond, &wave->lock);
+  }
+  wave->closed = TRUE;
+  UNLOCK(wave->lock);
+
+  LOG("mgmt", GB_LOG_INFO, "block %s on volume %s configured on %zu of %zu "
+      "hosts issued, %zu still busy", cobj->block_name, cobj->volume,
+      wave->nkept, nhosts, nhosts - wave->ndone);
+
+  /* the surplus hosts are torn down, they have no say in the reply */
+  for (i = 0; i < nhosts; i++) {
+    if (!wave->done[i] || (!wave->kept[i] && !wave->args[i].exit)) {
+      continue;
+    }
+    if (wave->args[i].xdata) {
+      ret = blockRemoteCreateResultMerge(&wave->args[i], savereply);
+    } else {
+      /* peers older than the typed create result only send text */
+      ret = blockRemoteCreateRespParse(wave->args[i].reply, savereply);
+    }
+    if (ret) {
+      goto out;
+    }
+  }
+
+  ret = (wave->nkept == mpath) ? 0 : -1;
+
+ out:
+  GB_FREE(errMsg);
+  blockCreateWaveUnref(wave);
+
+  return ret;
+}
+
+
+void *
+glusterBlockModifyRemote(void *data)
+{
+  int ret;
+  int saveret;
+  blockRemoteObj *args = (blockRemoteObj *)data;
+  blockModify cobj = *(blockModify *)args->obj;
+  char *errMsg = NULL;
+  bool rpc_sent = FALSE;
+
+
+  GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
+                        ret, errMsg, out, "%s: AUTH%sENFORCEING\n", args->addr,
+                        cobj.auth_mode?"":"CLEAR");
+
+  ret = glusterBlockCallRPC_1(args->addr, &cobj, MODIFY_SRV, &rpc_sent,
+                              &args->reply, NULL);
+  if (ret) {
+    saveret = ret;
+    if (!rpc_sent) {
+      GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
+      LOG("mgmt", GB_LOG_ERROR, "%s hence %s for block %s on "
+          "host %s volume %s", strerror(errno), FAILED_REMOTE_MODIFY,
+          cobj.block_name, args->addr, args->volume);
+      goto out;
+    } else if (args->reply) {
+      errMsg = args->reply;
+      args->reply = NULL;
+    }
+
+    GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
+                          ret, errMsg, out, "%s: AUTH%sENFORCEFAIL\n",
+                          args->addr, cobj.auth_mode?"":"CLEAR");
+    LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
+        FAILED_REMOTE_MODIFY, cobj.block_name, args->addr, args->volume);
+
+    ret = saveret;
+    goto out;
+  }
+
+  GB_METAUPDATE_OR_GOTO(lock, args->glfs, cobj.block_name, cobj.volume,
+                        ret, errMsg, out, "%s: AUTH%sENFORCED\n", args->addr,
+                        cobj.auth_mode?"":"CLEAR");
+
+ out:
+  if (!args->reply) {
+    if (GB_ASPRINTF(&args->reply, "failed to configure auth on %s %s",
+                 args->addr, errMsg?errMsg:"") == -1) {
+      ret = ret?ret:-1;
+    }
+  }
+  GB_FREE(errMsg);
+  args->exit = ret;
+
+  return NULL;
+}
+
+
+void *
+glusterBlockModifySizeRemote(void *data)
+{
+  int ret;
+  int saveret;
+  blockRemoteObj *args = (blockRemoteObj *)data;
+  blockModifySize mobj = *(blockModifySize *)args->obj;
+  char *errMsg = NULL;
+  bool rpc_sent = FALSE;
+
+
+  GB_METAUPDATE_OR_GOTO(lock, args->glfs, mobj.block_name, mobj.volume,
+                        ret, errMsg, out, "%s: RSINPROGRESS-%zu\n",
+                        args->addr, mobj.size);
+
+  ret = glusterBlockCallRPC_1(args->addr, &mobj, MODIFY_SIZE_SRV, &rpc_sent,
+                              &args->reply, NULL);
+  if (ret) {
+    saveret = ret;
+    if (!rpc_sent) {
+      GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
+      LOG("mgmt", GB_LOG_ERROR,
+          "%s hence %s for block %s on volume %s for size %zu on host %s",
+          strerror(errno), FAILED_REMOTE_MODIFY_SIZE,
+          mobj.block_name, mobj.volume, mobj.size, args->addr);
+      goto out;
+    } else if (args->reply) {
+      errMsg = args->reply;
+      args->reply = NULL;
+    }
+    GB_METAUPDATE_OR_GOTO(lock, args->glfs, mobj.block_name, mobj.volume,
+                          ret, errMsg, out, "%s: RSFAIL-%zu\n", args->addr, mobj.size);
 
     LOG("mgmt", GB_LOG_ERROR, "%s for block %s on volume %s for size %zu on host %s",
         FAILED_REMOTE_MODIFY, mobj.block_name, mobj.volume, mobj.size, args->addr);
@@ -1643,6 +2224,8 @@ glusterBlockBuildMinCaps(void *data, operations opt)
   blockModifyCli *mblk = NULL;
   blockModifySizeCli *msblk = NULL;
   blockReplaceCli *rblk = NULL;
+  blockRebalanceCli *rbblk = NULL;
+  blockDrainCli *drblk = NULL;
   bool *minCaps = NULL;
 
 
@@ -1661,6 +2244,7 @@ glusterBlockBuildMinCaps(void *data, operations opt)
     if (cblk->prealloc) {
       minCaps[GB_CREATE_PREALLOC_CAP] = true;
     }
+    minCaps[GB_PREALLOC_BACKGROUND_CAP] = true;
     if (cblk->auth_mode) {
       minCaps[GB_CREATE_AUTH_CAP] = true;
     }
@@ -1697,6 +2281,7 @@ glusterBlockBuildMinCaps(void *data, operations opt)
   case MODIFY_SIZE_SRV:
     msblk = (blockModifySizeCli *)data;
     minCaps[GB_MODIFY_SIZE_CAP] = true;
+    minCaps[GB_PREALLOC_BACKGROUND_CAP] = true;
     if (msblk->json_resp) {
       minCaps[GB_JSON_CAP] = true;
     }
@@ -1709,12 +2294,31 @@ glusterBlockBuildMinCaps(void *data, operations opt)
       minCaps[GB_JSON_CAP] = true;
     }
     break;
+  case REBALANCE_SRV:
+    rbblk = (blockRebalanceCli *)data;
+
+    minCaps[GB_REBALANCE_CAP] = true;
+    if (rbblk->json_resp) {
+      minCaps[GB_JSON_CAP] = true;
+    }
+    break;
+  case DRAIN_SRV:
+    drblk = (blockDrainCli *)data;
+
+    minCaps[GB_DRAIN_CAP] = true;
+    if (drblk->json_resp) {
+      minCaps[GB_JSON_CAP] = true;
+    }
+    break;
   case MODIFY_TPGC_SRV:
   case REPLACE_GET_PORTAL_TPG_SRV:
+  case PRIO_PATH_SRV:
   case LIST_SRV:
   case INFO_SRV:
   case VERSION_SRV:
   case GENCONFIG_SRV:
+  case STATUS_SRV:
+  case LOAD_SRV:
     break;
   }
 
@@ -1768,111 +2372,365 @@ glusterBlockCheckCapabilities(void* blk, operations opt, blockServerDefPtr list,
 }
 
 
-blockServerDefPtr
-glusterBlockGetListFromInfo(MetaInfo *info)
+/*
+ * Whether a failed glusterBlockCheckCapabilities() only found capabilities
+ * from 'optional' (a mask of GB_CAP_BIT()s) missing, the ones the caller
+ * can do without by falling back to the older way.
+ */
+static bool
+glusterBlockCapsMissingOnly(bool *resultCaps, unsigned long optional)
 {
+  bool missing = false;
   size_t i;
-  blockServerDefPtr list = NULL;
 
 
-  if (!info || GB_ALLOC(list) < 0) {
-    return NULL;
+  for (i = 0; i < GB_CAP_MAX; i++) {
+    if (!resultCaps[i]) {
+      continue;
+    }
+    if (!(optional & GB_CAP_BIT(i))) {
+      return false;
+    }
+    missing = true;
   }
 
-  if (GB_ALLOC_N(list->hosts, info->mpath) < 0) {
-    goto out;
-  }
+  return missing;
+}
 
-  for (i = 0; i < info->nhosts; i++) {
-    if (blockhostIsValid (info->list[i]->status)) {
-      if (GB_STRDUP(list->hosts[list->nhosts++], info->list[i]->addr) < 0) {
-        goto out;
-      }
-    }
-  }
 
-  return list;
+/* load of the peers, as last reported by them */
+typedef struct gbNodeLoadCache {
+  char *addr;
+  blockNodeLoad load;
+  bool known;                   /* false if the peer couldn't tell */
+  unsigned long long usec;
+  struct list_head list;
+} gbNodeLoadCache;
 
- out:
-  blockServerDefFree(list);
-  return NULL;
-}
+static pthread_mutex_t loadCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(loadCache);
 
 
-void *
-glusterBlockReplacePortalRemote(void *data)
+static gbNodeLoadCache *
+glusterBlockLoadCacheGet(const char *addr)
 {
-  int ret;
-  int saveret;
-  blockRemoteObj *args = (blockRemoteObj *)data;
-  blockReplace robj = *(blockReplace *)args->obj;
-  char *errMsg = NULL;
-  bool rpc_sent = FALSE;
-
+  gbNodeLoadCache *entry;
 
-  GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
-                        ret, errMsg, out, "%s: RPINPROGRESS\n", args->addr);
 
-  ret = glusterBlockCallRPC_1(args->addr, &robj, REPLACE_SRV, &rpc_sent,
-                              &args->reply);
-  if (ret && ret != GB_OP_SKIPPED) {
-    saveret = ret;
-    if (!rpc_sent) {
-      GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
-      LOG("mgmt", GB_LOG_ERROR, "%s hence %s for block %s on "
-          "host %s volume %s", strerror(errno), FAILED_REMOTE_REPLACE,
-          robj.block_name, args->addr, args->volume);
-      goto out;
-    } else if (args->reply) {
-      errMsg = args->reply;
-      args->reply = NULL;
+  list_for_each_entry(entry, &loadCache, list) {
+    if (!strcmp(entry->addr, addr)) {
+      return entry;
     }
+  }
 
-    GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
-                          ret, errMsg, out, "%s: RPFAIL\n", args->addr);
-    LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
-        FAILED_REMOTE_CREATE, robj.block_name, args->addr, args->volume);
-
-    ret = saveret;
-    goto out;
+  if (GB_ALLOC(entry) < 0) {
+    return NULL;
+  }
+  if (GB_STRDUP(entry->addr, addr) < 0) {
+    GB_FREE(entry);
+    return NULL;
   }
+  list_add(&entry->list, &loadCache);
 
-  GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
-                        ret, errMsg, out, "%s: RPSUCCESS\n", args->addr);
+  return entry;
+}
 
-out:
-  if (!args->reply) {
-    if (GB_ASPRINTF(&args->reply, "failed to replace remote portal on %s %s\n", args->addr,
-          errMsg?errMsg:"") == -1) {
-      ret = ret?ret:-1;
-    }
-  }
-  args->exit = ret;
 
-  GB_FREE (errMsg);
+static void *
+glusterBlockLoadRemote(void *data)
+{
+  blockRemoteObj *args = (blockRemoteObj *)data;
+  bool rpc_sent = FALSE;
+
+
+  args->exit = glusterBlockCallRPC_1(args->addr, NULL, LOAD_SRV, &rpc_sent,
+                                     &args->reply, &args->xdata);
+
   return NULL;
 }
 
 
-int
-blockGetHostStatus(MetaInfo *info, char *host)
+/*
+ * Load of every host in list, asked in parallel from the peers whose
+ * last answer is older than GB_LOAD_CACHE_USEC. Returns false unless all
+ * of them could tell, e.g. when some still run an older version.
+ */
+static bool
+glusterBlockLoadRemoteAsync(blockServerDefPtr list, blockNodeLoad *loads)
 {
+  blockRemoteObj *args = NULL;
+  gbNodeLoadCache *entry;
+  pthread_t *tid = NULL;
+  unsigned long long now = gbTimeNowUsec();
+  bool known = true;
+  size_t count = 0;
   size_t i;
 
 
-  if (!info || !host)
-    return GB_METASTATUS_MAX;
+  if (GB_ALLOC_N(tid, list->nhosts) < 0 ||
+      GB_ALLOC_N(args, list->nhosts) < 0) {
+    known = false;
+    goto out;
+  }
 
-  for (i = 0; i < info->nhosts; i++) {
-    if (!strcmp(info->list[i]->addr, host)) {
-      return blockMetaStatusEnumParse(info->list[i]->status);
+  LOCK(loadCacheLock);
+  for (i = 0; i < list->nhosts; i++) {
+    entry = glusterBlockLoadCacheGet(list->hosts[i]);
+    if (!entry || !entry->usec || now - entry->usec >= GB_LOAD_CACHE_USEC) {
+      args[count++].addr = list->hosts[i];
     }
   }
+  UNLOCK(loadCacheLock);
+
+  for (i = 0; i < count; i++) {
+    pthread_create(&tid[i], NULL, glusterBlockLoadRemote, &args[i]);
+  }
+  for (i = 0; i < count; i++) {
+    pthread_join(tid[i], NULL);
+  }
+
+  LOCK(loadCacheLock);
+  for (i = 0; i < count; i++) {
+    entry = glusterBlockLoadCacheGet(args[i].addr);
+    if (entry) {
+      entry->known = !args[i].exit && args[i].xdata;
+      if (entry->known) {
+        entry->load = *(blockNodeLoad *)args[i].xdata;
+      }
+      entry->usec = now;
+    }
+    GB_FREE(args[i].xdata);
+    GB_FREE(args[i].reply);
+  }
+  for (i = 0; i < list->nhosts; i++) {
+    entry = glusterBlockLoadCacheGet(list->hosts[i]);
+    if (!entry || !entry->known) {
+      known = false;
+      break;
+    }
+    loads[i] = entry->load;
+  }
+  UNLOCK(loadCacheLock);
+
+ out:
+  GB_FREE(args);
+  GB_FREE(tid);
+  return known;
+}
+
+
+static double
+blockLoadShare(unsigned long long val, unsigned long long max)
+{
+  return max ? (double)val / max : 0;
+}
+
+
+/*
+ * blockGetPrioPath(), unless GB_PRIO_LOAD_AWARE is set. Then every host
+ * scores its active paths on the volume, LUNs, command rate, throughput
+ * and cpu load, each relative to the highest among the candidates, and
+ * the lowest score wins. Without the load of every host only the active
+ * paths count, as with blockGetPrioPath(). Drained hosts are left out,
+ * unless all of them are drained.
+ */
+static void
+glusterBlockPickPrioPath(struct glfs *glfs, char *volume,
+                         blockServerDefPtr list, char *prio_path,
+                         size_t prio_len)
+{
+  blockServerDef avail = {0, };
+  bool *drained = NULL;
+  blockNodeLoad *loads = NULL;
+  blockNodeLoad max = {0, };
+  size_t *counts = NULL;
+  size_t maxCount = 0;
+  double score, best = 0;
+  size_t index = 0;
+  size_t i;
+  bool aware;
+
+
+  if (list->nhosts > 1 &&
+      GB_ALLOC_N(drained, list->nhosts) == 0 &&
+      GB_ALLOC_N(avail.hosts, list->nhosts) == 0 &&
+      !blockGetDrained(glfs, volume, list, drained)) {
+    for (i = 0; i < list->nhosts; i++) {
+      if (!drained[i]) {
+        avail.hosts[avail.nhosts++] = list->hosts[i];
+      }
+    }
+    if (avail.nhosts && avail.nhosts < list->nhosts) {
+      list = &avail;
+    }
+  }
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  aware = gbConf.prioLoadAware;
+  RWUNLOCK(gbConf.cfgLock);
+
+  if (!aware || list->nhosts <= 1) {
+    blockGetPrioPath(glfs, volume, list, prio_path, prio_len);
+    goto out;
+  }
+
+  if (GB_ALLOC_N(counts, list->nhosts) < 0 ||
+      GB_ALLOC_N(loads, list->nhosts) < 0) {
+    goto out;
+  }
+
+  if (blockGetPrioCounts(glfs, volume, list, counts)) {
+    goto out;
+  }
+
+  if (!glusterBlockLoadRemoteAsync(list, loads)) {
+    LOG("mgmt", GB_LOG_INFO,
+        "load of some of the hosts of volume %s unknown, placing by active paths only",
+        volume);
+    memset(loads, 0, list->nhosts * sizeof(*loads));
+  }
+
+  for (i = 0; i < list->nhosts; i++) {
+    maxCount = counts[i] > maxCount ? counts[i] : maxCount;
+    max.luns = loads[i].luns > max.luns ? loads[i].luns : max.luns;
+    max.iops = loads[i].iops > max.iops ? loads[i].iops : max.iops;
+    max.mbps = loads[i].mbps > max.mbps ? loads[i].mbps : max.mbps;
+    max.cpu = loads[i].cpu > max.cpu ? loads[i].cpu : max.cpu;
+  }
+
+  for (i = 0; i < list->nhosts; i++) {
+    score = blockLoadShare(counts[i], maxCount) +
+            blockLoadShare(loads[i].luns, max.luns) +
+            blockLoadShare(loads[i].iops, max.iops) +
+            blockLoadShare(loads[i].mbps, max.mbps) +
+            blockLoadShare(loads[i].cpu, max.cpu);
+    LOG("mgmt", GB_LOG_DEBUG,
+        "prio path candidate %s: paths %zu luns %u iops %llu mbps %llu "
+        "cpu %u score %.3f", list->hosts[i], counts[i], loads[i].luns,
+        (unsigned long long)loads[i].iops, (unsigned long long)loads[i].mbps,
+        loads[i].cpu, score);
+    if (!i || score < best ||
+        (score == best && counts[i] < counts[index])) {
+      best = score;
+      index = i;
+    }
+  }
+
+  GB_STRCPY(prio_path, list->hosts[index], prio_len);
+
+ out:
+  GB_FREE(avail.hosts);
+  GB_FREE(drained);
+  GB_FREE(loads);
+  GB_FREE(counts);
+}
+
+
+blockServerDefPtr
+glusterBlockGetListFromInfo(MetaInfo *info)
+{
+  size_t i;
+  blockServerDefPtr list = NULL;
+
+
+  if (!info || GB_ALLOC(list) < 0) {
+    return NULL;
+  }
+
+  if (GB_ALLOC_N(list->hosts, info->mpath) < 0) {
+    goto out;
+  }
+
+  for (i = 0; i < info->nhosts; i++) {
+    if (blockhostIsValid (info->list[i]->status)) {
+      if (GB_STRDUP(list->hosts[list->nhosts++], info->list[i]->addr) < 0) {
+        goto out;
+      }
+    }
+  }
+
+  return list;
+
+ out:
+  blockServerDefFree(list);
+  return NULL;
+}
+
+
+void *
+glusterBlockReplacePortalRemote(void *data)
+{
+  int ret;
+  int saveret;
+  blockRemoteObj *args = (blockRemoteObj *)data;
+  blockReplace robj = *(blockReplace *)args->obj;
+  char *errMsg = NULL;
+  bool rpc_sent = FALSE;
+
+
+  GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
+                        ret, errMsg, out, "%s: RPINPROGRESS\n", args->addr);
+
+  ret = glusterBlockCallRPC_1(args->addr, &robj, REPLACE_SRV, &rpc_sent,
+                              &args->reply, NULL);
+  if (ret && ret != GB_OP_SKIPPED) {
+    saveret = ret;
+    if (!rpc_sent) {
+      GB_ASPRINTF(&errMsg, ": %s", strerror(errno));
+      LOG("mgmt", GB_LOG_ERROR, "%s hence %s for block %s on "
+          "host %s volume %s", strerror(errno), FAILED_REMOTE_REPLACE,
+          robj.block_name, args->addr, args->volume);
+      goto out;
+    } else if (args->reply) {
+      errMsg = args->reply;
+      args->reply = NULL;
+    }
+
+    GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
+                          ret, errMsg, out, "%s: RPFAIL\n", args->addr);
+    LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
+        FAILED_REMOTE_CREATE, robj.block_name, args->addr, args->volume);
+
+    ret = saveret;
+    goto out;
+  }
+
+  GB_METAUPDATE_OR_GOTO(lock, args->glfs, robj.block_name, robj.volume,
+                        ret, errMsg, out, "%s: RPSUCCESS\n", args->addr);
+
+out:
+  if (!args->reply) {
+    if (GB_ASPRINTF(&args->reply, "failed to replace remote portal on %s %s\n", args->addr,
+          errMsg?errMsg:"") == -1) {
+      ret = ret?ret:-1;
+    }
+  }
+  args->exit = ret;
+
+  GB_FREE (errMsg);
+  return NULL;
+}
+
+
+int
+blockGetHostStatus(MetaInfo *info, char *host)
+{
+  size_t i;
+
+
+  if (!info || !host)
+    return GB_METASTATUS_MAX;
+
+  for (i = 0; i < info->nhosts; i++) {
+    if (!strcmp(info->list[i]->addr, host)) {
+      return blockMetaStatusEnumParse(info->list[i]->status);
+    }
+  }
+
+  return GB_METASTATUS_MAX;
+}
+
 
-  return GB_METASTATUS_MAX;
-}
-
-
 void
 blockRemoteRespFree(blockRemoteResp *resp)
 {
@@ -1917,10 +2775,14 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
   bool dCheck = false;
   bool rCheck = false;
   bool newNodeInUse = false;
-  char *tmp = NULL;
+  gbStrBuf hosts = {0, };
+  gbStrBuf skipped = {0, };
+  gbStrBuf attempt = {0, };
+  gbStrBuf success = {0, };
   size_t i = 0, j = 1;
   int ret = -1;
   int status = 0;
+  gbArena arena = {0, };
 
 
   if ((GB_ALLOC(reply) < 0) || (GB_ALLOC(reply->cop) < 0) ||
@@ -1932,7 +2794,9 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
   reply->rop->status = -1;
   reply->force = blk->force;
 
-  if ((GB_ALLOC(cobj) < 0) || (GB_ALLOC(robj) < 0)  || (GB_ALLOC(dobj) < 0)){
+  if ((GB_ARENA_ALLOC(&arena, cobj) < 0) ||
+      (GB_ARENA_ALLOC(&arena, robj) < 0) ||
+      (GB_ARENA_ALLOC(&arena, dobj) < 0)) {
     goto out;
   }
 
@@ -1963,26 +2827,23 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
   GB_STRCPYSTATIC(dobj->gbid, info->gbid);
 
   /* Fill args[] */
-  if (GB_ALLOC_N(args, info->mpath + 1) < 0) {
+  if (GB_ARENA_ALLOC_N(&arena, args, info->mpath + 1) < 0) {
     goto out;
   }
   args[0].glfs = glfs;
   args[0].obj = (void *)cobj;
   args[0].addr = blk->new_node;
   args[0].volume = blk->volume;
-  if (GB_STRDUP(cobj->block_hosts, blk->new_node) < 0) {
+  if (gbStrBufAppendf(&hosts, "%s", blk->new_node) < 0) {
     goto out;
   }
   for (i = 0; i < info->nhosts; i++) {
     if (strcmp(info->list[i]->addr, blk->old_node)) {
       if (blockhostIsValid(info->list[i]->status)) {
         /* Construct block_hosts */
-        tmp = cobj->block_hosts;
-        if (GB_ASPRINTF(&cobj->block_hosts, "%s,%s", tmp, info->list[i]->addr) == -1) {
-          GB_FREE (tmp);
+        if (gbStrBufAppendf(&hosts, ",%s", info->list[i]->addr) < 0) {
           goto out;
         }
-        GB_FREE(tmp);
 
         /* Fill args */
         args[j].glfs = glfs;
@@ -1993,6 +2854,7 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
       }
     }
   }
+  cobj->block_hosts = hosts.buf;
   args[info->mpath].glfs = glfs;
   args[info->mpath].obj = (void *)dobj;
   args[info->mpath].addr = blk->old_node;
@@ -2068,7 +2930,7 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
     }
   }
 
-  if (GB_ALLOC_N(tid, info->mpath + 1) < 0) {
+  if (GB_ARENA_ALLOC_N(&arena, tid, info->mpath + 1) < 0) {
     goto out;
   }
 
@@ -2090,14 +2952,11 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
   } else {
     reply->rop->status = GB_OP_SKIPPED; /* skip */
     for (i = 1; i < info->mpath; i++) {
-      tmp = reply->rop->skipped;
-      if (GB_ASPRINTF(&reply->rop->skipped, "%s %s",
-                      (tmp==NULL?"":tmp), args[i].addr) == -1) {
-        GB_FREE (tmp);
+      if (gbStrBufAppendf(&skipped, " %s", args[i].addr) < 0) {
         goto out;
       }
-      GB_FREE (tmp);
     }
+    reply->rop->skipped = gbStrBufDetach(&skipped);
   }
 
   /* Delete */
@@ -2151,21 +3010,14 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
 
   if (rCheck) {
     for (i = 1; i < info->mpath; i++) {
-      if (args[i].exit) {
-        tmp = reply->rop->attempt;
-        if (GB_ASPRINTF(&reply->rop->attempt, "%s %s", tmp?tmp:"", args[i].addr) == -1) {
-          goto out;
-        }
-        GB_FREE(tmp);
-      } else {
-        tmp = reply->rop->success;
-        if (GB_ASPRINTF(&reply->rop->success, "%s %s", tmp?tmp:"", args[i].addr) == -1) {
-          goto out;
-        }
-        GB_FREE(tmp);
+      if (gbStrBufAppendf(args[i].exit ? &attempt : &success, " %s",
+                          args[i].addr) < 0) {
+        goto out;
       }
       reply->rop->status = args[i].exit;
     }
+    reply->rop->attempt = gbStrBufDetach(&attempt);
+    reply->rop->success = gbStrBufDetach(&success);
   } else {
     if (info->mpath == 1) {
       if (GB_ASPRINTF(&reply->rop->success, "N/A") == -1) {
@@ -2182,11 +3034,11 @@ glusterBlockReplaceNodeRemoteAsync(struct glfs *glfs, blockReplaceCli *blk,
     *savereply = reply;
     reply = NULL;
   }
-  GB_FREE(tid);
-  GB_FREE(cobj);
-  GB_FREE(dobj);
-  GB_FREE(robj);
-  GB_FREE(args);
+  gbArenaFree(&arena);
+  gbStrBufFree(&hosts);
+  gbStrBufFree(&skipped);
+  gbStrBufFree(&attempt);
+  gbStrBufFree(&success);
   blockRemoteReplaceRespFree(reply);
 
   return ret;
@@ -2417,12 +3269,37 @@ out:
 }
 
 
+/*
+ * Metafile updates that follow the remote calls of a node replace of one
+ * block. Called with the volume metadata lock held.
+ */
+static int
+blockReplaceNodeFinish(struct glfs *glfs, blockReplaceCli *blk, MetaInfo *info,
+                       blockRemoteReplaceResp *savereply, char **errMsg)
+{
+  int ret = 0;
+
+
+  if (savereply && savereply->force && savereply->dop->status) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume, ret,
+                          *errMsg, out, "%s: CLEANUPSUCCESS\n", blk->old_node);
+  }
+  if (info->prio_path[0] && !strcmp(info->prio_path, blk->old_node)) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume, ret,
+                          *errMsg, out, "PRIOPATH: %s\n", blk->new_node);
+  }
+
+ out:
+  return ret;
+}
+
+
 blockResponse *
 block_replace_cli_1_svc_st(blockReplaceCli *blk, struct svc_req *rqstp)
 {
   blockRemoteReplaceResp *savereply = NULL;
   blockResponse *reply = NULL;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
   int errCode = 0;
   char *errMsg = NULL;
@@ -2456,7 +3333,7 @@ block_replace_cli_1_svc_st(blockReplaceCli *blk, struct svc_req *rqstp)
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, optfail);
   LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
 
-  if (glfs_access(glfs, blk->block_name, F_OK)) {
+  if (glusterBlockAccessAt(glfs, GB_OBJ_METADIR, blk->block_name)) {
     errCode = errno;
     if (errCode == ENOENT) {
       GB_ASPRINTF(&errMsg, "block %s/%s doesn't exist",
@@ -2513,17 +3390,11 @@ block_replace_cli_1_svc_st(blockReplaceCli *blk, struct svc_req *rqstp)
       goto out;
     }
   }
-  if (savereply && savereply->force && savereply->dop->status) {
-    GB_METAUPDATE_OR_GOTO(lock, glfs,  blk->block_name,  blk->volume,
-                          errCode, errMsg, out, "%s: CLEANUPSUCCESS\n", blk->old_node);
-  }
-  if (info->prio_path[0] && !strcmp(info->prio_path, blk->old_node)) {
-    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume,
-        errCode, errMsg, out, "PRIOPATH: %s\n", blk->new_node);
+  errCode = blockReplaceNodeFinish(glfs, blk, info, savereply, &errMsg);
+  if (errCode) {
+    goto out;
   }
 
-  errCode = 0;
-
   LOG("mgmt", GB_LOG_DEBUG, "replace cli success, volume=%s", blk->volume);
 
  out:
@@ -2543,59 +3414,1948 @@ optfail:
 
   GB_FREE(errMsg);
 
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
   return reply;
 }
 
 
-struct json_object *
-getTpgObj(char *block, MetaInfo *info, blockGenConfigCli *blk, char *portal, int tag)
-{
-  int auth = 0;
-  uuid_t uuid;
-  char alias[UUID_BUF_SIZE];
-  char alias_10[11] = {'\0', };
-  char lun_so[256] = {'\0', };
+typedef struct blockRebalanceNode {
+  char *addr;
+  size_t before;              /* active paths as recorded in the metafiles */
+  size_t after;               /* projected, then actual after the moves */
+  bool member;                /* a valid host of at least one block */
+  bool drained;
+} blockRebalanceNode;
+
+typedef struct blockRebalanceItem {
+  char *name;
+  char gbid[38];
+  char *drainPath;            /* DRAINPATH of the block, if any */
+  blockServerDefPtr list;     /* valid hosts of the block */
+  size_t from;                /* indexes into the node table */
+  size_t to;
+  bool move;
+  int status;
+  char *errMsg;
+} blockRebalanceItem;
 
-  struct json_object *tpg_obj = json_object_new_object();
-  struct json_object *tpg_attr_obj = json_object_new_object();
-  struct json_object *tpg_luns_arr = json_object_new_array();
-  struct json_object *tpg_lun_obj = json_object_new_object();
-  struct json_object *tpg_portals_arr = json_object_new_array();
-  struct json_object *tpg_portal_obj = json_object_new_object();
-  struct json_object *tpg_params_obj = json_object_new_object();
+typedef struct blockRebalancePlan {
+  struct glfs *glfs;
+  char *volume;
+  char *drainPath;            /* DRAINPATH recorded with the moves, or NULL */
+  blockRebalanceNode *nodes;
+  size_t nnodes;
+  blockRebalanceItem *items;
+  size_t nitems;
+  size_t *moves;              /* indexes into items, in planned order */
+  size_t nmoves;
+  size_t next;                /* next move to be picked by a worker */
+  pthread_mutex_t lock;
+} blockRebalancePlan;
+
+
+static ssize_t
+blockRebalanceNodeIndex(blockRebalancePlan *plan, char *addr)
+{
+  size_t i;
 
 
-  // {  Tpg Object open
-  auth = 1;
-  if(info->passwd[0] == '\0') {
-    auth = 0;
+  for (i = 0; i < plan->nnodes; i++) {
+    if (!strcmp(plan->nodes[i].addr, addr)) {
+      return i;
+    }
   }
 
-  json_object_object_add(tpg_attr_obj, "authentication", json_object_new_int(auth));
-  json_object_object_add(tpg_attr_obj, "cache_dynamic_acls", json_object_new_int(1));
-  json_object_object_add(tpg_attr_obj, "demo_mode_write_protect", json_object_new_int(0));
-  json_object_object_add(tpg_attr_obj, "generate_node_acls", json_object_new_int(1));
-  if (strcmp(blk->addr, portal)) {
-    json_object_object_add(tpg_attr_obj, "tpg_enabled_sendtargets", json_object_new_int(0));
+  if (GB_REALLOC_N(plan->nodes, plan->nnodes + 1) < 0) {
+    return -1;
   }
-  json_object_object_add(tpg_obj, "attributes", tpg_attr_obj);
-  if (auth) {
-    json_object_object_add(tpg_obj, "chap_password", GB_JSON_OBJ_TO_STR(info->passwd));
-    json_object_object_add(tpg_obj, "chap_userid", GB_JSON_OBJ_TO_STR(info->gbid));
+  memset(&plan->nodes[plan->nnodes], 0, sizeof(*plan->nodes));
+  if (GB_STRDUP(plan->nodes[plan->nnodes].addr, addr) < 0) {
+    return -1;
   }
 
-  if (!strcmp(blk->addr, portal)) {
-    json_object_object_add(tpg_obj, "enable", json_object_new_boolean(TRUE));
-  } else {
-    json_object_object_add(tpg_obj, "enable", json_object_new_boolean(FALSE));
+  return plan->nnodes++;
+}
+
+
+static int
+blockRebalanceAddItem(blockRebalancePlan *plan, char *name, MetaInfo *info)
+{
+  blockRebalanceItem *item;
+  ssize_t n;
+  size_t i;
+
+
+  if (GB_REALLOC_N(plan->items, plan->nitems + 1) < 0) {
+    return -1;
   }
+  item = &plan->items[plan->nitems];
+  memset(item, 0, sizeof(*item));
+  plan->nitems++;
 
-  // "luns" : [
-  uuid_generate(uuid);
-  uuid_unparse(uuid, alias);
-  snprintf(alias_10, 11, "%.10s", alias+24);
-  json_object_object_add(tpg_lun_obj, "alias", GB_JSON_OBJ_TO_STR(alias_10[0]?alias_10:NULL));
-  snprintf(lun_so, 256, "/backstores/user/%s", block);
+  if (GB_STRDUP(item->name, name) < 0) {
+    return -1;
+  }
+  GB_STRCPYSTATIC(item->gbid, info->gbid);
+  if (info->drain_path[0] && GB_STRDUP(item->drainPath, info->drain_path) < 0) {
+    return -1;
+  }
+
+  item->list = blockMetaInfoToServerParse(info);
+  if (!item->list) {
+    return -1;
+  }
+  for (i = 0; i < item->list->nhosts; i++) {
+    n = blockRebalanceNodeIndex(plan, item->list->hosts[i]);
+    if (n < 0) {
+      return -1;
+    }
+    plan->nodes[n].member = true;
+  }
+
+  n = blockRebalanceNodeIndex(plan, info->prio_path);
+  if (n < 0) {
+    return -1;
+  }
+  item->from = item->to = n;
+  plan->nodes[n].before++;
+
+  return 0;
+}
+
+
+/*
+ * Read the prio path of every block of the volume into the plan, blocks
+ * created without load balancing have nothing to move and are left out.
+ * Called with the volume metadata lock held.
+ */
+static int
+blockRebalanceLoad(blockRebalancePlan *plan, char **errMsg)
+{
+  gbMetaScan scan = {0};
+  blockServerDef nodes = {0, };
+  MetaInfo *info = NULL;
+  bool *drained = NULL;
+  struct stat *st;
+  char *name;
+  int errCode = 0;
+  size_t i;
+
+
+  if (glusterBlockMetaScanOpen(plan->glfs, plan->volume, &scan)) {
+    errCode = errno;
+    GB_ASPRINTF(errMsg, "Not able to open metadata directory for volume "
+                "%s[%s]", plan->volume, strerror(errCode));
+    LOG("mgmt", GB_LOG_ERROR, "glfs_h_opendir(%s): on volume %s failed[%s]",
+        GB_METADIR, plan->volume, strerror(errCode));
+    goto out;
+  }
+
+  while ((name = glusterBlockMetaScanNext(&scan, &st))) {
+    if (GB_ALLOC(info) < 0) {
+      errCode = ENOMEM;
+      goto out;
+    }
+    if (blockGetMetaInfoCached(plan->glfs, plan->volume, name, st, info,
+                               &errCode)) {
+      GB_ASPRINTF(errMsg, "failed to read metadata of block %s/%s",
+                  plan->volume, name);
+      errCode = errCode ? errCode : GB_DEFAULT_ERRCODE;
+      goto out;
+    }
+
+    if (info->prio_path[0] && blockRebalanceAddItem(plan, name, info)) {
+      errCode = ENOMEM;
+      goto out;
+    }
+    blockFreeMetaInfo(info);
+    info = NULL;
+  }
+
+  /* drained nodes take no new prio paths */
+  if (plan->nnodes &&
+      (GB_ALLOC_N(nodes.hosts, plan->nnodes) < 0 ||
+       GB_ALLOC_N(drained, plan->nnodes) < 0)) {
+    errCode = ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < plan->nnodes; i++) {
+    nodes.hosts[nodes.nhosts++] = plan->nodes[i].addr;
+  }
+  if (nodes.nhosts && !blockGetDrained(plan->glfs, plan->volume, &nodes, drained)) {
+    for (i = 0; i < plan->nnodes; i++) {
+      plan->nodes[i].drained = drained[i];
+    }
+  }
+
+ out:
+  glusterBlockMetaScanClose(&scan);
+  blockFreeMetaInfo(info);
+  GB_FREE(nodes.hosts);
+  GB_FREE(drained);
+  return errCode;
+}
+
+
+/* least loaded valid host of item to move its prio path to, or item->from */
+static size_t
+blockRebalanceTarget(blockRebalancePlan *plan, blockRebalanceItem *item,
+                     bool *valid)
+{
+  size_t to = item->from;
+  ssize_t n;
+  size_t i;
+
+
+  *valid = false;
+  for (i = 0; i < item->list->nhosts; i++) {
+    n = blockRebalanceNodeIndex(plan, item->list->hosts[i]);
+    if (n < 0) {
+      continue;
+    }
+    if ((size_t)n == item->from) {
+      *valid = true;
+      continue;
+    }
+    if (plan->nodes[n].drained) {
+      continue;
+    }
+    if (to == item->from || plan->nodes[n].after < plan->nodes[to].after) {
+      to = n;
+    }
+  }
+
+  return to;
+}
+
+
+static void
+blockRebalancePlanMove(blockRebalancePlan *plan, size_t idx, size_t to)
+{
+  blockRebalanceItem *item = &plan->items[idx];
+
+
+  item->move = true;
+  item->to = to;
+  item->status = -1;
+  plan->nodes[item->from].after--;
+  plan->nodes[item->to].after++;
+  plan->moves[plan->nmoves++] = idx;
+}
+
+
+/*
+ * Greedy plan: keep moving the prio path of the block that narrows the gap
+ * the most, from its current node to its least loaded HA host, while that
+ * gap is at least 2. A block is moved at most once. Blocks whose prio path
+ * is no longer one of their valid hosts are always moved first.
+ */
+static int
+blockRebalanceBuildPlan(blockRebalancePlan *plan)
+{
+  blockRebalanceItem *item;
+  size_t bestItem, bestTo, bestGain;
+  size_t cur, to, gain;
+  bool valid;
+  size_t i;
+
+
+  for (i = 0; i < plan->nnodes; i++) {
+    plan->nodes[i].after = plan->nodes[i].before;
+  }
+
+  if (GB_ALLOC_N(plan->moves, plan->nitems + 1) < 0) {
+    return -1;
+  }
+
+  while (plan->nmoves < plan->nitems) {
+    bestGain = 0;
+    bestItem = bestTo = 0;
+
+    for (i = 0; i < plan->nitems; i++) {
+      item = &plan->items[i];
+      if (item->move) {
+        continue;
+      }
+
+      cur = item->from;
+      to = blockRebalanceTarget(plan, item, &valid);
+      if (to == cur) {
+        continue;
+      }
+
+      if (!valid) {
+        gain = SIZE_MAX;
+      } else if (plan->nodes[cur].after >= plan->nodes[to].after + 2) {
+        gain = plan->nodes[cur].after - plan->nodes[to].after;
+      } else {
+        continue;
+      }
+
+      if (gain > bestGain) {
+        bestGain = gain;
+        bestItem = i;
+        bestTo = to;
+      }
+    }
+
+    if (!bestGain) {
+      break;
+    }
+
+    blockRebalancePlanMove(plan, bestItem, bestTo);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Drain: move every prio path served by node to the least loaded valid
+ * host of its block that is not drained. Undrain: move back the prio paths
+ * drained off node, if node is still a valid host of the block.
+ */
+static int
+blockRebalanceBuildDrainPlan(blockRebalancePlan *plan, char *node, bool undrain)
+{
+  blockRebalanceItem *item;
+  ssize_t idx;
+  size_t to;
+  bool valid;
+  size_t i, j;
+
+
+  for (i = 0; i < plan->nnodes; i++) {
+    plan->nodes[i].after = plan->nodes[i].before;
+  }
+
+  if (GB_ALLOC_N(plan->moves, plan->nitems + 1) < 0) {
+    return -1;
+  }
+
+  idx = blockRebalanceNodeIndex(plan, node);
+  if (idx < 0) {
+    return -1;
+  }
+  plan->nodes[idx].drained = !undrain;
+
+  for (i = 0; i < plan->nitems; i++) {
+    item = &plan->items[i];
+
+    if (undrain) {
+      if (!item->drainPath || strcmp(item->drainPath, node) ||
+          item->from == (size_t)idx) {
+        continue;
+      }
+      for (j = 0; j < item->list->nhosts; j++) {
+        if (!strcmp(item->list->hosts[j], node)) {
+          blockRebalancePlanMove(plan, i, idx);
+          break;
+        }
+      }
+      continue;
+    }
+
+    if (item->from != (size_t)idx) {
+      continue;
+    }
+    to = blockRebalanceTarget(plan, item, &valid);
+    if (to == item->from) {
+      /* listed as failed, so that the node is not taken as drained */
+      GB_ASPRINTF(&item->errMsg, "no other healthy HA node");
+      item->status = -1;
+      item->move = true;
+      plan->moves[plan->nmoves++] = i;
+      continue;
+    }
+    blockRebalancePlanMove(plan, i, to);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Switch the active-optimized path of one block on all its hosts. On a
+ * partial failure the hosts switched so far are flipped back, so the
+ * targets keep agreeing with the PRIOPATH recorded in the metafile.
+ */
+static void
+blockRebalanceMoveOne(blockRebalancePlan *plan, blockRebalanceItem *item)
+{
+  blockPrioPath pobj = {{0}, };
+  bool *done = NULL;
+  char *out = NULL;
+  bool rpc_sent;
+  size_t i;
+  int ret = -1;
+
+
+  if (item->from == item->to) {
+    return;
+  }
+
+  item->status = -1;
+  if (GB_ALLOC_N(done, item->list->nhosts) < 0) {
+    goto out;
+  }
+
+  GB_STRCPYSTATIC(pobj.volume, plan->volume);
+  GB_STRCPYSTATIC(pobj.block_name, item->name);
+  GB_STRCPYSTATIC(pobj.gbid, item->gbid);
+  GB_STRCPYSTATIC(pobj.prio_path, plan->nodes[item->to].addr);
+  GB_STRCPYSTATIC(pobj.old_path, plan->nodes[item->from].addr);
+
+  for (i = 0; i < item->list->nhosts; i++) {
+    ret = glusterBlockCallRPC_1(item->list->hosts[i], &pobj, PRIO_PATH_SRV,
+                                &rpc_sent, &out, NULL);
+    if (ret) {
+      GB_ASPRINTF(&item->errMsg, "%s: %s", item->list->hosts[i],
+                  (rpc_sent && out) ? out : strerror(errno));
+      LOG("mgmt", GB_LOG_ERROR, "%s for block %s on host %s volume %s",
+          FAILED_REMOTE_PRIO_PATH, item->name, item->list->hosts[i],
+          plan->volume);
+      GB_FREE(out);
+      break;
+    }
+    GB_FREE(out);
+    done[i] = true;
+  }
+
+  if (ret) {
+    GB_STRCPYSTATIC(pobj.prio_path, plan->nodes[item->from].addr);
+    GB_STRCPYSTATIC(pobj.old_path, plan->nodes[item->to].addr);
+    for (i = 0; i < item->list->nhosts; i++) {
+      if (!done[i]) {
+        continue;
+      }
+      if (glusterBlockCallRPC_1(item->list->hosts[i], &pobj, PRIO_PATH_SRV,
+                                &rpc_sent, &out, NULL)) {
+        LOG("mgmt", GB_LOG_WARNING,
+            "reverting prio path of block %s on host %s volume %s failed",
+            item->name, item->list->hosts[i], plan->volume);
+      }
+      GB_FREE(out);
+    }
+    goto out;
+  }
+
+  if (plan->drainPath) {
+    GB_METAUPDATE_OR_GOTO(lock, plan->glfs, item->name, plan->volume, ret,
+                          item->errMsg, out, "PRIOPATH: %s\nDRAINPATH: %s\n",
+                          plan->nodes[item->to].addr, plan->drainPath);
+  } else {
+    GB_METAUPDATE_OR_GOTO(lock, plan->glfs, item->name, plan->volume, ret,
+                          item->errMsg, out, "PRIOPATH: %s\n",
+                          plan->nodes[item->to].addr);
+  }
+  item->status = 0;
+
+ out:
+  GB_FREE(done);
+}
+
+
+static void *
+glusterBlockRebalanceWorker(void *data)
+{
+  blockRebalancePlan *plan = data;
+  size_t idx;
+
+
+  while (1) {
+    LOCK(plan->lock);
+    if (plan->next >= plan->nmoves) {
+      UNLOCK(plan->lock);
+      break;
+    }
+    idx = plan->moves[plan->next++];
+    UNLOCK(plan->lock);
+
+    blockRebalanceMoveOne(plan, &plan->items[idx]);
+  }
+
+  return NULL;
+}
+
+
+static int
+glusterBlockRebalanceApply(blockRebalancePlan *plan, size_t parallel)
+{
+  pthread_t *tid = NULL;
+  size_t nthreads;
+  size_t i;
+
+
+  nthreads = parallel < plan->nmoves ? parallel : plan->nmoves;
+  if (!nthreads) {
+    return 0;
+  }
+
+  if (GB_ALLOC_N(tid, nthreads) < 0) {
+    return -1;
+  }
+
+  pthread_mutex_init(&plan->lock, NULL);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&tid[i], NULL, glusterBlockRebalanceWorker, plan)) {
+      break;
+    }
+  }
+  if (!i) {
+    /* not even one worker, do the moves inline */
+    glusterBlockRebalanceWorker(plan);
+  }
+  nthreads = i;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  pthread_mutex_destroy(&plan->lock);
+
+  GB_FREE(tid);
+  return 0;
+}
+
+
+/*
+ * Apply the planned moves, parallel blocks at a time, and resync the prio
+ * counters with what the targets serve now. Returns GB_DEFAULT_ERRCODE if
+ * any of the moves failed.
+ */
+static int
+glusterBlockRebalanceRun(blockRebalancePlan *plan, void *blk, operations opt,
+                         u_int parallel, char **errMsg)
+{
+  blockServerDefPtr list = NULL;
+  blockRebalanceItem *item;
+  char **hosts = NULL;
+  size_t *counts = NULL;
+  size_t failed = 0;
+  int errCode = ENOMEM;
+  size_t i;
+
+
+  if (!plan->nmoves) {
+    return 0;
+  }
+
+  if (GB_ALLOC(list) < 0 || GB_ALLOC_N(list->hosts, plan->nnodes) < 0) {
+    goto out;
+  }
+  for (i = 0; i < plan->nnodes; i++) {
+    if (plan->nodes[i].member &&
+        GB_STRDUP(list->hosts[list->nhosts++], plan->nodes[i].addr) < 0) {
+      goto out;
+    }
+  }
+
+  errCode = glusterBlockCheckCapabilities(blk, opt, list, NULL, errMsg);
+  if (errCode) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "glusterBlockCheckCapabilities() for prio path moves on volume %s "
+        "failed", plan->volume);
+    goto out;
+  }
+
+  if (!parallel) {
+    parallel = GB_REBALANCE_PARALLEL_DEF;
+  } else if (parallel > GB_REBALANCE_PARALLEL_MAX) {
+    parallel = GB_REBALANCE_PARALLEL_MAX;
+  }
+  if (glusterBlockRebalanceApply(plan, parallel)) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  /* what the targets serve now, failed moves kept their old path */
+  for (i = 0; i < plan->nnodes; i++) {
+    plan->nodes[i].after = plan->nodes[i].before;
+  }
+  for (i = 0; i < plan->nmoves; i++) {
+    item = &plan->items[plan->moves[i]];
+    if (item->status) {
+      failed++;
+      continue;
+    }
+    plan->nodes[item->from].after--;
+    plan->nodes[item->to].after++;
+  }
+
+  /* resync the prio counters with the metafiles */
+  errCode = ENOMEM;
+  if (GB_ALLOC_N(hosts, plan->nnodes) < 0 ||
+      GB_ALLOC_N(counts, plan->nnodes) < 0) {
+    goto out;
+  }
+  for (i = 0; i < plan->nnodes; i++) {
+    hosts[i] = plan->nodes[i].addr;
+    counts[i] = plan->nodes[i].after;
+  }
+  if (blockSetPrioCounts(plan->glfs, plan->volume, hosts, counts, plan->nnodes)) {
+    LOG("mgmt", GB_LOG_WARNING, "failed to update prio counters on volume %s",
+        plan->volume);
+  }
+
+  errCode = failed ? GB_DEFAULT_ERRCODE : 0;
+
+  LOG("mgmt", GB_LOG_DEBUG, "prio path moves on volume %s: moved=%zu "
+      "failed=%zu", plan->volume, plan->nmoves - failed, failed);
+
+ out:
+  blockServerDefFree(list);
+  GB_FREE(hosts);
+  GB_FREE(counts);
+  return errCode;
+}
+
+
+static void
+blockRebalancePlanFree(blockRebalancePlan *plan)
+{
+  size_t i;
+
+
+  for (i = 0; i < plan->nnodes; i++) {
+    GB_FREE(plan->nodes[i].addr);
+  }
+  GB_FREE(plan->nodes);
+
+  for (i = 0; i < plan->nitems; i++) {
+    GB_FREE(plan->items[i].name);
+    GB_FREE(plan->items[i].drainPath);
+    GB_FREE(plan->items[i].errMsg);
+    blockServerDefFree(plan->items[i].list);
+  }
+  GB_FREE(plan->items);
+  GB_FREE(plan->moves);
+}
+
+
+static const char *
+blockRebalanceMoveStatus(blockRebalanceItem *item, bool planned)
+{
+  if (item->errMsg) {
+    return "FAIL";
+  }
+  if (planned) {
+    return "PLANNED";
+  }
+  return item->status ? "FAIL" : "SUCCESS";
+}
+
+
+static json_object *
+blockRebalancePlanToJson(blockRebalancePlan *plan, bool planned)
+{
+  json_object *json_obj = NULL;
+  json_object *json_array = NULL;
+  json_object *json_item = NULL;
+  blockRebalanceItem *item;
+  size_t i;
+
+
+  json_obj = json_object_new_object();
+  json_object_object_add(json_obj, "VOLUME", GB_JSON_OBJ_TO_STR(plan->volume));
+
+  json_array = json_object_new_array();
+  for (i = 0; i < plan->nnodes; i++) {
+    json_item = json_object_new_object();
+    json_object_object_add(json_item, "NODE",
+                           GB_JSON_OBJ_TO_STR(plan->nodes[i].addr));
+    json_object_object_add(json_item, "ACTIVE PATHS",
+                           json_object_new_int64(plan->nodes[i].before));
+    json_object_object_add(json_item, planned ? "PROJECTED" : "AFTER",
+                           json_object_new_int64(plan->nodes[i].after));
+    json_object_object_add(json_item, "DRAINED",
+                           json_object_new_boolean(plan->nodes[i].drained));
+    json_object_array_add(json_array, json_item);
+  }
+  json_object_object_add(json_obj, "NODES", json_array);
+
+  json_array = json_object_new_array();
+  for (i = 0; i < plan->nmoves; i++) {
+    item = &plan->items[plan->moves[i]];
+    json_item = json_object_new_object();
+    json_object_object_add(json_item, "NAME", GB_JSON_OBJ_TO_STR(item->name));
+    json_object_object_add(json_item, "FROM",
+                           GB_JSON_OBJ_TO_STR(plan->nodes[item->from].addr));
+    json_object_object_add(json_item, "TO",
+                           GB_JSON_OBJ_TO_STR(plan->nodes[item->to].addr));
+    json_object_object_add(json_item, "STATUS",
+                           GB_JSON_OBJ_TO_STR(blockRebalanceMoveStatus(item, planned)));
+    if (item->errMsg) {
+      json_object_object_add(json_item, "errMsg",
+                             GB_JSON_OBJ_TO_STR(item->errMsg));
+    }
+    json_object_array_add(json_array, json_item);
+  }
+  json_object_object_add(json_obj, "MOVES", json_array);
+
+  return json_obj;
+}
+
+
+static int
+blockRebalancePlanToStr(blockRebalancePlan *plan, bool planned, gbStrBuf *sb)
+{
+  blockRebalanceItem *item;
+  size_t i;
+
+
+  if (gbStrBufAppendf(sb, "VOLUME: %s\nNODES:\n", plan->volume) < 0) {
+    return -1;
+  }
+  for (i = 0; i < plan->nnodes; i++) {
+    if (gbStrBufAppendf(sb, "  %s: %zu -> %zu%s\n", plan->nodes[i].addr,
+                        plan->nodes[i].before, plan->nodes[i].after,
+                        plan->nodes[i].drained ? " (drained)" : "") < 0) {
+      return -1;
+    }
+  }
+  if (gbStrBufAppendf(sb, "MOVES:%s\n", plan->nmoves ? "" : " *Nil*") < 0) {
+    return -1;
+  }
+  for (i = 0; i < plan->nmoves; i++) {
+    item = &plan->items[plan->moves[i]];
+    if (gbStrBufAppendf(sb, "  %s: %s -> %s [%s%s%s]\n", item->name,
+                        plan->nodes[item->from].addr, plan->nodes[item->to].addr,
+                        blockRebalanceMoveStatus(item, planned),
+                        item->errMsg ? ": " : "",
+                        item->errMsg ? item->errMsg : "") < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+static void
+blockRebalanceCliFormatResponse(blockRebalanceCli *blk, int errCode,
+                                char *errMsg, blockRebalancePlan *plan,
+                                struct blockResponse *reply)
+{
+  json_object *json_obj = NULL;
+  gbStrBuf sb = {0, };
+
+
+  if (!reply) {
+    return;
+  }
+
+  if (errCode < 0) {
+    errCode = GB_DEFAULT_ERRCODE;
+  }
+  reply->exit = errCode;
+
+  if (errMsg) {
+    blockFormatErrorResponse(REBALANCE_SRV, blk->json_resp, errCode,
+                             errMsg, reply);
+    return;
+  }
+
+  if (blk->json_resp) {
+    json_obj = blockRebalancePlanToJson(plan, blk->dry_run);
+    json_object_object_add(json_obj, "RESULT",
+                           GB_JSON_OBJ_TO_STR(errCode ? "FAIL" : "SUCCESS"));
+    GB_ASPRINTF(&reply->out, "%s\n", json_object_to_json_string_ext(json_obj,
+                                       mapJsonFlagToJsonCstring(blk->json_resp)));
+    json_object_put(json_obj);
+    return;
+  }
+
+  if (blockRebalancePlanToStr(plan, blk->dry_run, &sb) ||
+      gbStrBufAppendf(&sb, "RESULT: %s\n", errCode ? "FAIL" : "SUCCESS") < 0) {
+    goto out;
+  }
+  reply->out = gbStrBufDetach(&sb);
+
+ out:
+  gbStrBufFree(&sb);
+}
+
+
+blockResponse *
+block_rebalance_cli_1_svc_st(blockRebalanceCli *blk, struct svc_req *rqstp)
+{
+  blockResponse *reply = NULL;
+  struct glfs *glfs = NULL;
+  struct glfs_fd *lkfd = NULL;
+  blockRebalancePlan plan = {0, };
+  int errCode = 0;
+  char *errMsg = NULL;
+
+
+  LOG("mgmt", GB_LOG_DEBUG,
+      "rebalance request, volume=%s dry_run=%d parallel=%u",
+      blk->volume, blk->dry_run, blk->parallel);
+
+  if (GB_ALLOC(reply) < 0) {
+    return NULL;
+  }
+  reply->exit = -1;
+
+  plan.volume = blk->volume;
+
+  glfs = glusterBlockVolumeInit(blk->volume, &errCode, &errMsg);
+  if (!glfs) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "glusterBlockVolumeInit(%s) failed", blk->volume);
+    goto optfail;
+  }
+  plan.glfs = glfs;
+
+  lkfd = glusterBlockCreateMetaLockFile(glfs, blk->volume, &errCode, &errMsg);
+  if (!lkfd) {
+    LOG("mgmt", GB_LOG_ERROR, "%s %s", FAILED_CREATING_META, blk->volume);
+    goto optfail;
+  }
+
+  GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, optfail);
+  LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
+
+  errCode = blockRebalanceLoad(&plan, &errMsg);
+  if (errCode) {
+    goto out;
+  }
+
+  if (blockRebalanceBuildPlan(&plan)) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  if (!blk->dry_run) {
+    errCode = glusterBlockRebalanceRun(&plan, blk, REBALANCE_SRV,
+                                       blk->parallel, &errMsg);
+  }
+
+ out:
+  GB_METAUNLOCK(lkfd, blk->volume, errCode, errMsg);
+  blockRebalanceCliFormatResponse(blk, errCode, errMsg, &plan, reply);
+  LOG("cmdlog", errCode?GB_LOG_ERROR:GB_LOG_INFO, "%s", reply->out);
+
+ optfail:
+  if (!reply->out) {
+    blockFormatErrorResponse(REBALANCE_SRV, blk->json_resp,
+                             errCode ? errCode : GB_DEFAULT_ERRCODE,
+                             errMsg ? errMsg : FAILED_REBALANCE, reply);
+  }
+
+  if (lkfd && glfs_close(lkfd) != 0) {
+    LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        GB_TXLOCKFILE, blk->volume, strerror(errno));
+  }
+
+  blockRebalancePlanFree(&plan);
+  GB_FREE(errMsg);
+
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
+  return reply;
+}
+
+
+/*
+ * Drain or undrain blk->node on one volume, see
+ * blockRebalanceBuildDrainPlan(). The drained mark is updated even if some
+ * of the moves failed, so a drained node takes no new prio paths and the
+ * command can simply be run again.
+ */
+static int
+glusterBlockDrainVolume(blockDrainCli *blk, char *volume,
+                        blockRebalancePlan *plan, char **errMsg)
+{
+  struct glfs *glfs = NULL;
+  struct glfs_fd *lkfd = NULL;
+  int errCode = 0;
+
+
+  plan->volume = volume;
+  plan->drainPath = blk->undrain ? "" : blk->node;
+
+  glfs = glusterBlockVolumeInit(volume, &errCode, errMsg);
+  if (!glfs) {
+    LOG("mgmt", GB_LOG_ERROR, "glusterBlockVolumeInit(%s) failed", volume);
+    goto optfail;
+  }
+  plan->glfs = glfs;
+
+  lkfd = glusterBlockCreateMetaLockFile(glfs, volume, &errCode, errMsg);
+  if (!lkfd) {
+    LOG("mgmt", GB_LOG_ERROR, "%s %s", FAILED_CREATING_META, volume);
+    goto optfail;
+  }
+
+  GB_METALOCK_OR_GOTO(lkfd, volume, errCode, *errMsg, optfail);
+
+  errCode = blockRebalanceLoad(plan, errMsg);
+  if (errCode) {
+    goto out;
+  }
+
+  if (blockRebalanceBuildDrainPlan(plan, blk->node, blk->undrain)) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  errCode = glusterBlockRebalanceRun(plan, blk, DRAIN_SRV, blk->parallel,
+                                     errMsg);
+  if (*errMsg) {
+    goto out;
+  }
+
+  if (blockSetDrained(glfs, volume, blk->node, !blk->undrain)) {
+    errCode = errno ? errno : GB_DEFAULT_ERRCODE;
+    GB_ASPRINTF(errMsg, "failed to mark node %s %s on volume %s[%s]",
+                blk->node, blk->undrain ? "undrained" : "drained", volume,
+                strerror(errCode));
+    goto out;
+  }
+
+ out:
+  GB_METAUNLOCK(lkfd, volume, errCode, *errMsg);
+
+ optfail:
+  if (lkfd && glfs_close(lkfd) != 0) {
+    LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        GB_TXLOCKFILE, volume, strerror(errno));
+  }
+
+  /* the plan outlives the handle, for the response */
+  plan->glfs = NULL;
+  glusterBlockVolumeRelease(volume, glfs);
+
+  return errCode;
+}
+
+
+static void
+blockDrainCliFormatResponse(blockDrainCli *blk, int errCode, char *errMsg,
+                            blockRebalancePlan *plans, size_t nplans,
+                            struct blockResponse *reply)
+{
+  json_object *json_obj = NULL;
+  json_object *json_array = NULL;
+  gbStrBuf sb = {0, };
+  size_t i;
+
+
+  if (!reply) {
+    return;
+  }
+
+  if (errCode < 0) {
+    errCode = GB_DEFAULT_ERRCODE;
+  }
+  reply->exit = errCode;
+
+  if (errMsg) {
+    blockFormatErrorResponse(DRAIN_SRV, blk->json_resp, errCode,
+                             errMsg, reply);
+    return;
+  }
+
+  if (blk->json_resp) {
+    json_obj = json_object_new_object();
+    json_object_object_add(json_obj, "NODE", GB_JSON_OBJ_TO_STR(blk->node));
+    json_array = json_object_new_array();
+    for (i = 0; i < nplans; i++) {
+      json_object_array_add(json_array,
+                            blockRebalancePlanToJson(&plans[i], false));
+    }
+    json_object_object_add(json_obj, "VOLUMES", json_array);
+    json_object_object_add(json_obj, "RESULT",
+                           GB_JSON_OBJ_TO_STR(errCode ? "FAIL" : "SUCCESS"));
+    GB_ASPRINTF(&reply->out, "%s\n", json_object_to_json_string_ext(json_obj,
+                                       mapJsonFlagToJsonCstring(blk->json_resp)));
+    json_object_put(json_obj);
+    return;
+  }
+
+  if (gbStrBufAppendf(&sb, "NODE: %s\n", blk->node) < 0) {
+    goto out;
+  }
+  for (i = 0; i < nplans; i++) {
+    if (blockRebalancePlanToStr(&plans[i], false, &sb)) {
+      goto out;
+    }
+  }
+  if (gbStrBufAppendf(&sb, "RESULT: %s\n", errCode ? "FAIL" : "SUCCESS") < 0) {
+    goto out;
+  }
+  reply->out = gbStrBufDetach(&sb);
+
+ out:
+  gbStrBufFree(&sb);
+}
+
+
+blockResponse *
+block_drain_cli_1_svc_st(blockDrainCli *blk, struct svc_req *rqstp)
+{
+  blockResponse *reply = NULL;
+  blockRebalancePlan *plans = NULL;
+  strToCharArrayDefPtr vols = NULL;
+  size_t nplans = 0;
+  int errCode = 0;
+  int ret;
+  char *errMsg = NULL;
+  size_t i;
+
+
+  LOG("mgmt", GB_LOG_DEBUG, "%s request, node=%s volume=%s parallel=%u",
+      blk->undrain ? "undrain" : "drain", blk->node, blk->volume,
+      blk->parallel);
+
+  if (GB_ALLOC(reply) < 0) {
+    return NULL;
+  }
+  reply->exit = -1;
+
+  LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
+
+  vols = getCharArrayFromDelimitedStr(blk->volume, GB_VOLS_DELIMITER);
+  if (!vols || GB_ALLOC_N(plans, vols->len) < 0) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "getCharArrayFromDelimitedStr(%s) failed", blk->volume);
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  /* failed moves do not stop the run, a volume failing before them does */
+  for (i = 0; i < vols->len; i++) {
+    ret = glusterBlockDrainVolume(blk, vols->data[i], &plans[nplans], &errMsg);
+    if (errMsg) {
+      /* could not get as far as moving, nothing to show for it */
+      errCode = ret ? ret : GB_DEFAULT_ERRCODE;
+      break;
+    }
+    nplans++;
+    if (ret) {
+      errCode = ret;
+    }
+  }
+
+ out:
+  blockDrainCliFormatResponse(blk, errCode, errMsg, plans, nplans, reply);
+  if (!reply->out) {
+    blockFormatErrorResponse(DRAIN_SRV, blk->json_resp,
+                             errCode ? errCode : GB_DEFAULT_ERRCODE,
+                             blk->undrain ? FAILED_UNDRAIN : FAILED_DRAIN,
+                             reply);
+  }
+  LOG("cmdlog", errCode?GB_LOG_ERROR:GB_LOG_INFO, "%s", reply->out);
+
+  for (i = 0; plans && i < vols->len; i++) {
+    blockRebalancePlanFree(&plans[i]);
+  }
+  GB_FREE(plans);
+  strToCharArrayDefFree(vols);
+  GB_FREE(errMsg);
+
+  return reply;
+}
+
+
+typedef struct blockReplaceItem {
+  char *name;
+  MetaInfo *info;
+  size_t *hosts;              /* nodes called for the block, into plan->hosts */
+  size_t nhosts;
+  int status;                 /* 0, GB_OP_SKIPPED or an errCode */
+  char *errMsg;
+} blockReplaceItem;
+
+typedef struct blockReplacePlan {
+  struct glfs *glfs;
+  char *volume;
+  blockReplaceBulkCli *blk;
+  blockReplaceItem *items;
+  size_t nitems;
+  size_t next;                /* next block to be picked by a worker */
+  char **hosts;               /* every node called for the blocks */
+  size_t *inflight;           /* blocks in flight per node */
+  size_t nhosts;
+  size_t hostLimit;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} blockReplacePlan;
+
+
+static ssize_t
+blockReplaceHostIndex(blockReplacePlan *plan, char *addr)
+{
+  size_t i;
+
+
+  for (i = 0; i < plan->nhosts; i++) {
+    if (!strcmp(plan->hosts[i], addr)) {
+      return i;
+    }
+  }
+
+  if (GB_REALLOC_N(plan->hosts, plan->nhosts + 1) < 0) {
+    return -1;
+  }
+  if (GB_STRDUP(plan->hosts[plan->nhosts], addr) < 0) {
+    return -1;
+  }
+
+  return plan->nhosts++;
+}
+
+
+/*
+ * Takes over info. The nodes of a block are the ones the replace calls:
+ * the new node, the old node and the other valid hosts.
+ */
+static int
+blockReplaceAddItem(blockReplacePlan *plan, char *name, MetaInfo *info)
+{
+  blockReplaceItem *item;
+  ssize_t n;
+  size_t i;
+
+
+  if (GB_REALLOC_N(plan->items, plan->nitems + 1) < 0) {
+    blockFreeMetaInfo(info);
+    return -1;
+  }
+  item = &plan->items[plan->nitems];
+  memset(item, 0, sizeof(*item));
+  plan->nitems++;
+  item->info = info;
+
+  if (GB_STRDUP(item->name, name) < 0 ||
+      GB_ALLOC_N(item->hosts, info->nhosts + 1) < 0) {
+    return -1;
+  }
+
+  n = blockReplaceHostIndex(plan, plan->blk->new_node);
+  if (n < 0) {
+    return -1;
+  }
+  item->hosts[item->nhosts++] = n;
+
+  for (i = 0; i < info->nhosts; i++) {
+    if (!strcmp(info->list[i]->addr, plan->blk->new_node)) {
+      continue;
+    }
+    if (strcmp(info->list[i]->addr, plan->blk->old_node) &&
+        !blockhostIsValid(info->list[i]->status)) {
+      continue;
+    }
+    n = blockReplaceHostIndex(plan, info->list[i]->addr);
+    if (n < 0) {
+      return -1;
+    }
+    item->hosts[item->nhosts++] = n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Read the blocks of the volume that have the old node in their metafile,
+ * whatever its state, so the ones a previous run left half way are taken up
+ * again and the ones it got through are reported as skipped. Called with
+ * the volume metadata lock held.
+ */
+static int
+blockReplaceLoad(blockReplacePlan *plan, char **errMsg)
+{
+  gbMetaScan scan = {0};
+  MetaInfo *info = NULL;
+  struct stat *st;
+  char *name;
+  int errCode = 0;
+
+
+  if (glusterBlockMetaScanOpen(plan->glfs, plan->volume, &scan)) {
+    errCode = errno;
+    GB_ASPRINTF(errMsg, "Not able to open metadata directory for volume "
+                "%s[%s]", plan->volume, strerror(errCode));
+    LOG("mgmt", GB_LOG_ERROR, "glfs_h_opendir(%s): on volume %s failed[%s]",
+        GB_METADIR, plan->volume, strerror(errCode));
+    goto out;
+  }
+
+  while ((name = glusterBlockMetaScanNext(&scan, &st))) {
+    if (GB_ALLOC(info) < 0) {
+      errCode = ENOMEM;
+      goto out;
+    }
+    if (blockGetMetaInfoCached(plan->glfs, plan->volume, name, st, info,
+                               &errCode)) {
+      GB_ASPRINTF(errMsg, "failed to read metadata of block %s/%s",
+                  plan->volume, name);
+      errCode = errCode ? errCode : GB_DEFAULT_ERRCODE;
+      goto out;
+    }
+
+    if (blockGetHostStatus(info, plan->blk->old_node) == GB_METASTATUS_MAX) {
+      blockFreeMetaInfo(info);
+      info = NULL;
+      continue;
+    }
+    if (blockReplaceAddItem(plan, name, info)) {
+      info = NULL;
+      errCode = ENOMEM;
+      goto out;
+    }
+    info = NULL;
+  }
+
+  if (plan->nhosts && GB_ALLOC_N(plan->inflight, plan->nhosts) < 0) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+ out:
+  glusterBlockMetaScanClose(&scan);
+  blockFreeMetaInfo(info);
+  return errCode;
+}
+
+
+/*
+ * One capability fan-out for all the blocks, over every node called for
+ * them but the old one when forced, which may well be gone.
+ */
+static int
+blockReplaceCheckCapabilities(blockReplacePlan *plan, char **errMsg)
+{
+  blockReplaceCli rblk = {{0}, };
+  blockServerDefPtr list = NULL;
+  int errCode = ENOMEM;
+  size_t i;
+
+
+  if (GB_ALLOC(list) < 0 || GB_ALLOC_N(list->hosts, plan->nhosts) < 0) {
+    goto out;
+  }
+  for (i = 0; i < plan->nhosts; i++) {
+    if (plan->blk->force && !strcmp(plan->hosts[i], plan->blk->old_node)) {
+      continue;
+    }
+    if (GB_STRDUP(list->hosts[list->nhosts++], plan->hosts[i]) < 0) {
+      goto out;
+    }
+  }
+
+  rblk.json_resp = plan->blk->json_resp;
+  errCode = glusterBlockCheckCapabilities((void *)&rblk, REPLACE_SRV, list,
+                                          NULL, errMsg);
+  if (errCode) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "glusterBlockCheckCapabilities() for replace of node %s on volume "
+        "%s failed", plan->blk->old_node, plan->volume);
+  }
+
+ out:
+  blockServerDefFree(list);
+  return errCode;
+}
+
+
+/* what glusterBlockReplaceNodeRemoteAsync() could not get done, if anything */
+static char *
+blockReplaceFailures(blockRemoteReplaceResp *savereply)
+{
+  gbStrBuf sb = {0, };
+  int ret = 0;
+
+
+  if (savereply->cop->status && savereply->cop->status != GB_OP_SKIPPED) {
+    ret |= gbStrBufAppendf(&sb, "; create failed on %s",
+                           savereply->cop->attempt);
+  }
+  if (savereply->dop->status && savereply->dop->status != GB_OP_SKIPPED &&
+      !savereply->force) {
+    ret |= gbStrBufAppendf(&sb, "; delete failed on %s",
+                           savereply->dop->attempt);
+  }
+  if (savereply->rop->status != GB_OP_SKIPPED &&
+      savereply->rop->attempt && savereply->rop->attempt[0]) {
+    ret |= gbStrBufAppendf(&sb, "; replace portal failed on%s",
+                           savereply->rop->attempt);
+  }
+
+  if (ret < 0) {
+    gbStrBufFree(&sb);
+    GB_STRDUP(sb.buf, FAILED_REPLACE);
+    return sb.buf;
+  }
+  if (!sb.buf) {
+    return NULL;
+  }
+
+  /* drop the leading "; " */
+  memmove(sb.buf, sb.buf + 2, strlen(sb.buf + 2) + 1);
+  return gbStrBufDetach(&sb);
+}
+
+
+static void
+blockReplaceOne(blockReplacePlan *plan, blockReplaceItem *item)
+{
+  blockRemoteReplaceResp *savereply = NULL;
+  blockReplaceCli rblk = {{0}, };
+  int ret;
+
+
+  GB_STRCPYSTATIC(rblk.volume, plan->volume);
+  GB_STRCPYSTATIC(rblk.block_name, item->name);
+  GB_STRCPYSTATIC(rblk.old_node, plan->blk->old_node);
+  GB_STRCPYSTATIC(rblk.new_node, plan->blk->new_node);
+  rblk.force = plan->blk->force;
+
+  ret = glusterBlockReplaceNodeRemoteAsync(plan->glfs, &rblk, item->info,
+                                           item->name, &savereply);
+  if (ret) {
+    item->status = ret;
+    if (ret == GB_NODE_NOT_EXIST) {
+      GB_ASPRINTF(&item->errMsg, "block is not configured on node '%s'",
+                  plan->blk->old_node);
+    } else if (ret == GB_NODE_IN_USE) {
+      GB_ASPRINTF(&item->errMsg, "block was already configured on node '%s'",
+                  plan->blk->new_node);
+    } else {
+      GB_ASPRINTF(&item->errMsg, "%s", FAILED_REPLACE);
+    }
+    LOG("mgmt", GB_LOG_WARNING, "glusterBlockReplaceNodeRemoteAsync: return"
+        " %d %s for block %s on volume %s", ret, FAILED_REMOTE_REPLACE,
+        item->name, plan->volume);
+    goto out;
+  }
+
+  if (blockReplaceNodeFinish(plan->glfs, &rblk, item->info, savereply,
+                             &item->errMsg)) {
+    item->status = GB_DEFAULT_ERRCODE;
+    goto out;
+  }
+
+  if (savereply->status == GB_OP_SKIPPED) {
+    item->status = GB_OP_SKIPPED;
+    goto out;
+  }
+
+  item->errMsg = blockReplaceFailures(savereply);
+  item->status = item->errMsg ? GB_DEFAULT_ERRCODE : 0;
+
+ out:
+  blockRemoteReplaceRespFree(savereply);
+}
+
+
+static bool
+blockReplaceHostsFree(blockReplacePlan *plan, blockReplaceItem *item)
+{
+  size_t i;
+
+
+  for (i = 0; i < item->nhosts; i++) {
+    if (plan->inflight[item->hosts[i]] >= plan->hostLimit) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+/*
+ * Blocks are taken in order, a worker waits for every node of its block to
+ * have a free slot and takes them all at once, so no node has more than
+ * hostLimit blocks in flight and workers never hold slots while waiting.
+ */
+static void *
+glusterBlockReplaceWorker(void *data)
+{
+  blockReplacePlan *plan = data;
+  blockReplaceItem *item;
+  size_t i;
+
+
+  while (1) {
+    LOCK(plan->lock);
+    if (plan->next >= plan->nitems) {
+      UNLOCK(plan->lock);
+      break;
+    }
+    item = &plan->items[plan->next++];
+    while (!blockReplaceHostsFree(plan, item)) {
+      pthread_cond_wait(&plan->cond, &plan->lock);
+    }
+    for (i = 0; i < item->nhosts; i++) {
+      plan->inflight[item->hosts[i]]++;
+    }
+    UNLOCK(plan->lock);
+
+    blockReplaceOne(plan, item);
+
+    LOCK(plan->lock);
+    for (i = 0; i < item->nhosts; i++) {
+      plan->inflight[item->hosts[i]]--;
+    }
+    pthread_cond_broadcast(&plan->cond);
+    UNLOCK(plan->lock);
+  }
+
+  return NULL;
+}
+
+
+static int
+glusterBlockReplaceApply(blockReplacePlan *plan, size_t parallel)
+{
+  pthread_t *tid = NULL;
+  size_t nthreads;
+  size_t i;
+
+
+  nthreads = parallel < plan->nitems ? parallel : plan->nitems;
+  if (!nthreads) {
+    return 0;
+  }
+
+  if (GB_ALLOC_N(tid, nthreads) < 0) {
+    return -1;
+  }
+
+  pthread_mutex_init(&plan->lock, NULL);
+  pthread_cond_init(&plan->cond, NULL);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&tid[i], NULL, glusterBlockReplaceWorker, plan)) {
+      break;
+    }
+  }
+  if (!i) {
+    /* not even one worker, replace inline */
+    glusterBlockReplaceWorker(plan);
+  }
+  nthreads = i;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  pthread_cond_destroy(&plan->cond);
+  pthread_mutex_destroy(&plan->lock);
+
+  GB_FREE(tid);
+  return 0;
+}
+
+
+static void
+blockReplacePlanFree(blockReplacePlan *plan)
+{
+  size_t i;
+
+
+  for (i = 0; i < plan->nhosts; i++) {
+    GB_FREE(plan->hosts[i]);
+  }
+  GB_FREE(plan->hosts);
+  GB_FREE(plan->inflight);
+
+  for (i = 0; i < plan->nitems; i++) {
+    GB_FREE(plan->items[i].name);
+    GB_FREE(plan->items[i].hosts);
+    GB_FREE(plan->items[i].errMsg);
+    blockFreeMetaInfo(plan->items[i].info);
+  }
+  GB_FREE(plan->items);
+}
+
+
+static void
+glusterBlockReplaceJournalPath(const char *volume, char *path, size_t len)
+{
+  snprintf(path, len, "%s/%s", GB_REPLACE_DIR, volume);
+}
+
+
+/* note the run down, so that it is taken up again if the daemon goes away */
+static void
+glusterBlockReplaceJournalSave(blockReplaceBulkCli *blk, const char *volume)
+{
+  char path[PATH_MAX];
+
+
+  glusterBlockReplaceJournalPath(volume, path, sizeof(path));
+  if (gbWriteFileAtomic(path, "%s\n%s\n%d %u\n", blk->old_node,
+                        blk->new_node, blk->force, blk->parallel)) {
+    LOG("mgmt", GB_LOG_WARNING, "saving replace journal of node %s on "
+        "volume %s to %s failed[%s]", blk->old_node, volume, path,
+        strerror(errno));
+  }
+}
+
+
+static void
+glusterBlockReplaceJournalDrop(const char *volume)
+{
+  char path[PATH_MAX];
+
+
+  glusterBlockReplaceJournalPath(volume, path, sizeof(path));
+  if (unlink(path) && errno != ENOENT) {
+    LOG("mgmt", GB_LOG_WARNING, "unlink(%s) failed[%s]", path,
+        strerror(errno));
+  }
+}
+
+
+/*
+ * Replace blk->old_node by blk->new_node on every block of volume that has
+ * it, parallel blocks at a time, under a single hold of the volume metadata
+ * lock. The run is journaled while it goes on, see
+ * glusterBlockReplaceResume(). Failed blocks do not stop the run, they are
+ * reported with GB_DEFAULT_ERRCODE.
+ */
+static int
+glusterBlockReplaceVolume(blockReplaceBulkCli *blk, char *volume,
+                          blockReplacePlan *plan, char **errMsg)
+{
+  struct glfs *glfs = NULL;
+  struct glfs_fd *lkfd = NULL;
+  size_t parallel;
+  size_t failed = 0;
+  size_t i;
+  int errCode = 0;
+
+
+  plan->volume = volume;
+  plan->blk = blk;
+
+  glfs = glusterBlockVolumeInit(volume, &errCode, errMsg);
+  if (!glfs) {
+    LOG("mgmt", GB_LOG_ERROR, "glusterBlockVolumeInit(%s) failed", volume);
+    goto optfail;
+  }
+  plan->glfs = glfs;
+
+  lkfd = glusterBlockCreateMetaLockFile(glfs, volume, &errCode, errMsg);
+  if (!lkfd) {
+    LOG("mgmt", GB_LOG_ERROR, "%s %s", FAILED_CREATING_META, volume);
+    goto optfail;
+  }
+
+  GB_METALOCK_OR_GOTO(lkfd, volume, errCode, *errMsg, optfail);
+  glusterBlockReplaceJournalSave(blk, volume);
+
+  errCode = blockReplaceLoad(plan, errMsg);
+  if (errCode || !plan->nitems) {
+    goto out;
+  }
+
+  errCode = blockReplaceCheckCapabilities(plan, errMsg);
+  if (errCode) {
+    goto out;
+  }
+
+  parallel = blk->parallel;
+  if (!parallel) {
+    parallel = GB_REBALANCE_PARALLEL_DEF;
+  } else if (parallel > GB_REBALANCE_PARALLEL_MAX) {
+    parallel = GB_REBALANCE_PARALLEL_MAX;
+  }
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  plan->hostLimit = gbConf.replaceHostParallel;
+  RWUNLOCK(gbConf.cfgLock);
+
+  if (glusterBlockReplaceApply(plan, parallel)) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  for (i = 0; i < plan->nitems; i++) {
+    if (plan->items[i].status && plan->items[i].status != GB_OP_SKIPPED) {
+      failed++;
+    }
+  }
+  errCode = failed ? GB_DEFAULT_ERRCODE : 0;
+
+  LOG("mgmt", GB_LOG_INFO, "replace of node %s by %s on volume %s: "
+      "blocks=%zu failed=%zu", blk->old_node, blk->new_node, volume,
+      plan->nitems, failed);
+
+ out:
+  glusterBlockReplaceJournalDrop(volume);
+  GB_METAUNLOCK(lkfd, volume, errCode, *errMsg);
+
+ optfail:
+  if (lkfd && glfs_close(lkfd) != 0) {
+    LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        GB_TXLOCKFILE, volume, strerror(errno));
+  }
+
+  /* the plan outlives the handle, for the response */
+  plan->glfs = NULL;
+  glusterBlockVolumeRelease(volume, glfs);
+
+  return errCode;
+}
+
+
+static const char *
+blockReplaceItemResult(blockReplaceItem *item)
+{
+  if (item->status == GB_OP_SKIPPED) {
+    return "SKIPPED";
+  }
+  return item->status ? "FAIL" : "SUCCESS";
+}
+
+
+static json_object *
+blockReplacePlanToJson(blockReplacePlan *plan)
+{
+  json_object *json_obj = NULL;
+  json_object *json_array = NULL;
+  json_object *json_item = NULL;
+  blockReplaceItem *item;
+  size_t i;
+
+
+  json_obj = json_object_new_object();
+  json_object_object_add(json_obj, "VOLUME", GB_JSON_OBJ_TO_STR(plan->volume));
+
+  json_array = json_object_new_array();
+  for (i = 0; i < plan->nitems; i++) {
+    item = &plan->items[i];
+    json_item = json_object_new_object();
+    json_object_object_add(json_item, "NAME", GB_JSON_OBJ_TO_STR(item->name));
+    json_object_object_add(json_item, "RESULT",
+                           GB_JSON_OBJ_TO_STR(blockReplaceItemResult(item)));
+    if (item->errMsg) {
+      json_object_object_add(json_item, "errMsg",
+                             GB_JSON_OBJ_TO_STR(item->errMsg));
+    }
+    json_object_array_add(json_array, json_item);
+  }
+  json_object_object_add(json_obj, "BLOCKS", json_array);
+
+  return json_obj;
+}
+
+
+static int
+blockReplacePlanToStr(blockReplacePlan *plan, gbStrBuf *sb)
+{
+  blockReplaceItem *item;
+  size_t i;
+
+
+  if (gbStrBufAppendf(sb, "VOLUME: %s\nBLOCKS:%s\n", plan->volume,
+                      plan->nitems ? "" : " *Nil*") < 0) {
+    return -1;
+  }
+  for (i = 0; i < plan->nitems; i++) {
+    item = &plan->items[i];
+    if (gbStrBufAppendf(sb, "  %s: %s%s%s\n", item->name,
+                        blockReplaceItemResult(item),
+                        item->errMsg ? ": " : "",
+                        item->errMsg ? item->errMsg : "") < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+static void
+blockReplaceBulkCliFormatResponse(blockReplaceBulkCli *blk, int errCode,
+                                  char *errMsg, blockReplacePlan *plans,
+                                  size_t nplans, struct blockResponse *reply)
+{
+  json_object *json_obj = NULL;
+  json_object *json_array = NULL;
+  gbStrBuf sb = {0, };
+  size_t i;
+
+
+  if (!reply) {
+    return;
+  }
+
+  if (errCode < 0) {
+    errCode = GB_DEFAULT_ERRCODE;
+  }
+  reply->exit = errCode;
+
+  if (errMsg) {
+    blockFormatErrorResponse(REPLACE_SRV, blk->json_resp, errCode,
+                             errMsg, reply);
+    return;
+  }
+
+  if (blk->json_resp) {
+    json_obj = json_object_new_object();
+    json_object_object_add(json_obj, "OLD NODE", GB_JSON_OBJ_TO_STR(blk->old_node));
+    json_object_object_add(json_obj, "NEW NODE", GB_JSON_OBJ_TO_STR(blk->new_node));
+    json_array = json_object_new_array();
+    for (i = 0; i < nplans; i++) {
+      json_object_array_add(json_array, blockReplacePlanToJson(&plans[i]));
+    }
+    json_object_object_add(json_obj, "VOLUMES", json_array);
+    json_object_object_add(json_obj, "RESULT",
+                           GB_JSON_OBJ_TO_STR(errCode ? "FAIL" : "SUCCESS"));
+    GB_ASPRINTF(&reply->out, "%s\n", json_object_to_json_string_ext(json_obj,
+                                       mapJsonFlagToJsonCstring(blk->json_resp)));
+    json_object_put(json_obj);
+    return;
+  }
+
+  if (gbStrBufAppendf(&sb, "OLD NODE: %s\nNEW NODE: %s\n", blk->old_node,
+                      blk->new_node) < 0) {
+    goto out;
+  }
+  for (i = 0; i < nplans; i++) {
+    if (blockReplacePlanToStr(&plans[i], &sb)) {
+      goto out;
+    }
+  }
+  if (gbStrBufAppendf(&sb, "RESULT: %s\n", errCode ? "FAIL" : "SUCCESS") < 0) {
+    goto out;
+  }
+  reply->out = gbStrBufDetach(&sb);
+
+ out:
+  gbStrBufFree(&sb);
+}
+
+
+static blockResponse *
+glusterBlockReplaceBulk(blockReplaceBulkCli *blk)
+{
+  blockResponse *reply = NULL;
+  blockReplacePlan *plans = NULL;
+  strToCharArrayDefPtr vols = NULL;
+  size_t nplans = 0;
+  int errCode = 0;
+  int ret;
+  char *errMsg = NULL;
+  size_t i;
+
+
+  if (GB_ALLOC(reply) < 0) {
+    return NULL;
+  }
+  reply->exit = -1;
+
+  vols = getCharArrayFromDelimitedStr(blk->volume, GB_VOLS_DELIMITER);
+  if (!vols || GB_ALLOC_N(plans, vols->len) < 0) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "getCharArrayFromDelimitedStr(%s) failed", blk->volume);
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  /* failed blocks do not stop the run, a volume failing before them does */
+  for (i = 0; i < vols->len; i++) {
+    ret = glusterBlockReplaceVolume(blk, vols->data[i], &plans[nplans], &errMsg);
+    if (errMsg) {
+      errCode = ret ? ret : GB_DEFAULT_ERRCODE;
+      break;
+    }
+    nplans++;
+    if (ret) {
+      errCode = ret;
+    }
+  }
+
+ out:
+  blockReplaceBulkCliFormatResponse(blk, errCode, errMsg, plans, nplans, reply);
+  if (!reply->out) {
+    blockFormatErrorResponse(REPLACE_SRV, blk->json_resp,
+                             errCode ? errCode : GB_DEFAULT_ERRCODE,
+                             FAILED_REPLACE, reply);
+  }
+
+  for (i = 0; plans && i < vols->len; i++) {
+    blockReplacePlanFree(&plans[i]);
+  }
+  GB_FREE(plans);
+  strToCharArrayDefFree(vols);
+  GB_FREE(errMsg);
+
+  return reply;
+}
+
+
+blockResponse *
+block_replace_bulk_cli_1_svc_st(blockReplaceBulkCli *blk, struct svc_req *rqstp)
+{
+  blockResponse *reply;
+
+
+  LOG("mgmt", GB_LOG_DEBUG,
+      "replace request, volume=%s oldnode=%s newnode=%s force=%d parallel=%u",
+      blk->volume, blk->old_node, blk->new_node, blk->force, blk->parallel);
+
+  LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
+
+  reply = glusterBlockReplaceBulk(blk);
+  if (reply) {
+    LOG("cmdlog", reply->exit?GB_LOG_ERROR:GB_LOG_INFO, "%s", reply->out);
+  }
+
+  return reply;
+}
+
+
+static void
+glusterBlockReplaceResumeOne(const char *volume)
+{
+  blockReplaceBulkCli blk = {{0}, };
+  blockResponse *reply;
+  char path[PATH_MAX];
+  int force;
+  FILE *fp;
+
+
+  GB_STRCPYSTATIC(blk.volume, volume);
+  glusterBlockReplaceJournalPath(volume, path, sizeof(path));
+  fp = fopen(path, "r");
+  if (!fp) {
+    return;
+  }
+  if (fscanf(fp, "%254s %254s %d %u", blk.old_node, blk.new_node, &force,
+             &blk.parallel) != 4) {
+    fclose(fp);
+    LOG("mgmt", GB_LOG_WARNING, "dropping malformed replace journal %s", path);
+    glusterBlockReplaceJournalDrop(volume);
+    return;
+  }
+  fclose(fp);
+  blk.force = force;
+
+  LOG("mgmt", GB_LOG_INFO, "resuming replace of node %s by %s on volume %s",
+      blk.old_node, blk.new_node, volume);
+  reply = glusterBlockReplaceBulk(&blk);
+  if (reply) {
+    LOG("cmdlog", reply->exit?GB_LOG_ERROR:GB_LOG_INFO, "%s", reply->out);
+    GB_FREE(reply->out);
+    GB_FREE(reply);
+  }
+}
+
+
+static void *
+glusterBlockReplaceResumeThread(void *data)
+{
+  char **vols = NULL;
+  size_t nvols = 0;
+  struct dirent *entry;
+  DIR *dir;
+  size_t i;
+
+
+  dir = opendir(GB_REPLACE_DIR);
+  if (!dir) {
+    return NULL;
+  }
+
+  /* the runs rewrite their journals, so list them all first */
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.' || strstr(entry->d_name, ".tmp")) {
+      continue;
+    }
+    if (GB_REALLOC_N(vols, nvols + 1) < 0 ||
+        GB_STRDUP(vols[nvols], entry->d_name) < 0) {
+      break;
+    }
+    nvols++;
+  }
+  closedir(dir);
+
+  for (i = 0; i < nvols; i++) {
+    glusterBlockReplaceResumeOne(vols[i]);
+    GB_FREE(vols[i]);
+  }
+  GB_FREE(vols);
+
+  return NULL;
+}
+
+
+/*
+ * Take up, in the background, the bulk replaces that were running here when
+ * the daemon went away. Blocks they got through are skipped.
+ */
+int
+glusterBlockReplaceResume(void)
+{
+  pthread_t tid;
+
+
+  if (access(GB_REPLACE_DIR, F_OK)) {
+    return 0;
+  }
+
+  if (pthread_create(&tid, NULL, glusterBlockReplaceResumeThread, NULL)) {
+    LOG("mgmt", GB_LOG_WARNING, "%s", "failed to start resuming replaces");
+    return -1;
+  }
+  pthread_detach(tid);
+
+  return 0;
+}
+
+
+struct json_object *
+getTpgObj(char *block, MetaInfo *info, blockGenConfigCli *blk, char *portal, int tag)
+{
+  int auth = 0;
+  uuid_t uuid;
+  char alias[UUID_BUF_SIZE];
+  char alias_10[11] = {'\0', };
+  char lun_so[256] = {'\0', };
+
+  struct json_object *tpg_obj = json_object_new_object();
+  struct json_object *tpg_attr_obj = json_object_new_object();
+  struct json_object *tpg_luns_arr = json_object_new_array();
+  struct json_object *tpg_lun_obj = json_object_new_object();
+  struct json_object *tpg_portals_arr = json_object_new_array();
+  struct json_object *tpg_portal_obj = json_object_new_object();
+  struct json_object *tpg_params_obj = json_object_new_object();
+
+
+  // {  Tpg Object open
+  auth = 1;
+  if(info->passwd[0] == '\0') {
+    auth = 0;
+  }
+
+  json_object_object_add(tpg_attr_obj, "authentication", json_object_new_int(auth));
+  json_object_object_add(tpg_attr_obj, "cache_dynamic_acls", json_object_new_int(1));
+  json_object_object_add(tpg_attr_obj, "demo_mode_write_protect", json_object_new_int(0));
+  json_object_object_add(tpg_attr_obj, "generate_node_acls", json_object_new_int(1));
+  if (strcmp(blk->addr, portal)) {
+    json_object_object_add(tpg_attr_obj, "tpg_enabled_sendtargets", json_object_new_int(0));
+  }
+  json_object_object_add(tpg_obj, "attributes", tpg_attr_obj);
+  if (auth) {
+    json_object_object_add(tpg_obj, "chap_password", GB_JSON_OBJ_TO_STR(info->passwd));
+    json_object_object_add(tpg_obj, "chap_userid", GB_JSON_OBJ_TO_STR(info->gbid));
+  }
+
+  if (!strcmp(blk->addr, portal)) {
+    json_object_object_add(tpg_obj, "enable", json_object_new_boolean(TRUE));
+  } else {
+    json_object_object_add(tpg_obj, "enable", json_object_new_boolean(FALSE));
+  }
+
+  // "luns" : [
+  uuid_generate(uuid);
+  uuid_unparse(uuid, alias);
+  snprintf(alias_10, 11, "%.10s", alias+24);
+  json_object_object_add(tpg_lun_obj, "alias", GB_JSON_OBJ_TO_STR(alias_10[0]?alias_10:NULL));
+  snprintf(lun_so, 256, "/backstores/user/%s", block);
   if (info->prio_path[0]) {
     if (!strcmp(info->prio_path, portal)) {
       json_object_object_add(tpg_lun_obj, "alua_tg_pt_gp_name",
@@ -2731,10 +5491,11 @@ static int
 getSoTgArraysForAllVolume(struct soTgObj *obj, blockGenConfigCli *blk,
                           char **errMsg, int *errCode)
 {
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
-  struct glfs_fd *tgmdfd = NULL;
-  struct dirent *entry;
+  gbMetaScan scan = {0};
+  char *name;
+  struct stat *st;
   MetaInfo *info = NULL;
   strToCharArrayDefPtr vols;
   size_t i, j;
@@ -2768,75 +5529,72 @@ getSoTgArraysForAllVolume(struct soTgObj *obj, blockGenConfigCli *blk,
 
     GB_METALOCK_OR_GOTO(lkfd, vols->data[i], *errCode, *errMsg, out);
 
-    tgmdfd = glfs_opendir(glfs, GB_METADIR);
-    if (!tgmdfd) {
+    if (glusterBlockMetaScanOpen(glfs, vols->data[i], &scan)) {
       *errCode = errno;
       GB_ASPRINTF(errMsg, "Not able to open metadata directory for volume "
           "%s[%s]", vols->data[i], strerror(*errCode));
-      LOG("mgmt", GB_LOG_ERROR, "glfs_opendir(%s): on volume %s failed[%s]",
-          GB_METADIR, vols->data[i], strerror(errno));
+      LOG("mgmt", GB_LOG_ERROR, "glfs_h_opendir(%s): on volume %s failed[%s]",
+          GB_METADIR, vols->data[i], strerror(*errCode));
       ret = -1;
       goto out;
     }
 
-    while ((entry = glfs_readdir(tgmdfd))) {
-      if (!strchr(entry->d_name, '.')) {
-        if (GB_ALLOC(info) < 0) {
+    while ((name = glusterBlockMetaScanNext(&scan, &st))) {
+      if (GB_ALLOC(info) < 0) {
+        ret = -1;
+        goto out;
+      }
+      ret = blockGetMetaInfoCached(glfs, vols->data[i], name, st, info, NULL);
+      if (ret) {
+        goto out;
+      }
+
+      if (!info->prio_path[0]) {
+        /* default as the load balancing is enabled */
+        list = blockMetaInfoToServerParse(info);
+        if (!list) {
           ret = -1;
           goto out;
         }
-        ret = blockGetMetaInfo(glfs, entry->d_name, info, NULL);
-        if (ret) {
-          goto out;
-        }
-
-        if (!info->prio_path[0]) {
-          /* default as the load balancing is enabled */
-          list = blockMetaInfoToServerParse(info);
-          if (!list) {
-            ret = -1;
-            goto out;
-          }
 
-          blockGetPrioPath(glfs, blk->volume, list, info->prio_path, sizeof(info->prio_path));
-          blockIncPrioAttr(glfs, blk->volume, info->prio_path);
+        glusterBlockPickPrioPath(glfs, blk->volume, list, info->prio_path, sizeof(info->prio_path));
+        blockIncPrioAttr(glfs, blk->volume, info->prio_path);
 
-          GB_METAUPDATE_OR_GOTO(lock, glfs, entry->d_name, vols->data[i],
-                                *errCode, *errMsg, out, "PRIOPATH: %s\n", info->prio_path);
-        }
+        GB_METAUPDATE_OR_GOTO(lock, glfs, name, vols->data[i],
+                              *errCode, *errMsg, out, "PRIOPATH: %s\n", info->prio_path);
+      }
 
-        partOfBlock = false;
-        for (j = 0; j < info->nhosts; j++) {
-          if (blockhostIsValid(info->list[j]->status) && !strcmp(info->list[j]->addr, blk->addr)) {
-            partOfBlock = true;
-          }
-        }
-        if (!partOfBlock) {
-          blockFreeMetaInfo(info);
-          continue;
+      partOfBlock = false;
+      for (j = 0; j < info->nhosts; j++) {
+        if (blockhostIsValid(info->list[j]->status) && !strcmp(info->list[j]->addr, blk->addr)) {
+          partOfBlock = true;
         }
+      }
+      if (!partOfBlock) {
+        blockFreeMetaInfo(info);
+        continue;
+      }
 
-        /* storage_objects */
-        so_obj = getSoObj(entry->d_name, info, blk);
-        json_object_array_add(obj->so_arr, so_obj);
+      /* storage_objects */
+      so_obj = getSoObj(name, info, blk);
+      json_object_array_add(obj->so_arr, so_obj);
 
-        /* targets */
-        tg_obj = getTgObj(entry->d_name, info, blk);
-        json_object_array_add(obj->tg_arr, tg_obj);
+      /* targets */
+      tg_obj = getTgObj(name, info, blk);
+      json_object_array_add(obj->tg_arr, tg_obj);
 
-        blockFreeMetaInfo(info);
-      }
+      blockFreeMetaInfo(info);
     }
 
     GB_METAUNLOCK(lkfd, vols->data[i], *errCode, *errMsg);
-    if (tgmdfd && glfs_closedir (tgmdfd) != 0) {
-      LOG("mgmt", GB_LOG_ERROR, "glfs_closedir(%s): on volume %s failed[%s]",
-          GB_METADIR, vols->data[i], strerror(errno));
-    }
+    glusterBlockMetaScanClose(&scan);
     if (lkfd && glfs_close(lkfd) != 0) {
       LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
           GB_TXLOCKFILE, vols->data[i], strerror(errno));
     }
+    lkfd = NULL;
+    glusterBlockVolumeRelease(vols->data[i], glfs);
+    glfs = NULL;
   }
 
   ret = 0;
@@ -2844,10 +5602,7 @@ getSoTgArraysForAllVolume(struct soTgObj *obj, blockGenConfigCli *blk,
 
  out:
   GB_METAUNLOCK(lkfd, vols->data[i], *errCode, *errMsg);
-  if (tgmdfd && glfs_closedir (tgmdfd) != 0) {
-    LOG("mgmt", GB_LOG_ERROR, "glfs_closedir(%s): on volume %s failed[%s]",
-        GB_METADIR, vols->data[i], strerror(errno));
-  }
+  glusterBlockMetaScanClose(&scan);
   blockFreeMetaInfo(info);
 
  optfail:
@@ -2855,6 +5610,9 @@ getSoTgArraysForAllVolume(struct soTgObj *obj, blockGenConfigCli *blk,
     LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
         GB_TXLOCKFILE, vols->data[i], strerror(errno));
   }
+  if (glfs) {
+    glusterBlockVolumeRelease(vols->data[i], glfs);
+  }
 
  free:
   strToCharArrayDefFree(vols);
@@ -2925,10 +5683,174 @@ block_gen_config_cli_1_svc_st(blockGenConfigCli *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  LOG("mgmt", GB_LOG_DEBUG, "genconfig cli success, volume[s]=%s", blk->volume);
+  LOG("mgmt", GB_LOG_DEBUG, "genconfig cli success, volume[s]=%s", blk->volume);
+
+ out:
+  GB_FREE(errMsg);
+  return reply;
+}
+
+
+/* ops and call sites shown by status, the ones holding the most memory */
+# define   GB_STATUS_ALLOC_TOP   16
+
+typedef struct blockStatusOut {
+  int json_resp;
+  json_object *root;
+  json_object *section;
+  gbStrBuf plain;
+} blockStatusOut;
+
+
+static void
+blockStatusSection(blockStatusOut *so, const char *name)
+{
+  if (so->json_resp) {
+    so->section = json_object_new_object();
+    json_object_object_add(so->root, name, so->section);
+    return;
+  }
+
+  gbStrBufAppendf(&so->plain, "%s:\n", name);
+}
+
+
+static void
+blockStatusAdd(blockStatusOut *so, const char *key, long long val)
+{
+  if (so->json_resp) {
+    json_object_object_add(so->section, key, json_object_new_int64(val));
+    return;
+  }
+
+  gbStrBufAppendf(&so->plain, "  %s: %lld\n", key, val);
+}
+
+
+static void
+blockStatusAlloc(blockStatusOut *so, const char *name, gbAllocStats *as)
+{
+  blockStatusSection(so, name);
+  blockStatusAdd(so, "ALLOCS", as->allocs);
+  blockStatusAdd(so, "BYTES", as->bytes);
+  blockStatusAdd(so, "LIVE ALLOCS", as->live);
+  blockStatusAdd(so, "LIVE BYTES", as->liveBytes);
+}
+
+
+static void
+blockStatusCliFormatResponse(blockStatusCli *blk, blockResponse *reply)
+{
+  blockStatusOut so = {blk->json_resp, NULL, NULL, {0, }};
+  gbCacheStats cs;
+  gbLockStats ls;
+  gbRunnerStats rs;
+  gbTrashStats ts;
+  gbAllocStats as[GB_STATUS_ALLOC_TOP];
+  char name[PATH_MAX];
+  size_t j, n;
+  int i;
+
+
+  if (so.json_resp) {
+    so.root = json_object_new_object();
+  }
+
+  blockStatusSection(&so, "DAEMON");
+  blockStatusAdd(&so, "PID", getpid());
+  blockStatusAdd(&so, "RSS KIB", gbProcRssKiB());
+  blockStatusAdd(&so, "LOG MESSAGES DROPPED", gbLogDroppedCount());
+
+  getCacheStats(&cs);
+  blockStatusSection(&so, "GLFS CACHE");
+  blockStatusAdd(&so, "CACHED", cs.cached);
+  blockStatusAdd(&so, "PINNED", cs.pinned);
+  blockStatusAdd(&so, "BUSY", cs.busy);
+  blockStatusAdd(&so, "LIMIT", cs.limit);
+  blockStatusAdd(&so, "ADAPTIVE MIN", cs.limitMin);
+  blockStatusAdd(&so, "ADAPTIVE MAX", cs.limitMax);
+  blockStatusAdd(&so, "MEMORY LIMIT MIB", cs.memLimit);
+  blockStatusAdd(&so, "HITS", cs.hits);
+  blockStatusAdd(&so, "MISSES", cs.misses);
+  blockStatusAdd(&so, "COALESCED INITS", cs.coalesced);
+  blockStatusAdd(&so, "GHOST HITS", cs.ghostHits);
+  blockStatusAdd(&so, "EVICTIONS", cs.evictions);
+  blockStatusAdd(&so, "GROWS", cs.grows);
+  blockStatusAdd(&so, "SHRINKS", cs.shrinks);
+  blockStatusAdd(&so, "RSS KIB PER HANDLE", cs.rssPerHandle);
+
+  for (i = 0; i < GB_LOCK_MAX; i++) {
+    gbLockGetStats(i, &ls);
+    snprintf(name, sizeof(name), "LOCK %s", gbLockIdLookup[i]);
+    blockStatusSection(&so, name);
+    blockStatusAdd(&so, "ACQUIRED", ls.acquired);
+    blockStatusAdd(&so, "CONTENDED", ls.contended);
+    blockStatusAdd(&so, "WAIT USEC", ls.waitUsecTotal);
+    blockStatusAdd(&so, "MAX WAIT USEC", ls.waitUsecMax);
+  }
+
+  if (gbAllocAcctEnabled()) {
+    n = gbAllocGetOpStats(as, GB_STATUS_ALLOC_TOP);
+    for (j = 0; j < n; j++) {
+      snprintf(name, sizeof(name), "ALLOC OP %s", as[j].name);
+      blockStatusAlloc(&so, name, &as[j]);
+    }
+    n = gbAllocGetSiteStats(as, GB_STATUS_ALLOC_TOP);
+    for (j = 0; j < n; j++) {
+      snprintf(name, sizeof(name), "ALLOC SITE %s:%zu %s", as[j].file,
+               as[j].line, as[j].name);
+      blockStatusAlloc(&so, name, &as[j]);
+    }
+  }
+
+  gbRunnerGetStats(&rs);
+  blockStatusSection(&so, "COMMANDS");
+  blockStatusAdd(&so, "RUNS", rs.runs);
+  blockStatusAdd(&so, "FAILURES", rs.failures);
+  blockStatusAdd(&so, "TIMEOUTS", rs.timeouts);
+  blockStatusAdd(&so, "EXEC USEC", rs.execUsecTotal);
+  blockStatusAdd(&so, "MAX EXEC USEC", rs.execUsecMax);
+
+  glusterBlockTrashGetStats(&ts);
+  blockStatusSection(&so, "TRASH");
+  blockStatusAdd(&so, "PENDING FILES", ts.pendingFiles);
+  blockStatusAdd(&so, "PENDING BYTES", ts.pendingBytes);
+  blockStatusAdd(&so, "REAPED FILES", ts.reapedFiles);
+  blockStatusAdd(&so, "RECLAIMED BYTES", ts.reclaimedBytes);
+
+  if (so.json_resp) {
+    GB_ASPRINTF(&reply->out, "%s\n",
+                json_object_to_json_string_ext(so.root,
+                                mapJsonFlagToJsonCstring(so.json_resp)));
+    json_object_put(so.root);
+  } else {
+    reply->out = gbStrBufDetach(&so.plain);
+  }
+
+  if (!reply->out) {
+    blockFormatErrorResponse(STATUS_SRV, blk->json_resp, ENOMEM,
+                             GB_DEFAULT_ERRMSG, reply);
+    return;
+  }
+  reply->exit = 0;
+}
+
+
+blockResponse *
+block_status_cli_1_svc_st(blockStatusCli *blk, struct svc_req *rqstp)
+{
+  blockResponse *reply = NULL;
+
+
+  LOG("mgmt", GB_LOG_DEBUG, "%s", "status request");
+
+  if (GB_ALLOC(reply) < 0) {
+    return NULL;
+  }
+  reply->exit = -1;
+
+  blockStatusCliFormatResponse(blk, reply);
 
- out:
-  GB_FREE(errMsg);
   return reply;
 }
 
@@ -3231,7 +6153,7 @@ block_modify_cli_1_svc_st(blockModifyCli *blk, struct svc_req *rqstp)
   static blockModify mobj = {0};
   static blockRemoteModifyResp *savereply = NULL;
   static blockResponse *reply = NULL;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
   MetaInfo *info = NULL;
   uuid_t uuid;
@@ -3273,7 +6195,7 @@ block_modify_cli_1_svc_st(blockModifyCli *blk, struct svc_req *rqstp)
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, ret, errMsg, nolock);
   LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
 
-  if (glfs_access(glfs, blk->block_name, F_OK)) {
+  if (glusterBlockAccessAt(glfs, GB_OBJ_METADIR, blk->block_name)) {
     errCode = errno;
     if (errCode == ENOENT) {
       GB_ASPRINTF(&errMsg, "block %s/%s doesn't exist",
@@ -3416,6 +6338,8 @@ block_modify_cli_1_svc_st(blockModifyCli *blk, struct svc_req *rqstp)
   }
   GB_FREE(errMsg);
 
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
   return reply;
 }
 
@@ -3533,7 +6457,7 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
   static blockModifySize mobj = {0};
   static blockRemoteResp *savereply = NULL;
   static blockResponse *reply = NULL;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
   MetaInfo *info = NULL;
   int asyncret = 0;
@@ -3542,6 +6466,13 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
   char *cSize = NULL;
   char *rSize = NULL;
   blockServerDefPtr list = NULL;
+  bool preallocated = false;
+  bool takeover = false;
+  bool filled = false;
+  bool running;
+  bool *resultCaps = NULL;
+  size_t preallocFrom = 0;
+  size_t reserved = 0;
 
 
   LOG("mgmt", GB_LOG_DEBUG,
@@ -3574,7 +6505,7 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, ret, errMsg, nolock);
   LOG("cmdlog", GB_LOG_INFO, "%s",  blk->cmd);
 
-  if (glfs_access(glfs, blk->block_name, F_OK)) {
+  if (glusterBlockAccessAt(glfs, GB_OBJ_METADIR, blk->block_name)) {
     errCode = errno;
     if (errCode == ENOENT) {
       GB_ASPRINTF(&errMsg, "block %s/%s doesn't exist",
@@ -3596,6 +6527,28 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
     goto out;
   }
 
+  /*
+   * A preallocation still recorded as running may belong to a node that is
+   * gone for good; with force, take it over as if it had failed.
+   */
+  if (!strcmp(info->prealloc, "INPROGRESS")) {
+    running = glusterBlockPreallocRunning(info->gbid);
+    if (running || !blk->force) {
+      GB_ASPRINTF(&errMsg, "block %s/%s is still being preallocated "
+                  "[%zu of %zu bytes], try again later%s", blk->volume,
+                  blk->block_name, info->prealloc_done, info->size,
+                  running ? "" :
+                  " (use 'force' if the node preallocating it is gone)");
+      LOG("mgmt", GB_LOG_ERROR, "%s", errMsg);
+      errCode = EBUSY;
+      goto out;
+    }
+    LOG("mgmt", GB_LOG_WARNING, "taking over the preallocation of block "
+        "%s/%s at %zu of %zu bytes", blk->volume, blk->block_name,
+        info->prealloc_done, info->size);
+    takeover = true;
+  }
+
   if ((info->size > blk->size && !blk->force) || info->size == blk->size) {
     cSize = glusterBlockFormatSize("mgmt", info->size);
     rSize = glusterBlockFormatSize("mgmt", blk->size);
@@ -3629,12 +6582,22 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  errCode = glusterBlockCheckCapabilities((void *)blk, MODIFY_SIZE_SRV, list, NULL, &errMsg);
-  if (errCode) {
+  if (GB_ALLOC_N(resultCaps, GB_CAP_MAX) < 0) {
+    errCode = ENOMEM;
+    goto out;
+  }
+
+  errCode = glusterBlockCheckCapabilities((void *)blk, MODIFY_SIZE_SRV, list,
+                                          resultCaps, &errMsg);
+  if (errCode && !glusterBlockCapsMissingOnly(resultCaps,
+                                              GB_CAP_BIT(GB_PREALLOC_BACKGROUND_CAP))) {
     LOG("mgmt", GB_LOG_ERROR,
         "glusterBlockCheckCapabilities() for block %s on volume %s failed",
         blk->block_name, blk->volume);
     goto out;
+  } else if (errCode) {
+    GB_FREE(errMsg);
+    errCode = 0;
   }
 
   GB_STRCPYSTATIC(mobj.block_name, blk->block_name);
@@ -3642,13 +6605,53 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
   GB_STRCPYSTATIC(mobj.gbid, info->gbid);
   mobj.size = blk->size;
 
-  ret = glusterBlockResizeEntry(glfs, &mobj, &errCode, &errMsg);
+  if (mobj.size > info->size) {
+    ret = glusterBlockReserveSpace(glfs, blk->volume, mobj.size - info->size,
+                                   &errMsg);
+    if (ret) {
+      errCode = errno;
+      goto out;
+    }
+    reserved = mobj.size - info->size;
+  }
+
+  ret = glusterBlockResizeEntry(glfs, &mobj, &preallocated, &errCode, &errMsg);
   if (ret) {
     LOG("mgmt", GB_LOG_ERROR, "%s block: %s volume: %s file: %s size: %zu",
         FAILED_MODIFY_SIZE, mobj.block_name, mobj.volume, mobj.gbid, mobj.size);
     goto out;
   }
 
+  /* blocks created before PREALLOC was recorded go by their file */
+  if (info->prealloc[0]) {
+    preallocated = strcmp(info->prealloc, "NONE") != 0;
+  }
+  if (mobj.size <= info->size) {
+    preallocated = false;
+  }
+  if (preallocated) {
+    /* pick up what a failed preallocation left too */
+    preallocFrom = info->size;
+    if ((takeover || !strcmp(info->prealloc, "FAIL")) &&
+        info->prealloc_done < preallocFrom) {
+      preallocFrom = info->prealloc_done;
+    }
+  }
+
+  /* with nodes that can't parse a PREALLOC record, fill it in line */
+  if (preallocated && resultCaps[GB_PREALLOC_BACKGROUND_CAP]) {
+    ret = glusterBlockZerofillEntry(glfs, &mobj, preallocFrom, &errCode,
+                                    &errMsg);
+    if (ret) {
+      LOG("mgmt", GB_LOG_ERROR, "%s block: %s volume: %s file: %s size: %zu",
+          FAILED_MODIFY_SIZE, mobj.block_name, mobj.volume, mobj.gbid,
+          mobj.size);
+      goto out;
+    }
+    preallocated = false;
+    filled = true;
+  }
+
   asyncret = glusterBlockModifySizeRemoteAsync(info, glfs, &mobj, &savereply);
   if (asyncret) {   /* asyncret decides result is success/fail */
     errCode = asyncret;
@@ -3656,6 +6659,23 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
         "glusterBlockModifySizeRemoteAsync(size=%zu): return %d %s for block %s on volume %s",
         blk->size, asyncret, FAILED_REMOTE_AYNC_MODIFY, blk->block_name, info->volume);
     goto out;
+  }
+
+  if (preallocated) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, mobj.block_name, mobj.volume,
+                          ret, errMsg, out, "SIZE: %zu\nPREALLOC: INPROGRESS-%zu\n",
+                          mobj.size, preallocFrom);
+  } else if (filled && info->prealloc[0]) {
+    /* filled in line above, don't leave an older FAIL standing */
+    GB_METAUPDATE_OR_GOTO(lock, glfs, mobj.block_name, mobj.volume,
+                          ret, errMsg, out, "SIZE: %zu\nPREALLOC: SUCCESS\n",
+                          mobj.size);
+  } else if (takeover) {
+    /* shrunk, what is left undone is for a later grow to pick up */
+    GB_METAUPDATE_OR_GOTO(lock, glfs, mobj.block_name, mobj.volume,
+                          ret, errMsg, out, "SIZE: %zu\nPREALLOC: FAIL-%zu\n",
+                          mobj.size, info->prealloc_done < mobj.size ?
+                          info->prealloc_done : mobj.size);
   } else {
     GB_METAUPDATE_OR_GOTO(lock, glfs, mobj.block_name, mobj.volume,
                           ret, errMsg, out, "SIZE: %zu\n",  mobj.size);
@@ -3667,6 +6687,21 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
   GB_METAUNLOCK(lkfd, blk->volume, ret, errMsg);
   blockServerDefFree(list);
 
+  /* preallocate the grown range behind the target, as on create */
+  if (!ret && !errCode && preallocated) {
+    errCode = glusterBlockPreallocStart(glfs, blk->volume, blk->block_name,
+                                        info->gbid, preallocFrom, mobj.size,
+                                        reserved, false);
+    if (errCode) {
+      GB_ASPRINTF(&errMsg, "block %s/%s was resized, but preallocating the "
+                  "grown storage failed[%s]", blk->volume, blk->block_name,
+                  strerror(errCode));
+      LOG("mgmt", GB_LOG_ERROR, "%s", errMsg);
+    }
+  } else if (reserved) {
+    glusterBlockUnreserveSpace(blk->volume, reserved, false);
+  }
+
  nolock:
   if (lkfd && glfs_close(lkfd) != 0) {
     LOG("mgmt", GB_LOG_ERROR,
@@ -3682,6 +6717,9 @@ block_modify_size_cli_1_svc_st(blockModifySizeCli *blk, struct svc_req *rqstp)
 
   blockRemoteRespFree(savereply);
   GB_FREE(errMsg);
+  GB_FREE(resultCaps);
+
+  glusterBlockVolumeRelease(blk->volume, glfs);
 
   return reply;
 }
@@ -3701,6 +6739,7 @@ blockCreateCliFormatResponse(struct glfs *glfs, blockCreateCli *blk,
   char         *portals  = NULL;
   int          i         = 0;
   int          infoErrCode = 0;
+  gbArena      arena     = {0, };
 
 
   if (!reply) {
@@ -3738,6 +6777,7 @@ blockCreateCliFormatResponse(struct glfs *glfs, blockCreateCli *blk,
     if (blockMetaStatusEnumParse(info->list[i]->status) == GB_CONFIG_INPROGRESS) {
       if (GB_ASPRINTF(&savereply->obj->d_attempt, "%s %s",
                       (tmp==NULL?"":tmp), info->list[i]->addr) == -1) {
+        GB_FREE(tmp);
         goto out;
       }
       GB_FREE(tmp);
@@ -3789,18 +6829,17 @@ blockCreateCliFormatResponse(struct glfs *glfs, blockCreateCli *blk,
     json_object_put(json_obj);
   } else {
     for (i = 0; i < savereply->nportal; i++) {
-      if (GB_ASPRINTF(&portals, "%s %s",
-                      tmp!=NULL?tmp:"", savereply->portal[i]) == -1) {
+      if (GB_ARENA_ASPRINTF(&arena, &portals, "%s %s",
+                            tmp!=NULL?tmp:"", savereply->portal[i]) == -1) {
         goto out;
       }
-      GB_FREE(tmp);
       tmp = portals;
     }
 
     /* save 'failed on'*/
     tmp = NULL;
     if (savereply->obj->d_attempt) {
-      if (GB_ASPRINTF(&tmp, "ROLLBACK FAILED ON: %s\n",
+      if (GB_ARENA_ASPRINTF(&arena, &tmp, "ROLLBACK FAILED ON: %s\n",
             savereply->obj->d_attempt?savereply->obj->d_attempt:"") == -1) {
         goto out;
       }
@@ -3808,17 +6847,17 @@ blockCreateCliFormatResponse(struct glfs *glfs, blockCreateCli *blk,
 
     if (savereply->obj->d_success) {
       tmp2 = tmp;
-      if (GB_ASPRINTF(&tmp, "%sROLLBACK SUCCESS ON: %s\n", tmp2?tmp2:"",
+      if (GB_ARENA_ASPRINTF(&arena, &tmp, "%sROLLBACK SUCCESS ON: %s\n",
+            tmp2?tmp2:"",
             savereply->obj->d_success?savereply->obj->d_success:"") == -1) {
         goto out;
       }
-      GB_FREE(tmp2);
     }
 
     /* if savereply->iqn==NULL no point in printing auth */
     if (blk->auth_mode && savereply->iqn) {
-      if (GB_ASPRINTF(&tmp2, "USERNAME: %s\nPASSWORD: %s\n",
-                      cobj->gbid, cobj->passwd) == 1) {
+      if (GB_ARENA_ASPRINTF(&arena, &tmp2, "USERNAME: %s\nPASSWORD: %s\n",
+                            cobj->gbid, cobj->passwd) == -1) {
         goto out;
       }
     }
@@ -3837,8 +6876,7 @@ blockCreateCliFormatResponse(struct glfs *glfs, blockCreateCli *blk,
   }
 
   blockFreeMetaInfo(info);
-  GB_FREE(tmp);
-  GB_FREE(tmp2);
+  gbArenaFree(&arena);
   return;
 }
 
@@ -3858,6 +6896,10 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
   char *errMsg = NULL;
   struct blockCreate2  cobj = {0, };
   bool *resultCaps = NULL;
+  bool reserved = false;
+  bool record = false;
+  bool background = false;
+  size_t nwave;
 
 
   LOG("mgmt", GB_LOG_INFO,
@@ -3893,16 +6935,25 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
   }
 
   errCode = glusterBlockCheckCapabilities((void *)blk, CREATE_SRV, list, resultCaps, &errMsg);
-  if (errCode && !resultCaps[GB_CREATE_LOAD_BALANCE_CAP]) {
+  if (errCode && !glusterBlockCapsMissingOnly(resultCaps,
+                                              GB_CAP_BIT(GB_CREATE_LOAD_BALANCE_CAP) |
+                                              GB_CAP_BIT(GB_PREALLOC_BACKGROUND_CAP))) {
     LOG("mgmt", GB_LOG_ERROR,
         "glusterBlockCheckCapabilities() for block %s on volume %s failed",
         blk->block_name, blk->volume);
     goto optfail;
-  } else if (resultCaps[GB_CREATE_LOAD_BALANCE_CAP]) {
+  } else if (errCode) {
     GB_FREE(errMsg);
     errCode = 0;
   }
 
+  /*
+   * Nodes that can't parse a PREALLOC record get none, and the storage
+   * filled in line. A given storage file keeps whatever it has allocated.
+   */
+  record = !resultCaps[GB_PREALLOC_BACKGROUND_CAP] && !blk->storage[0];
+  background = blk->prealloc && record;
+
   glfs = glusterBlockVolumeInit(blk->volume, &errCode, &errMsg);
   if (!glfs) {
     LOG("mgmt", GB_LOG_ERROR,
@@ -3921,7 +6972,7 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, out);
   LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
 
-  if (!glfs_access(glfs, blk->block_name, F_OK)) {
+  if (!glusterBlockAccessAt(glfs, GB_OBJ_METADIR, blk->block_name)) {
     LOG("mgmt", GB_LOG_ERROR,
         "block with name %s already exist in the volume %s",
         blk->block_name, blk->volume);
@@ -3934,8 +6985,14 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
     goto exist;
   }
 
+  if (glusterBlockReserveSpace(glfs, blk->volume, blk->size, &errMsg)) {
+    errCode = errno;
+    goto exist;
+  }
+  reserved = true;
+
   if (!resultCaps[GB_CREATE_LOAD_BALANCE_CAP]) {
-    blockGetPrioPath(glfs, blk->volume, list, cobj.prio_path, sizeof(cobj.prio_path));
+    glusterBlockPickPrioPath(glfs, blk->volume, list, cobj.prio_path, sizeof(cobj.prio_path));
   }
 
   uuid_generate(uuid);
@@ -3955,16 +7012,29 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
                           blk->volume, gbid, blk->mpath);
   }
 
-  if (glusterBlockCreateEntry(glfs, blk, gbid, &errCode, &errMsg)) {
+  if (glusterBlockCreateEntry(glfs, blk, gbid, blk->prealloc && !background,
+                              &errCode, &errMsg)) {
     LOG("mgmt", GB_LOG_ERROR, "%s volume: %s block: %s file: %s host: %s",
         FAILED_CREATING_FILE, blk->volume, blk->block_name, gbid, blk->block_hosts);
     goto exist;
   }
 
-  GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume,
-                        errCode, errMsg, exist,
-                        "SIZE: %zu\nRINGBUFFER: %d\nENTRYCREATE: SUCCESS\n",
-                        blk->size, blk->rb_size);
+  if (background) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume,
+                          errCode, errMsg, exist,
+                          "SIZE: %zu\nRINGBUFFER: %d\nENTRYCREATE: SUCCESS\n"
+                          "PREALLOC: INPROGRESS-0\n", blk->size, blk->rb_size);
+  } else if (record && !blk->prealloc) {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume,
+                          errCode, errMsg, exist,
+                          "SIZE: %zu\nRINGBUFFER: %d\nENTRYCREATE: SUCCESS\n"
+                          "PREALLOC: NONE\n", blk->size, blk->rb_size);
+  } else {
+    GB_METAUPDATE_OR_GOTO(lock, glfs, blk->block_name, blk->volume,
+                          errCode, errMsg, exist,
+                          "SIZE: %zu\nRINGBUFFER: %d\nENTRYCREATE: SUCCESS\n",
+                          blk->size, blk->rb_size);
+  }
 
   GB_STRCPYSTATIC(cobj.volume, blk->volume);
   GB_STRCPYSTATIC(cobj.block_name, blk->block_name);
@@ -3986,8 +7056,21 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
                           errCode, errMsg, exist, "PASSWORD: %s\n", passwd);
   }
 
-  errCode = glusterBlockCreateRemoteAsync(list, 0, blk->mpath,
-                                          glfs, &cobj, &savereply);
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  nwave = blk->mpath + gbConf.createSpeculate;
+  RWUNLOCK(gbConf.cfgLock);
+  if (nwave > list->nhosts) {
+    nwave = list->nhosts;
+  }
+
+  /* issued to spare hosts upfront, the audit finds the surplus spent */
+  if (nwave > blk->mpath) {
+    errCode = glusterBlockCreateRemoteWave(list, blk->mpath, nwave,
+                                           glfs, &cobj, &savereply);
+  } else {
+    errCode = glusterBlockCreateRemoteAsync(list, 0, blk->mpath,
+                                            glfs, &cobj, &savereply);
+  }
   if (errCode) {
     LOG("mgmt", GB_LOG_WARNING, "glusterBlockCreateRemoteAsync: return %d"
         " %s for block %s on volume %s with hosts %s", errCode,
@@ -4008,6 +7091,21 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
  exist:
   GB_METAUNLOCK(lkfd, blk->volume, errCode, errMsg);
 
+  /* the target is usable already, preallocate its storage behind it */
+  if (!errCode && background) {
+    errCode = glusterBlockPreallocStart(glfs, blk->volume, blk->block_name,
+                                        gbid, 0, blk->size, blk->size,
+                                        blk->prealloc_wait);
+    if (errCode) {
+      GB_ASPRINTF(&errMsg, "block %s/%s was created, but preallocating its "
+                  "storage failed[%s]", blk->volume, blk->block_name,
+                  strerror(errCode));
+      LOG("mgmt", GB_LOG_ERROR, "%s", errMsg);
+    }
+  } else if (reserved) {
+    glusterBlockUnreserveSpace(blk->volume, blk->size, false);
+  }
+
  out:
 
   if (lkfd && glfs_close(lkfd) != 0) {
@@ -4025,77 +7123,196 @@ block_create_cli_1_svc_st(blockCreateCli *blk, struct svc_req *rqstp)
   GB_FREE (cobj.block_hosts);
   GB_FREE(resultCaps);
 
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
   return reply;
 }
 
 
+# define GB_CREATE_EXPECT_MAX  10   /* targetcli lines checked per create */
+
+typedef struct blockCreateExpect {
+  int step;
+  char *line;
+  bool seen;
+} blockCreateExpect;
+
+
+/*
+ * Walk the targetcli output of a create once, collecting the objects that
+ * were created and the status of each step into res. Returns 0 if all the
+ * steps went through.
+ */
 static int
-blockValidateCommandOutput(const char *out, int opt, void *data)
+blockCreateResultFill(const char *out, blockCreate *blk, blockCreateResult *res)
 {
-  blockCreate *cblk = data;
-  blockDelete *dblk = data;
-  blockModify *mblk = data;
-  blockModifySize *msblk = data;
-  blockReplace *rblk = data;
+  blockCreateExpect expect[GB_CREATE_EXPECT_MAX] = {{0, }, };
+  size_t nexpect = 0;
+  char *buf = NULL;
+  char *line;
+  char *sptr = NULL;
+  char *word;
+  u_int tpg;
+  size_t i;
   int ret = -1;
 
 
-  switch (opt) {
-  case CREATE_SRV:
-    /* backend create validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "backend creation failed for: %s", cblk,
-                    cblk->volume,
-                    "Created user-backed storage object %s size %zu.",
-                    cblk->block_name, cblk->size);
-
-    /* target iqn create validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "target iqn creation failed for: %s",
-                    cblk, cblk->volume, "Created target %s%s.",
-                    GB_TGCLI_IQN_PREFIX, cblk->gbid);
-
-    /* LUN create validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "LUN creation failed for: %s",cblk,
-                    cblk->volume,
-                    "Created LUN 0.");
-
-    /* Portal create validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "portal creation failed for %s", cblk,
-                    cblk->volume,
-                    "Created network portal %s:3260.", cblk->ipaddr);
-
-    /* TPG enable validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "TPGT enablement failed for: %s", cblk,
-                    cblk->volume,
-                    "The TPGT has been enabled.");
-
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "generate_node_acls set failed for: %s",
-                    cblk, cblk->volume,
-                    "Parameter generate_node_acls is now '1'");
-
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "demo_mode_write_protect set failed "
-                    "for: %s", cblk, cblk->volume,
-                    "Parameter demo_mode_write_protect is now '0'.");
+  if (GB_ALLOC_N(res->step_status.step_status_val, GB_CREATE_STEP_MAX) < 0) {
+    return -1;
+  }
+  res->step_status.step_status_len = GB_CREATE_STEP_MAX;
+
+# define GB_CREATE_EXPECT(s, ...)                                          \
+  do {                                                                     \
+    if (nexpect >= GB_CREATE_EXPECT_MAX) {                                 \
+      LOG("mgmt", GB_LOG_ERROR, "more than %d create steps to check",      \
+          GB_CREATE_EXPECT_MAX);                                           \
+      goto out;                                                            \
+    }                                                                      \
+    expect[nexpect].step = s;                                              \
+    if (GB_ASPRINTF(&expect[nexpect].line, __VA_ARGS__) == -1) {           \
+      goto out;                                                            \
+    }                                                                      \
+    nexpect++;                                                             \
+  } while (0)
+
+  GB_CREATE_EXPECT(GB_CREATE_STEP_BACKSTORE,
+                   "Created user-backed storage object %s size %zu.",
+                   blk->block_name, blk->size);
+  GB_CREATE_EXPECT(GB_CREATE_STEP_IQN, "Created target %s%s.",
+                   GB_TGCLI_IQN_PREFIX, blk->gbid);
+  GB_CREATE_EXPECT(GB_CREATE_STEP_LUN, "Created LUN 0.");
+  GB_CREATE_EXPECT(GB_CREATE_STEP_PORTAL, "Created network portal %s:3260.",
+                   blk->ipaddr);
+  GB_CREATE_EXPECT(GB_CREATE_STEP_TPG_ENABLE, "The TPGT has been enabled.");
+  GB_CREATE_EXPECT(GB_CREATE_STEP_ATTRIBUTES,
+                   "Parameter generate_node_acls is now '1'");
+  GB_CREATE_EXPECT(GB_CREATE_STEP_ATTRIBUTES,
+                   "Parameter demo_mode_write_protect is now '0'.");
+  if (blk->auth_mode) {
+    GB_CREATE_EXPECT(GB_CREATE_STEP_AUTH, "Parameter authentication is now '1'.");
+    GB_CREATE_EXPECT(GB_CREATE_STEP_AUTH, "Parameter userid is now '%s'.",
+                     blk->gbid);
+    GB_CREATE_EXPECT(GB_CREATE_STEP_AUTH, "Parameter password is now '%s'.",
+                     blk->passwd);
+  } else {
+    res->step_status.step_status_val[GB_CREATE_STEP_AUTH] = GB_STEP_SKIPPED;
+  }
 
-    if (cblk->auth_mode) {
-      /* authentication validation */
-      GB_OUT_VALIDATE_OR_GOTO(out, out, "attribute authentication set failed "
-                      "for: %s", cblk, cblk->volume,
-                      "Parameter authentication is now '1'.");
+# undef GB_CREATE_EXPECT
 
-      /* userid set validation */
-      GB_OUT_VALIDATE_OR_GOTO(out, out, "userid set failed for: %s", cblk,
-                      cblk->volume,
-                      "Parameter userid is now '%s'.", cblk->gbid);
+  if (GB_STRDUP(buf, out) < 0) {
+    goto out;
+  }
 
-      /* password set validation */
-      GB_OUT_VALIDATE_OR_GOTO(out, out, "password set failed for: %s", cblk,
-                      cblk->volume,
-                      "Parameter password is now '%s'.", cblk->passwd);
+  for (line = strtok_r(buf, "\n", &sptr); line;
+       line = strtok_r(NULL, "\n", &sptr)) {
+    for (i = 0; i < nexpect; i++) {
+      if (!expect[i].seen && strstr(line, expect[i].line)) {
+        expect[i].seen = true;
+      }
     }
 
-    ret = 0;
-    break;
+    switch (blockRemoteCreateRespEnumParse(line)) {
+    case GB_IQN_RESP:
+      if (!res->iqn && GB_STRDUP(res->iqn, getLastWordNoDot(line)) < 0) {
+        goto out;
+      }
+      break;
+    case GB_TPG_NO_RESP:
+      word = getLastWordNoDot(line);
+      if (word && sscanf(word, "%u", &tpg) == 1) {
+        if (GB_REALLOC_N(res->tpgs.tpgs_val, res->tpgs.tpgs_len + 1) < 0) {
+          goto out;
+        }
+        res->tpgs.tpgs_val[res->tpgs.tpgs_len++] = tpg;
+      }
+      break;
+    case GB_PORTAL_RESP:
+      if (GB_REALLOC_N(res->portals.portals_val,
+                       res->portals.portals_len + 1) < 0) {
+        goto out;
+      }
+      if (GB_STRDUP(res->portals.portals_val[res->portals.portals_len],
+                    getLastWordNoDot(line)) < 0) {
+        goto out;
+      }
+      res->portals.portals_len++;
+      break;
+    }
+  }
+
+  ret = 0;
+  for (i = 0; i < nexpect; i++) {
+    if (!expect[i].seen) {
+      if (res->step_status.step_status_val[expect[i].step] != GB_STEP_FAILED) {
+        LOG("mgmt", GB_LOG_ERROR, "%s failed for: %s/%s",
+            blockCreateStepLookup[expect[i].step], blk->volume, blk->block_name);
+      }
+      res->step_status.step_status_val[expect[i].step] = GB_STEP_FAILED;
+      ret = -1;
+    }
+  }
+
+  if (res->step_status.step_status_val[GB_CREATE_STEP_BACKSTORE] == GB_STEP_DONE) {
+    res->backend_size = blk->size;
+  }
+
+ out:
+  if (!res->iqn) {
+    GB_STRDUP(res->iqn, "");
+  }
+  for (i = 0; i < nexpect; i++) {
+    GB_FREE(expect[i].line);
+  }
+  GB_FREE(buf);
+
+  return ret;
+}
+
+
+/* XDR encode the create result into reply->xdata */
+static int
+blockCreateResultEncode(blockCreateResult *res, blockResponse *reply)
+{
+  XDR xdrs;
+  char *buf = NULL;
+  u_int len;
+
+
+  len = xdr_sizeof((xdrproc_t)xdr_blockCreateResult, res);
+  if (!len || GB_ALLOC_N(buf, len) < 0) {
+    return -1;
+  }
+
+  xdrmem_create(&xdrs, buf, len, XDR_ENCODE);
+  if (!xdr_blockCreateResult(&xdrs, res)) {
+    LOG("mgmt", GB_LOG_ERROR, "%s", "failed to encode create result");
+    xdr_destroy(&xdrs);
+    GB_FREE(buf);
+    return -1;
+  }
+  xdr_destroy(&xdrs);
+
+  reply->xdata.xdata_len = len;
+  reply->xdata.xdata_val = buf;
+
+  return 0;
+}
+
+
+static int
+blockValidateCommandOutput(const char *out, int opt, void *data)
+{
+  blockDelete *dblk = data;
+  blockModify *mblk = data;
+  blockModifySize *msblk = data;
+  blockReplace *rblk = data;
+  blockPrioPath *pblk = data;
+  int ret = -1;
+
 
+  switch (opt) {
   case DELETE_SRV:
     /* backend delete validation */
     GB_OUT_VALIDATE_OR_GOTO(out, out, "backend deletion failed for block: %s",
@@ -4151,108 +7368,250 @@ blockValidateCommandOutput(const char *out, int opt, void *data)
     ret = 0;
     break;
 
-  case REPLACE_SRV:
-    /* old portal deletion validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "portal delete failed: %s:3260",
-                            rblk, rblk->ripaddr, "Deleted network portal %s:3260",
-                            rblk->ripaddr);
+  case REPLACE_SRV:
+    /* old portal deletion validation */
+    GB_OUT_VALIDATE_OR_GOTO(out, out, "portal delete failed: %s:3260",
+                            rblk, rblk->ripaddr, "Deleted network portal %s:3260",
+                            rblk->ripaddr);
+
+    /* re-create portal validation */
+    GB_OUT_VALIDATE_OR_GOTO(out, out, "portal (re)create failed: %s:3260",
+                            rblk, rblk->ipaddr, "Created network portal %s:3260.",
+                            rblk->ipaddr);
+    ret = 0;
+    break;
+
+  case REPLACE_GET_PORTAL_TPG_SRV:
+    /* get tpg of the portal */
+    GB_OUT_VALIDATE_OR_GOTO(out, out, "failed to get tpg number for portal : %s",
+                            rblk, rblk->ripaddr, "tpg");
+    ret = 0;
+    break;
+
+  case PRIO_PATH_SRV:
+    /* the new prio path's lun is active-optimized */
+    GB_OUT_VALIDATE_OR_GOTO(out, out, "alua group set failed for block: %s",
+                            pblk, pblk->volume,
+                            "Parameter alua_tg_pt_gp_name is now '%s'.",
+                            GB_ALUA_AO_TPG_NAME);
+    ret = 0;
+    break;
+  }
+
+out:
+  return ret;
+}
+
+
+/*
+ * From the 'targetcli /iscsi/<iqn> ls' output, get the tpg under which the
+ * portal addr is configured, i.e. the closest 'o- tpgN' line above it.
+ */
+static char *
+blockGetPortalTpg(char *out, char *addr)
+{
+  char *portal = NULL;
+  char *tpg = NULL;
+  char *line;
+  char *sptr = NULL;
+  char *p;
+  bool found = false;
+
+
+  if (GB_ASPRINTF(&portal, "%s:3260", addr) == -1) {
+    return NULL;
+  }
+
+  for (line = strtok_r(out, "\n", &sptr); line;
+       line = strtok_r(NULL, "\n", &sptr)) {
+    p = strstr(line, "o- tpg");
+    if (p) {
+      p += strlen("o- ");
+      GB_FREE(tpg);
+      if (GB_ASPRINTF(&tpg, "%.*s", (int)(strspn(p + 3, "0123456789") + 3),
+                      p) == -1) {
+        tpg = NULL;
+        break;
+      }
+      continue;
+    }
+    if (tpg && strstr(line, portal)) {
+      found = true;
+      break;
+    }
+  }
+
+  if (!found) {
+    GB_FREE(tpg);
+  }
+  GB_FREE(portal);
+
+  return tpg;
+}
+
+
+blockResponse *
+block_replace_1_svc_st(blockReplace *blk, struct svc_req *rqstp)
+{
+  blockResponse *reply = NULL;
+  char *iqn = NULL;
+  char *path = NULL;
+  char *save = NULL;
+  char *exec = NULL;
+  char *tpg = NULL;
+  char *lsArgv[] = {GB_TGCLI, NULL, "ls", NULL};
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
+
+
+  LOG("mgmt", GB_LOG_INFO,
+      "replace portal request, volume=%s blockname=%s iqn=%s old_portal=%s "
+      "new_portal=%s", blk->volume, blk->block_name, blk->gbid, blk->ripaddr, blk->ipaddr);
+
+  if (GB_ALLOC(reply) < 0) {
+    goto out;
+  }
+  reply->exit = -1;
+
+  if (GB_ASPRINTF(&iqn, "%s/%s%s", GB_TGCLI_ISCSI_PATH,
+                  GB_TGCLI_IQN_PREFIX, blk->gbid) == -1) {
+    goto out;
+  }
+
+  if (!blockTgcliLsMatch(iqn, blk->ipaddr, NULL)) {
+    reply->exit = GB_OP_SKIPPED;
+    GB_ASPRINTF(&reply->out, "remote portal %s already exist", blk->ipaddr);
+    goto out;
+  }
+
+  /* get the tpg holding the old portal */
+  lsArgv[1] = iqn;
+  GB_CMD_EXEC_AND_VALIDATE(lsArgv, NULL, GB_TGCLI_QUERY_TIMEOUT, reply, blk,
+                           blk->volume, REPLACE_GET_PORTAL_TPG_SRV);
+  if (!reply->exit) {
+    tpg = blockGetPortalTpg(reply->out, blk->ripaddr);
+  }
+  if (!tpg) {
+    reply->exit = -1;
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "failed to get portal tpg");
+    goto out;
+  }
+
+  if (GB_ASPRINTF(&path, "%s/%s/portals", iqn, tpg) == -1) {
+    goto out;
+  }
+
+  if (GB_ASPRINTF(&save, GB_TGCLI_GLFS_SAVE, blk->block_name) == -1) {
+    goto out;
+  }
 
-    /* re-create portal validation */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "portal (re)create failed: %s:3260",
-                            rblk, rblk->ipaddr, "Created network portal %s:3260.",
-                            rblk->ipaddr);
-    ret = 0;
-    break;
+  if (GB_ASPRINTF(&exec, "%s delete %s ip_port=3260\n%s create %s\n%s\n",
+                  path, blk->ripaddr, path, blk->ipaddr, save) == -1) {
+    goto out;
+  }
 
-  case REPLACE_GET_PORTAL_TPG_SRV:
-    /* get tpg of the portal */
-    GB_OUT_VALIDATE_OR_GOTO(out, out, "failed to get tpg number for portal : %s",
-                            rblk, rblk->ripaddr, "tpg");
-    ret = 0;
-    break;
+  GB_CMD_EXEC_AND_VALIDATE(tgcliArgv, exec, GB_TGCLI_TIMEOUT, reply, blk,
+                           blk->volume, REPLACE_SRV);
+  if (reply->exit) {
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "replace portal failed");
+    goto out;
   }
 
 out:
-  return ret;
+  GB_FREE(iqn);
+  GB_FREE(tpg);
+  GB_FREE(path);
+  GB_FREE(exec);
+  GB_FREE(save);
+  return reply;
 }
 
 
 blockResponse *
-block_replace_1_svc_st(blockReplace *blk, struct svc_req *rqstp)
+block_prio_path_1_svc_st(blockPrioPath *blk, struct svc_req *rqstp)
 {
   blockResponse *reply = NULL;
-  char *path = NULL;
+  char *iqn = NULL;
+  char *lsOut = NULL;
+  char *newTpg = NULL;
+  char *oldTpg = NULL;
   char *save = NULL;
-  char *exec = NULL;
-  char *tpg;
+  gbStrBuf exec = {0, };
+  char *lsArgv[] = {GB_TGCLI, NULL, "ls", NULL};
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
+  gbRunnerResult res = {0, };
 
 
   LOG("mgmt", GB_LOG_INFO,
-      "replace portal request, volume=%s blockname=%s iqn=%s old_portal=%s "
-      "new_portal=%s", blk->volume, blk->block_name, blk->gbid, blk->ripaddr, blk->ipaddr);
+      "prio path request, volume=%s blockname=%s iqn=%s prio_path=%s "
+      "old_path=%s", blk->volume, blk->block_name, blk->gbid, blk->prio_path,
+      blk->old_path);
 
   if (GB_ALLOC(reply) < 0) {
     goto out;
   }
   reply->exit = -1;
 
-  if (GB_ALLOC_N(reply->out, 8192) < 0) {
-    GB_FREE(reply);
+  if (GB_ASPRINTF(&iqn, "%s/%s%s", GB_TGCLI_ISCSI_PATH,
+                  GB_TGCLI_IQN_PREFIX, blk->gbid) == -1) {
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, GB_CHECK_PORTAL, blk->gbid, blk->ipaddr) == -1) {
+  /* every node has all the tpgs, find the ones holding both portals */
+  lsArgv[1] = iqn;
+  if (gbRunnerExec(lsArgv, NULL, GB_TGCLI_QUERY_TIMEOUT, &res) < 0 ||
+      res.exitStatus == -1 || !res.out) {
+    GB_ASPRINTF(&reply->out, "failed to list target %s", iqn);
     goto out;
   }
-
-  if (!gbRunner(exec)) {
-    reply->exit = GB_OP_SKIPPED;
-    snprintf(reply->out, 8192, "remote portal %s already exist", blk->ipaddr);
+  if (GB_STRDUP(lsOut, res.out) < 0) {
     goto out;
   }
-  GB_FREE(exec);
 
-  if (GB_ASPRINTF(&exec, GB_GET_PORTAL_TPG, blk->gbid,
-        blk->ripaddr, blk->ripaddr) == -1) {
+  newTpg = blockGetPortalTpg(res.out, blk->prio_path);
+  if (!newTpg) {
+    GB_ASPRINTF(&reply->out, "portal %s is not configured for block %s",
+                blk->prio_path, blk->block_name);
     goto out;
   }
+  if (blk->old_path[0]) {
+    oldTpg = blockGetPortalTpg(lsOut, blk->old_path);
+  }
 
-  /* get number of tpg's for this target */
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, REPLACE_GET_PORTAL_TPG_SRV);
-  if (reply->exit) {
-    snprintf(reply->out, 8192, "failed to get portal tpg");
+  if (GB_ASPRINTF(&save, GB_TGCLI_GLFS_SAVE, blk->block_name) == -1) {
     goto out;
   }
-  GB_FREE(exec);
-  tpg = strtok(reply->out, "\n");
 
-  if (GB_ASPRINTF(&path, "%s/%s%s/%s/portals", GB_TGCLI_ISCSI_PATH,
-                  GB_TGCLI_IQN_PREFIX, blk->gbid, tpg) == -1) {
+  if (gbStrBufAppendf(&exec, "%s/%s/luns/lun0 set alua alua_tg_pt_gp_name=%s\n",
+                      iqn, newTpg, GB_ALUA_AO_TPG_NAME) < 0) {
     goto out;
   }
-
-  if (GB_ASPRINTF(&save, GB_TGCLI_GLFS_SAVE, blk->block_name) == -1) {
+  if (oldTpg && strcmp(oldTpg, newTpg) &&
+      gbStrBufAppendf(&exec, "%s/%s/luns/lun0 set alua alua_tg_pt_gp_name=%s\n",
+                      iqn, oldTpg, GB_ALUA_ANO_TPG_NAME) < 0) {
     goto out;
   }
-
-  if (GB_ASPRINTF(&exec,
-                  "targetcli <<EOF\n%s delete %s ip_port=3260\n%s create %s\n%s\nEOF",
-                  path, blk->ripaddr, path, blk->ipaddr, save) == -1) {
+  if (gbStrBufAppendf(&exec, "%s\n", save) < 0) {
     goto out;
   }
-  GB_FREE(path);
 
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, REPLACE_SRV);
+  GB_CMD_EXEC_AND_VALIDATE(tgcliArgv, exec.buf, GB_TGCLI_TIMEOUT, reply, blk,
+                           blk->volume, PRIO_PATH_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "replace portal failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "prio path switch failed");
     goto out;
   }
-  GB_FREE(exec);
 
 out:
-  GB_FREE(path);
-  GB_FREE(exec);
+  GB_FREE(res.out);
+  GB_FREE(iqn);
+  GB_FREE(lsOut);
+  GB_FREE(newTpg);
+  GB_FREE(oldTpg);
   GB_FREE(save);
+  gbStrBufFree(&exec);
   return reply;
 }
 
@@ -4260,11 +7619,10 @@ out:
 blockResponse *
 block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_path)
 {
-  char *tmp = NULL;
   char *backstore = NULL;
   char *backstore_attr = NULL;
   char *iqn = NULL;
-  char *tpg = NULL;
+  gbStrBuf tpg = {0, };
   char *glfs_alua = NULL;
   char *glfs_alua_type = NULL;
   char *lun = NULL;
@@ -4273,11 +7631,15 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
   char *attr = NULL;
   char *authcred = NULL;
   char *save = NULL;
-  char *exec = NULL;
+  gbStrBuf exec = {0, };
   blockResponse *reply = NULL;
   blockServerDefPtr list = NULL;
   size_t i;
   bool prioCap = false;
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
+  gbRunnerResult res;
+  blockCreateResult cres = {0, };
+  gbArena arena = {0, };
 
 
   LOG("mgmt", GB_LOG_INFO,
@@ -4295,21 +7657,21 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
     prioCap = true;
   }
 
-  if (GB_ASPRINTF(&backstore, "%s %s name=%s size=%zu cfgstring=%s@%s%s/%s%s wwn=%s",
+  if (GB_ARENA_ASPRINTF(&arena, &backstore, "%s %s name=%s size=%zu cfgstring=%s@%s%s/%s%s wwn=%s",
                   GB_TGCLI_GLFS_PATH, GB_CREATE, blk->block_name, blk->size,
                   blk->volume, volServer?volServer:blk->ipaddr, GB_STOREDIR,
                   blk->gbid, rbsize ? rbsize: "", blk->gbid) == -1) {
     goto out;
   }
 
-  if (GB_ASPRINTF(&backstore_attr,
+  if (GB_ARENA_ASPRINTF(&arena, &backstore_attr,
                   "%s/%s set attribute cmd_time_out=%d",
                   GB_TGCLI_GLFS_PATH, blk->block_name, GB_CMD_TIME_OUT) == -1) {
     goto out;
   }
 
   if (prioCap) {
-    if (GB_ASPRINTF(&glfs_alua,
+    if (GB_ARENA_ASPRINTF(&arena, &glfs_alua,
                     "%s/%s/alua create name=glfs_tg_pt_gp_ao tag=1\n"
                     "%s/%s/alua create name=glfs_tg_pt_gp_ano tag=2",
                     GB_TGCLI_GLFS_PATH, blk->block_name,
@@ -4317,7 +7679,7 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
       goto out;
     }
 
-    if (GB_ASPRINTF(&glfs_alua_type,
+    if (GB_ARENA_ASPRINTF(&arena, &glfs_alua_type,
                     "%s/%s/alua/glfs_tg_pt_gp_ao set alua alua_access_type=1\n"
                     "%s/%s/alua/glfs_tg_pt_gp_ano set alua alua_access_type=1\n"
                     "%s/%s/alua/glfs_tg_pt_gp_ao set alua alua_access_state=0\n"
@@ -4330,7 +7692,7 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
     }
   }
 
-  if (GB_ASPRINTF(&iqn, "%s %s %s%s", GB_TGCLI_ISCSI_PATH, GB_CREATE,
+  if (GB_ARENA_ASPRINTF(&arena, &iqn, "%s %s %s%s", GB_TGCLI_ISCSI_PATH, GB_CREATE,
                   GB_TGCLI_IQN_PREFIX, blk->gbid) == -1) {
     goto out;
   }
@@ -4342,25 +7704,14 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
 
   /* i = 2; because tpg1 is created by default while iqn create */
   for (i = 2; i <= list->nhosts; i++) {
-    if (!tmp) {
-      if (GB_ASPRINTF(&tpg, "%s/%s%s create tpg%zu\n",
-                   GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i) == -1) {
-        goto out;
-      }
-      tmp = tpg;
-    } else {
-      if (GB_ASPRINTF(&tpg, "%s %s/%s%s create tpg%zu\n", tmp,
-                   GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i) == -1) {
-        goto out;
-      }
-      GB_FREE(tmp);
-      tmp = tpg;
+    if (gbStrBufAppendf(&tpg, "%s%s/%s%s create tpg%zu\n", tpg.buf ? " " : "",
+                   GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i) < 0) {
+      goto out;
     }
   }
-  tmp = NULL;
 
   for (i = 1; i <= list->nhosts; i++) {
-    if (GB_ASPRINTF(&lun, "%s/%s%s/tpg%zu/luns %s %s/%s",  GB_TGCLI_ISCSI_PATH,
+    if (GB_ARENA_ASPRINTF(&arena, &lun, "%s/%s%s/tpg%zu/luns %s %s/%s",  GB_TGCLI_ISCSI_PATH,
                  GB_TGCLI_IQN_PREFIX, blk->gbid, i, GB_CREATE,
                  GB_TGCLI_GLFS_PATH, blk->block_name) == -1) {
       goto out;
@@ -4368,12 +7719,12 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
 
     if (prioCap) {
       if (!strcmp(prio_path, list->hosts[i-1])) {
-        if (GB_ASPRINTF(&lun0, "%s/%s%s/tpg%zu/luns/lun0 set alua alua_tg_pt_gp_name=glfs_tg_pt_gp_ao",
+        if (GB_ARENA_ASPRINTF(&arena, &lun0, "%s/%s%s/tpg%zu/luns/lun0 set alua alua_tg_pt_gp_name=glfs_tg_pt_gp_ao",
                         GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i) == -1) {
           goto out;
         }
       } else {
-        if (GB_ASPRINTF(&lun0, "%s/%s%s/tpg%zu/luns/lun0 set alua alua_tg_pt_gp_name=glfs_tg_pt_gp_ano",
+        if (GB_ARENA_ASPRINTF(&arena, &lun0, "%s/%s%s/tpg%zu/luns/lun0 set alua alua_tg_pt_gp_name=glfs_tg_pt_gp_ano",
                         GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i) == -1) {
           goto out;
         }
@@ -4381,24 +7732,24 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
     }
 
     if (!strcmp(blk->ipaddr, list->hosts[i-1])) {
-      if (GB_ASPRINTF(&attr, "%s/%s%s/tpg%zu enable\n%s/%s%s/tpg%zu set attribute %s %s",
+      if (GB_ARENA_ASPRINTF(&arena, &attr, "%s/%s%s/tpg%zu enable\n%s/%s%s/tpg%zu set attribute %s %s",
                    GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
                    GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
                    blk->auth_mode?"authentication=1":"", GB_TGCLI_ATTRIBUTES) == -1) {
         goto out;
       }
-      if (GB_ASPRINTF(&portal, "%s/%s%s/tpg%zu/portals create %s ",
+      if (GB_ARENA_ASPRINTF(&arena, &portal, "%s/%s%s/tpg%zu/portals create %s ",
                    GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
                    blk->ipaddr) == -1) {
         goto out;
       }
     } else {
-      if (GB_ASPRINTF(&attr, "%s/%s%s/tpg%zu set attribute tpg_enabled_sendtargets=0 %s %s",
+      if (GB_ARENA_ASPRINTF(&arena, &attr, "%s/%s%s/tpg%zu set attribute tpg_enabled_sendtargets=0 %s %s",
                    GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
                    blk->auth_mode?"authentication=1":"", GB_TGCLI_ATTRIBUTES) == -1) {
         goto out;
       }
-      if (GB_ASPRINTF(&portal, "%s/%s%s/tpg%zu/portals create %s",
+      if (GB_ARENA_ASPRINTF(&arena, &portal, "%s/%s%s/tpg%zu/portals create %s",
                    GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
                    list->hosts[i-1]) == -1) {
         goto out;
@@ -4406,84 +7757,91 @@ block_create_common(blockCreate *blk, char *rbsize, char *volServer, char *prio_
     }
 
     if (blk->auth_mode &&
-        GB_ASPRINTF(&authcred, "\n%s/%s%s/tpg%zu set auth userid=%s password=%s",
+        GB_ARENA_ASPRINTF(&arena, &authcred, "\n%s/%s%s/tpg%zu set auth userid=%s password=%s",
           GB_TGCLI_ISCSI_PATH, GB_TGCLI_IQN_PREFIX, blk->gbid, i,
           blk->gbid, blk->passwd) == -1) {
       goto out;
     }
-    if (!tmp) {
+    if (!exec.buf) {
       if (!prioCap) {
-        if (GB_ASPRINTF(&exec, "%s\n%s\n%s\n%s %s\n%s\n%s %s",
+        if (gbStrBufAppendf(&exec, "%s\n%s\n%s\n%s %s\n%s\n%s %s",
             backstore, backstore_attr, iqn,
-            tpg?tpg:"", lun, portal, attr, blk->auth_mode?authcred:"") == -1) {
+            tpg.buf?tpg.buf:"", lun, portal, attr,
+            blk->auth_mode?authcred:"") < 0) {
           goto out;
         }
       } else {
-        if (GB_ASPRINTF(&exec, "%s\n%s\n%s\n%s\n%s\n%s %s\n%s\n%s\n%s %s",
+        if (gbStrBufAppendf(&exec, "%s\n%s\n%s\n%s\n%s\n%s %s\n%s\n%s\n%s %s",
             backstore, backstore_attr, glfs_alua, glfs_alua_type, iqn,
-            tpg?tpg:"", lun, lun0, portal, attr, blk->auth_mode?authcred:"") == -1) {
+            tpg.buf?tpg.buf:"", lun, lun0, portal, attr,
+            blk->auth_mode?authcred:"") < 0) {
           goto out;
         }
       }
-      tmp = exec;
     } else {
       if (!prioCap) {
-        if (GB_ASPRINTF(&exec, "%s\n%s\n%s\n%s\n%s",
-            tmp, lun, portal, attr, blk->auth_mode?authcred:"") == -1) {
+        if (gbStrBufAppendf(&exec, "\n%s\n%s\n%s\n%s",
+            lun, portal, attr, blk->auth_mode?authcred:"") < 0) {
           goto out;
         }
       } else {
-        if (GB_ASPRINTF(&exec, "%s\n%s\n%s\n%s\n%s\n%s",
-            tmp, lun, lun0, portal, attr, blk->auth_mode?authcred:"") == -1) {
+        if (gbStrBufAppendf(&exec, "\n%s\n%s\n%s\n%s\n%s",
+            lun, lun0, portal, attr, blk->auth_mode?authcred:"") < 0) {
           goto out;
         }
       }
-      GB_FREE(tmp);
-      tmp = exec;
     }
-
-    GB_FREE(authcred);
-    GB_FREE(attr);
-    GB_FREE(portal);
-    GB_FREE(lun);
-    GB_FREE(lun0);
   }
 
-  if (GB_ASPRINTF(&save, GB_TGCLI_GLFS_SAVE, blk->block_name) == -1) {
+  if (GB_ARENA_ASPRINTF(&arena, &save, GB_TGCLI_GLFS_SAVE, blk->block_name) == -1) {
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, "targetcli <<EOF\n%s\n%s\nEOF", tmp, save) == -1) {
+  if (gbStrBufAppendf(&exec, "\n%s\n", save) < 0) {
     goto out;
   }
-  GB_FREE(tmp);
 
-  if (GB_ALLOC_N(reply->out, 8192) < 0) {
-    GB_FREE(reply);
+  LOG("mgmt", GB_LOG_DEBUG, "command, %s %s", tgcliArgv[0], exec.buf);
+  if (gbRunnerExec(tgcliArgv, exec.buf, GB_TGCLI_TIMEOUT, &res) < 0 ||
+      !res.out) {
+    LOG("mgmt", GB_LOG_ERROR, "executing command %s for %s/%s failed(%s)",
+        tgcliArgv[0], blk->volume, blk->block_name, strerror(errno));
+    GB_FREE(res.out);
     goto out;
   }
+  GB_FREE(reply->out);
+  reply->out = res.out;
+  LOG("mgmt", GB_LOG_DEBUG, "raw output, %s", reply->out);
+
+  cres.spawn_usec = res.spawnUsec;
+  cres.exec_usec = res.execUsec;
+  reply->exit = blockCreateResultFill(reply->out, blk, &cres);
+  if (res.exitStatus == -1) {
+    LOG("mgmt", GB_LOG_ERROR, "command %s for %s/%s %s", tgcliArgv[0],
+        blk->volume, blk->block_name,
+        res.timedOut ? "timed out" : "exit abnormally");
+    reply->exit = -1;
+  }
+  LOG("mgmt", GB_LOG_INFO, "command exit code, %d", reply->exit);
+
+  if (blockCreateResultEncode(&cres, reply)) {
+    LOG("mgmt", GB_LOG_WARNING, "sending create result of %s/%s as text only",
+        blk->volume, blk->block_name);
+  }
 
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, CREATE_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "configure failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "configure failed");
   }
 
  out:
-  GB_FREE(exec);
-  GB_FREE(save);
-  GB_FREE(authcred);
-  GB_FREE(attr);
-  GB_FREE(portal);
-  GB_FREE(lun);
-  GB_FREE(tpg);
-  GB_FREE(iqn);
-  GB_FREE(backstore);
-  GB_FREE(glfs_alua);
-  GB_FREE(glfs_alua_type);
+  gbStrBufFree(&tpg);
+  gbStrBufFree(&exec);
+  gbArenaFree(&arena);
   GB_FREE(rbsize);
-  GB_FREE(backstore_attr);
   GB_FREE(volServer);
   blockServerDefFree(list);
+  xdr_free((xdrproc_t)xdr_blockCreateResult, (char *)&cres);
 
   return reply;
 }
@@ -4590,7 +7948,7 @@ block_delete_cli_1_svc_st(blockDeleteCli *blk, struct svc_req *rqstp)
   blockRemoteDeleteResp *savereply = NULL;
   MetaInfo *info = NULL;
   static blockResponse *reply = NULL;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
   char *errMsg = NULL;
   int errCode = 0;
@@ -4628,7 +7986,7 @@ block_delete_cli_1_svc_st(blockDeleteCli *blk, struct svc_req *rqstp)
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, optfail);
   LOG("cmdlog", GB_LOG_INFO, "%s", blk->cmd);
 
-  if (glfs_access(glfs, blk->block_name, F_OK)) {
+  if (glusterBlockAccessAt(glfs, GB_OBJ_METADIR, blk->block_name)) {
     errCode = errno;
     if (errCode == ENOENT) {
       GB_ASPRINTF(&errMsg, "block %s/%s doesn't exist",
@@ -4674,8 +8032,11 @@ block_delete_cli_1_svc_st(blockDeleteCli *blk, struct svc_req *rqstp)
   if (errCode) {
     LOG("mgmt", GB_LOG_WARNING, "glusterBlockCleanUp: return %d "
         "on block %s for volume %s", errCode, blk->block_name, blk->volume);
-  } else if (info->prio_path[0]) {
-    blockDecPrioAttr(glfs, blk->volume, info->prio_path);
+  } else {
+    glusterBlockPreallocCancel(blk->volume, blk->block_name);
+    if (info->prio_path[0]) {
+      blockDecPrioAttr(glfs, blk->volume, info->prio_path);
+    }
   }
 
  out:
@@ -4701,6 +8062,8 @@ block_delete_cli_1_svc_st(blockDeleteCli *blk, struct svc_req *rqstp)
   }
   GB_FREE(errMsg);
 
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
   return reply;
 }
 
@@ -4713,6 +8076,7 @@ block_delete_1_svc_st(blockDelete *blk, struct svc_req *rqstp)
   char *backstore = NULL;
   char *exec = NULL;
   blockResponse *reply = NULL;
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
 
 
   LOG("mgmt", GB_LOG_INFO,
@@ -4738,18 +8102,15 @@ block_delete_1_svc_st(blockDelete *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, "targetcli <<EOF\n%s\n%s\nEOF", backstore, iqn) == -1) {
-    goto out;
-  }
-
-  if (GB_ALLOC_N(reply->out, 8192) < 0) {
-    GB_FREE(reply);
+  if (GB_ASPRINTF(&exec, "%s\n%s\n", backstore, iqn) == -1) {
     goto out;
   }
 
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, NULL, DELETE_SRV);
+  GB_CMD_EXEC_AND_VALIDATE(tgcliArgv, exec, GB_TGCLI_TIMEOUT, reply, blk,
+                           NULL, DELETE_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "delete failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "delete failed");
   }
 
  out:
@@ -4761,6 +8122,167 @@ block_delete_1_svc_st(blockDelete *blk, struct svc_req *rqstp)
 }
 
 
+static unsigned long long
+blockReadConfigfsU64(const char *dir, const char *attr)
+{
+  char path[PATH_MAX];
+  unsigned long long val = 0;
+  FILE *fp;
+
+
+  snprintf(path, sizeof(path), "%s/%s", dir, attr);
+  fp = fopen(path, "r");
+  if (!fp) {
+    return 0;
+  }
+  if (fscanf(fp, "%llu", &val) != 1) {
+    val = 0;
+  }
+  fclose(fp);
+
+  return val;
+}
+
+
+/*
+ * Load of this node, as weighed by the masters placing prio paths: the
+ * user backstores configured in LIO, their command and throughput rates
+ * from the configfs statistics, and the cpu load. The rates are over the
+ * time since the previous sample, at least GB_LOAD_SAMPLE_USEC, so they
+ * follow closely while blocks are being created and masters keep asking.
+ */
+static void
+glusterBlockNodeLoadSample(blockNodeLoad *load)
+{
+  static pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned long long lastUsec, lastCmds, lastMbytes;
+  static unsigned long long iops, mbps;
+  unsigned long long now, cmds = 0, mbytes = 0;
+  char hba[PATH_MAX];
+  char dev[PATH_MAX];
+  struct dirent *h, *d;
+  DIR *core, *dir;
+  double avg;
+  long ncpu;
+  FILE *fp;
+  int ret;
+
+
+  memset(load, 0, sizeof(*load));
+
+  core = opendir(GB_TARGET_CORE_DIR);
+  while (core && (h = readdir(core))) {
+    if (strncmp(h->d_name, "user_", 5)) {
+      continue;
+    }
+    ret = snprintf(hba, sizeof(hba), "%s/%s", GB_TARGET_CORE_DIR, h->d_name);
+    if (ret < 0 || (size_t)ret >= sizeof(hba)) {
+      continue;
+    }
+    dir = opendir(hba);
+    while (dir && (d = readdir(dir))) {
+      if (d->d_type != DT_DIR || d->d_name[0] == '.') {
+        continue;
+      }
+      ret = snprintf(dev, sizeof(dev), "%s/%s/statistics/scsi_lu", hba,
+                     d->d_name);
+      if (ret < 0 || (size_t)ret >= sizeof(dev)) {
+        continue;
+      }
+      load->luns++;
+      cmds += blockReadConfigfsU64(dev, "num_cmds");
+      mbytes += blockReadConfigfsU64(dev, "read_mbytes");
+      mbytes += blockReadConfigfsU64(dev, "write_mbytes");
+    }
+    if (dir) {
+      closedir(dir);
+    }
+  }
+  if (core) {
+    closedir(core);
+  }
+
+  now = gbTimeNowUsec();
+  LOCK(loadLock);
+  if (!lastUsec || now - lastUsec >= GB_LOAD_SAMPLE_USEC) {
+    if (lastUsec) {
+      /* deleted luns take their counters along */
+      iops = cmds > lastCmds ? (cmds - lastCmds) * 1000000 / (now - lastUsec) : 0;
+      mbps = mbytes > lastMbytes ? (mbytes - lastMbytes) * 1000000 / (now - lastUsec) : 0;
+    }
+    lastUsec = now;
+    lastCmds = cmds;
+    lastMbytes = mbytes;
+  }
+  load->iops = iops;
+  load->mbps = mbps;
+  UNLOCK(loadLock);
+
+  fp = fopen("/proc/loadavg", "r");
+  if (fp) {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (fscanf(fp, "%lf", &avg) == 1 && ncpu > 0) {
+      load->cpu = avg * 1000 / ncpu;
+    }
+    fclose(fp);
+  }
+}
+
+
+/* XDR encode the node load into reply->xdata */
+static int
+blockNodeLoadEncode(blockNodeLoad *load, blockResponse *reply)
+{
+  XDR xdrs;
+  char *buf = NULL;
+  u_int len;
+
+
+  len = xdr_sizeof((xdrproc_t)xdr_blockNodeLoad, load);
+  if (!len || GB_ALLOC_N(buf, len) < 0) {
+    return -1;
+  }
+
+  xdrmem_create(&xdrs, buf, len, XDR_ENCODE);
+  if (!xdr_blockNodeLoad(&xdrs, load)) {
+    LOG("mgmt", GB_LOG_ERROR, "%s", "failed to encode node load");
+    xdr_destroy(&xdrs);
+    GB_FREE(buf);
+    return -1;
+  }
+  xdr_destroy(&xdrs);
+
+  reply->xdata.xdata_len = len;
+  reply->xdata.xdata_val = buf;
+
+  return 0;
+}
+
+
+blockResponse *
+block_load_1_svc_st(void *data, struct svc_req *rqstp)
+{
+  blockResponse *reply = NULL;
+  blockNodeLoad load;
+
+
+  LOG("mgmt", GB_LOG_DEBUG, "%s", "node load request");
+
+  if (GB_ALLOC(reply) < 0) {
+    return NULL;
+  }
+
+  glusterBlockNodeLoadSample(&load);
+  reply->exit = blockNodeLoadEncode(&load, reply);
+
+  GB_ASPRINTF(&reply->out, "luns: %u iops: %llu mbps: %llu cpu: %u",
+              load.luns, (unsigned long long)load.iops,
+              (unsigned long long)load.mbps, load.cpu);
+
+  return reply;
+}
+
+
 blockResponse *
 block_version_1_svc_st(void *data, struct svc_req *rqstp)
 {
@@ -4807,6 +8329,9 @@ block_modify_1_svc_st(blockModify *blk, struct svc_req *rqstp)
   size_t tpgs = 0;
   size_t i;
   char *tmp = NULL;
+  char *iqn = NULL;
+  char *statusArgv[] = {GB_TGCLI, NULL, "status", NULL};
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
 
 
   LOG("mgmt", GB_LOG_INFO,
@@ -4824,20 +8349,18 @@ block_modify_1_svc_st(blockModify *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, "targetcli %s/%s%s status", GB_TGCLI_ISCSI_PATH,
+  if (GB_ASPRINTF(&iqn, "%s/%s%s", GB_TGCLI_ISCSI_PATH,
                   GB_TGCLI_IQN_PREFIX, blk->gbid) == -1) {
     goto out;
   }
-
-  if (GB_ALLOC_N(reply->out, 8192) < 0) {
-    GB_FREE(reply);
-    goto out;
-  }
+  statusArgv[1] = iqn;
 
   /* get number of tpg's for this target */
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, MODIFY_TPGC_SRV);
+  GB_CMD_EXEC_AND_VALIDATE(statusArgv, NULL, GB_TGCLI_QUERY_TIMEOUT, reply,
+                           blk, blk->volume, MODIFY_TPGC_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "modify failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "modify failed");
     goto out;
   }
 
@@ -4895,16 +8418,19 @@ block_modify_1_svc_st(blockModify *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, "targetcli <<EOF\n%s\n%s\nEOF", tmp, save) == -1) {
+  if (GB_ASPRINTF(&exec, "%s\n%s\n", tmp, save) == -1) {
     goto out;
   }
 
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, MODIFY_SRV);
+  GB_CMD_EXEC_AND_VALIDATE(tgcliArgv, exec, GB_TGCLI_TIMEOUT, reply, blk,
+                           blk->volume, MODIFY_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "modify failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "modify failed");
   }
 
  out:
+  GB_FREE(iqn);
   GB_FREE(tmp);
   GB_FREE(exec);
   GB_FREE(save);
@@ -4923,6 +8449,7 @@ block_modify_size_1_svc_st(blockModifySize *blk, struct svc_req *rqstp)
   char *exec = NULL;
   blockResponse *reply = NULL;
   char *tmp = NULL;
+  char *tgcliArgv[] = {GB_TGCLI, NULL};
 
 
   LOG("mgmt", GB_LOG_INFO,
@@ -4948,18 +8475,15 @@ block_modify_size_1_svc_st(blockModifySize *blk, struct svc_req *rqstp)
     goto out;
   }
 
-  if (GB_ASPRINTF(&exec, "targetcli <<EOF\n%s\n%s\nEOF", tmp, save) == -1) {
-    goto out;
-  }
-
-  if (GB_ALLOC_N(reply->out, 8192) < 0) {
-    GB_FREE(reply);
+  if (GB_ASPRINTF(&exec, "%s\n%s\n", tmp, save) == -1) {
     goto out;
   }
 
-  GB_CMD_EXEC_AND_VALIDATE(exec, reply, blk, blk->volume, MODIFY_SIZE_SRV);
+  GB_CMD_EXEC_AND_VALIDATE(tgcliArgv, exec, GB_TGCLI_TIMEOUT, reply, blk,
+                           blk->volume, MODIFY_SIZE_SRV);
   if (reply->exit) {
-    snprintf(reply->out, 8192, "modify size failed");
+    GB_FREE(reply->out);
+    GB_ASPRINTF(&reply->out, "modify size failed");
   }
 
  out:
@@ -4975,12 +8499,12 @@ blockResponse *
 block_list_cli_1_svc_st(blockListCli *blk, struct svc_req *rqstp)
 {
   blockResponse *reply;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
-  struct glfs_fd *tgmdfd = NULL;
-  struct dirent *entry;
-  char *tmp = NULL;
-  char *filelist = NULL;
+  gbMetaScan scan = {0};
+  char *name;
+  struct stat *st;
+  gbStrBuf filelist = {0, };
   json_object *json_obj = NULL;
   json_object *json_array = NULL;
   int errCode = 0;
@@ -5013,31 +8537,22 @@ block_list_cli_1_svc_st(blockListCli *blk, struct svc_req *rqstp)
 
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, optfail);
 
-  tgmdfd = glfs_opendir (glfs, GB_METADIR);
-  if (!tgmdfd) {
+  if (glusterBlockMetaScanOpen(glfs, blk->volume, &scan)) {
     errCode = errno;
     GB_ASPRINTF (&errMsg, "Not able to open metadata directory for volume "
                  "%s[%s]", blk->volume, strerror(errCode));
-    LOG("mgmt", GB_LOG_ERROR, "glfs_opendir(%s): on volume %s failed[%s]",
+    LOG("mgmt", GB_LOG_ERROR, "glfs_h_opendir(%s): on volume %s failed[%s]",
         GB_METADIR, blk->volume, strerror(errCode));
     goto out;
   }
 
-  while ((entry = glfs_readdir (tgmdfd))) {
-    if (!strchr(entry->d_name, '.')) {
-      if (blk->json_resp) {
-        json_object_array_add(json_array,
-                              GB_JSON_OBJ_TO_STR(entry->d_name));
-      } else {
-        if (GB_ASPRINTF(&filelist, "%s%s\n", (tmp==NULL?"":tmp),
-                        entry->d_name)  == -1) {
-          filelist = NULL;
-          GB_FREE(tmp);
-          errCode = ENOMEM;
-          goto out;
-        }
-        GB_FREE(tmp);
-        tmp = filelist;
+  while ((name = glusterBlockMetaScanNext(&scan, &st))) {
+    if (blk->json_resp) {
+      json_object_array_add(json_array, GB_JSON_OBJ_TO_STR(name));
+    } else {
+      if (gbStrBufAppendf(&filelist, "%s\n", name) < 0) {
+        errCode = ENOMEM;
+        goto out;
       }
     }
   }
@@ -5054,10 +8569,7 @@ block_list_cli_1_svc_st(blockListCli *blk, struct svc_req *rqstp)
   GB_METAUNLOCK(lkfd, blk->volume, errCode, errMsg);
 
  optfail:
-  if (tgmdfd && glfs_closedir (tgmdfd) != 0) {
-    LOG("mgmt", GB_LOG_ERROR, "glfs_closedir(%s): on volume %s failed[%s]",
-        GB_METADIR, blk->volume, strerror(errno));
-  }
+  glusterBlockMetaScanClose(&scan);
 
   if (errCode < 0) {
     errCode = GB_DEFAULT_ERRCODE;
@@ -5085,7 +8597,8 @@ block_list_cli_1_svc_st(blockListCli *blk, struct svc_req *rqstp)
                      "successfully\n");
       }
     } else {
-      reply->out = filelist? filelist:strdup("*Nil*\n");
+      reply->out = filelist.buf ? gbStrBufDetach(&filelist) :
+                                  strdup("*Nil*\n");
     }
   }
 
@@ -5095,6 +8608,9 @@ block_list_cli_1_svc_st(blockListCli *blk, struct svc_req *rqstp)
   }
 
   GB_FREE(errMsg);
+  gbStrBufFree(&filelist);
+
+  glusterBlockVolumeRelease(blk->volume, glfs);
 
   return reply;
 }
@@ -5114,6 +8630,7 @@ blockInfoCliFormatResponse(blockInfoCli *blk, int errCode,
   char         *out         = NULL;
   int          i            = 0;
   char         *hr_size     = NULL;           /* Human Readable size */
+  char         prealloc[64] = {0, };          /* while preallocating or failed */
 
   if (!reply) {
     return;
@@ -5155,6 +8672,12 @@ blockInfoCliFormatResponse(blockInfoCli *blk, int errCode,
     }
   }
 
+  if (info->size && (!strcmp(info->prealloc, "INPROGRESS") ||
+                     !strcmp(info->prealloc, "FAIL"))) {
+    snprintf(prealloc, sizeof(prealloc), "%s %zu%%", info->prealloc,
+             (size_t)((double)info->prealloc_done * 100 / info->size));
+  }
+
   if (blk->json_resp) {
     json_obj = json_object_new_object();
     json_object_object_add(json_obj, "NAME", GB_JSON_OBJ_TO_STR(blk->block_name));
@@ -5163,6 +8686,9 @@ blockInfoCliFormatResponse(blockInfoCli *blk, int errCode,
     json_object_object_add(json_obj, "SIZE", GB_JSON_OBJ_TO_STR(hr_size));
     json_object_object_add(json_obj, "HA", json_object_new_int(info->mpath));
     json_object_object_add(json_obj, "PASSWORD", GB_JSON_OBJ_TO_STR(info->passwd));
+    if (prealloc[0]) {
+      json_object_object_add(json_obj, "PREALLOC", json_object_new_string(prealloc));
+    }
 
     json_array1 = json_object_new_array();
 
@@ -5193,9 +8719,10 @@ blockInfoCliFormatResponse(blockInfoCli *blk, int errCode,
     json_object_put(json_obj);
   } else {
     if (GB_ASPRINTF(&tmp, "NAME: %s\nVOLUME: %s\nGBID: %s\nSIZE: %s\n"
-                    "HA: %zu\nPASSWORD: %s\nEXPORTED ON:",
+                    "HA: %zu\nPASSWORD: %s\n%s%s%sEXPORTED ON:",
                     blk->block_name, info->volume, info->gbid, hr_size,
-                    info->mpath, info->passwd) == -1) {
+                    info->mpath, info->passwd, prealloc[0] ? "PREALLOC: " : "",
+                    prealloc, prealloc[0] ? "\n" : "") == -1) {
       goto out;
     }
     for (i = 0; i < info->nhosts; i++) {
@@ -5249,7 +8776,7 @@ blockResponse *
 block_info_cli_1_svc_st(blockInfoCli *blk, struct svc_req *rqstp)
 {
   blockResponse *reply;
-  struct glfs *glfs;
+  struct glfs *glfs = NULL;
   struct glfs_fd *lkfd = NULL;
   MetaInfo *info = NULL;
   int ret = -1;
@@ -5283,7 +8810,8 @@ block_info_cli_1_svc_st(blockInfoCli *blk, struct svc_req *rqstp)
 
   GB_METALOCK_OR_GOTO(lkfd, blk->volume, errCode, errMsg, optfail);
 
-  ret = blockGetMetaInfo(glfs, blk->block_name, info, &errCode);
+  ret = blockGetMetaInfoCached(glfs, blk->volume, blk->block_name, NULL, info,
+                               &errCode);
   if (ret) {
     if (errCode == ENOENT) {
       GB_ASPRINTF (&errMsg, "block %s/%s doesn't exist", blk->volume,
@@ -5313,6 +8841,8 @@ block_info_cli_1_svc_st(blockInfoCli *blk, struct svc_req *rqstp)
   GB_FREE(errMsg);
   blockFreeMetaInfo(info);
 
+  glusterBlockVolumeRelease(blk->volume, glfs);
+
   return reply;
 }
 
@@ -5375,6 +8905,16 @@ block_version_1_svc(void *data, blockResponse *reply, struct svc_req *rqstp)
 }
 
 
+bool_t
+block_load_1_svc(void *data, blockResponse *reply, struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(load, data, reply, rqstp, ret);
+  return ret;
+}
+
+
 bool_t
 block_replace_1_svc(blockReplace *blk, blockResponse *reply, struct svc_req *rqstp)
 {
@@ -5385,6 +8925,17 @@ block_replace_1_svc(blockReplace *blk, blockResponse *reply, struct svc_req *rqs
 }
 
 
+bool_t
+block_prio_path_1_svc(blockPrioPath *blk, blockResponse *reply,
+                      struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(prio_path, blk, reply, rqstp, ret);
+  return ret;
+}
+
+
 bool_t
 block_create_cli_1_svc(blockCreateCli *blk, blockResponse *reply,
                        struct svc_req *rqstp)
@@ -5428,6 +8979,39 @@ block_replace_cli_1_svc(blockReplaceCli *blk, blockResponse *reply,
   return ret;
 }
 
+
+bool_t
+block_rebalance_cli_1_svc(blockRebalanceCli *blk, blockResponse *reply,
+                          struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(rebalance_cli, blk, reply, rqstp, ret);
+  return ret;
+}
+
+
+bool_t
+block_drain_cli_1_svc(blockDrainCli *blk, blockResponse *reply,
+                      struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(drain_cli, blk, reply, rqstp, ret);
+  return ret;
+}
+
+
+bool_t
+block_replace_bulk_cli_1_svc(blockReplaceBulkCli *blk, blockResponse *reply,
+                             struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(replace_bulk_cli, blk, reply, rqstp, ret);
+  return ret;
+}
+
 bool_t
 block_gen_config_cli_1_svc(blockGenConfigCli *blk, blockResponse *reply,
                       struct svc_req *rqstp)
@@ -5438,6 +9022,16 @@ block_gen_config_cli_1_svc(blockGenConfigCli *blk, blockResponse *reply,
   return ret;
 }
 
+bool_t
+block_status_cli_1_svc(blockStatusCli *blk, blockResponse *reply,
+                       struct svc_req *rqstp)
+{
+  int ret;
+
+  GB_RPC_CALL(status_cli, blk, reply, rqstp, ret);
+  return ret;
+}
+
 bool_t
 block_list_cli_1_svc(blockListCli *blk, blockResponse *reply,
                      struct svc_req *rqstp)
@@ -5471,9 +9065,21 @@ block_delete_cli_1_svc(blockDeleteCli *blk, blockResponse *reply,
 }
 
 
+/* replies are built with GB_ASPRINTF(), but given back with xdr_free() */
+static void
+blockResponseUntrack(xdrproc_t xdr_result, caddr_t result)
+{
+  if (xdr_result == (xdrproc_t)xdr_blockResponse) {
+    gbAllocUntrack(((blockResponse *)result)->out);
+    gbAllocUntrack(((blockResponse *)result)->xdata.xdata_val);
+  }
+}
+
+
 int
 gluster_block_1_freeresult (SVCXPRT *transp, xdrproc_t xdr_result, caddr_t result)
 {
+  blockResponseUntrack(xdr_result, result);
   xdr_free (xdr_result, result);
 
   return 1;
@@ -5483,6 +9089,7 @@ gluster_block_1_freeresult (SVCXPRT *transp, xdrproc_t xdr_result, caddr_t resul
 int
 gluster_block_cli_1_freeresult (SVCXPRT *transp, xdrproc_t xdr_result, caddr_t result)
 {
+  blockResponseUntrack(xdr_result, result);
   xdr_free (xdr_result, result);
 
   return 1;
@@ -12,19 +12,168 @@
 # include "common.h"
 # include "glfs-operations.h"
 
+# include <fcntl.h>
+# include <dirent.h>
+# include <sys/stat.h>
+
 # define  GB_LB_ATTR_PREFIX  "user.block"
+# define  GB_LB_RECORD_ATTR  GB_LB_ATTR_PREFIX ".prio"
+# define  GB_LB_DRAIN_ATTR   GB_LB_ATTR_PREFIX ".drained"
+# define  GB_LB_RECORD_MAX   65536  /* XATTR_SIZE_MAX */
 
+# define  GB_PREALLOC_CHUNK  (256 * 1024 * 1024)  /* handed to a worker at a time */
+# define  GB_PREALLOC_STEPS  20   /* progress records over a preallocation */
 
-struct glfs *
-glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg)
+# define  GB_SPACE_REFRESH_USEC  (10 * 1000000)  /* free space reused for */
+
+
+typedef struct gbVolfileRefresh {
+  char *volume;
+  struct glfs *glfs;      /* connected through glusterd, not swapped in yet */
+  bool changed;           /* its volfile differed from the cached one */
+  time_t retryAt;         /* swap again no sooner, 0 for a new request */
+  struct list_head list;
+} gbVolfileRefresh;
+
+
+/* volumes whose handle was initialized from the cached volfile and still
+ * have to be checked against glusterd */
+static pthread_mutex_t refreshLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refreshCond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(refreshQueue);
+static bool refreshRunning;
+
+
+static void
+glusterBlockVolfilePath(const char *volume, char *path, size_t len)
+{
+  snprintf(path, len, "%s/%s.vol", GB_VOLFILE_DIR, volume);
+}
+
+
+/*
+ * Copy the volfile glfs was initialized with into *volfile. Returns its
+ * length, 0 if there is none or -1 on failure.
+ */
+static ssize_t
+glusterBlockVolfileGet(struct glfs *glfs, char **volfile)
+{
+  size_t len = 4096;
+  ssize_t ret;
+
+
+  *volfile = NULL;
+  while (1) {
+    if (GB_REALLOC_N(*volfile, len) < 0) {
+      ret = -1;
+      break;
+    }
+    ret = glfs_get_volfile(glfs, *volfile, len);
+    if (ret >= 0) {
+      break;
+    }
+    /* buffer too small by -ret bytes */
+    len += -ret;
+  }
+
+  if (ret <= 0) {
+    GB_FREE(*volfile);
+  }
+
+  return ret;
+}
+
+
+/*
+ * Store the volfile of glfs as the cached volfile of volume, unless it is
+ * the same already. Returns 1 if the cached copy changed, 0 if it did not
+ * and -1 on failure.
+ */
+static int
+glusterBlockVolfileSave(const char *volume, struct glfs *glfs)
+{
+  char path[PATH_MAX];
+  char tmpPath[PATH_MAX + sizeof(".tmp")];
+  char *volfile = NULL;
+  char *cached = NULL;
+  ssize_t len;
+  struct stat st;
+  int fd = -1;
+  int n;
+  int ret = -1;
+
+
+  len = glusterBlockVolfileGet(glfs, &volfile);
+  if (len <= 0) {
+    return -1;
+  }
+
+  glusterBlockVolfilePath(volume, path, sizeof(path));
+  fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    if (!fstat(fd, &st) && st.st_size == len && !GB_ALLOC_N(cached, len) &&
+        read(fd, cached, len) == len && !memcmp(cached, volfile, len)) {
+      ret = 0;
+    }
+    close(fd);
+    fd = -1;
+    if (!ret) {
+      goto out;
+    }
+  }
+
+  if (mkdir(GB_VOLFILE_DIR, 0700) && errno != EEXIST) {
+    LOG("gfapi", GB_LOG_WARNING, "mkdir(%s) failed[%s]", GB_VOLFILE_DIR,
+        strerror(errno));
+    goto out;
+  }
+
+  n = snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  if (n < 0 || (size_t)n >= sizeof(tmpPath)) {
+    LOG("gfapi", GB_LOG_WARNING, "volfile path of volume %s is too long",
+        volume);
+    goto out;
+  }
+
+  fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || write(fd, volfile, len) != len || fsync(fd)) {
+    goto fail;
+  }
+  n = close(fd);
+  fd = -1;
+  if (n || rename(tmpPath, path)) {
+    goto fail;
+  }
+  ret = 1;
+  goto out;
+
+ fail:
+  LOG("gfapi", GB_LOG_WARNING, "saving volfile of volume %s to %s "
+      "failed[%s]", volume, path, strerror(errno));
+  if (fd >= 0) {
+    close(fd);
+  }
+  unlink(tmpPath);
+
+ out:
+  GB_FREE(cached);
+  GB_FREE(volfile);
+
+  return ret;
+}
+
+
+/*
+ * glfs_new() and glfs_init() of volume, from the local volfile if it is
+ * not NULL and from the volfile server otherwise.
+ */
+static struct glfs *
+glusterBlockGlfsInit(char *volume, const char *volfile, int *errCode,
+                     char **errMsg)
 {
   struct glfs *glfs;
   int ret;
 
-  glfs = queryCache(volume);
-  if (glfs) {
-    return glfs;
-  }
 
   glfs = glfs_new(volume);
   if (!glfs) {
@@ -36,14 +185,26 @@ glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg)
     return NULL;
   }
 
-  ret = glfs_set_volfile_server(glfs, "tcp", gbConf.volServer, 24007);
-  if (ret) {
-    *errCode = errno;
-    GB_ASPRINTF (errMsg, "Not able to add Volfile server for volume %s[%s]",
-                 volume, strerror(*errCode));
-    LOG("gfapi", GB_LOG_ERROR, "glfs_set_volfile_server(%s) of %s "
-        "failed[%s]", gbConf.volServer, volume, strerror(*errCode));
-    goto out;
+  if (volfile) {
+    ret = glfs_set_volfile(glfs, volfile);
+    if (ret) {
+      *errCode = errno;
+      GB_ASPRINTF (errMsg, "Not able to use volfile %s for volume %s[%s]",
+                   volfile, volume, strerror(*errCode));
+      LOG("gfapi", GB_LOG_ERROR, "glfs_set_volfile(%s) of %s failed[%s]",
+          volfile, volume, strerror(*errCode));
+      goto out;
+    }
+  } else {
+    ret = glfs_set_volfile_server(glfs, "tcp", gbConf.volServer, 24007);
+    if (ret) {
+      *errCode = errno;
+      GB_ASPRINTF (errMsg, "Not able to add Volfile server for volume %s[%s]",
+                   volume, strerror(*errCode));
+      LOG("gfapi", GB_LOG_ERROR, "glfs_set_volfile_server(%s) of %s "
+          "failed[%s]", gbConf.volServer, volume, strerror(*errCode));
+      goto out;
+    }
   }
 
   ret = glfs_set_logging(glfs, gbConf.gfapiLogFile, GFAPI_LOG_LEVEL);
@@ -67,14 +228,8 @@ glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg)
       GB_ASPRINTF (errMsg, "Not able to initialize volume %s[%s]", volume,
                    strerror(*errCode));
     }
-    LOG("gfapi", GB_LOG_ERROR, "glfs_init() on %s failed[%s]", volume,
-        strerror(*errCode));
-    goto out;
-  }
-
-  if (appendNewEntry(volume, glfs)) {
-    *errCode = ENOMEM;
-    LOG("gfapi", GB_LOG_ERROR, "allocation failed in appendNewEntry(%s)", volume);
+    LOG("gfapi", GB_LOG_ERROR, "glfs_init() on %s%s%s failed[%s]", volume,
+        volfile ? " from " : "", volfile ? volfile : "", strerror(*errCode));
     goto out;
   }
 
@@ -87,799 +242,3497 @@ glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg)
 }
 
 
-int
-glusterBlockCheckAvailableSpace(struct glfs *glfs,
-                                char *volume, size_t blockSize, char **errMsg)
+/* deep copy of src into info, info->list is left NULL on failure */
+static int
+blockCopyMetaInfo(MetaInfo *info, MetaInfo *src)
 {
-  struct statvfs buf = {'\0', };
-  int errSave = 0;
+  size_t i;
 
 
-  if (!glfs_statvfs(glfs, "/", &buf)) {
-    if ((buf.f_bfree * buf.f_bsize) >= GB_METASTORE_RESERVE + blockSize) {
-      return 0;
+  *info = *src;
+  info->list = NULL;
+  info->nhosts = 0;
+  if (!src->nhosts) {
+    return 0;
+  }
+
+  if (GB_ALLOC_N(info->list, src->nhosts) < 0) {
+    return -1;
+  }
+  for (i = 0; i < src->nhosts; i++) {
+    if (GB_ALLOC(info->list[i]) < 0) {
+      while (i--) {
+        GB_FREE(info->list[i]);
+      }
+      GB_FREE(info->list);
+      return -1;
     }
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_statvfs('%s'): Low space on volume => "
-        "Total size: %lu, Free space: %lu, Block request space: %lu", volume,
-        buf.f_blocks * buf.f_bsize, buf.f_bfree * buf.f_bsize, blockSize);
-    GB_ASPRINTF(errMsg, "Low space on the volume %s\n", volume);
-    errSave = ENOSPC;
-  } else {
-    errSave = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_statvfs('%s'): couldn't get file-system statistics", volume);
-    GB_ASPRINTF(errMsg,
-                "couldn't get file-system statistics on volume %s\n", volume);
+    *info->list[i] = *src->list[i];
   }
-  errno = errSave;
+  info->nhosts = src->nhosts;
 
-  return -1;
+  return 0;
 }
 
 
-int
-glusterBlockCreateEntry(struct glfs *glfs, blockCreateCli *blk, char *gbid,
-                        int *errCode, char **errMsg)
+/*
+ * MetaInfo of the metafiles seen by scans, keyed by volume and block name.
+ * An entry is used while the size and mtime of the metafile (as returned
+ * by readdirplus along with the name) did not change; metafiles are only
+ * ever appended to, so any update invalidates it.
+ *
+ * With GB_META_CACHE_UPCALL_TTL set, the daemon also registers for gfapi
+ * upcalls on the cached glfs handles. Entries and the listing of
+ * /block-meta are then trusted without looking at the volume at all, until
+ * an invalidation comes in for the metafile (or for the directory, which
+ * covers creates and deletes) or the ttl runs out. The upcall xlator only
+ * notifies clients that accessed an inode within
+ * features.cache-invalidation-timeout, hence the ttl. Local writes
+ * invalidate the same way, other nodes see them through their upcalls.
+ */
+# define   GB_META_CACHE_BUCKETS   256    /* must be a power of 2 */
+# define   GB_META_CACHE_MAX       4096
+
+typedef struct gbMetaCacheEntry {
+  char volume[255];
+  char block[255];
+  off_t size;
+  struct timespec mtime;
+  MetaInfo *info;
+  unsigned char gfid[GFAPI_HANDLE_LENGTH];
+  bool hasGfid;
+  time_t trustedUntil;        /* 0 unless upcalls cover it */
+  unsigned long epoch;        /* gbMetaVol.epoch it was trusted in */
+
+  struct list_head hash;
+  struct list_head gfidHash;
+  struct list_head lru;
+} gbMetaCacheEntry;
+
+typedef struct gbMetaVol {
+  char volume[255];
+  struct glfs *watchFs;       /* handle registered for upcalls, or NULL */
+  unsigned char dirGfid[GFAPI_HANDLE_LENGTH];
+  bool hasDirGfid;
+  unsigned long epoch;        /* bumped when /block-meta changes */
+  strToCharArrayDefPtr names; /* trusted listing of /block-meta */
+  time_t namesUntil;
+
+  struct list_head list;
+} gbMetaVol;
+
+
+static pthread_mutex_t metaCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head metaCacheBuckets[GB_META_CACHE_BUCKETS];
+static struct list_head metaCacheGfidBuckets[GB_META_CACHE_BUCKETS];
+static LIST_HEAD(metaCacheLru);
+static LIST_HEAD(metaCacheVols);
+static size_t metaCacheCount;
+static bool metaCacheInit;
+static unsigned long metaCacheSeq;  /* bumped on every invalidation */
+
+
+/* called with metaCacheLock held */
+static void
+blockMetaCacheInitOnce(void)
 {
-  struct glfs_fd *tgfd;
-  struct stat st;
-  char *tmp;
-  int ret = -1;
+  size_t i;
 
 
-  if (glusterBlockCheckAvailableSpace(glfs, blk->volume, blk->size, errMsg)) {
-    *errCode = errno;
-    goto out;
+  if (metaCacheInit) {
+    return;
   }
-
-  ret = glfs_mkdir (glfs, GB_STOREDIR, 0);
-  if (ret && errno != EEXIST) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_mkdir(%s) on volume %s for block %s failed[%s]",
-        GB_STOREDIR, blk->volume, blk->block_name, strerror(errno));
-    goto out;
+  for (i = 0; i < GB_META_CACHE_BUCKETS; i++) {
+    INIT_LIST_HEAD(&metaCacheBuckets[i]);
+    INIT_LIST_HEAD(&metaCacheGfidBuckets[i]);
   }
+  metaCacheInit = true;
+}
 
-  ret = glfs_chdir (glfs, GB_STOREDIR);
-  if (ret) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_chdir(%s) on volume %s for block %s failed[%s]",
-        GB_STOREDIR, blk->volume, blk->block_name, strerror(errno));
-    goto out;
-  }
 
-  if (strlen(blk->storage)) {
-    ret = glfs_stat(glfs, blk->storage, &st);
-    if (ret) {
-      *errCode = errno;
-      if (*errCode == ENOENT) {
-        LOG("mgmt", GB_LOG_ERROR,
-            "storage file '/block-store/%s' doesn't exist in volume %s",
-            blk->storage, blk->volume);
-        GB_ASPRINTF(errMsg,
-                    "storage file '/block-store/%s' doesn't exist in volume %s\n",
-                    blk->storage, blk->volume);
-      } else {
-        LOG("mgmt", GB_LOG_ERROR,
-            "glfs_stat failed on /block-store/%s in volume %s [%s]",
-            blk->storage, blk->volume, strerror(*errCode));
-        GB_ASPRINTF(errMsg,
-                    "glfs_stat failed on /block-store/%s in volume %s [%s]",
-                    blk->storage, blk->volume, strerror(*errCode));
-      }
-      goto out;
-    }
-    blk->size = st.st_size;
+/* called with metaCacheLock held */
+static struct list_head *
+blockMetaCacheBucket(const char *volume, const char *block)
+{
+  unsigned int h = 2166136261u;
 
-    if (st.st_nlink == 1) {
-      ret = glfs_link(glfs, blk->storage, gbid);
-      if (ret) {
-        *errCode=errno;
-        LOG("mgmt", GB_LOG_ERROR,
-            "glfs_link(%s, %s) on volume %s for block %s failed [%s]",
-            blk->storage, gbid, blk->volume, blk->block_name, strerror(errno));
-        GB_ASPRINTF(errMsg,
-                    "glfs_link(%s, %s) on volume %s for block %s failed [%s]",
-                    blk->storage, gbid, blk->volume, blk->block_name, strerror(errno));
-        goto out;
-      }
-    } else {
-      *errCode = EBUSY;
-      LOG("mgmt", GB_LOG_ERROR,
-          "storage file /block-store/%s is already in use in volume %s [%s]",
-          blk->storage, blk->volume, strerror(*errCode));
-      GB_ASPRINTF(errMsg,
-                  "storage file /block-store/%s is already in use in volume %s [%s]\n"
-                  "hint: delete the hardlink file, make sure file is not in use\n",
-                  blk->storage, blk->volume, strerror(*errCode));
-      ret = -1;
-      goto out;
-    }
-    return 0;
+
+  blockMetaCacheInitOnce();
+  while (*volume) {
+    h ^= (unsigned char)*volume++;
+    h *= 16777619u;
+  }
+  h ^= '/';
+  h *= 16777619u;
+  while (*block) {
+    h ^= (unsigned char)*block++;
+    h *= 16777619u;
   }
 
-  tgfd = glfs_creat(glfs, gbid,
-                    O_WRONLY | O_CREAT | O_EXCL | O_SYNC,
-                    S_IRUSR | S_IWUSR);
-  if (!tgfd) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_creat(%s) on volume %s for block %s failed[%s]",
-        gbid, blk->volume, blk->block_name, strerror(errno));
-    ret = -1;
-    goto out;
-  } else {
-    ret = glfs_ftruncate(tgfd, blk->size);
-    if (ret) {
-      *errCode = errno;
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_ftruncate(%s): on volume %s for block %s "
-          "of size %zu failed[%s]", gbid, blk->volume, blk->block_name,
-          blk->size, strerror(errno));
-      goto unlink;
-    }
+  return &metaCacheBuckets[h & (GB_META_CACHE_BUCKETS - 1)];
+}
 
-    if (blk->prealloc && glfs_zerofill(tgfd, 0, blk->size)) {
-      *errCode = errno;
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_zerofill(%s): on volume %s for block %s "
-          "of size %zu failed[%s]", gbid, blk->volume, blk->block_name,
-          blk->size, strerror(errno));
-      ret = -1;
-      goto unlink;
-    }
-  }
 
+/* called with metaCacheLock held; gfids are random, any byte will do */
+static struct list_head *
+blockMetaCacheGfidBucket(const unsigned char *gfid)
+{
+  blockMetaCacheInitOnce();
 
-unlink:
-  if (tgfd && glfs_close(tgfd) != 0) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_close(%s): on volume %s for block %s failed[%s]",
-        gbid, blk->volume, blk->block_name, strerror(errno));
-    ret = -1;
-  }
+  return &metaCacheGfidBuckets[(gfid[14] << 8 | gfid[15]) &
+                               (GB_META_CACHE_BUCKETS - 1)];
+}
 
-  if (ret && glfs_unlink(glfs, gbid) && errno != ENOENT) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_unlink(%s) on volume %s for block %s failed[%s]",
-        gbid, blk->volume, blk->block_name, strerror(errno));
-  }
 
- out:
-  if (ret) {
-    if (errMsg && !(*errMsg)) {
-      GB_ASPRINTF (errMsg, "Not able to create storage for %s/%s [%s]",
-                   blk->volume, blk->block_name, strerror(*errCode));
-    }
+/* called with metaCacheLock held */
+static gbMetaCacheEntry *
+blockMetaCacheLookup(const char *volume, const char *block)
+{
+  struct list_head *bucket = blockMetaCacheBucket(volume, block);
+  gbMetaCacheEntry *ent;
 
-    GB_ASPRINTF(&tmp, "%s/%s", GB_METADIR, blk->block_name);
 
-    if (glfs_unlink(glfs, tmp) && errno != ENOENT) {
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_unlink(%s) on volume %s for block %s failed[%s]",
-          tmp, blk->volume, blk->block_name, strerror(errno));
+  list_for_each_entry(ent, bucket, hash) {
+    if (!strcmp(ent->block, block) && !strcmp(ent->volume, volume)) {
+      return ent;
     }
-    GB_FREE(tmp);
   }
 
-  return ret;
+  return NULL;
 }
 
 
-int
-glusterBlockResizeEntry(struct glfs *glfs, blockModifySize *blk,
-                        int *errCode, char **errMsg)
+/* called with metaCacheLock held */
+static gbMetaVol *
+blockMetaVolLookup(const char *volume, bool create)
 {
-  char fpath[PATH_MAX] = {0};
-  struct glfs_fd *tgfd;
-  struct stat sb = {0, };
-  int ret;
+  gbMetaVol *vol;
 
-  snprintf(fpath, sizeof fpath, "%s/%s", GB_STOREDIR, blk->gbid);
-  tgfd = glfs_open(glfs, fpath, O_WRONLY | O_SYNC);
-  if (!tgfd) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR, "glfs_open(%s) failed[%s]", blk->gbid,
-        strerror(errno));
-    ret = -1;
-    goto out;
-  } else {
-    ret = glfs_stat (glfs, fpath, &sb);
-    if (ret == -1) {
-      *errCode = errno;
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_stat(%s): on volume %s for block %s "
-          "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
-          blk->size, strerror(errno));
-      ret = -1;
-      goto close;
-    }
 
-    /* skip changing file size */
-    if (blk->size ==  sb.st_size) {
-      ret = 0;
-      goto close;
+  list_for_each_entry(vol, &metaCacheVols, list) {
+    if (!strcmp(vol->volume, volume)) {
+      return vol;
     }
+  }
+  if (!create || GB_ALLOC(vol) < 0) {
+    return NULL;
+  }
+  GB_STRCPYSTATIC(vol->volume, volume);
+  list_add(&vol->list, &metaCacheVols);
 
-    if (glusterBlockCheckAvailableSpace(glfs, blk->volume, blk->size - sb.st_size, errMsg)) {
-      *errCode = errno;
-      ret = -1;
-      goto close;
-    }
+  return vol;
+}
+
+
+static void
+blockMetaCacheEntryFree(gbMetaCacheEntry *ent)
+{
+  list_del(&ent->hash);
+  list_del(&ent->gfidHash);
+  list_del(&ent->lru);
+  blockFreeMetaInfo(ent->info);
+  GB_FREE(ent);
+  metaCacheCount--;
+}
+
+
+/* called with metaCacheLock held */
+static void
+blockMetaVolDropNames(gbMetaVol *vol)
+{
+  strToCharArrayDefFree(vol->names);
+  vol->names = NULL;
+  vol->namesUntil = 0;
+}
+
+
+/* an inode changed, locally or as told by an upcall */
+static void
+blockMetaCacheInvalidate(const unsigned char *gfid)
+{
+  gbMetaCacheEntry *ent;
+  gbMetaVol *vol;
+
+
+  LOCK(metaCacheLock);
+  metaCacheSeq++;
+  list_for_each_entry(vol, &metaCacheVols, list) {
+    if (vol->hasDirGfid && !memcmp(vol->dirGfid, gfid, GFAPI_HANDLE_LENGTH)) {
+      /* names may now map to other files, distrust them all */
+      vol->epoch++;
+      blockMetaVolDropNames(vol);
+    }
+  }
+  list_for_each_entry(ent, blockMetaCacheGfidBucket(gfid), gfidHash) {
+    if (ent->hasGfid && !memcmp(ent->gfid, gfid, GFAPI_HANDLE_LENGTH)) {
+      ent->trustedUntil = 0;
+    }
+  }
+  UNLOCK(metaCacheLock);
+}
+
+
+static void
+blockMetaCacheInvalidateObject(struct glfs_object *obj)
+{
+  unsigned char gfid[GFAPI_HANDLE_LENGTH];
+
+
+  if (glfs_h_extract_handle(obj, gfid, sizeof(gfid)) == sizeof(gfid)) {
+    blockMetaCacheInvalidate(gfid);
+  }
+}
+
+
+static time_t
+blockMetaCacheTtl(void)
+{
+  time_t ttl;
+
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  ttl = gbConf.metaUpcallTtl;
+  RWUNLOCK(gbConf.cfgLock);
+
+  return ttl;
+}
+
+
+/* ttl of trusted entries for a read through glfs, 0 if they are not */
+static time_t
+blockMetaCacheTrustTtl(gbMetaVol *vol, struct glfs *glfs)
+{
+  if (!vol || !glfs || vol->watchFs != glfs) {
+    return 0;
+  }
+
+  return blockMetaCacheTtl();
+}
+
+
+/* seq is metaCacheSeq from before info was read */
+static void
+blockMetaCacheStore(struct glfs *glfs, const char *volume, const char *block,
+                    struct stat *st, const unsigned char *gfid,
+                    unsigned long seq, MetaInfo *info)
+{
+  gbMetaCacheEntry *ent;
+  MetaInfo *copy = NULL;
+  gbMetaVol *vol;
+  time_t ttl;
+
+
+  if (GB_ALLOC(copy) < 0 || blockCopyMetaInfo(copy, info)) {
+    blockFreeMetaInfo(copy);
+    return;
+  }
+
+  LOCK(metaCacheLock);
+  ent = blockMetaCacheLookup(volume, block);
+  if (!ent) {
+    if (GB_ALLOC(ent) < 0) {
+      UNLOCK(metaCacheLock);
+      blockFreeMetaInfo(copy);
+      return;
+    }
+    GB_STRCPYSTATIC(ent->volume, volume);
+    GB_STRCPYSTATIC(ent->block, block);
+    list_add(&ent->hash, blockMetaCacheBucket(volume, block));
+    INIT_LIST_HEAD(&ent->gfidHash);
+    list_add(&ent->lru, &metaCacheLru);
+    metaCacheCount++;
+    if (metaCacheCount > GB_META_CACHE_MAX) {
+      blockMetaCacheEntryFree(list_entry(metaCacheLru.prev,
+                                         gbMetaCacheEntry, lru));
+    }
+  } else {
+    list_move(&ent->lru, &metaCacheLru);
+  }
+  blockFreeMetaInfo(ent->info);
+  ent->info = copy;
+  ent->size = st ? st->st_size : -1;
+  if (st) {
+    ent->mtime = st->st_mtim;
+  }
+
+  list_del_init(&ent->gfidHash);
+  ent->hasGfid = false;
+  if (gfid) {
+    memcpy(ent->gfid, gfid, GFAPI_HANDLE_LENGTH);
+    ent->hasGfid = true;
+    list_add(&ent->gfidHash, blockMetaCacheGfidBucket(gfid));
+  }
+
+  vol = blockMetaVolLookup(volume, false);
+  ttl = blockMetaCacheTrustTtl(vol, glfs);
+  ent->trustedUntil = 0;
+  if (ttl && gfid && seq == metaCacheSeq) {
+    ent->trustedUntil = time(NULL) + ttl;
+    ent->epoch = vol->epoch;
+  }
+  UNLOCK(metaCacheLock);
+}
+
+
+# ifdef HAVE_GLFS_UPCALL_REGISTER
+static void
+glusterBlockUpcallCbk(struct glfs_upcall *up, void *data)
+{
+  struct glfs_upcall_inode *in;
+  struct glfs_object *obj;
+
+
+  if (glfs_upcall_get_reason(up) == GLFS_UPCALL_INODE_INVALIDATE) {
+    in = glfs_upcall_get_event(up);
+    obj = in ? glfs_upcall_inode_get_object(in) : NULL;
+    if (obj) {
+      blockMetaCacheInvalidateObject(obj);
+    }
+  }
+
+  glfs_free(up);
+}
+# endif
+
+
+/*
+ * The object of the well known path which on glfs, looked up on first use
+ * and then kept along with the cached handle. The prio file and the trash
+ * directory are created if they do not exist yet. Returns NULL with errno
+ * set on failure.
+ */
+static struct glfs_object *
+glusterBlockGetObject(struct glfs *glfs, gbGlfsObj which)
+{
+  struct glfs_object *parent = NULL;
+  struct glfs_object *cached;
+  struct glfs_object *obj;
+  gbGlfsObj parentWhich = GB_OBJ_MAX;
+  const char *name;
+
+
+  obj = cacheGetObject(glfs, which);
+  if (obj) {
+    return obj;
+  }
+
+  switch (which) {
+  case GB_OBJ_METADIR:
+    name = GB_METADIR;
+    break;
+  case GB_OBJ_STOREDIR:
+    name = GB_STOREDIR;
+    break;
+  case GB_OBJ_PRIOFILE:
+    parentWhich = GB_OBJ_METADIR;
+    name = GB_PRIO_FILENAME;
+    break;
+  case GB_OBJ_TRASHDIR:
+    parentWhich = GB_OBJ_STOREDIR;
+    name = GB_TRASHDIRNAME;
+    break;
+  default:
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (parentWhich != GB_OBJ_MAX) {
+    parent = glusterBlockGetObject(glfs, parentWhich);
+    if (!parent) {
+      return NULL;
+    }
+  }
+
+  obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+  if (!obj && errno == ENOENT && which == GB_OBJ_PRIOFILE) {
+    obj = glfs_h_creat(glfs, parent, name, O_RDWR, S_IRUSR | S_IWUSR, NULL);
+    if (!obj && errno == EEXIST) {
+      obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+    }
+  } else if (!obj && errno == ENOENT && which == GB_OBJ_TRASHDIR) {
+    obj = glfs_h_mkdir(glfs, parent, name, S_IRWXU, NULL);
+    if (!obj && errno == EEXIST) {
+      obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+    }
+  }
+  if (!obj) {
+    if (errno == ESTALE && parent) {
+      cacheStaleObject(glfs, parentWhich, parent);
+    }
+    return NULL;
+  }
+
+  cached = cacheSetObject(glfs, which, obj);
+  if (cached != obj) {
+    glfs_h_close(obj);
+  }
+  if (!cached) {
+    LOG("gfapi", GB_LOG_ERROR, "resolving %s on a glfs handle that is not "
+        "cached", name);
+    errno = EBADF;
+  }
+
+  return cached;
+}
+
+
+/*
+ * Start trusting the metadata cache of volume for reads through glfs, the
+ * handle now cached for it, if upcalls can be had on it (glfs NULL stops
+ * trusting it). Whatever was trusted through an earlier handle is not
+ * anymore, as invalidations may have been missed in between.
+ */
+static void
+glusterBlockWatchMeta(char *volume, struct glfs *glfs)
+{
+  unsigned char gfid[GFAPI_HANDLE_LENGTH] = {0};
+  struct glfs_object *dir;
+  struct glfs *watch = NULL;
+  gbMetaVol *vol;
+
+
+# ifdef HAVE_GLFS_UPCALL_REGISTER
+  if (glfs && blockMetaCacheTtl()) {
+    if (glfs_upcall_register(glfs, GLFS_EVENT_INODE_INVALIDATE,
+                             glusterBlockUpcallCbk, NULL) > 0) {
+      watch = glfs;
+    } else {
+      LOG("gfapi", GB_LOG_WARNING, "glfs_upcall_register() on volume %s "
+          "failed[%s], metadata is not cached across reads", volume,
+          strerror(errno));
+    }
+  }
+# endif
+
+  /* creates and deletes of metafiles come in as invalidations of it */
+  dir = watch ? glusterBlockGetObject(glfs, GB_OBJ_METADIR) : NULL;
+  if (!dir || glfs_h_extract_handle(dir, gfid, sizeof(gfid)) != sizeof(gfid)) {
+    watch = NULL;
+  }
+
+  LOCK(metaCacheLock);
+  vol = blockMetaVolLookup(volume, !!watch);
+  if (vol) {
+    vol->watchFs = watch;
+    memcpy(vol->dirGfid, gfid, sizeof(gfid));
+    vol->hasDirGfid = !!watch;
+    vol->epoch++;
+    blockMetaVolDropNames(vol);
+  }
+  UNLOCK(metaCacheLock);
+}
+
+
+/*
+ * Connect every queued volume through glusterd and swap that handle in for
+ * the one built from the cached volfile, which has no glusterd connection
+ * and would never see a graph change. The volfile is saved if it changed.
+ * A swap that has to wait goes back to the tail of the queue with a retry
+ * time, so that one volume doesn't hold up the others.
+ */
+static void *
+glusterBlockVolfileRefreshThread(void *data)
+{
+  gbVolfileRefresh *req;
+  gbVolfileRefresh *tmp;
+  struct timespec deadline = {0, };
+  char *errMsg = NULL;
+  int errCode = 0;
+  time_t now;
+  int ret;
+
+
+  while (1) {
+    req = NULL;
+    LOCK(refreshLock);
+    while (!list_empty(&refreshQueue)) {
+      now = time(NULL);
+      deadline.tv_sec = 0;
+      list_for_each_entry(tmp, &refreshQueue, list) {
+        if (tmp->retryAt <= now) {
+          req = tmp;
+          break;
+        }
+        if (!deadline.tv_sec || tmp->retryAt < deadline.tv_sec) {
+          deadline.tv_sec = tmp->retryAt;
+        }
+      }
+      if (req) {
+        break;
+      }
+      /* only retries left, till the first is due or a request comes in */
+      pthread_cond_timedwait(&refreshCond, &refreshLock, &deadline);
+    }
+    if (!req) {
+      refreshRunning = false;
+      UNLOCK(refreshLock);
+      break;
+    }
+    list_del(&req->list);
+    UNLOCK(refreshLock);
+
+    if (!req->glfs) {
+      req->glfs = glusterBlockGlfsInit(req->volume, NULL, &errCode, &errMsg);
+      if (!req->glfs) {
+        LOG("gfapi", GB_LOG_WARNING, "refreshing volfile of volume %s "
+            "failed[%s], keeping the cached one", req->volume,
+            errMsg ? errMsg : strerror(errCode));
+        GB_FREE(errMsg);
+        goto next;
+      }
+      req->changed = glusterBlockVolfileSave(req->volume, req->glfs) == 1;
+    }
+
+    ret = replaceCacheHandle(req->volume, req->glfs);
+    if (ret == 1) {
+      /* the stand-in's init, or users of an earlier swap, still to go */
+      req->retryAt = time(NULL) + 1;
+      LOCK(refreshLock);
+      list_add_tail(&req->list, &refreshQueue);
+      UNLOCK(refreshLock);
+      continue;
+    }
+    if (!ret) {
+      LOG("gfapi", GB_LOG_INFO, "volume %s connected through glusterd%s, "
+          "handle swapped", req->volume,
+          req->changed ? " on a changed graph" : "");
+      glusterBlockWatchMeta(req->volume, req->glfs);
+    } else {
+      glfs_fini(req->glfs);
+    }
+
+ next:
+    GB_FREE(req->volume);
+    GB_FREE(req);
+  }
+
+  return NULL;
+}
+
+
+static void
+glusterBlockVolfileRefresh(const char *volume)
+{
+  gbVolfileRefresh *req;
+  pthread_t tid;
+
+
+  LOCK(refreshLock);
+  list_for_each_entry(req, &refreshQueue, list) {
+    if (!strcmp(req->volume, volume)) {
+      UNLOCK(refreshLock);
+      return;
+    }
+  }
+
+  if (GB_ALLOC(req) < 0 || GB_STRDUP(req->volume, volume) < 0) {
+    GB_FREE(req);
+    UNLOCK(refreshLock);
+    return;
+  }
+  list_add_tail(&req->list, &refreshQueue);
+  pthread_cond_signal(&refreshCond);
+
+  if (!refreshRunning) {
+    if (pthread_create(&tid, NULL, glusterBlockVolfileRefreshThread, NULL)) {
+      LOG("gfapi", GB_LOG_WARNING, "failed to start volfile refresh of %s",
+          volume);
+      list_del(&req->list);
+      GB_FREE(req->volume);
+      GB_FREE(req);
+    } else {
+      pthread_detach(tid);
+      refreshRunning = true;
+    }
+  }
+  UNLOCK(refreshLock);
+}
+
+
+/*
+ * Returns a referenced handle of volume, see glusterBlockVolumeRelease().
+ *
+ * With the volfile cache on, a volume that is not cached yet is initialized
+ * from the volfile saved the last time it was fetched from glusterd, which
+ * saves the round trips to the volfile server. That handle only stands in
+ * until one connected through glusterd is up in the background.
+ */
+struct glfs *
+glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg)
+{
+  struct glfs *glfs = NULL;
+  char volfile[PATH_MAX];
+  bool initOwner;
+  bool useVolfile;
+  long rss;
+
+
+  glfs = queryCache(volume, &initOwner);
+  if (glfs) {
+    return glfs;
+  }
+  if (!initOwner) {
+    *errCode = ENOMEM;
+    LOG("gfapi", GB_LOG_ERROR, "allocation failed in queryCache(%s)", volume);
+    return NULL;
+  }
+
+  /* the new handle may reuse the address of an evicted one */
+  glusterBlockWatchMeta(volume, NULL);
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  useVolfile = gbConf.glfsVolfileCache;
+  RWUNLOCK(gbConf.cfgLock);
+
+  glusterBlockVolfilePath(volume, volfile, sizeof(volfile));
+  rss = gbProcRssKiB();
+  if (useVolfile && !access(volfile, R_OK)) {
+    glfs = glusterBlockGlfsInit(volume, volfile, errCode, errMsg);
+    if (glfs) {
+      glusterBlockVolfileRefresh(volume);
+    } else {
+      GB_FREE(*errMsg);
+      *errCode = 0;
+    }
+  }
+
+  if (!glfs) {
+    glfs = glusterBlockGlfsInit(volume, NULL, errCode, errMsg);
+    if (!glfs) {
+      dropNewEntry(volume);
+      return NULL;
+    }
+    if (useVolfile) {
+      glusterBlockVolfileSave(volume, glfs);
+    }
+  }
+
+  if (rss >= 0) {
+    cacheAccountInitRss(gbProcRssKiB() - rss);
+  }
+
+  if (appendNewEntry(volume, glfs)) {
+    *errCode = EINVAL;
+    LOG("gfapi", GB_LOG_ERROR, "no cache placeholder for volume %s", volume);
+    glfs_fini(glfs);
+    return NULL;
+  }
+  glusterBlockWatchMeta(volume, glfs);
+
+  return glfs;
+}
+
+
+/* give back a handle returned by glusterBlockVolumeInit() */
+void
+glusterBlockVolumeRelease(char *volume, struct glfs *glfs)
+{
+  if (!glfs) {
+    return;
+  }
+
+  releaseCacheRef(volume, glfs);
+}
+
+
+typedef struct gbPrewarm {
+  strToCharArrayDefPtr vols;
+  size_t npinned;             /* the first npinned vols are kept warm */
+  size_t next;                /* next volume to pick, atomic */
+} gbPrewarm;
+
+
+static void *
+glusterBlockPrewarmWorker(void *data)
+{
+  gbPrewarm *pw = data;
+  struct glfs *glfs;
+  char *errMsg = NULL;
+  int errCode = 0;
+  size_t i;
+
+
+  while ((i = __atomic_fetch_add(&pw->next, 1, __ATOMIC_RELAXED)) <
+         pw->vols->len) {
+    glfs = glusterBlockVolumeInit(pw->vols->data[i], &errCode, &errMsg);
+    if (!glfs) {
+      LOG("mgmt", GB_LOG_WARNING, "pre-warming volume %s failed[%s]",
+          pw->vols->data[i], errMsg ? errMsg : strerror(errCode));
+      GB_FREE(errMsg);
+      continue;
+    }
+    if (i < pw->npinned) {
+      pinCacheEntry(pw->vols->data[i]);
+    }
+    glusterBlockVolumeRelease(pw->vols->data[i], glfs);
+  }
+
+  return NULL;
+}
+
+
+static void *
+glusterBlockPrewarmThread(void *data)
+{
+  gbPrewarm *pw = data;
+  pthread_t workers[GB_PREWARM_THREADS_MAX];
+  unsigned long long start = gbTimeNowUsec();
+  size_t nworkers;
+  size_t i;
+
+
+  nworkers = pw->vols->len < GB_PREWARM_THREADS_MAX ?
+             pw->vols->len : GB_PREWARM_THREADS_MAX;
+  for (i = 0; i < nworkers; i++) {
+    if (pthread_create(&workers[i], NULL, glusterBlockPrewarmWorker, pw)) {
+      break;
+    }
+  }
+  if (!i) {
+    /* no luck with threads, warm them one after the other */
+    glusterBlockPrewarmWorker(pw);
+  }
+  nworkers = i;
+  for (i = 0; i < nworkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  LOG("mgmt", GB_LOG_INFO, "pre-warmed %zu volume(s) in %llu msec",
+      pw->vols->len, (gbTimeNowUsec() - start) / 1000);
+
+  strToCharArrayDefFree(pw->vols);
+  GB_FREE(pw);
+
+  return NULL;
+}
+
+
+static bool
+glusterBlockPrewarmHas(strToCharArrayDefPtr vols, const char *volume)
+{
+  size_t i;
+
+
+  for (i = 0; i < vols->len; i++) {
+    if (!strcmp(vols->data[i], volume)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/*
+ * Initialize, in the background and in parallel, the comma separated list
+ * of volumes in pinned (these stay cached for good) and up to glfsLruCount
+ * of the volumes that were cached when the daemon last ran. Requests that
+ * hit a volume still being warmed up just wait for its glfs_init().
+ */
+int
+glusterBlockPrewarmVolumes(char *pinned)
+{
+  strToCharArrayDefPtr conf = NULL;
+  strToCharArrayDefPtr warm = NULL;
+  gbPrewarm *pw = NULL;
+  pthread_t tid;
+  size_t max;
+  size_t nwarm = 0;
+  size_t i;
+  int ret = -1;
+
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  max = gbConf.glfsLruCount;
+  RWUNLOCK(gbConf.cfgLock);
+
+  if (pinned && pinned[0]) {
+    conf = getCharArrayFromDelimitedStr(pinned, GB_VOLS_DELIMITER);
+  }
+  warm = loadWarmVolumes();
+
+  if (GB_ALLOC(pw) < 0 || GB_ALLOC(pw->vols) < 0) {
+    goto out;
+  }
+  if (GB_ALLOC_N(pw->vols->data, (conf ? conf->len : 0) +
+                 (warm ? warm->len : 0) + 1) < 0) {
+    goto out;
+  }
+
+  for (i = 0; conf && i < conf->len; i++) {
+    if (conf->data[i] && conf->data[i][0] &&
+        !glusterBlockPrewarmHas(pw->vols, conf->data[i])) {
+      pw->vols->data[pw->vols->len++] = conf->data[i];
+      conf->data[i] = NULL;
+    }
+  }
+  pw->npinned = pw->vols->len;
+
+  for (i = 0; warm && i < warm->len && nwarm < max; i++) {
+    if (!glusterBlockPrewarmHas(pw->vols, warm->data[i])) {
+      pw->vols->data[pw->vols->len++] = warm->data[i];
+      warm->data[i] = NULL;
+      nwarm++;
+    }
+  }
+
+  if (!pw->vols->len) {
+    ret = 0;
+    goto out;
+  }
+
+  LOG("mgmt", GB_LOG_INFO, "pre-warming %zu pinned and %zu recent volume(s)",
+      pw->npinned, nwarm);
+
+  if (pthread_create(&tid, NULL, glusterBlockPrewarmThread, pw)) {
+    LOG("mgmt", GB_LOG_WARNING, "%s", "failed to start pre-warming thread");
+    goto out;
+  }
+  pthread_detach(tid);
+  pw = NULL;
+  ret = 0;
+
+ out:
+  if (pw) {
+    strToCharArrayDefFree(pw->vols);
+    GB_FREE(pw);
+  }
+  strToCharArrayDefFree(conf);
+  strToCharArrayDefFree(warm);
+
+  return ret;
+}
+
+
+/*
+ * Open name in the directory dir, creating it if flags has O_CREAT. This
+ * takes the place of glfs_chdir() followed by glfs_creat() or glfs_open(),
+ * as the cwd is per glfs instance and all threads share the cached ones.
+ * The gfid of the file goes to gfid if that is not NULL.
+ */
+static struct glfs_fd *
+glusterBlockOpenAtGfid(struct glfs *glfs, gbGlfsObj dir, const char *name,
+                       int flags, mode_t mode, unsigned char *gfid)
+{
+  struct glfs_object *parent;
+  struct glfs_object *obj;
+  struct glfs_fd *fd;
+  bool retried = false;
+  bool created = false;
+  int errSave;
+
+
+ retry:
+  parent = glusterBlockGetObject(glfs, dir);
+  if (!parent) {
+    return NULL;
+  }
+
+  obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+  if (obj && (flags & O_CREAT) && (flags & O_EXCL)) {
+    glfs_h_close(obj);
+    errno = EEXIST;
+    return NULL;
+  }
+  if (!obj && errno == ENOENT && (flags & O_CREAT)) {
+    obj = glfs_h_creat(glfs, parent, name, flags, mode, NULL);
+    created = !!obj;
+    if (!obj && errno == EEXIST && !(flags & O_EXCL)) {
+      obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+    }
+  }
+  if (!obj) {
+    if (errno == ESTALE && !retried) {
+      cacheStaleObject(glfs, dir, parent);
+      retried = true;
+      goto retry;
+    }
+    return NULL;
+  }
+
+  if (dir == GB_OBJ_METADIR) {
+    if (created) {
+      blockMetaCacheInvalidateObject(parent);
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+      blockMetaCacheInvalidateObject(obj);
+    }
+  }
+  if (gfid && glfs_h_extract_handle(obj, gfid, GFAPI_HANDLE_LENGTH) !=
+      GFAPI_HANDLE_LENGTH) {
+    memset(gfid, 0, GFAPI_HANDLE_LENGTH);
+  }
+
+  fd = glfs_h_open(glfs, obj, flags & ~(O_CREAT | O_EXCL));
+  errSave = errno;
+  glfs_h_close(obj);
+  errno = errSave;
+
+  return fd;
+}
+
+
+struct glfs_fd *
+glusterBlockOpenAt(struct glfs *glfs, gbGlfsObj dir, const char *name,
+                   int flags, mode_t mode)
+{
+  return glusterBlockOpenAtGfid(glfs, dir, name, flags, mode, NULL);
+}
+
+
+/*
+ * Like glfs_access(name, F_OK) relative to dir, 0 if name exists there and
+ * -1 with errno set otherwise.
+ */
+int
+glusterBlockAccessAt(struct glfs *glfs, gbGlfsObj dir, const char *name)
+{
+  struct glfs_object *parent;
+  struct glfs_object *obj;
+  bool retried = false;
+
+
+ retry:
+  parent = glusterBlockGetObject(glfs, dir);
+  if (!parent) {
+    return -1;
+  }
+
+  obj = glfs_h_lookupat(glfs, parent, name, NULL, 0);
+  if (!obj) {
+    if (errno == ESTALE && !retried) {
+      cacheStaleObject(glfs, dir, parent);
+      retried = true;
+      goto retry;
+    }
+    return -1;
+  }
+  glfs_h_close(obj);
+
+  return 0;
+}
+
+
+static int
+glusterBlockUnlinkAt(struct glfs *glfs, gbGlfsObj dir, const char *name)
+{
+  struct glfs_object *parent;
+  bool retried = false;
+  int ret;
+
+
+ retry:
+  parent = glusterBlockGetObject(glfs, dir);
+  if (!parent) {
+    return -1;
+  }
+
+  ret = glfs_h_unlink(glfs, parent, name);
+  if (ret && errno == ESTALE && !retried) {
+    cacheStaleObject(glfs, dir, parent);
+    retried = true;
+    goto retry;
+  }
+  if (!ret && dir == GB_OBJ_METADIR) {
+    blockMetaCacheInvalidateObject(parent);
+  }
+
+  return ret;
+}
+
+
+/* get (buf != NULL) or set xattr attr of the prio file */
+static ssize_t
+glusterBlockPrioXattr(struct glfs *glfs, const char *attr, char *buf,
+                      size_t len, bool set)
+{
+  struct glfs_object *obj;
+  bool retried = false;
+  ssize_t ret;
+
+
+ retry:
+  obj = glusterBlockGetObject(glfs, GB_OBJ_PRIOFILE);
+  if (!obj) {
+    return -1;
+  }
+
+  if (set) {
+    ret = glfs_h_setxattrs(glfs, obj, attr, buf, len, 0);
+  } else {
+    ret = glfs_h_getxattrs(glfs, obj, attr, buf, len);
+  }
+  if (ret < 0 && errno == ESTALE && !retried) {
+    cacheStaleObject(glfs, GB_OBJ_PRIOFILE, obj);
+    retried = true;
+    goto retry;
+  }
+
+  return ret;
+}
+
+
+typedef struct gbSpaceLedger {
+  char volume[255];
+  size_t total;                   /* as of the last glfs_statvfs() */
+  size_t free;
+  size_t reserved;                /* by creates and resizes in flight */
+  unsigned long long refreshed;   /* usec, 0 to refresh at next use */
+  bool refreshing;
+  struct list_head list;
+} gbSpaceLedger;
+
+
+static pthread_mutex_t spaceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spaceCond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(spaceLedgers);
+
+
+static gbSpaceLedger *
+glusterBlockSpaceLedgerGet(const char *volume, bool alloc)
+{
+  gbSpaceLedger *ledger;
+
+
+  list_for_each_entry(ledger, &spaceLedgers, list) {
+    if (!strcmp(ledger->volume, volume)) {
+      return ledger;
+    }
+  }
+
+  if (!alloc || GB_ALLOC(ledger) < 0) {
+    return NULL;
+  }
+  GB_STRCPYSTATIC(ledger->volume, volume);
+  list_add(&ledger->list, &spaceLedgers);
+
+  return ledger;
+}
+
+
+/*
+ * Set size bytes of volume aside for a create or resize, if the free space
+ * less what the requests in flight set aside leaves room for it and
+ * GB_METASTORE_RESERVE. The free space is read with glfs_statvfs() at most
+ * every GB_SPACE_REFRESH_USEC. Give the bytes back with
+ * glusterBlockUnreserveSpace() once the request is over.
+ */
+int
+glusterBlockReserveSpace(struct glfs *glfs, char *volume, size_t size,
+                         char **errMsg)
+{
+  struct statvfs buf = {'\0', };
+  gbSpaceLedger *ledger;
+  gbSpaceLedger seen;
+  unsigned long long now;
+  size_t avail;
+  int errSave = 0;
+  int ret;
+
+
+  LOCK(spaceLock);
+  ledger = glusterBlockSpaceLedgerGet(volume, true);
+  if (!ledger) {
+    UNLOCK(spaceLock);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  while (ledger->refreshing) {
+    pthread_cond_wait(&spaceCond, &spaceLock);
+  }
+
+  now = gbTimeNowUsec();
+  if (!ledger->refreshed || now - ledger->refreshed > GB_SPACE_REFRESH_USEC) {
+    ledger->refreshing = true;
+    UNLOCK(spaceLock);
+    ret = glfs_statvfs(glfs, "/", &buf);
+    errSave = errno;
+    LOCK(spaceLock);
+    ledger->refreshing = false;
+    pthread_cond_broadcast(&spaceCond);
+    if (ret) {
+      UNLOCK(spaceLock);
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_statvfs('%s'): couldn't get file-system statistics", volume);
+      GB_ASPRINTF(errMsg,
+                  "couldn't get file-system statistics on volume %s\n", volume);
+      errno = errSave;
+      return -1;
+    }
+    ledger->total = buf.f_blocks * buf.f_bsize;
+    ledger->free = buf.f_bfree * buf.f_bsize;
+    ledger->refreshed = now;
+  }
+
+  avail = ledger->free > ledger->reserved ? ledger->free - ledger->reserved : 0;
+  if (avail >= GB_METASTORE_RESERVE + size) {
+    ledger->reserved += size;
+    UNLOCK(spaceLock);
+    return 0;
+  }
+  seen = *ledger;
+  UNLOCK(spaceLock);
+
+  LOG("gfapi", GB_LOG_ERROR,
+      "glfs_statvfs('%s'): Low space on volume => "
+      "Total size: %zu, Free space: %zu, Reserved space: %zu, "
+      "Block request space: %zu", volume, seen.total, seen.free,
+      seen.reserved, size);
+  GB_ASPRINTF(errMsg, "Low space on the volume %s\n", volume);
+  errno = ENOSPC;
+
+  return -1;
+}
+
+
+/*
+ * Give back size bytes set aside by glusterBlockReserveSpace(). If consumed
+ * is set, they were written to meanwhile and the free space is read afresh
+ * at the next reservation.
+ */
+void
+glusterBlockUnreserveSpace(char *volume, size_t size, bool consumed)
+{
+  gbSpaceLedger *ledger;
+
+
+  LOCK(spaceLock);
+  ledger = glusterBlockSpaceLedgerGet(volume, false);
+  if (ledger) {
+    ledger->reserved -= size < ledger->reserved ? size : ledger->reserved;
+    if (consumed) {
+      ledger->refreshed = 0;
+    }
+  }
+  UNLOCK(spaceLock);
+}
+
+
+int
+glusterBlockCreateEntry(struct glfs *glfs, blockCreateCli *blk, char *gbid,
+                        bool zerofill, int *errCode, char **errMsg)
+{
+  struct glfs_object *storeDir;
+  struct glfs_object *obj;
+  struct glfs_fd *tgfd;
+  struct stat st;
+  int ret = -1;
+
+
+  ret = glfs_mkdir (glfs, GB_STOREDIR, 0);
+  if (ret && errno != EEXIST) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_mkdir(%s) on volume %s for block %s failed[%s]",
+        GB_STOREDIR, blk->volume, blk->block_name, strerror(errno));
+    goto out;
+  }
+
+  storeDir = glusterBlockGetObject(glfs, GB_OBJ_STOREDIR);
+  if (!storeDir) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_h_lookupat(%s) on volume %s for block %s failed[%s]",
+        GB_STOREDIR, blk->volume, blk->block_name, strerror(errno));
+    ret = -1;
+    goto out;
+  }
+
+  if (strlen(blk->storage)) {
+    obj = glfs_h_lookupat(glfs, storeDir, blk->storage, &st, 0);
+    if (!obj) {
+      *errCode = errno;
+      if (*errCode == ESTALE) {
+        cacheStaleObject(glfs, GB_OBJ_STOREDIR, storeDir);
+      }
+      ret = -1;
+      if (*errCode == ENOENT) {
+        LOG("mgmt", GB_LOG_ERROR,
+            "storage file '/block-store/%s' doesn't exist in volume %s",
+            blk->storage, blk->volume);
+        GB_ASPRINTF(errMsg,
+                    "storage file '/block-store/%s' doesn't exist in volume %s\n",
+                    blk->storage, blk->volume);
+      } else {
+        LOG("mgmt", GB_LOG_ERROR,
+            "glfs_stat failed on /block-store/%s in volume %s [%s]",
+            blk->storage, blk->volume, strerror(*errCode));
+        GB_ASPRINTF(errMsg,
+                    "glfs_stat failed on /block-store/%s in volume %s [%s]",
+                    blk->storage, blk->volume, strerror(*errCode));
+      }
+      goto out;
+    }
+    blk->size = st.st_size;
+
+    if (st.st_nlink == 1) {
+      ret = glfs_h_link(glfs, obj, storeDir, gbid);
+      if (ret) {
+        *errCode = errno;
+      }
+      glfs_h_close(obj);
+      if (ret) {
+        LOG("mgmt", GB_LOG_ERROR,
+            "glfs_link(%s, %s) on volume %s for block %s failed [%s]",
+            blk->storage, gbid, blk->volume, blk->block_name, strerror(*errCode));
+        GB_ASPRINTF(errMsg,
+                    "glfs_link(%s, %s) on volume %s for block %s failed [%s]",
+                    blk->storage, gbid, blk->volume, blk->block_name, strerror(*errCode));
+        goto out;
+      }
+    } else {
+      glfs_h_close(obj);
+      *errCode = EBUSY;
+      LOG("mgmt", GB_LOG_ERROR,
+          "storage file /block-store/%s is already in use in volume %s [%s]",
+          blk->storage, blk->volume, strerror(*errCode));
+      GB_ASPRINTF(errMsg,
+                  "storage file /block-store/%s is already in use in volume %s [%s]\n"
+                  "hint: delete the hardlink file, make sure file is not in use\n",
+                  blk->storage, blk->volume, strerror(*errCode));
+      ret = -1;
+      goto out;
+    }
+    return 0;
+  }
+
+  tgfd = glusterBlockOpenAt(glfs, GB_OBJ_STOREDIR, gbid,
+                            O_WRONLY | O_CREAT | O_EXCL | O_SYNC,
+                            S_IRUSR | S_IWUSR);
+  if (!tgfd) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_creat(%s) on volume %s for block %s failed[%s]",
+        gbid, blk->volume, blk->block_name, strerror(errno));
+    ret = -1;
+    goto out;
+  } else {
+    ret = glfs_ftruncate(tgfd, blk->size);
+    if (ret) {
+      *errCode = errno;
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_ftruncate(%s): on volume %s for block %s "
+          "of size %zu failed[%s]", gbid, blk->volume, blk->block_name,
+          blk->size, strerror(errno));
+      goto unlink;
+    }
+
+    if (zerofill && glfs_zerofill(tgfd, 0, blk->size)) {
+      *errCode = errno;
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_zerofill(%s): on volume %s for block %s "
+          "of size %zu failed[%s]", gbid, blk->volume, blk->block_name,
+          blk->size, strerror(errno));
+      ret = -1;
+      goto unlink;
+    }
+  }
+
+
+unlink:
+  if (tgfd && glfs_close(tgfd) != 0) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_close(%s): on volume %s for block %s failed[%s]",
+        gbid, blk->volume, blk->block_name, strerror(errno));
+    ret = -1;
+  }
+
+  if (ret && glusterBlockUnlinkAt(glfs, GB_OBJ_STOREDIR, gbid) &&
+      errno != ENOENT) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_unlink(%s) on volume %s for block %s failed[%s]",
+        gbid, blk->volume, blk->block_name, strerror(errno));
+  }
+
+ out:
+  if (ret) {
+    if (errMsg && !(*errMsg)) {
+      GB_ASPRINTF (errMsg, "Not able to create storage for %s/%s [%s]",
+                   blk->volume, blk->block_name, strerror(*errCode));
+    }
+
+    if (glusterBlockUnlinkAt(glfs, GB_OBJ_METADIR, blk->block_name) &&
+        errno != ENOENT) {
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_h_unlink(%s/%s) on volume %s for block %s failed[%s]",
+          GB_METADIR, blk->block_name, blk->volume, blk->block_name,
+          strerror(errno));
+    }
+  }
+
+  return ret;
+}
+
+
+/*
+ * Truncate the block file to blk->size. The grown range is left to be
+ * preallocated by the caller; *preallocated is set to whether the file
+ * looks preallocated going by its allocated blocks, for blocks that do
+ * not record that in their metadata.
+ */
+int
+glusterBlockResizeEntry(struct glfs *glfs, blockModifySize *blk,
+                        bool *preallocated, int *errCode, char **errMsg)
+{
+  struct glfs_fd *tgfd;
+  struct stat sb = {0, };
+  int ret;
+
+  tgfd = glusterBlockOpenAt(glfs, GB_OBJ_STOREDIR, blk->gbid,
+                            O_WRONLY | O_SYNC, 0);
+  if (!tgfd) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_open(%s) failed[%s]", blk->gbid,
+        strerror(errno));
+    ret = -1;
+    goto out;
+  } else {
+    ret = glfs_fstat (tgfd, &sb);
+    if (ret == -1) {
+      *errCode = errno;
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_fstat(%s): on volume %s for block %s "
+          "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
+          blk->size, strerror(errno));
+      ret = -1;
+      goto close;
+    }
+
+    *preallocated = sb.st_size && sb.st_size <= 512 * sb.st_blocks;
+
+    /* skip changing file size */
+    if (blk->size ==  sb.st_size) {
+      ret = 0;
+      goto close;
+    }
 
     ret = glfs_ftruncate(tgfd, blk->size);
     if (ret) {
       *errCode = errno;
       LOG("gfapi", GB_LOG_ERROR,
-          "glfs_ftruncate(%s): on volume %s for block %s "
-          "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
-          blk->size, strerror(errno));
-      goto close;
+          "glfs_ftruncate(%s): on volume %s for block %s "
+          "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
+          blk->size, strerror(errno));
+      goto close;
+    }
+  }
+
+ close:
+  if (tgfd && glfs_close(tgfd) != 0) {
+    if (!(*errCode)) {
+      *errCode = errno;
+    }
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_close(%s): on volume %s for block %s failed[%s]",
+        blk->gbid, blk->volume, blk->block_name, strerror(errno));
+    ret = -1;
+  }
+
+
+ out:
+  if (ret) {
+    if (errMsg && !(*errMsg)) {
+      GB_ASPRINTF (errMsg, "Not able to resize storage for %s/%s [%s]",
+                   blk->volume, blk->block_name, strerror(*errCode));
+    }
+
+  }
+
+  return ret;
+}
+
+
+/*
+ * Zerofill [from, blk->size) of the block file, for a grown block that
+ * can't be preallocated in the background.
+ */
+int
+glusterBlockZerofillEntry(struct glfs *glfs, blockModifySize *blk,
+                          size_t from, int *errCode, char **errMsg)
+{
+  struct glfs_fd *tgfd;
+  int ret = -1;
+
+
+  tgfd = glusterBlockOpenAt(glfs, GB_OBJ_STOREDIR, blk->gbid,
+                            O_WRONLY | O_SYNC, 0);
+  if (!tgfd) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_open(%s) failed[%s]", blk->gbid,
+        strerror(errno));
+    goto out;
+  }
+
+  ret = glfs_zerofill(tgfd, from, blk->size - from);
+  if (ret) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_zerofill(%s): on volume %s for block %s "
+        "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
+        blk->size, strerror(errno));
+  }
+
+  if (glfs_close(tgfd) != 0) {
+    if (!(*errCode)) {
+      *errCode = errno;
+    }
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_close(%s): on volume %s for block %s failed[%s]",
+        blk->gbid, blk->volume, blk->block_name, strerror(errno));
+    ret = -1;
+  }
+
+ out:
+  if (ret && errMsg && !(*errMsg)) {
+    GB_ASPRINTF (errMsg, "Not able to zerofill storage for %s/%s [%s]",
+                 blk->volume, blk->block_name, strerror(*errCode));
+  }
+
+  return ret;
+}
+
+
+typedef struct gbTrashVol {
+  char volume[255];
+  struct list_head list;
+} gbTrashVol;
+
+
+static pthread_mutex_t trashLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(trashQueue);     /* volumes waiting for the reaper */
+static bool trashReaping;
+static gbTrashStats trashStats;
+
+
+static bool
+glusterBlockTrashQueued(const char *volume)
+{
+  gbTrashVol *tv;
+
+
+  list_for_each_entry(tv, &trashQueue, list) {
+    if (!strcmp(tv->volume, volume)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/*
+ * Note down locally that volume has files in its trash, so that they are
+ * reaped after a restart too, or drop that note once they are all gone.
+ */
+static void
+glusterBlockTrashMark(const char *volume, bool pending)
+{
+  char path[PATH_MAX];
+  int fd;
+
+
+  snprintf(path, sizeof(path), "%s/%s", GB_TRASH_VOLS_DIR, volume);
+  if (!pending) {
+    if (unlink(path) && errno != ENOENT) {
+      LOG("mgmt", GB_LOG_WARNING, "unlink(%s) failed[%s]", path,
+          strerror(errno));
+    }
+    return;
+  }
+
+  if (mkdir(GB_TRASH_VOLS_DIR, 0700) && errno != EEXIST) {
+    LOG("mgmt", GB_LOG_WARNING, "mkdir(%s) failed[%s]", GB_TRASH_VOLS_DIR,
+        strerror(errno));
+    return;
+  }
+  fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd < 0 || fsync(fd)) {
+    LOG("mgmt", GB_LOG_WARNING, "noting down trash of volume %s in %s "
+        "failed[%s]", volume, path, strerror(errno));
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+
+static struct glfs_fd *
+glusterBlockOpenTrashDir(struct glfs *glfs, struct glfs_object **dir)
+{
+  struct glfs_fd *fd;
+  bool retried = false;
+
+
+ retry:
+  *dir = glusterBlockGetObject(glfs, GB_OBJ_TRASHDIR);
+  if (!*dir) {
+    return NULL;
+  }
+
+  fd = glfs_h_opendir(glfs, *dir);
+  if (!fd && errno == ESTALE && !retried) {
+    cacheStaleObject(glfs, GB_OBJ_TRASHDIR, *dir);
+    retried = true;
+    goto retry;
+  }
+
+  return fd;
+}
+
+
+typedef struct gbTrashFile {
+  char name[256];
+  size_t bytes;        /* storage the unlink gives back */
+} gbTrashFile;
+
+
+/*
+ * Unlink the files in the trash of volume, pacing it at trashReapRate.
+ * Returns 0 if the trash was emptied.
+ */
+static int
+glusterBlockTrashReap(char *volume)
+{
+  unsigned long long start = gbTimeNowUsec();
+  unsigned long long begin;
+  unsigned long long pace;
+  unsigned long long took;
+  struct glfs *glfs;
+  struct glfs_object *dir;
+  struct glfs_fd *dirfd;
+  struct dirent buf;
+  struct dirent *entry;
+  struct stat st;
+  gbTrashFile *files = NULL;
+  size_t nfiles = 0;
+  size_t reaped = 0;
+  size_t reclaimed = 0;
+  size_t rate;
+  char *errMsg = NULL;
+  int errCode = 0;
+  bool failed = false;
+  bool unlinked;
+  size_t i;
+
+
+  glfs = glusterBlockVolumeInit(volume, &errCode, &errMsg);
+  if (!glfs) {
+    LOG("mgmt", GB_LOG_WARNING, "not reaping trash of volume %s[%s]", volume,
+        errMsg ? errMsg : strerror(errCode));
+    GB_FREE(errMsg);
+    return -1;
+  }
+
+  dirfd = glusterBlockOpenTrashDir(glfs, &dir);
+  if (!dirfd) {
+    LOG("gfapi", GB_LOG_ERROR, "opening %s on volume %s failed[%s]",
+        GB_TRASHDIR, volume, strerror(errno));
+    failed = true;
+    goto out;
+  }
+
+  while (1) {
+    memset(&st, 0, sizeof(st));
+    if (glfs_readdirplus_r(dirfd, &st, &buf, &entry)) {
+      failed = true;
+      break;
+    }
+    if (!entry) {
+      break;
+    }
+    if (st.st_mode ? !S_ISREG(st.st_mode) : entry->d_type != DT_REG) {
+      continue;
+    }
+    if (GB_REALLOC_N(files, nfiles + 1) < 0) {
+      failed = true;
+      break;
+    }
+    GB_STRCPYSTATIC(files[nfiles].name, entry->d_name);
+    /* a storage file linked in by create stays around */
+    files[nfiles].bytes = st.st_nlink > 1 ? 0 : st.st_blocks * 512;
+    nfiles++;
+  }
+  glfs_closedir(dirfd);
+
+  LOCK(trashLock);
+  for (i = 0; i < nfiles; i++) {
+    trashStats.pendingFiles++;
+    trashStats.pendingBytes += files[i].bytes;
+  }
+  UNLOCK(trashLock);
+
+  for (i = 0; i < nfiles; i++) {
+    begin = gbTimeNowUsec();
+    unlinked = !glfs_h_unlink(glfs, dir, files[i].name) || errno == ENOENT;
+    if (!unlinked) {
+      LOG("gfapi", GB_LOG_ERROR, "glfs_h_unlink(%s/%s) on volume %s "
+          "failed[%s]", GB_TRASHDIR, files[i].name, volume, strerror(errno));
+      failed = true;
+    } else {
+      LOG("mgmt", GB_LOG_DEBUG, "reaped %s/%s of volume %s, %zu bytes in "
+          "%llu msec", GB_TRASHDIR, files[i].name, volume, files[i].bytes,
+          (gbTimeNowUsec() - begin) / 1000);
+      reaped++;
+      reclaimed += files[i].bytes;
+    }
+
+    LOCK(trashLock);
+    trashStats.pendingFiles--;
+    trashStats.pendingBytes -= files[i].bytes;
+    if (unlinked) {
+      trashStats.reapedFiles++;
+      trashStats.reclaimedBytes += files[i].bytes;
+    }
+    UNLOCK(trashLock);
+
+    RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+    rate = gbConf.trashReapRate;
+    RWUNLOCK(gbConf.cfgLock);
+    if (rate && i + 1 < nfiles) {
+      pace = files[i].bytes / 1024 * 1000000 / (rate * 1024);
+      took = gbTimeNowUsec() - begin;
+      if (pace > took) {
+        usleep(pace - took);
+      }
+    }
+  }
+
+  if (reclaimed) {
+    /* let the next create see the space given back */
+    glusterBlockUnreserveSpace(volume, 0, true);
+  }
+
+  LOG("mgmt", GB_LOG_INFO, "reaped %zu of %zu "
+      "file(s) from trash of volume %s, reclaimed %zu bytes in %llu msec",
+      reaped, nfiles, volume, reclaimed, (gbTimeNowUsec() - start) / 1000);
+
+ out:
+  GB_FREE(files);
+  glusterBlockVolumeRelease(volume, glfs);
+
+  return failed ? -1 : 0;
+}
+
+
+static void *
+glusterBlockTrashThread(void *data)
+{
+  gbTrashVol *tv;
+
+
+  while (1) {
+    LOCK(trashLock);
+    if (list_empty(&trashQueue)) {
+      trashReaping = false;
+      UNLOCK(trashLock);
+      break;
+    }
+    tv = list_entry(trashQueue.next, gbTrashVol, list);
+    list_del(&tv->list);
+    UNLOCK(trashLock);
+
+    if (!glusterBlockTrashReap(tv->volume)) {
+      /* unless more was trashed meanwhile */
+      LOCK(trashLock);
+      if (!glusterBlockTrashQueued(tv->volume)) {
+        glusterBlockTrashMark(tv->volume, false);
+      }
+      UNLOCK(trashLock);
+    }
+    GB_FREE(tv);
+  }
+
+  return NULL;
+}
+
+
+/* have the trash of volume reaped in the background */
+static void
+glusterBlockTrashKick(const char *volume)
+{
+  gbTrashVol *tv;
+  pthread_t tid;
+
+
+  LOCK(trashLock);
+  if (glusterBlockTrashQueued(volume) || GB_ALLOC(tv) < 0) {
+    UNLOCK(trashLock);
+    return;
+  }
+  GB_STRCPYSTATIC(tv->volume, volume);
+  list_add_tail(&tv->list, &trashQueue);
+
+  if (!trashReaping) {
+    if (pthread_create(&tid, NULL, glusterBlockTrashThread, NULL)) {
+      LOG("mgmt", GB_LOG_WARNING, "failed to start reaping trash of volume "
+          "%s", volume);
+    } else {
+      pthread_detach(tid);
+      trashReaping = true;
+    }
+  }
+  UNLOCK(trashLock);
+}
+
+
+/*
+ * Reap, in the background, the trash of the volumes that still had some
+ * when the daemon last ran.
+ */
+int
+glusterBlockTrashResume(void)
+{
+  DIR *dir;
+  struct dirent *entry;
+
+
+  dir = opendir(GB_TRASH_VOLS_DIR);
+  if (!dir) {
+    return 0;
+  }
+
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] != '.') {
+      glusterBlockTrashKick(entry->d_name);
+    }
+  }
+  closedir(dir);
+
+  return 0;
+}
+
+
+void
+glusterBlockTrashGetStats(gbTrashStats *st)
+{
+  LOCK(trashLock);
+  *st = trashStats;
+  UNLOCK(trashLock);
+}
+
+
+static int
+glusterBlockTrashAt(struct glfs *glfs, char *gbid)
+{
+  struct glfs_object *storeDir;
+  struct glfs_object *trashDir;
+  bool retried = false;
+  int ret;
+
+
+ retry:
+  storeDir = glusterBlockGetObject(glfs, GB_OBJ_STOREDIR);
+  trashDir = glusterBlockGetObject(glfs, GB_OBJ_TRASHDIR);
+  if (!storeDir || !trashDir) {
+    return -1;
+  }
+
+  ret = glfs_h_rename(glfs, storeDir, gbid, trashDir, gbid);
+  if (ret && errno == ESTALE && !retried) {
+    cacheStaleObject(glfs, GB_OBJ_STOREDIR, storeDir);
+    cacheStaleObject(glfs, GB_OBJ_TRASHDIR, trashDir);
+    retried = true;
+    goto retry;
+  }
+
+  return ret;
+}
+
+
+/*
+ * Move the block file gbid to the trash of volume, for it to be unlinked
+ * in the background, as unlinking a large file on a sharded volume takes
+ * a while. Falls back to unlinking it here if it cannot be moved.
+ */
+int
+glusterBlockDeleteEntry(struct glfs *glfs, char *volume, char *gbid)
+{
+  int ret;
+
+
+  glusterBlockTrashMark(volume, true);
+  ret = glusterBlockTrashAt(glfs, gbid);
+  if (!ret) {
+    glusterBlockTrashKick(volume);
+    return 0;
+  }
+  if (errno != ENOENT) {
+    LOG("gfapi", GB_LOG_WARNING, "moving %s/%s to %s on volume %s failed[%s], "
+        "unlinking it", GB_STOREDIR, gbid, GB_TRASHDIR, volume,
+        strerror(errno));
+    ret = glusterBlockUnlinkAt(glfs, GB_OBJ_STOREDIR, gbid);
+  }
+  if (ret && errno != ENOENT) {
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_unlink(%s/%s) on volume %s failed[%s]",
+        GB_STOREDIR, gbid, volume, strerror(errno));
+  }
+
+  return ret;
+}
+
+
+struct glfs_fd *
+glusterBlockCreateMetaLockFile(struct glfs *glfs, char *volume, int *errCode,
+                               char **errMsg)
+{
+  struct glfs_fd *lkfd;
+  int ret;
+
+
+  ret = glfs_mkdir (glfs, GB_METADIR, 0);
+  if (ret && errno != EEXIST) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR, "glfs_mkdir(%s) on volume %s failed[%s]",
+        GB_METADIR, volume, strerror(*errCode));
+    goto out;
+  }
+
+  lkfd = glusterBlockOpenAt(glfs, GB_OBJ_METADIR, GB_TXLOCKFILE,
+                            O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (!lkfd) {
+    *errCode = errno;
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_creat(%s) on volume %s failed[%s]",
+        GB_TXLOCKFILE, volume, strerror(*errCode));
+    goto out;
+  }
+
+  return lkfd;
+
+ out:
+  GB_ASPRINTF (errMsg, "Not able to create Metadata on volume %s[%s]", volume,
+               strerror (*errCode));
+  return NULL;
+}
+
+int
+glusterBlockDeleteMetaFile(struct glfs *glfs,
+                               char *volume, char *blockname)
+{
+  int ret;
+
+
+  ret = glusterBlockUnlinkAt(glfs, GB_OBJ_METADIR, blockname);
+  if (ret && errno != ENOENT) {
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_unlink(%s/%s) on volume %s failed[%s]",
+        GB_METADIR, blockname, volume, strerror(errno));
+  }
+
+  return ret;
+}
+
+
+void
+blockFreeMetaInfo(MetaInfo *info)
+{
+  int i;
+
+
+  if (!info)
+    return;
+
+  for (i = 0; i < info->nhosts; i++) {
+    GB_FREE(info->list[i]);
+  }
+
+  GB_FREE(info->list);
+  GB_FREE(info);
+}
+
+
+static void
+blockParseRSstatus(MetaInfo *info)
+{
+  size_t i;
+  char *s;
+
+
+  for (i = 0; i < info->nhosts; i++) {
+    if ( (s = strchr(info->list[i]->status, '-')) ) {
+      *s = '\0';
+      s++;
+      sscanf(s, "%zu", &info->list[i]->size);
+    }
+  }
+}
+
+
+static int
+blockStuffMetaInfo(MetaInfo *info, char *line)
+{
+  char *tmp = strdup(line);
+  char *opt = strtok(tmp, ":");
+  bool flag = 0;
+  int  ret = -1;
+  size_t i;
+
+
+  switch (blockMetaKeyEnumParse(opt)) {
+  case GB_META_VOLUME:
+    GB_STRCPYSTATIC(info->volume, strchr(line, ' ') + 1);
+    break;
+  case GB_META_GBID:
+     GB_STRCPYSTATIC(info->gbid, strchr(line, ' ') + 1);
+    break;
+  case GB_META_SIZE:
+    sscanf(strchr(line, ' '), "%zu", &info->size);
+    break;
+  case GB_META_RINGBUFFER:
+    sscanf(strchr(line, ' '), "%zu", &info->rb_size);
+    break;
+  case GB_META_HA:
+    sscanf(strchr(line, ' '), "%zu", &info->mpath);
+    break;
+  case GB_META_ENTRYCREATE:
+    GB_STRCPYSTATIC(info->entry, strchr(line, ' ') + 1);
+    break;
+  case GB_META_PASSWD:
+    GB_STRCPYSTATIC(info->passwd, strchr(line, ' ') + 1);
+    break;
+  case GB_META_PRIOPATH:
+    GB_STRCPYSTATIC(info->prio_path, strchr(line, ' ') + 1);
+    break;
+  case GB_META_DRAINPATH:
+    GB_STRCPYSTATIC(info->drain_path, strchr(line, ' ') + 1);
+    break;
+  case GB_META_PREALLOC:
+    /* STATE[-bytes done] */
+    info->prealloc_done = 0;
+    sscanf(strchr(line, ' '), " %15[^-]-%zu", info->prealloc,
+           &info->prealloc_done);
+    break;
+
+  default:
+    if(!info->list) {
+      if(GB_ALLOC(info->list) < 0)
+        goto out;
+      if(GB_ALLOC(info->list[0]) < 0)
+        goto out;
+      GB_STRCPYSTATIC(info->list[0]->addr, opt);
+      GB_STRCPYSTATIC(info->list[0]->status, strchr(line, ' ') + 1);
+      info->nhosts = 1;
+    } else {
+      if(GB_REALLOC_N(info->list, info->nhosts+1) < 0)
+        goto out;
+      for (i = 0; i < info->nhosts; i++) {
+        if(!strcmp(info->list[i]->addr, opt)) {
+          GB_STRCPYSTATIC(info->list[i]->status, strchr(line, ' ') + 1);
+          flag = 1;
+          break;
+        }
+      }
+      if (!flag) {
+        if(GB_ALLOC(info->list[info->nhosts]) < 0)
+          goto out;
+        GB_STRCPYSTATIC(info->list[info->nhosts]->addr, opt);
+        GB_STRCPYSTATIC(info->list[info->nhosts]->status, strchr(line, ' ') + 1);
+        info->nhosts++;
+      }
+    }
+    break;
+  }
+
+  ret = 0;
+
+ out:
+  GB_FREE(tmp);
+
+  return ret;
+}
+
+
+int
+blockParseValidServers(struct glfs* glfs, char *metafile,
+                       int *errCode, blockServerDefPtr *savelist, char *skiphost)
+{
+  blockServerDefPtr list = *savelist;
+  struct glfs_fd *tgmfd = NULL;
+  char line[1024];
+  int ret = -1;
+  char *h, *s, *sep;
+  size_t i, count = 0;
+  bool match;
+
+
+  tgmfd = glusterBlockOpenAt(glfs, GB_OBJ_METADIR, metafile, O_RDONLY, 0);
+  if (!tgmfd) {
+    if (errCode) {
+      *errCode = errno;
+    }
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_open(%s) failed[%s]", metafile,
+                               strerror(errno));
+    goto out;
+  }
+
+  while ((ret = glfs_read (tgmfd, line, sizeof(line), 0)) > 0) {
+    /* clip till current line */
+    h = line;
+    sep = strchr(h, '\n');
+    *sep = '\0';
+
+    count += strlen(h) + 1;
+
+    /* Part before ':' */
+    sep = strchr(h, ':');
+    *sep = '\0';
+
+    switch (blockMetaKeyEnumParse(h)) {
+    case GB_META_VOLUME:
+    case GB_META_GBID:
+    case GB_META_SIZE:
+    case GB_META_HA:
+    case GB_META_ENTRYCREATE:
+    case GB_META_PASSWD:
+      break;
+    default:
+      if (skiphost && !strcmp(h, skiphost)) {
+        break; /* switch case */
+      }
+      /* Part after ':' and before '\n' */
+      s = sep + 1;
+      while(*s == ' ') {
+        s++;
+      }
+
+      if (!list) {
+        if (blockhostIsValid(s)) {
+          if (GB_ALLOC(list) < 0)
+            goto out;
+          if (GB_ALLOC(list->hosts) < 0)
+            goto out;
+          if (GB_STRDUP(list->hosts[0], h) < 0)
+            goto out;
+
+          list->nhosts = 1;
+        }
+      } else {
+        match = false;
+        for (i = 0; i < list->nhosts; i++) {
+          if (!strcmp(list->hosts[i], h)) {
+            match = true;
+            break; /* for loop */
+          }
+        }
+        if (!match && blockhostIsValid(s)){
+          if(GB_REALLOC_N(list->hosts, list->nhosts+1) < 0)
+            goto out;
+          if (GB_STRDUP(list->hosts[list->nhosts], h) < 0)
+            goto out;
+
+          list->nhosts++;
+        }
+      }
+      break; /* switch case */
+    }
+
+    glfs_lseek(tgmfd, count, SEEK_SET);
+  }
+
+  if (ret < 0 && errCode) { /*Failure from glfs_read*/
+    *errCode = errno;
+    goto out;
+  }
+
+  *savelist = list;
+  list = NULL;
+  ret = 0;
+
+ out:
+  if (tgmfd && glfs_close(tgmfd) != 0) {
+    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): failed[%s]",
+        metafile, strerror(errno));
+  }
+  blockServerDefFree(list);
+
+  return ret;
+}
+
+
+static int
+blockReadMetaInfo(struct glfs* glfs, char* metafile, MetaInfo *info,
+                  int *errCode, unsigned char *gfid)
+{
+  size_t count = 0;
+  struct glfs_fd *tgmfd = NULL;
+  char line[1024];
+  char *tmp;
+  int ret;
+
+  tgmfd = glusterBlockOpenAtGfid(glfs, GB_OBJ_METADIR, metafile, O_RDONLY, 0,
+                                 gfid);
+  if (!tgmfd) {
+    if (errCode) {
+      *errCode = errno;
+    }
+    LOG("gfapi", GB_LOG_ERROR, "glfs_h_open(%s) failed[%s]", metafile,
+                               strerror(errno));
+    ret = -1;
+    goto out;
+  }
+
+  while ((ret = glfs_read (tgmfd, line, sizeof(line), 0)) > 0) {
+    tmp = strtok(line,"\n");
+    count += strlen(tmp) + 1;
+    ret = blockStuffMetaInfo(info, tmp);
+    if (ret) {
+      if (errCode) {
+        *errCode = errno;
+      }
+      LOG("gfapi", GB_LOG_ERROR,
+          "blockStuffMetaInfo: on volume %s for block %s failed[%s]",
+          info->volume, metafile, strerror(errno));
+      goto out;
+    }
+    glfs_lseek(tgmfd, count, SEEK_SET);
+  }
+  if (ret < 0 && errCode) {/*Failure from glfs_read*/
+    *errCode = errno;
+    goto out;
+  }
+  blockParseRSstatus(info);
+
+ out:
+  if (tgmfd && glfs_close(tgmfd) != 0) {
+    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        metafile, info->volume, strerror(errno));
+  }
+
+  return ret;
+}
+
+
+int
+blockGetMetaInfo(struct glfs* glfs, char* metafile, MetaInfo *info,
+                 int *errCode)
+{
+  return blockReadMetaInfo(glfs, metafile, info, errCode, NULL);
+}
+
+
+static bool
+blockMetaCacheValid(gbMetaCacheEntry *ent, struct stat *st)
+{
+  return ent->size == st->st_size &&
+         ent->mtime.tv_sec == st->st_mtim.tv_sec &&
+         ent->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/*
+ * Like blockGetMetaInfo(), but the MetaInfo read earlier is used instead of
+ * reading the metafile again if upcalls vouch for it, or if st (the stat
+ * of the metafile seen by a directory scan, may be NULL) shows the same
+ * size and mtime.
+ */
+int
+blockGetMetaInfoCached(struct glfs *glfs, char *volume, char *metafile,
+                       struct stat *st, MetaInfo *info, int *errCode)
+{
+  unsigned char gfid[GFAPI_HANDLE_LENGTH];
+  gbMetaCacheEntry *ent;
+  gbMetaVol *vol;
+  unsigned long seq;
+  bool valid;
+  int ret = -1;
+
+
+  if (st && !st->st_mtim.tv_sec) {
+    st = NULL;
+  }
+
+  LOCK(metaCacheLock);
+  ent = blockMetaCacheLookup(volume, metafile);
+  if (ent) {
+    vol = blockMetaVolLookup(volume, false);
+    valid = (ent->trustedUntil > time(NULL) && vol &&
+             vol->watchFs == glfs && ent->epoch == vol->epoch) ||
+            (st && blockMetaCacheValid(ent, st));
+    if (valid) {
+      list_move(&ent->lru, &metaCacheLru);
+      ret = blockCopyMetaInfo(info, ent->info);
+    }
+  }
+  seq = metaCacheSeq;
+  UNLOCK(metaCacheLock);
+  if (!ret) {
+    return 0;
+  }
+  memset(info, 0, sizeof(*info));
+
+  memset(gfid, 0, sizeof(gfid));
+  ret = blockReadMetaInfo(glfs, metafile, info, errCode, gfid);
+  if (!ret) {
+    blockMetaCacheStore(glfs, volume, metafile, st, gfid[0] || gfid[15] ?
+                        gfid : NULL, seq, info);
+  }
+
+  return ret;
+}
+
+
+/* metafiles are named after the blocks: alphanumerics, '-' and '_' */
+static bool
+glusterBlockIsMetaFileName(const char *name)
+{
+  if (!*name) {
+    return false;
+  }
+  for (; *name; name++) {
+    if (!isalnum((unsigned char)*name) && *name != '_' && *name != '-') {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+static struct glfs_fd *
+glusterBlockOpenMetaDir(struct glfs *glfs)
+{
+  struct glfs_object *dir;
+  struct glfs_fd *fd;
+  bool retried = false;
+
+
+ retry:
+  dir = glusterBlockGetObject(glfs, GB_OBJ_METADIR);
+  if (!dir) {
+    return NULL;
+  }
+
+  fd = glfs_h_opendir(glfs, dir);
+  if (!fd && errno == ESTALE && !retried) {
+    cacheStaleObject(glfs, GB_OBJ_METADIR, dir);
+    retried = true;
+    goto retry;
+  }
+
+  return fd;
+}
+
+
+/*
+ * Next metafile in the directory, NULL at the end or on error. The stat of
+ * the file comes back with the name, so anything but regular files (".",
+ * "..", subdirectories) is skipped without a lookup, as are the lock and
+ * prio files.
+ */
+static struct dirent *
+glusterBlockReadMetaDir(struct glfs_fd *dirfd, struct dirent *buf,
+                        struct stat *st, bool *failed)
+{
+  struct dirent *entry;
+
+
+  while (1) {
+    memset(st, 0, sizeof(*st));
+    if (glfs_readdirplus_r(dirfd, st, buf, &entry)) {
+      *failed = true;
+      return NULL;
+    }
+    if (!entry) {
+      return NULL;
+    }
+
+    if (st->st_mode) {
+      if (!S_ISREG(st->st_mode)) {
+        continue;
+      }
+    } else if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+      continue;
+    }
+
+    if (glusterBlockIsMetaFileName(entry->d_name)) {
+      return entry;
+    }
+  }
+}
+
+
+/*
+ * Start a walk over the metafiles of volume. The listing of an earlier
+ * walk is used if upcalls vouch for it, else /block-meta is read.
+ */
+int
+glusterBlockMetaScanOpen(struct glfs *glfs, char *volume, gbMetaScan *scan)
+{
+  strToCharArrayDefPtr names = NULL;
+  gbMetaVol *vol;
+  size_t i;
+
+
+  memset(scan, 0, sizeof(*scan));
+  scan->glfs = glfs;
+  scan->volume = volume;
+
+  LOCK(metaCacheLock);
+  vol = blockMetaVolLookup(volume, false);
+  if (vol && vol->names && vol->namesUntil > time(NULL) &&
+      vol->watchFs == glfs) {
+    names = vol->names;
+    if (GB_ALLOC(scan->names) < 0 ||
+        GB_ALLOC_N(scan->names->data, names->len ? names->len : 1) < 0) {
+      names = NULL;
+    }
+    for (i = 0; names && i < names->len; i++) {
+      if (GB_STRDUP(scan->names->data[i], names->data[i]) < 0) {
+        names = NULL;
+        break;
+      }
+      scan->names->len++;
+    }
+    if (names) {
+      UNLOCK(metaCacheLock);
+      scan->cached = true;
+      return 0;
     }
+    strToCharArrayDefFree(scan->names);
+    scan->names = NULL;
+  }
+  scan->seq = metaCacheSeq;
+  UNLOCK(metaCacheLock);
+
+  scan->dirfd = glusterBlockOpenMetaDir(glfs);
+  if (!scan->dirfd) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* keep the listing just read for later walks, if upcalls cover it */
+static void
+glusterBlockMetaScanSave(gbMetaScan *scan)
+{
+  gbMetaVol *vol;
+  time_t ttl;
+
+
+  if (!scan->names && GB_ALLOC(scan->names) < 0) {
+    return;
+  }
+
+  LOCK(metaCacheLock);
+  vol = blockMetaVolLookup(scan->volume, false);
+  ttl = blockMetaCacheTrustTtl(vol, scan->glfs);
+  if (ttl && vol->hasDirGfid && scan->seq == metaCacheSeq) {
+    strToCharArrayDefFree(vol->names);
+    vol->names = scan->names;
+    vol->namesUntil = time(NULL) + ttl;
+    scan->names = NULL;
+  }
+  UNLOCK(metaCacheLock);
+}
+
+
+/*
+ * Name of the next metafile, NULL at the end. *st is the stat of it, or
+ * NULL when the name came from the cached listing.
+ */
+char *
+glusterBlockMetaScanNext(gbMetaScan *scan, struct stat **st)
+{
+  struct dirent *entry;
+  bool failed = false;
+
+
+  *st = NULL;
+  if (scan->cached) {
+    if (scan->next < scan->names->len) {
+      return scan->names->data[scan->next++];
+    }
+    return NULL;
+  }
+  if (!scan->dirfd) {
+    return NULL;
+  }
+
+  entry = glusterBlockReadMetaDir(scan->dirfd, &scan->buf, &scan->st, &failed);
+  if (!entry) {
+    if (!failed && !scan->failed) {
+      glusterBlockMetaScanSave(scan);
+    }
+    glfs_closedir(scan->dirfd);
+    scan->dirfd = NULL;
+    return NULL;
+  }
+
+  /* remember the name in case the walk completes */
+  if (!scan->failed) {
+    if (!scan->names && GB_ALLOC(scan->names) < 0) {
+      scan->failed = true;
+    } else if (GB_REALLOC_N(scan->names->data, scan->names->len + 1) < 0 ||
+               GB_STRDUP(scan->names->data[scan->names->len],
+                         entry->d_name) < 0) {
+      scan->failed = true;
+    } else {
+      scan->names->len++;
+    }
+  }
+
+  *st = &scan->st;
+  return entry->d_name;
+}
+
+
+void
+glusterBlockMetaScanClose(gbMetaScan *scan)
+{
+  if (scan->dirfd) {
+    glfs_closedir(scan->dirfd);
+    scan->dirfd = NULL;
+  }
+  strToCharArrayDefFree(scan->names);
+  scan->names = NULL;
+}
+
+
+/*
+ * The active path counters of all the hosts live in a single xattr of the
+ * prio file, as "<host> <count>\n" lines, so that picking a path costs one
+ * getxattr and an update is one getxattr + setxattr of the whole record.
+ * Callers hold the volume metadata lock, which serializes the updates
+ * across all the masters.
+ *
+ * Older versions kept one GB_LB_ATTR_PREFIX.<host> xattr per host; those
+ * are folded into the record the first time it is written.
+ */
+static char *
+blockPrioRecordGet(struct glfs *glfs, char *volume, const char *attr,
+                   bool *missing)
+{
+  char *buf = NULL;
+  ssize_t ret;
+
+
+  if (GB_ALLOC_N(buf, GB_LB_RECORD_MAX + 1) < 0) {
+    return NULL;
+  }
+
+  ret = glusterBlockPrioXattr(glfs, attr, buf, GB_LB_RECORD_MAX, false);
+  if (ret < 0) {
+    if (errno != ENODATA) {
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_h_getxattrs(%s) on volume %s for prio file %s failed[%s]",
+          attr ? attr : "<list>", volume, GB_PRIO_FILE, strerror(errno));
+      GB_FREE(buf);
+      return NULL;
+    }
+    ret = 0;
+  }
+  if (missing) {
+    *missing = (ret == 0);
+  }
+  buf[ret] = '\0';
+
+  return buf;
+}
+
+
+/* count of host in the record, false if the host has no line */
+static bool
+blockPrioRecordCount(const char *rec, const char *host, size_t *count)
+{
+  size_t len = strlen(host);
+  const char *line = rec;
+
+
+  while (*line) {
+    if (!strncmp(line, host, len) && line[len] == ' ') {
+      *count = strtoul(line + len + 1, NULL, 10);
+      return true;
+    }
+    line = strchrnul(line, '\n');
+    if (*line) {
+      line++;
+    }
+  }
+
+  return false;
+}
+
+
+/* the count of host as kept by older versions, 0 if it has none */
+static size_t
+blockPrioLegacyCount(struct glfs *glfs, char *volume, const char *host)
+{
+  char attr[256];
+  char buf[1024] = {'\0', };
+  size_t count = 0;
+
+
+  snprintf(attr, sizeof(attr), "%s.%s", GB_LB_ATTR_PREFIX, host);
+  if (glusterBlockPrioXattr(glfs, attr, buf, sizeof(buf) - 1, false) < 0) {
+    if (errno != ENODATA) {
+      LOG("gfapi", GB_LOG_ERROR,
+          "glfs_h_getxattrs(%s) on volume %s for prio file %s failed[%s]",
+          attr, volume, GB_PRIO_FILE, strerror(errno));
+    }
+    return 0;
+  }
+  sscanf(buf, "%zu", &count);
+
+  return count;
+}
+
+
+/* build the record from the per host xattrs of older versions */
+static char *
+blockPrioLegacyImport(struct glfs *glfs, char *volume)
+{
+  gbStrBuf sb = {0};
+  char *names;
+  char *name;
+  char *rec = NULL;
+  size_t len = strlen(GB_LB_ATTR_PREFIX ".");
+
+
+  /* a NULL attr lists the xattr names, '\0' separated */
+  names = blockPrioRecordGet(glfs, volume, NULL, NULL);
+  if (!names) {
+    return NULL;
+  }
+
+  for (name = names; *name; name += strlen(name) + 1) {
+    if (strncmp(name, GB_LB_ATTR_PREFIX ".", len) ||
+        !strcmp(name, GB_LB_RECORD_ATTR) || !strcmp(name, GB_LB_DRAIN_ATTR)) {
+      continue;
+    }
+    if (gbStrBufAppendf(&sb, "%s %zu\n", name + len,
+                        blockPrioLegacyCount(glfs, volume, name + len)) < 0) {
+      goto out;
+    }
+  }
+
+  rec = gbStrBufDetach(&sb);
+  if (!rec) {
+    GB_STRDUP(rec, "");
+  }
+
+ out:
+  gbStrBufFree(&sb);
+  GB_FREE(names);
+  return rec;
+}
+
+
+static void
+blockPrioRecordUpdate(struct glfs *glfs, char *volume, char *addr, int delta)
+{
+  gbStrBuf sb = {0};
+  char *rec = NULL;
+  char *line;
+  char *sptr = NULL;
+  size_t len = strlen(addr);
+  size_t count;
+  bool missing;
+  bool found = false;
+
+
+  rec = blockPrioRecordGet(glfs, volume, GB_LB_RECORD_ATTR, &missing);
+  if (rec && missing) {
+    GB_FREE(rec);
+    rec = blockPrioLegacyImport(glfs, volume);
+  }
+  if (!rec) {
+    return;
+  }
+
+  for (line = strtok_r(rec, "\n", &sptr); line;
+       line = strtok_r(NULL, "\n", &sptr)) {
+    if (!strncmp(line, addr, len) && line[len] == ' ') {
+      count = strtoul(line + len + 1, NULL, 10);
+      if (delta > 0) {
+        count++;
+      } else if (count) {
+        count--;
+      }
+      found = true;
+      if (gbStrBufAppendf(&sb, "%s %zu\n", addr, count) < 0) {
+        goto out;
+      }
+    } else if (gbStrBufAppendf(&sb, "%s\n", line) < 0) {
+      goto out;
+    }
+  }
+  if (!found) {
+    if (delta < 0) {
+      /* nothing to release, and no need to persist a zero */
+      goto out;
+    }
+    if (gbStrBufAppendf(&sb, "%s 1\n", addr) < 0) {
+      goto out;
+    }
+  }
+
+  if (sb.len > GB_LB_RECORD_MAX) {
+    LOG("gfapi", GB_LOG_ERROR,
+        "prio record of volume %s outgrew %d bytes, not updating %s",
+        volume, GB_LB_RECORD_MAX, addr);
+    goto out;
+  }
 
-    /* dirty hack to check if the file is zerofilled ? */
-    if ((blk->size > sb.st_size) && (sb.st_size <= 512 * sb.st_blocks)) {
-      if (glfs_zerofill(tgfd, sb.st_size, blk->size - sb.st_size)) {
-        *errCode = errno;
-        LOG("gfapi", GB_LOG_ERROR,
-            "glfs_zerofill(%s): on volume %s for block %s "
-            "of size %zu failed[%s]", blk->gbid, blk->volume, blk->block_name,
-            blk->size, strerror(errno));
-        ret = -1;
-        goto close;
-      }
+  if (glusterBlockPrioXattr(glfs, GB_LB_RECORD_ATTR, sb.buf, sb.len, true) < 0) {
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_h_setxattrs(%s) on volume %s for prio file %s failed[%s]",
+        GB_LB_RECORD_ATTR, volume, GB_PRIO_FILE, strerror(errno));
+  }
+
+ out:
+  gbStrBufFree(&sb);
+  GB_FREE(rec);
+}
+
+
+/* active path counts of the hosts in list, as recorded in the prio file */
+int
+blockGetPrioCounts(struct glfs* glfs, char *volume, blockServerDefPtr list,
+                   size_t *counts)
+{
+  char *rec;
+  bool missing;
+  size_t i;
+
+
+  rec = blockPrioRecordGet(glfs, volume, GB_LB_RECORD_ATTR, &missing);
+  if (!rec) {
+    return -1;
+  }
+
+  for (i = 0; i < list->nhosts; i++) {
+    if (!blockPrioRecordCount(rec, list->hosts[i], &counts[i])) {
+      /* not written since the upgrade yet */
+      counts[i] = missing ? blockPrioLegacyCount(glfs, volume, list->hosts[i]) : 0;
     }
   }
 
- close:
-  if (tgfd && glfs_close(tgfd) != 0) {
-    if (!(*errCode)) {
-      *errCode = errno;
+  GB_FREE(rec);
+  return 0;
+}
+
+
+/* replace the whole record, e.g. with the counts recomputed from the metafiles */
+int
+blockSetPrioCounts(struct glfs* glfs, char *volume, char **hosts,
+                   size_t *counts, size_t nhosts)
+{
+  gbStrBuf sb = {0};
+  size_t i;
+  int ret = -1;
+
+
+  for (i = 0; i < nhosts; i++) {
+    if (counts[i] && gbStrBufAppendf(&sb, "%s %zu\n", hosts[i], counts[i]) < 0) {
+      goto out;
     }
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_close(%s): on volume %s for block %s failed[%s]",
-        blk->gbid, blk->volume, blk->block_name, strerror(errno));
-    ret = -1;
   }
 
+  if (sb.len > GB_LB_RECORD_MAX) {
+    LOG("gfapi", GB_LOG_ERROR, "prio record of volume %s outgrew %d bytes",
+        volume, GB_LB_RECORD_MAX);
+    goto out;
+  }
+
+  /* with no paths at all, a blank line still tells the record exists */
+  if (!sb.len && gbStrBufAppendf(&sb, "\n") < 0) {
+    goto out;
+  }
+
+  ret = glusterBlockPrioXattr(glfs, GB_LB_RECORD_ATTR, sb.buf, sb.len, true);
+  if (ret < 0) {
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_h_setxattrs(%s) on volume %s for prio file %s failed[%s]",
+        GB_LB_RECORD_ATTR, volume, GB_PRIO_FILE, strerror(errno));
+    goto out;
+  }
+  ret = 0;
 
  out:
-  if (ret) {
-    if (errMsg && !(*errMsg)) {
-      GB_ASPRINTF (errMsg, "Not able to resize storage for %s/%s [%s]",
-                   blk->volume, blk->block_name, strerror(*errCode));
+  gbStrBufFree(&sb);
+  return ret;
+}
+
+
+/* true if rec has a line with just host on it */
+static bool
+blockDrainRecordHas(const char *rec, const char *host)
+{
+  size_t len = strlen(host);
+  const char *line = rec;
+
+
+  while (*line) {
+    if (!strncmp(line, host, len) && (line[len] == '\n' || !line[len])) {
+      return true;
     }
+    line = strchrnul(line, '\n');
+    if (*line) {
+      line++;
+    }
+  }
+
+  return false;
+}
+
+
+/*
+ * Drained hosts of a volume are kept as "<host>\n" lines in another xattr
+ * of the prio file, new prio paths are not placed on them till undrained.
+ */
+int
+blockGetDrained(struct glfs* glfs, char *volume, blockServerDefPtr list,
+                bool *drained)
+{
+  char *rec;
+  size_t i;
 
+
+  rec = blockPrioRecordGet(glfs, volume, GB_LB_DRAIN_ATTR, NULL);
+  if (!rec) {
+    return -1;
   }
 
-  return ret;
+  for (i = 0; i < list->nhosts; i++) {
+    drained[i] = blockDrainRecordHas(rec, list->hosts[i]);
+  }
+
+  GB_FREE(rec);
+  return 0;
 }
 
 
 int
-glusterBlockDeleteEntry(struct glfs *glfs, char *volume, char *gbid)
+blockSetDrained(struct glfs* glfs, char *volume, char *host, bool drained)
 {
-  int ret;
+  gbStrBuf sb = {0};
+  char *rec;
+  char *line;
+  char *sptr = NULL;
+  int ret = -1;
 
 
-  ret = glfs_chdir (glfs, GB_STOREDIR);
-  if (ret) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_chdir(%s) on volume %s failed[%s]",
-        GB_STOREDIR, volume, strerror(errno));
+  rec = blockPrioRecordGet(glfs, volume, GB_LB_DRAIN_ATTR, NULL);
+  if (!rec) {
+    return -1;
+  }
+
+  if (blockDrainRecordHas(rec, host) == drained) {
+    ret = 0;
     goto out;
   }
 
-  ret = glfs_unlink(glfs, gbid);
-  if (ret && errno != ENOENT) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_unlink(%s) on volume %s failed[%s]",
-        gbid, volume, strerror(errno));
+  for (line = strtok_r(rec, "\n", &sptr); line;
+       line = strtok_r(NULL, "\n", &sptr)) {
+    if (strcmp(line, host) && gbStrBufAppendf(&sb, "%s\n", line) < 0) {
+      goto out;
+    }
   }
+  if (drained && gbStrBufAppendf(&sb, "%s\n", host) < 0) {
+    goto out;
+  }
+  if (!sb.len && gbStrBufAppendf(&sb, "\n") < 0) {
+    goto out;
+  }
+
+  if (sb.len > GB_LB_RECORD_MAX ||
+      glusterBlockPrioXattr(glfs, GB_LB_DRAIN_ATTR, sb.buf, sb.len, true) < 0) {
+    LOG("gfapi", GB_LOG_ERROR,
+        "glfs_h_setxattrs(%s) on volume %s for prio file %s failed[%s]",
+        GB_LB_DRAIN_ATTR, volume, GB_PRIO_FILE, strerror(errno));
+    goto out;
+  }
+  ret = 0;
 
  out:
+  gbStrBufFree(&sb);
+  GB_FREE(rec);
   return ret;
 }
 
 
-struct glfs_fd *
-glusterBlockCreateMetaLockFile(struct glfs *glfs, char *volume, int *errCode,
-                               char **errMsg)
+void
+blockGetPrioPath(struct glfs* glfs, char *volume, blockServerDefPtr list,
+                 char *prio_path, size_t prio_len)
 {
-  struct glfs_fd *lkfd;
-  int ret;
+  size_t *counts = NULL;
+  size_t index = 0;
+  size_t i;
 
 
-  ret = glfs_mkdir (glfs, GB_METADIR, 0);
-  if (ret && errno != EEXIST) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR, "glfs_mkdir(%s) on volume %s failed[%s]",
-        GB_METADIR, volume, strerror(*errCode));
-    goto out;
+  if (!list->nhosts || GB_ALLOC_N(counts, list->nhosts) < 0) {
+    return;
   }
 
-  ret = glfs_chdir (glfs, GB_METADIR);
-  if (ret) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR, "glfs_chdir(%s) on volume %s failed[%s]",
-        GB_METADIR, volume, strerror(*errCode));
+  if (blockGetPrioCounts(glfs, volume, list, counts)) {
     goto out;
   }
 
-  lkfd = glfs_creat(glfs, GB_TXLOCKFILE, O_RDWR, S_IRUSR | S_IWUSR);
-  if (!lkfd) {
-    *errCode = errno;
-    LOG("gfapi", GB_LOG_ERROR, "glfs_creat(%s) on volume %s failed[%s]",
-        GB_TXLOCKFILE, volume, strerror(*errCode));
-    goto out;
+  for (i = 1; i < list->nhosts; i++) {
+    if (counts[i] < counts[index]) {
+      index = i;
+    }
   }
 
-  return lkfd;
+  GB_STRCPY(prio_path, list->hosts[index], prio_len);
 
  out:
-  GB_ASPRINTF (errMsg, "Not able to create Metadata on volume %s[%s]", volume,
-               strerror (*errCode));
-  return NULL;
+  GB_FREE(counts);
+  return;
+}
+
+
+void
+blockIncPrioAttr(struct glfs* glfs, char *volume, char *addr)
+{
+  blockPrioRecordUpdate(glfs, volume, addr, 1);
+}
+
+
+void
+blockDecPrioAttr(struct glfs* glfs, char *volume, char *addr)
+{
+  blockPrioRecordUpdate(glfs, volume, addr, -1);
 }
 
+
 int
-glusterBlockDeleteMetaFile(struct glfs *glfs,
-                               char *volume, char *blockname)
+blockGetAddrStatusFromInfo(MetaInfo *info, char *addr)
 {
-  int ret;
+  size_t i;
 
 
-  ret = glfs_chdir (glfs, GB_METADIR);
-  if (ret) {
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_chdir(%s) on volume %s for block %s failed[%s]",
-        GB_METADIR, volume, blockname, strerror(errno));
+  if (!addr) {
     goto out;
   }
 
-  ret = glfs_unlink(glfs, blockname);
-  if (ret && errno != ENOENT) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_unlink(%s) on volume %s failed[%s]",
-        blockname, volume, strerror(errno));
-    goto out;
+  for (i = 0; i < info->nhosts; i++) {
+    if (!strcmp(addr, info->list[i]->addr)) {
+      return blockMetaStatusEnumParse(info->list[i]->status);
+    }
   }
 
  out:
-  return ret;
+  return GB_METASTATUS_MAX;
 }
 
 
-void
-blockFreeMetaInfo(MetaInfo *info)
+typedef struct gbPreallocJob {
+  char volume[255];
+  char block[255];
+  char gbid[38];
+  size_t start;          /* [start, end) is preallocated */
+  size_t end;
+  size_t step;           /* bytes between progress records */
+  size_t recorded;       /* done, as last recorded in the metafile */
+  size_t done;           /* end of the range preallocated from start */
+  size_t nchunks;
+  size_t next;           /* next chunk handed to a worker */
+  size_t low;            /* first chunk not preallocated yet */
+  bool *chunkDone;
+  size_t running;        /* workers */
+  size_t reserved;       /* space set aside for the tail of the range */
+  bool cancel;
+  int errCode;
+  bool finished;
+  size_t refs;
+  struct glfs *glfs;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct list_head list;
+} gbPreallocJob;
+
+
+static pthread_mutex_t preallocLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t preallocRecordLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(preallocJobs);
+
+
+static void
+glusterBlockPreallocJournalPath(const char *gbid, char *path, size_t len)
 {
-  int i;
+  snprintf(path, len, "%s/%s", GB_PREALLOC_DIR, gbid);
+}
 
 
-  if (!info)
-    return;
+/* note the job down, so that it is resumed if the daemon goes away */
+static void
+glusterBlockPreallocJournalSave(gbPreallocJob *job)
+{
+  char path[PATH_MAX];
 
-  for (i = 0; i < info->nhosts; i++) {
-    GB_FREE(info->list[i]);
+
+  glusterBlockPreallocJournalPath(job->gbid, path, sizeof(path));
+  if (gbWriteFileAtomic(path, "%s\n%s\n", job->volume, job->block)) {
+    LOG("mgmt", GB_LOG_WARNING, "saving preallocation journal of block %s "
+        "on volume %s to %s failed[%s]", job->block, job->volume, path,
+        strerror(errno));
   }
+}
 
-  GB_FREE(info->list);
-  GB_FREE(info);
+
+static void
+glusterBlockPreallocJournalDrop(const char *gbid)
+{
+  char path[PATH_MAX];
+
+
+  glusterBlockPreallocJournalPath(gbid, path, sizeof(path));
+  if (unlink(path) && errno != ENOENT) {
+    LOG("mgmt", GB_LOG_WARNING, "unlink(%s) failed[%s]", path,
+        strerror(errno));
+  }
 }
 
 
 static void
-blockParseRSstatus(MetaInfo *info)
+glusterBlockPreallocJobUnref(gbPreallocJob *job)
 {
-  size_t i;
-  char *s;
+  bool last;
 
 
-  for (i = 0; i < info->nhosts; i++) {
-    if ( (s = strchr(info->list[i]->status, '-')) ) {
-      *s = '\0';
-      s++;
-      sscanf(s, "%zu", &info->list[i]->size);
-    }
+  LOCK(job->lock);
+  last = !--job->refs;
+  UNLOCK(job->lock);
+
+  if (last) {
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    GB_FREE(job->chunkDone);
+    GB_FREE(job);
   }
 }
 
 
+/*
+ * Record the state of the preallocation of block gbid in its metafile,
+ * under the metalock. Returns 1 without recording anything if job is given
+ * and was cancelled, or if the block is gone (or is another one of the
+ * same name by now), 0 once recorded and -1 on failure.
+ */
 static int
-blockStuffMetaInfo(MetaInfo *info, char *line)
+glusterBlockPreallocRecordOn(struct glfs *glfs, char *volume, char *block,
+                             char *gbid, gbPreallocJob *job,
+                             const char *state, size_t done)
 {
-  char *tmp = strdup(line);
-  char *opt = strtok(tmp, ":");
-  bool flag = 0;
-  int  ret = -1;
-  size_t i;
+  struct glfs_fd *lkfd;
+  MetaInfo *info = NULL;
+  char *errMsg = NULL;
+  int errCode = 0;
+  bool cancel = false;
+  int ret = -1;
 
 
-  switch (blockMetaKeyEnumParse(opt)) {
-  case GB_META_VOLUME:
-    GB_STRCPYSTATIC(info->volume, strchr(line, ' ') + 1);
-    break;
-  case GB_META_GBID:
-     GB_STRCPYSTATIC(info->gbid, strchr(line, ' ') + 1);
-    break;
-  case GB_META_SIZE:
-    sscanf(strchr(line, ' '), "%zu", &info->size);
-    break;
-  case GB_META_RINGBUFFER:
-    sscanf(strchr(line, ' '), "%zu", &info->rb_size);
-    break;
-  case GB_META_HA:
-    sscanf(strchr(line, ' '), "%zu", &info->mpath);
-    break;
-  case GB_META_ENTRYCREATE:
-    GB_STRCPYSTATIC(info->entry, strchr(line, ' ') + 1);
-    break;
-  case GB_META_PASSWD:
-    GB_STRCPYSTATIC(info->passwd, strchr(line, ' ') + 1);
-    break;
-  case GB_META_PRIOPATH:
-    GB_STRCPYSTATIC(info->prio_path, strchr(line, ' ') + 1);
-    break;
+  lkfd = glusterBlockCreateMetaLockFile(glfs, volume, &errCode, &errMsg);
+  if (!lkfd) {
+    goto out;
+  }
 
-  default:
-    if(!info->list) {
-      if(GB_ALLOC(info->list) < 0)
-        goto out;
-      if(GB_ALLOC(info->list[0]) < 0)
-        goto out;
-      GB_STRCPYSTATIC(info->list[0]->addr, opt);
-      GB_STRCPYSTATIC(info->list[0]->status, strchr(line, ' ') + 1);
-      info->nhosts = 1;
-    } else {
-      if(GB_REALLOC_N(info->list, info->nhosts+1) < 0)
-        goto out;
-      for (i = 0; i < info->nhosts; i++) {
-        if(!strcmp(info->list[i]->addr, opt)) {
-          GB_STRCPYSTATIC(info->list[i]->status, strchr(line, ' ') + 1);
-          flag = 1;
-          break;
-        }
-      }
-      if (!flag) {
-        if(GB_ALLOC(info->list[info->nhosts]) < 0)
-          goto out;
-        GB_STRCPYSTATIC(info->list[info->nhosts]->addr, opt);
-        GB_STRCPYSTATIC(info->list[info->nhosts]->status, strchr(line, ' ') + 1);
-        info->nhosts++;
-      }
-    }
-    break;
+  GB_METALOCK_OR_GOTO(lkfd, volume, errCode, errMsg, out);
+
+  if (job) {
+    LOCK(job->lock);
+    cancel = job->cancel;
+    UNLOCK(job->lock);
+  }
+  if (cancel) {
+    ret = 1;
+    goto unlock;
+  }
+
+  if (GB_ALLOC(info) < 0) {
+    goto unlock;
+  }
+  if (blockGetMetaInfo(glfs, block, info, &errCode) ||
+      strcmp(info->gbid, gbid)) {
+    LOG("mgmt", GB_LOG_INFO, "block %s on volume %s is gone, stopping its "
+        "preallocation", block, volume);
+    ret = 1;
+    goto unlock;
   }
 
-  ret = 0;
+  if (done) {
+    GB_METAUPDATE_OR_GOTO(preallocRecordLock, glfs, block, volume,
+                          ret, errMsg, unlock, "PREALLOC: %s-%zu\n",
+                          state, done);
+  } else {
+    GB_METAUPDATE_OR_GOTO(preallocRecordLock, glfs, block, volume,
+                          ret, errMsg, unlock, "PREALLOC: %s\n", state);
+  }
+
+ unlock:
+  GB_METAUNLOCK(lkfd, volume, errCode, errMsg);
 
  out:
-  GB_FREE(tmp);
+  if (lkfd && glfs_close(lkfd) != 0) {
+    LOG("mgmt", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
+        GB_TXLOCKFILE, volume, strerror(errno));
+  }
+  if (ret < 0) {
+    LOG("mgmt", GB_LOG_WARNING, "recording preallocation state %s of "
+        "block %s on volume %s failed[%s]", state, block, volume,
+        errMsg ? errMsg : strerror(errCode));
+  }
+  blockFreeMetaInfo(info);
+  GB_FREE(errMsg);
 
   return ret;
 }
 
 
-int
-blockParseValidServers(struct glfs* glfs, char *metafile,
-                       int *errCode, blockServerDefPtr *savelist, char *skiphost)
+static int
+glusterBlockPreallocRecord(gbPreallocJob *job, const char *state, size_t done)
 {
-  blockServerDefPtr list = *savelist;
-  char fpath[PATH_MAX] = {0};
-  struct glfs_fd *tgmfd = NULL;
-  char line[1024];
-  int ret = -1;
-  char *h, *s, *sep;
-  size_t i, count = 0;
-  bool match;
+  return glusterBlockPreallocRecordOn(job->glfs, job->volume, job->block,
+                                      job->gbid, job, state, done);
+}
 
 
-  snprintf(fpath, sizeof fpath, "%s/%s", GB_METADIR, metafile);
-  tgmfd = glfs_open(glfs, fpath, O_RDONLY);
-  if (!tgmfd) {
-    if (errCode) {
-      *errCode = errno;
+/*
+ * Preallocate the chunks handed out by the job through an fd of our own,
+ * until there are none left, one fails or the job is cancelled. Allocates
+ * rather than zerofills, as the target may be written to meanwhile.
+ */
+static void *
+glusterBlockPreallocWorker(void *data)
+{
+  gbPreallocJob *job = data;
+  struct glfs_fd *fd;
+  size_t i;
+  size_t off;
+  size_t len;
+  int ret;
+
+
+  fd = glusterBlockOpenAt(job->glfs, GB_OBJ_STOREDIR, job->gbid,
+                          O_WRONLY | O_SYNC, 0);
+
+  LOCK(job->lock);
+  if (!fd) {
+    if (!job->errCode) {
+      job->errCode = errno;
     }
-    LOG("gfapi", GB_LOG_ERROR, "glfs_open(%s) failed[%s]", metafile,
-                               strerror(errno));
-    goto out;
+    LOG("gfapi", GB_LOG_ERROR, "glfs_open(%s) on volume %s for block %s "
+        "failed[%s]", job->gbid, job->volume, job->block, strerror(errno));
   }
+  while (fd && !job->cancel && !job->errCode && job->next < job->nchunks) {
+    i = job->next++;
+    UNLOCK(job->lock);
 
-  while ((ret = glfs_read (tgmfd, line, sizeof(line), 0)) > 0) {
-    /* clip till current line */
-    h = line;
-    sep = strchr(h, '\n');
-    *sep = '\0';
+    off = job->start + i * (size_t)GB_PREALLOC_CHUNK;
+    len = job->end - off < GB_PREALLOC_CHUNK ? job->end - off :
+          GB_PREALLOC_CHUNK;
+    ret = glfs_fallocate(fd, 0, off, len) ? errno : 0;
 
-    count += strlen(h) + 1;
+    LOCK(job->lock);
+    if (ret) {
+      if (!job->errCode) {
+        job->errCode = ret;
+      }
+      LOG("gfapi", GB_LOG_ERROR, "glfs_fallocate(%s): on volume %s for block "
+          "%s at %zu of size %zu failed[%s]", job->gbid, job->volume,
+          job->block, off, len, strerror(ret));
+      break;
+    }
+    job->chunkDone[i] = true;
+    while (job->low < job->nchunks && job->chunkDone[job->low]) {
+      job->low++;
+    }
+    job->done = job->low < job->nchunks ?
+                job->start + job->low * (size_t)GB_PREALLOC_CHUNK : job->end;
+    pthread_cond_broadcast(&job->cond);
+  }
+  job->running--;
+  pthread_cond_broadcast(&job->cond);
+  UNLOCK(job->lock);
 
-    /* Part before ':' */
-    sep = strchr(h, ':');
-    *sep = '\0';
+  if (fd && glfs_close(fd) != 0) {
+    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): on volume %s for block %s "
+        "failed[%s]", job->gbid, job->volume, job->block, strerror(errno));
+  }
 
-    switch (blockMetaKeyEnumParse(h)) {
-    case GB_META_VOLUME:
-    case GB_META_GBID:
-    case GB_META_SIZE:
-    case GB_META_HA:
-    case GB_META_ENTRYCREATE:
-    case GB_META_PASSWD:
+  return NULL;
+}
+
+
+static void *
+glusterBlockPreallocThread(void *data)
+{
+  gbPreallocJob *job = data;
+  unsigned long long startTime = gbTimeNowUsec();
+  int errCode = 0;
+  pthread_t tid;
+  size_t nworkers;
+  size_t done;
+  size_t from;
+  bool cancel;
+  size_t i;
+
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  nworkers = gbConf.preallocThreads;
+  RWUNLOCK(gbConf.cfgLock);
+  if (nworkers > job->nchunks) {
+    nworkers = job->nchunks;
+  }
+
+  LOCK(job->lock);
+  for (i = 0; i < nworkers; i++) {
+    job->running++;
+    if (pthread_create(&tid, NULL, glusterBlockPreallocWorker, job)) {
+      job->running--;
       break;
-    default:
-      if (skiphost && !strcmp(h, skiphost)) {
-        break; /* switch case */
+    }
+    pthread_detach(tid);
+  }
+  if (!i) {
+    /* no luck with threads, preallocate it all from here */
+    job->running++;
+    UNLOCK(job->lock);
+    glusterBlockPreallocWorker(job);
+    LOCK(job->lock);
+  }
+
+  while (job->running) {
+    if (!job->cancel && job->done - job->recorded >= job->step) {
+      done = job->done;
+      from = job->end - job->reserved;
+      if (from < job->recorded) {
+        from = job->recorded;
       }
-      /* Part after ':' and before '\n' */
-      s = sep + 1;
-      while(*s == ' ') {
-        s++;
+      UNLOCK(job->lock);
+      /*
+       * The statvfs() of the next reservation sees what is fallocated by
+       * now, stop holding that much of the reservation as well.
+       */
+      if (done > from) {
+        glusterBlockUnreserveSpace(job->volume, done - from, true);
+        job->reserved -= done - from;
       }
-
-      if (!list) {
-        if (blockhostIsValid(s)) {
-          if (GB_ALLOC(list) < 0)
-            goto out;
-          if (GB_ALLOC(list->hosts) < 0)
-            goto out;
-          if (GB_STRDUP(list->hosts[0], h) < 0)
-            goto out;
-
-          list->nhosts = 1;
-        }
+      if (glusterBlockPreallocRecord(job, "INPROGRESS", done) > 0) {
+        LOCK(job->lock);
+        job->cancel = true;
       } else {
-        match = false;
-        for (i = 0; i < list->nhosts; i++) {
-          if (!strcmp(list->hosts[i], h)) {
-            match = true;
-            break; /* for loop */
-          }
-        }
-        if (!match && blockhostIsValid(s)){
-          if(GB_REALLOC_N(list->hosts, list->nhosts+1) < 0)
-            goto out;
-          if (GB_STRDUP(list->hosts[list->nhosts], h) < 0)
-            goto out;
-
-          list->nhosts++;
-        }
+        LOCK(job->lock);
       }
-      break; /* switch case */
+      job->recorded = done;
+      continue;
     }
-
-    glfs_lseek(tgmfd, count, SEEK_SET);
+    pthread_cond_wait(&job->cond, &job->lock);
   }
+  errCode = job->errCode;
+  cancel = job->cancel;
+  done = job->done;
+  UNLOCK(job->lock);
 
-  if (ret < 0 && errCode) { /*Failure from glfs_read*/
-    *errCode = errno;
-    goto out;
+  if (!cancel) {
+    if (errCode) {
+      glusterBlockPreallocRecord(job, "FAIL", done);
+    } else {
+      glusterBlockPreallocRecord(job, "SUCCESS", 0);
+    }
   }
+  glusterBlockPreallocJournalDrop(job->gbid);
+  glusterBlockVolumeRelease(job->volume, job->glfs);
 
-  *savelist = list;
-  list = NULL;
-  ret = 0;
+  LOG("mgmt", errCode ? GB_LOG_ERROR : GB_LOG_INFO, "preallocation of block "
+      "%s on volume %s %s at %zu of %zu bytes in %llu msec%s%s", job->block,
+      job->volume, cancel ? "cancelled" : errCode ? "failed" : "done",
+      done, job->end, (gbTimeNowUsec() - startTime) / 1000,
+      errCode ? ", " : "", errCode ? strerror(errCode) : "");
 
- out:
-  if (tgmfd && glfs_close(tgmfd) != 0) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): failed[%s]",
-        metafile, strerror(errno));
-  }
-  blockServerDefFree(list);
+  glusterBlockUnreserveSpace(job->volume, job->reserved, true);
 
-  return ret;
+  LOCK(preallocLock);
+  list_del(&job->list);
+  UNLOCK(preallocLock);
+
+  LOCK(job->lock);
+  job->finished = true;
+  pthread_cond_broadcast(&job->cond);
+  UNLOCK(job->lock);
+  glusterBlockPreallocJobUnref(job);
+
+  return NULL;
 }
 
 
+/*
+ * Preallocate [start, end) of the block file gbid in the background, with
+ * the progress recorded in its metafile as 'PREALLOC: INPROGRESS-<done>'
+ * and then SUCCESS or FAIL-<done>. The caller has recorded INPROGRESS
+ * already; if the job can't be started, FAIL-<start> is recorded through
+ * glfs instead. The reserved bytes of the volume, which stand for the tail
+ * of the range, are given back as that gets preallocated, the rest once it
+ * is over or now if it does not start. If wait is set, returns once it is
+ * over. Returns 0 or the errno the preallocation failed with.
+ */
 int
-blockGetMetaInfo(struct glfs* glfs, char* metafile, MetaInfo *info,
-                 int *errCode)
+glusterBlockPreallocStart(struct glfs *glfs, char *volume, char *block,
+                          char *gbid, size_t start, size_t end,
+                          size_t reserved, bool wait)
 {
-  size_t count = 0;
-  struct glfs_fd *tgmfd = NULL;
-  char line[1024];
-  char fpath[PATH_MAX] = {0};
-  char *tmp;
-  int ret;
+  gbPreallocJob *job = NULL;
+  gbPreallocJob *tmp;
+  char *errMsg = NULL;
+  int errCode = 0;
+  pthread_t tid;
+  size_t total;
+  int ret = ENOMEM;
+
+
+  if (start >= end) {
+    glusterBlockUnreserveSpace(volume, reserved, false);
+    glusterBlockPreallocRecordOn(glfs, volume, block, gbid, NULL,
+                                 "SUCCESS", 0);
+    return 0;
+  }
 
-  snprintf(fpath, sizeof fpath, "%s/%s", GB_METADIR, metafile);
-  tgmfd = glfs_open(glfs, fpath, O_RDONLY);
-  if (!tgmfd) {
-    if (errCode) {
-      *errCode = errno;
-    }
-    LOG("gfapi", GB_LOG_ERROR, "glfs_open(%s) failed[%s]", metafile,
-                               strerror(errno));
-    ret = -1;
-    goto out;
+  if (GB_ALLOC(job) < 0) {
+    goto fail;
+  }
+  GB_STRCPYSTATIC(job->volume, volume);
+  GB_STRCPYSTATIC(job->block, block);
+  GB_STRCPYSTATIC(job->gbid, gbid);
+  job->start = job->done = job->recorded = start;
+  job->end = end;
+  job->reserved = reserved;
+  total = end - start;
+  job->nchunks = (total + GB_PREALLOC_CHUNK - 1) / GB_PREALLOC_CHUNK;
+  job->step = total / GB_PREALLOC_STEPS > GB_PREALLOC_CHUNK ?
+              total / GB_PREALLOC_STEPS : GB_PREALLOC_CHUNK;
+  job->refs = wait ? 2 : 1;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  if (GB_ALLOC_N(job->chunkDone, job->nchunks) < 0) {
+    goto fail;
   }
 
-  while ((ret = glfs_read (tgmfd, line, sizeof(line), 0)) > 0) {
-    tmp = strtok(line,"\n");
-    count += strlen(tmp) + 1;
-    ret = blockStuffMetaInfo(info, tmp);
-    if (ret) {
-      if (errCode) {
-        *errCode = errno;
-      }
-      LOG("gfapi", GB_LOG_ERROR,
-          "blockStuffMetaInfo: on volume %s for block %s failed[%s]",
-          info->volume, metafile, strerror(errno));
-      goto out;
+  LOCK(preallocLock);
+  list_for_each_entry(tmp, &preallocJobs, list) {
+    if (!strcmp(tmp->gbid, gbid)) {
+      UNLOCK(preallocLock);
+      /* the running one records how it ends, leave the state to it */
+      LOG("mgmt", GB_LOG_ERROR, "block %s on volume %s is being "
+          "preallocated here already", block, volume);
+      glusterBlockUnreserveSpace(volume, reserved, false);
+      ret = EBUSY;
+      goto free;
     }
-    glfs_lseek(tgmfd, count, SEEK_SET);
   }
-  if (ret < 0 && errCode) {/*Failure from glfs_read*/
-    *errCode = errno;
-    goto out;
+  list_add(&job->list, &preallocJobs);
+  UNLOCK(preallocLock);
+
+  /* a handle of its own, the caller's goes with the request */
+  job->glfs = glusterBlockVolumeInit(volume, &errCode, &errMsg);
+  if (!job->glfs) {
+    LOG("mgmt", GB_LOG_ERROR, "failed to start preallocation of block %s "
+        "on volume %s[%s]", block, volume,
+        errMsg ? errMsg : strerror(errCode));
+    GB_FREE(errMsg);
+    ret = errCode ? errCode : EIO;
+    goto unlist;
   }
-  blockParseRSstatus(info);
 
- out:
-  if (tgmfd && glfs_close(tgmfd) != 0) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
-        metafile, info->volume, strerror(errno));
+  glusterBlockPreallocJournalSave(job);
+
+  ret = pthread_create(&tid, NULL, glusterBlockPreallocThread, job);
+  if (ret) {
+    LOG("mgmt", GB_LOG_ERROR, "failed to start preallocation of block %s "
+        "on volume %s[%s]", block, volume, strerror(ret));
+    glusterBlockPreallocJournalDrop(gbid);
+    glusterBlockVolumeRelease(volume, job->glfs);
+    goto unlist;
   }
+  pthread_detach(tid);
 
-  return ret;
-}
+  LOG("mgmt", GB_LOG_INFO, "preallocating [%zu, %zu) of block %s on "
+      "volume %s in the background", start, end, block, volume);
 
+  if (!wait) {
+    return 0;
+  }
 
-void
-blockGetPrioPath(struct glfs* glfs, char *volume, blockServerDefPtr list,
-                 char *prio_path, size_t prio_len)
-{
-  struct glfs_fd *pfd = NULL;
-  char attr[256];
-  char buf[1024];
-  int index = 0;
-  size_t count = 0;
-  size_t min = 0;
-  bool flag = true;
-  int i;
-  int ret = -1;
+  LOCK(job->lock);
+  while (!job->finished) {
+    pthread_cond_wait(&job->cond, &job->lock);
+  }
+  ret = job->errCode;
+  UNLOCK(job->lock);
+  glusterBlockPreallocJobUnref(job);
 
+  return ret;
 
-  pfd = glfs_creat(glfs, GB_PRIO_FILE, O_RDONLY | O_CREAT | O_SYNC,
-                   S_IRUSR | S_IWUSR);
-  if (!pfd) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_creat(%s) on volume %s failed[%s]",
-        GB_PRIO_FILE, volume, strerror(errno));
-    return;
+ unlist:
+  LOCK(preallocLock);
+  list_del(&job->list);
+  UNLOCK(preallocLock);
+
+ fail:
+  glusterBlockUnreserveSpace(volume, reserved, false);
+  glusterBlockPreallocRecordOn(glfs, volume, block, gbid, NULL, "FAIL", start);
+
+ free:
+  if (job) {
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    GB_FREE(job->chunkDone);
+    GB_FREE(job);
   }
 
-  for (i = 0; i < list->nhosts; i++) {
-    memset(attr, '\0', sizeof(attr));
-    snprintf(attr, sizeof(attr), "%s.%s", GB_LB_ATTR_PREFIX, list->hosts[i]);
-
-    memset(buf, '\0', sizeof(buf));
-    if (glfs_fgetxattr(pfd, attr, buf, sizeof(buf)) < 0) {
-      if (errno != ENODATA) {
-        LOG("gfapi", GB_LOG_ERROR,
-            "glfs_fgetxattr(%s) on volume %s for prio file %s failed[%s]",
-            attr, volume, GB_PRIO_FILE, strerror(errno));
-        goto out;
-      } else {
-        index = i;
-        min = 0;
-        break;
-      }
-    }
+  return ret;
+}
 
-    sscanf(buf, "%zu", &count);
-    if (flag || min > count) {
-      min = count;
-      index = i;
-      flag = false;
-    }
-  }
 
-  ret = 0;
+/* whether a preallocation of block gbid is running on this node */
+bool
+glusterBlockPreallocRunning(const char *gbid)
+{
+  gbPreallocJob *job;
+  bool running = false;
 
- out:
-  if (pfd && glfs_close(pfd) != 0) {
-    LOG("gfapi", GB_LOG_ERROR, "glfs_close(%s): on volume %s failed[%s]",
-        GB_PRIO_FILE, volume, strerror(errno));
-  }
 
-  if (!ret) {
-    if (strlen(list->hosts[index]) < sizeof(attr) - strlen(GB_LB_ATTR_PREFIX)) {
-      GB_STRCPY(prio_path, list->hosts[index], prio_len);
+  LOCK(preallocLock);
+  list_for_each_entry(job, &preallocJobs, list) {
+    if (!strcmp(job->gbid, gbid)) {
+      running = true;
+      break;
     }
   }
+  UNLOCK(preallocLock);
 
-  return;
+  return running;
 }
 
 
+/*
+ * Stop the preallocations of block running here, without waiting for the
+ * chunks in flight. Other nodes find the block gone at their next record.
+ */
 void
-blockIncPrioAttr(struct glfs* glfs, char *volume, char *addr)
+glusterBlockPreallocCancel(char *volume, char *block)
 {
-  size_t count;
-  char buf[1024] = {'\0', };
-  char attr[256] = {'\0', };
+  gbPreallocJob *job;
 
 
-  snprintf(attr, sizeof(attr), "%s.%s", GB_LB_ATTR_PREFIX, addr);
-  if (glfs_getxattr(glfs, GB_PRIO_FILE, attr, buf, sizeof(buf)) < 0) {
-    if (errno != ENODATA) {
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_getxattr(%s) on volume %s for prio file %s failed[%s]",
-          attr, volume, GB_PRIO_FILE, strerror(errno));
-      return;
-    } else {
-      count = 0;
+  LOCK(preallocLock);
+  list_for_each_entry(job, &preallocJobs, list) {
+    if (!strcmp(job->volume, volume) && !strcmp(job->block, block)) {
+      LOCK(job->lock);
+      job->cancel = true;
+      UNLOCK(job->lock);
     }
-  } else {
-    sscanf(buf, "%zu", &count);
   }
+  UNLOCK(preallocLock);
+}
 
-  memset(buf, '\0', sizeof(buf));
-  snprintf(buf, sizeof(buf), "%zu", count + 1);
-  if (glfs_setxattr(glfs, GB_PRIO_FILE, attr, buf, sizeof(buf), 0) < 0) {
-    LOG("gfapi", GB_LOG_ERROR,
-        "glfs_setxattr(%s) on volume %s for prio file %s failed[%s]",
-        attr, volume, GB_PRIO_FILE, strerror(errno));
+
+static void
+glusterBlockPreallocResumeOne(const char *gbid)
+{
+  char path[PATH_MAX];
+  char volume[255] = {0, };
+  char block[255] = {0, };
+  struct glfs *glfs = NULL;
+  MetaInfo *info = NULL;
+  char *errMsg = NULL;
+  int errCode = 0;
+  FILE *fp;
+
+
+  glusterBlockPreallocJournalPath(gbid, path, sizeof(path));
+  fp = fopen(path, "r");
+  if (!fp) {
     return;
   }
+  if (fscanf(fp, "%254s %254s", volume, block) != 2) {
+    fclose(fp);
+    LOG("mgmt", GB_LOG_WARNING, "dropping malformed preallocation journal %s",
+        path);
+    goto drop;
+  }
+  fclose(fp);
 
-  return;
+  glfs = glusterBlockVolumeInit(volume, &errCode, &errMsg);
+  if (!glfs) {
+    LOG("mgmt", GB_LOG_WARNING, "not resuming preallocation of block %s on "
+        "volume %s[%s]", block, volume, errMsg ? errMsg : strerror(errCode));
+    GB_FREE(errMsg);
+    return;
+  }
+
+  if (GB_ALLOC(info) < 0) {
+    goto out;
+  }
+  if (blockGetMetaInfo(glfs, block, info, &errCode) ||
+      strcmp(info->gbid, gbid) || strcmp(info->prealloc, "INPROGRESS")) {
+    LOG("mgmt", GB_LOG_INFO, "block %s on volume %s has no preallocation "
+        "to resume", block, volume);
+    goto drop;
+  }
+
+  LOG("mgmt", GB_LOG_INFO, "resuming preallocation of block %s on volume %s "
+      "at %zu of %zu bytes", block, volume, info->prealloc_done, info->size);
+  glusterBlockPreallocStart(glfs, volume, block, (char *)gbid,
+                            info->prealloc_done, info->size, 0, false);
+  goto out;
+
+ drop:
+  glusterBlockPreallocJournalDrop(gbid);
+
+ out:
+  blockFreeMetaInfo(info);
+  glusterBlockVolumeRelease(volume, glfs);
 }
 
 
-void
-blockDecPrioAttr(struct glfs* glfs, char *volume, char *addr)
+static void *
+glusterBlockPreallocResumeThread(void *data)
 {
-  size_t count;
-  char buf[1024] = {'\0', };
-  char attr[256] = {'\0', };
+  DIR *dir;
+  struct dirent *entry;
 
 
-  snprintf(attr, sizeof(attr), "%s.%s", GB_LB_ATTR_PREFIX, addr);
-  if (glfs_getxattr(glfs, GB_PRIO_FILE, attr, buf, sizeof(buf)) < 0) {
-    if (errno != ENODATA) {
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_getxattr(%s) on volume %s for prio file %s failed[%s]",
-          attr, volume, GB_PRIO_FILE, strerror(errno));
-      return;
-    } else {
-      count = 0;
-    }
-  } else {
-    sscanf(buf, "%zu", &count);
+  dir = opendir(GB_PREALLOC_DIR);
+  if (!dir) {
+    return NULL;
   }
 
-  if (count != 0) {
-    memset(buf, '\0', sizeof(buf));
-    snprintf(buf, sizeof(buf), "%zu", count - 1);
-    if (glfs_setxattr(glfs, GB_PRIO_FILE, attr, buf, sizeof(buf), 0) < 0) {
-      LOG("gfapi", GB_LOG_ERROR,
-          "glfs_setxattr(%s) on volume %s for prio file %s failed[%s]",
-          attr, volume, GB_PRIO_FILE, strerror(errno));
-      return;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.' || strstr(entry->d_name, ".tmp")) {
+      continue;
     }
+    glusterBlockPreallocResumeOne(entry->d_name);
   }
+  closedir(dir);
 
-  return;
+  return NULL;
 }
 
 
+/*
+ * Pick up, in the background, the preallocations that were running here
+ * when the daemon went away, from where their metafile says they got to.
+ */
 int
-blockGetAddrStatusFromInfo(MetaInfo *info, char *addr)
+glusterBlockPreallocResume(void)
 {
-  size_t i;
+  pthread_t tid;
 
 
-  if (!addr) {
-    goto out;
+  if (access(GB_PREALLOC_DIR, F_OK)) {
+    return 0;
   }
 
-  for (i = 0; i < info->nhosts; i++) {
-    if (!strcmp(addr, info->list[i]->addr)) {
-      return blockMetaStatusEnumParse(info->list[i]->status);
-    }
+  if (pthread_create(&tid, NULL, glusterBlockPreallocResumeThread, NULL)) {
+    LOG("mgmt", GB_LOG_WARNING, "%s",
+        "failed to start resuming preallocations");
+    return -1;
   }
+  pthread_detach(tid);
 
- out:
-  return GB_METASTATUS_MAX;
+  return 0;
 }
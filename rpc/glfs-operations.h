@@ -20,7 +20,28 @@
 # include  "lru.h"
 # include  "block.h"
 
+# define   GB_PREWARM_THREADS_MAX   8
 
+/* last volfile fetched from glusterd, one <volume>.vol per volume */
+# define   GB_VOLFILE_DIR   CONFDIR "/volfiles"
+
+/* one journal per preallocation running on this node, named after the gbid */
+# define   GB_PREALLOC_DIR  CONFDIR "/prealloc"
+
+/* one empty file per volume with files in GB_TRASHDIR left to unlink */
+# define   GB_TRASH_VOLS_DIR  CONFDIR "/trash"
+
+/* one file per volume with a bulk node replace running on it */
+# define   GB_REPLACE_DIR   CONFDIR "/replace"
+
+
+
+typedef struct gbTrashStats {
+  size_t pendingFiles;                 /* listed, not unlinked yet */
+  size_t pendingBytes;
+  size_t reapedFiles;
+  unsigned long long reclaimedBytes;
+} gbTrashStats;
 
 typedef struct NodeInfo {
   char addr[255];
@@ -34,29 +55,90 @@ typedef struct MetaInfo {
   size_t size;
   size_t rb_size;
   char   prio_path[255];
+  char   drain_path[255];  /* node the prio path was drained from */
   size_t mpath;
   char   entry[16];  /* possible strings for ENTRYCREATE: INPROGRESS|SUCCESS|FAIL */
+  char   prealloc[16];     /* PREALLOC state: INPROGRESS|SUCCESS|FAIL */
+  size_t prealloc_done;    /* bytes from the start preallocated, with the state */
   char   passwd[38];
 
   size_t nhosts;
   NodeInfo **list;
 } MetaInfo;
 
+/* walk over the metafiles of a volume, see glusterBlockMetaScanOpen() */
+typedef struct gbMetaScan {
+  struct glfs *glfs;
+  char *volume;
+  struct glfs_fd *dirfd;
+  strToCharArrayDefPtr names;
+  size_t next;
+  bool cached;
+  bool failed;
+  unsigned long seq;
+  struct dirent buf;
+  struct stat st;
+} gbMetaScan;
+
 
 struct glfs *
 glusterBlockVolumeInit(char *volume, int *errCode, char **errMsg);
 
+void
+glusterBlockVolumeRelease(char *volume, struct glfs *glfs);
+
+struct glfs_fd *
+glusterBlockOpenAt(struct glfs *glfs, gbGlfsObj dir, const char *name,
+                   int flags, mode_t mode);
+
+int
+glusterBlockAccessAt(struct glfs *glfs, gbGlfsObj dir, const char *name);
+
+int
+glusterBlockPrewarmVolumes(char *pinned);
+
 int
 glusterBlockCreateEntry(struct glfs *glfs, blockCreateCli *blk, char *gbid,
-                        int *errCode, char **errMsg);
+                        bool zerofill, int *errCode, char **errMsg);
 
 int
-glusterBlockResizeEntry(struct glfs *glfs, blockModifySize *blk, int *errCode,
-                        char **errMsg);
+glusterBlockResizeEntry(struct glfs *glfs, blockModifySize *blk,
+                        bool *preallocated, int *errCode, char **errMsg);
+
+int
+glusterBlockZerofillEntry(struct glfs *glfs, blockModifySize *blk,
+                          size_t from, int *errCode, char **errMsg);
 
 int
 glusterBlockDeleteEntry(struct glfs *glfs, char *volume, char *gbid);
 
+int
+glusterBlockTrashResume(void);
+
+void
+glusterBlockTrashGetStats(gbTrashStats *st);
+
+int
+glusterBlockReserveSpace(struct glfs *glfs, char *volume, size_t size,
+                         char **errMsg);
+
+void
+glusterBlockUnreserveSpace(char *volume, size_t size, bool consumed);
+
+int
+glusterBlockPreallocStart(struct glfs *glfs, char *volume, char *block,
+                          char *gbid, size_t start, size_t end,
+                          size_t reserved, bool wait);
+
+bool
+glusterBlockPreallocRunning(const char *gbid);
+
+void
+glusterBlockPreallocCancel(char *volume, char *block);
+
+int
+glusterBlockPreallocResume(void);
+
 struct glfs_fd *
 glusterBlockCreateMetaLockFile(struct glfs *glfs, char *volume, int *errCode,
                                char **errMsg);
@@ -71,14 +153,42 @@ blockGetMetaInfo(struct glfs* glfs, char* metafile, MetaInfo *info,
 void
 blockFreeMetaInfo(MetaInfo *info);
 
+int
+blockGetMetaInfoCached(struct glfs *glfs, char *volume, char *metafile,
+                       struct stat *st, MetaInfo *info, int *errCode);
+
+int
+glusterBlockMetaScanOpen(struct glfs *glfs, char *volume, gbMetaScan *scan);
+
+char *
+glusterBlockMetaScanNext(gbMetaScan *scan, struct stat **st);
+
+void
+glusterBlockMetaScanClose(gbMetaScan *scan);
+
 int
 blockParseValidServers(struct glfs* glfs, char *metafile, int *errCode,
                        blockServerDefPtr *savelist, char *skiphost);
 
+int
+blockGetPrioCounts(struct glfs* glfs, char *volume, blockServerDefPtr list,
+                   size_t *counts);
+
 void
 blockGetPrioPath(struct glfs* glfs, char *volume,
                  blockServerDefPtr list, char *prio_path, size_t prio_len);
 
+int
+blockSetPrioCounts(struct glfs* glfs, char *volume, char **hosts,
+                   size_t *counts, size_t nhosts);
+
+int
+blockGetDrained(struct glfs* glfs, char *volume, blockServerDefPtr list,
+                bool *drained);
+
+int
+blockSetDrained(struct glfs* glfs, char *volume, char *host, bool drained);
+
 void
 blockIncPrioAttr(struct glfs* glfs, char *volume, char *addr);
 
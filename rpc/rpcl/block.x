@@ -62,6 +62,14 @@ struct blockReplace {
   char      ripaddr[255];
 };
 
+struct blockPrioPath {
+  char      volume[255];
+  char      block_name[255];
+  char      gbid[127];
+  char      prio_path[255];              /* portal to make active-optimized */
+  char      old_path[255];               /* current one, empty if unknown */
+};
+
 struct blockCreateCli {
   char      volume[255];
   u_quad_t  size;
@@ -74,6 +82,7 @@ struct blockCreateCli {
   string    block_hosts<>;
   string    cmd<>;
   enum JsonResponseFormat     json_resp;
+  bool      prealloc_wait;        /* return once preallocated */
 };
 
 struct blockDeleteCli {
@@ -129,12 +138,83 @@ struct blockReplaceCli {
   enum JsonResponseFormat     json_resp;
 };
 
+struct blockReplaceBulkCli {
+  char      volume[255];                 /* comma separated list */
+  char      old_node[255];
+  char      new_node[255];
+  bool      force;
+  u_int     parallel;                    /* blocks replaced at a time */
+  string    cmd<>;
+  enum JsonResponseFormat     json_resp;
+};
+
 struct blockGenConfigCli {
   char      volume[255];
   char      addr[255];
   enum JsonResponseFormat     json_resp;
 };
 
+struct blockStatusCli {
+  enum JsonResponseFormat     json_resp;
+};
+
+struct blockRebalanceCli {
+  char      volume[255];
+  bool      dry_run;
+  u_int     parallel;                    /* blocks switched at a time */
+  string    cmd<>;
+  enum JsonResponseFormat     json_resp;
+};
+
+struct blockDrainCli {
+  char      node[255];
+  char      volume[255];                 /* comma separated list */
+  bool      undrain;
+  u_int     parallel;                    /* blocks switched at a time */
+  string    cmd<>;
+  enum JsonResponseFormat     json_resp;
+};
+
+/* steps of a BLOCK_CREATE on a node, reported in blockCreateResult */
+enum blockCreateStep {
+  GB_CREATE_STEP_BACKSTORE   = 0,
+  GB_CREATE_STEP_IQN         = 1,
+  GB_CREATE_STEP_LUN         = 2,
+  GB_CREATE_STEP_PORTAL      = 3,
+  GB_CREATE_STEP_TPG_ENABLE  = 4,
+  GB_CREATE_STEP_ATTRIBUTES  = 5,
+  GB_CREATE_STEP_AUTH        = 6,
+
+  GB_CREATE_STEP_MAX
+};
+
+enum blockStepStatus {
+  GB_STEP_DONE    = 0,
+  GB_STEP_FAILED  = 1,
+  GB_STEP_SKIPPED = 2
+};
+
+typedef string blockStr<>;
+
+/* BLOCK_CREATE* reply, XDR encoded into blockResponse.xdata */
+struct blockCreateResult {
+  u_quad_t  backend_size;       /* 0 if the backstore wasn't created */
+  string    iqn<>;              /* empty if the target wasn't created */
+  u_int     tpgs<>;             /* tpg numbers created */
+  blockStr  portals<>;          /* network portals created, ip:port */
+  int       step_status<>;      /* blockStepStatus, indexed by blockCreateStep */
+  u_quad_t  spawn_usec;         /* targetcli spawn latency */
+  u_quad_t  exec_usec;          /* targetcli run time */
+};
+
+/* BLOCK_LOAD reply, XDR encoded into blockResponse.xdata */
+struct blockNodeLoad {
+  u_int     luns;               /* user backstores configured on the node */
+  u_quad_t  iops;               /* scsi commands/sec, over all the luns */
+  u_quad_t  mbps;               /* read + write MiB/sec, over all the luns */
+  u_int     cpu;                /* 1 min load average per cpu, in permille */
+};
+
 struct blockResponse {
   int       exit;       /* exit code of the command */
   string    out<>;      /* output; TODO: return respective objects */
@@ -152,6 +232,8 @@ program GLUSTER_BLOCK {
     blockResponse BLOCK_MODIFY_SIZE(blockModifySize) = 6;
 
     blockResponse BLOCK_CREATE_V2(blockCreate2) = 7;
+    blockResponse BLOCK_LOAD() = 8;
+    blockResponse BLOCK_PRIO_PATH(blockPrioPath) = 9;
   } = 1;
 } = 21215311; /* B2 L12 O15 C3 K11 */
 
@@ -165,5 +247,9 @@ program GLUSTER_BLOCK_CLI {
     blockResponse BLOCK_REPLACE_CLI(blockReplaceCli) = 6;
     blockResponse BLOCK_MODIFY_SIZE_CLI(blockModifySizeCli) = 7;
     blockResponse BLOCK_GEN_CONFIG_CLI(blockGenConfigCli) = 8;
+    blockResponse BLOCK_STATUS_CLI(blockStatusCli) = 9;
+    blockResponse BLOCK_REBALANCE_CLI(blockRebalanceCli) = 10;
+    blockResponse BLOCK_DRAIN_CLI(blockDrainCli) = 11;
+    blockResponse BLOCK_REPLACE_BULK_CLI(blockReplaceBulkCli) = 12;
   } = 1;
 } = 212153113; /* B2 L12 O15 C3 K11 C3 */
@@ -17,4 +17,7 @@ gluster_block_cli_1(struct svc_req *rqstp, register SVCXPRT *transp);
 void
 gluster_block_1(struct svc_req *rqstp, register SVCXPRT *transp);
 
+int
+glusterBlockReplaceResume(void);
+
 # endif /* _BLOCK_SVC_H */
@@ -100,6 +100,39 @@ TEST gluster-block create ${VOLNAME}/${BLKNAME} ha 1 auth enable ${HOST} 1GiB
 # Block delete
 TEST gluster-block delete ${VOLNAME}/${BLKNAME}
 
+# Block create, returning once preallocated
+TEST gluster-block create ${VOLNAME}/${BLKNAME} ha 1 prealloc wait ${HOST} 1GiB
+
+# Block info, with nothing left to preallocate
+TEST "! gluster-block info ${VOLNAME}/${BLKNAME} | grep -q INPROGRESS"
+
+# Daemon status
+TEST gluster-block status
+
+# Rebalance dry run, moving nothing
+TEST gluster-block rebalance ${VOLNAME} dry-run
+
+# Rebalance
+TEST gluster-block rebalance ${VOLNAME}
+
+# Drain the node
+TEST gluster-block drain ${HOST} ${VOLNAME}
+
+# Block info
+TEST gluster-block info ${VOLNAME}/${BLKNAME}
+
+# Undrain the node
+TEST gluster-block undrain ${HOST} ${VOLNAME}
+
+# Replace a node no block has, on every block of the volume
+TEST gluster-block replace ${VOLNAME} 192.0.2.1 ${HOST}
+
+# Block info
+TEST gluster-block info ${VOLNAME}/${BLKNAME}
+
+# Block delete
+TEST gluster-block delete ${VOLNAME}/${BLKNAME}
+
 echo -e "\n*** JSON responses ***\n"
 
 # Block create and expect json response
@@ -123,4 +156,17 @@ TEST gluster-block delete ${VOLNAME}/${BLKNAME} --json-pretty
 # Block create with auth set and expect json response
 TEST gluster-block create ${VOLNAME}/${BLKNAME} ha 1 auth enable ${HOST} 1GiB --json-pretty
 
+# Daemon status and expect json response
+TEST gluster-block status --json-pretty
+
+# Rebalance dry run and expect json response
+TEST gluster-block rebalance ${VOLNAME} dry-run --json-pretty
+
+# Drain and undrain the node and expect json responses
+TEST gluster-block drain ${HOST} ${VOLNAME} --json-pretty
+TEST gluster-block undrain ${HOST} ${VOLNAME} --json-pretty
+
+# Bulk replace and expect json response
+TEST gluster-block replace ${VOLNAME} 192.0.2.1 ${HOST} --json-pretty
+
 cleanup;
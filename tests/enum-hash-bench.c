@@ -0,0 +1,175 @@
+/*
+  Copyright (c) 2019 Red Hat, Inc. <http://www.redhat.com>
+  This file is part of gluster-block.
+
+  This file is licensed to you under your choice of the GNU Lesser
+  General Public License, version 3 or any later version (LGPLv3 or
+  later), or the GNU General Public License, version 2 (GPLv2), in all
+  cases as published by the Free Software Foundation.
+*/
+
+
+/*
+ * Parses a synthetic metafile corpus of N lines, blocks of key lines
+ * followed by host status lines, the way blockStuffMetaInfo() does: the
+ * key of every line, and the status of the host lines. Once by strcmp()ing
+ * through the lookup tables, as before, and once with the hashed parsers,
+ * and prints the time each took over a few passes.
+ *
+ * Run:   $ make -C tests bench
+ *        $ ./tests/enum-hash-bench [lines] [passes]   (default 100000 10)
+ */
+
+
+# include  "utils.h"
+
+
+static int
+benchLinearParse(const char *const *lookup, int max, const char *opt)
+{
+  int i;
+
+
+  for (i = 0; i < max; i++) {
+    if (!strcmp(opt, lookup[i])) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+
+static char **
+benchCorpus(size_t count)
+{
+  static const char *const keys[] = {
+    "VOLUME: block-test", "GBID: 6b4c7a5e-9bb0-4d2c-8f47-1e3f0a2b9c11",
+    "HA: 3", "ENTRYCREATE: INPROGRESS", "PRIOPATH: 192.168.1.11",
+    "ENTRYCREATE: SUCCESS", "SIZE: 1073741824", "RINGBUFFER: 0",
+    "PREALLOC: NONE"
+  };
+  char **lines = NULL;
+  size_t nkeys = sizeof(keys) / sizeof(keys[0]);
+  size_t per = nkeys + 3 * 2;       /* 3 hosts, two states each */
+  size_t i;
+  size_t j;
+
+
+  if (GB_ALLOC_N(lines, count) < 0) {
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    j = i % per;
+    if (j < nkeys) {
+      GB_STRDUP(lines[i], keys[j]);
+    } else {
+      GB_ASPRINTF(&lines[i], "192.168.1.%zu: %s", 11 + (j - nkeys) / 2,
+                  MetaStatusLookup[(i / per + j) % GB_METASTATUS_MAX]);
+    }
+    if (!lines[i]) {
+      while (i--) {
+        GB_FREE(lines[i]);
+      }
+      GB_FREE(lines);
+      return NULL;
+    }
+  }
+
+  return lines;
+}
+
+
+/* returns a checksum of what was parsed, for the two ways to agree on */
+static size_t
+benchParse(char **lines, size_t count, bool hashed)
+{
+  char key[256];
+  const char *status;
+  size_t sum = 0;
+  size_t len;
+  size_t i;
+  int k;
+
+
+  for (i = 0; i < count; i++) {
+    status = strchr(lines[i], ':');
+    len = status - lines[i];
+    memcpy(key, lines[i], len);
+    key[len] = '\0';
+    status += 2;
+
+    k = hashed ? blockMetaKeyEnumParse(key) :
+        benchLinearParse(MetakeyLookup, GB_METAKEY_MAX, key);
+    if (k == GB_METAKEY_MAX) {
+      k += hashed ? blockMetaStatusEnumParse(status) :
+           benchLinearParse(MetaStatusLookup, GB_METASTATUS_MAX, status);
+    }
+    sum = sum * 31 + k;
+  }
+
+  return sum;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long long start;
+  unsigned long long tLinear;
+  unsigned long long tHashed;
+  size_t count = 100000;
+  size_t passes = 10;
+  size_t sumLinear = 0;
+  size_t sumHashed = 0;
+  char **lines;
+  size_t i;
+  int ret = 1;
+
+
+  if (argc > 1) {
+    count = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    passes = strtoul(argv[2], NULL, 10);
+  }
+
+  lines = benchCorpus(count);
+  if (!lines) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  /* builds the hashes, outside of the timing */
+  blockMetaKeyEnumParse("");
+
+  start = gbTimeNowUsec();
+  for (i = 0; i < passes; i++) {
+    sumLinear += benchParse(lines, count, false);
+  }
+  tLinear = gbTimeNowUsec() - start;
+
+  start = gbTimeNowUsec();
+  for (i = 0; i < passes; i++) {
+    sumHashed += benchParse(lines, count, true);
+  }
+  tHashed = gbTimeNowUsec() - start;
+
+  if (sumLinear != sumHashed) {
+    fprintf(stderr, "parsers disagree\n");
+    goto out;
+  }
+
+  printf("%zu metafile lines, %zu passes:\n", count, passes);
+  printf("  linear scan: %10.3f ms\n", tLinear / 1000.0);
+  printf("  hashed:      %10.3f ms\n", tHashed / 1000.0);
+  ret = 0;
+
+ out:
+  for (i = 0; i < count; i++) {
+    GB_FREE(lines[i]);
+  }
+  GB_FREE(lines);
+  return ret;
+}
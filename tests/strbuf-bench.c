@@ -0,0 +1,110 @@
+/*
+  Copyright (c) 2019 Red Hat, Inc. <http://www.redhat.com>
+  This file is part of gluster-block.
+
+  This file is licensed to you under your choice of the GNU Lesser
+  General Public License, version 3 or any later version (LGPLv3 or
+  later), or the GNU General Public License, version 2 (GPLv2), in all
+  cases as published by the Free Software Foundation.
+*/
+
+
+/*
+ * Formats a block list reply of N names ("name\n" each, as the list
+ * handler does) the old way, re-printing the prefix with GB_ASPRINTF() on
+ * every name, and with gbStrBuf, and prints the time each took.
+ *
+ * Run:   $ make -C tests bench
+ *        $ ./tests/strbuf-bench [names]        (default 10000)
+ */
+
+
+# include  "utils.h"
+
+
+# define  GB_BENCH_NAME_FMT  "block-%08zu"
+
+
+static char *
+benchAsprintf(size_t count)
+{
+  char *list = NULL;
+  char *tmp;
+  size_t i;
+
+
+  for (i = 0; i < count; i++) {
+    tmp = list;
+    if (GB_ASPRINTF(&list, "%s" GB_BENCH_NAME_FMT "\n",
+                    tmp ? tmp : "", i) == -1) {
+      GB_FREE(tmp);
+      return NULL;
+    }
+    GB_FREE(tmp);
+  }
+
+  return list;
+}
+
+
+static char *
+benchStrBuf(size_t count)
+{
+  gbStrBuf sb = {0, };
+  size_t i;
+
+
+  for (i = 0; i < count; i++) {
+    if (gbStrBufAppendf(&sb, GB_BENCH_NAME_FMT "\n", i) < 0) {
+      gbStrBufFree(&sb);
+      return NULL;
+    }
+  }
+
+  return gbStrBufDetach(&sb);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long long start;
+  unsigned long long tAsprintf;
+  unsigned long long tStrBuf;
+  size_t count = 10000;
+  char *a;
+  char *b;
+  int ret = 1;
+
+
+  if (argc > 1) {
+    count = strtoul(argv[1], NULL, 10);
+  }
+
+  start = gbTimeNowUsec();
+  a = benchAsprintf(count);
+  tAsprintf = gbTimeNowUsec() - start;
+
+  start = gbTimeNowUsec();
+  b = benchStrBuf(count);
+  tStrBuf = gbTimeNowUsec() - start;
+
+  if (!a || !b) {
+    fprintf(stderr, "out of memory\n");
+    goto out;
+  }
+  if (strcmp(a, b)) {
+    fprintf(stderr, "outputs differ\n");
+    goto out;
+  }
+
+  printf("list of %zu names, %zu bytes:\n", count, strlen(b));
+  printf("  GB_ASPRINTF() loop: %10.3f ms\n", tAsprintf / 1000.0);
+  printf("  gbStrBuf:           %10.3f ms\n", tStrBuf / 1000.0);
+  ret = 0;
+
+ out:
+  GB_FREE(a);
+  GB_FREE(b);
+  return ret;
+}
@@ -44,12 +44,21 @@ enum gbCapabilities {
 
   GB_CREATE_LOAD_BALANCE_CAP,
 
+  GB_REBALANCE_CAP,
+
+  GB_DRAIN_CAP,
+
+  GB_PREALLOC_BACKGROUND_CAP,
+
   GB_JSON_CAP,
 
   GB_CAP_MAX
 };
 
 
+# define GB_CAP_BIT(cap) (1UL << (cap))
+
+
 static const char *const gbCapabilitiesLookup[] = {
   [GB_CREATE_CAP]              = "create",
   [GB_CREATE_HA_CAP]           = "create_ha",
@@ -67,6 +76,12 @@ static const char *const gbCapabilitiesLookup[] = {
 
   [GB_REPLACE_CAP]             = "replace",
 
+  [GB_REBALANCE_CAP]           = "rebalance",
+
+  [GB_DRAIN_CAP]               = "drain",
+
+  [GB_PREALLOC_BACKGROUND_CAP] = "prealloc_background",
+
   [GB_JSON_CAP]                = "json",
 
   [GB_CAP_MAX]                 = NULL
@@ -184,6 +184,83 @@ glusterBlockConfSetOptions(gbConfig *cfg, bool reloading)
   if (cfg->GB_GLFS_LRU_COUNT) {
     glusterBlockSetLruCount(cfg->GB_GLFS_LRU_COUNT);
   }
+
+  /* adaptive lruCount bounds */
+  GB_PARSE_CFG_INT(cfg, GB_GLFS_LRU_COUNT_MIN, 0);
+  GB_PARSE_CFG_INT(cfg, GB_GLFS_LRU_COUNT_MAX, 0);
+  GB_PARSE_CFG_INT(cfg, GB_GLFS_LRU_MEM_LIMIT, 0);
+  glusterBlockSetLruBounds(cfg->GB_GLFS_LRU_COUNT_MIN,
+                           cfg->GB_GLFS_LRU_COUNT_MAX,
+                           cfg->GB_GLFS_LRU_MEM_LIMIT);
+
+  /* volumes to keep warm in the glfs cache */
+  GB_PARSE_CFG_STR(cfg, GB_GLFS_PREWARM_VOLUMES, "");
+
+  /* volfile cache, on unless set to 0 */
+  GB_PARSE_CFG_INT(cfg, GB_GLFS_VOLFILE_CACHE, 1);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.glfsVolfileCache = !!cfg->GB_GLFS_VOLFILE_CACHE;
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* metadata trusted on upcalls, off unless set */
+  GB_PARSE_CFG_INT(cfg, GB_META_CACHE_UPCALL_TTL, 0);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.metaUpcallTtl = cfg->GB_META_CACHE_UPCALL_TTL > 0 ?
+                         cfg->GB_META_CACHE_UPCALL_TTL : 0;
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* per call site allocation accounting, off unless set */
+  GB_PARSE_CFG_INT(cfg, GB_ALLOC_ACCOUNTING, 0);
+  gbAllocAcctEnable(cfg->GB_ALLOC_ACCOUNTING > 0);
+
+  /* load aware prio path placement, off unless set */
+  GB_PARSE_CFG_INT(cfg, GB_PRIO_LOAD_AWARE, 0);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.prioLoadAware = cfg->GB_PRIO_LOAD_AWARE > 0;
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* parallel preallocation of new blocks */
+  GB_PARSE_CFG_INT(cfg, GB_PREALLOC_THREADS, GB_PREALLOC_THREADS_DEF);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  if (cfg->GB_PREALLOC_THREADS < 1) {
+    gbConf.preallocThreads = 1;
+  } else if (cfg->GB_PREALLOC_THREADS > GB_PREALLOC_THREADS_MAX) {
+    gbConf.preallocThreads = GB_PREALLOC_THREADS_MAX;
+  } else {
+    gbConf.preallocThreads = cfg->GB_PREALLOC_THREADS;
+  }
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* pace of unlinking deleted block files, unlimited unless set */
+  GB_PARSE_CFG_INT(cfg, GB_TRASH_REAP_RATE, 0);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.trashReapRate = cfg->GB_TRASH_REAP_RATE > 0 ?
+                         cfg->GB_TRASH_REAP_RATE : 0;
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* bulk replace calls in flight per node */
+  GB_PARSE_CFG_INT(cfg, GB_REPLACE_HOST_PARALLEL, GB_REPLACE_HOST_PARALLEL_DEF);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  if (cfg->GB_REPLACE_HOST_PARALLEL < 1) {
+    gbConf.replaceHostParallel = 1;
+  } else if (cfg->GB_REPLACE_HOST_PARALLEL > GB_REBALANCE_PARALLEL_MAX) {
+    gbConf.replaceHostParallel = GB_REBALANCE_PARALLEL_MAX;
+  } else {
+    gbConf.replaceHostParallel = cfg->GB_REPLACE_HOST_PARALLEL;
+  }
+  RWUNLOCK(gbConf.cfgLock);
+
+  /* spare nodes a create is issued to upfront, none unless set */
+  GB_PARSE_CFG_INT(cfg, GB_CREATE_SPECULATE, 0);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  if (cfg->GB_CREATE_SPECULATE < 0) {
+    gbConf.createSpeculate = 0;
+  } else if (cfg->GB_CREATE_SPECULATE > GB_CREATE_SPECULATE_MAX) {
+    gbConf.createSpeculate = GB_CREATE_SPECULATE_MAX;
+  } else {
+    gbConf.createSpeculate = cfg->GB_CREATE_SPECULATE;
+  }
+  RWUNLOCK(gbConf.cfgLock);
   /* add your new config options */
 }
 
@@ -196,6 +273,7 @@ glusterBlockConfFreeStrKeys(gbConfig *cfg)
    * GB_FREE_CFG_STR_KEY(cfg, 'STR KEY');
    */
    GB_FREE_CFG_STR_KEY(cfg, GB_LOG_LEVEL);
+   GB_FREE_CFG_STR_KEY(cfg, GB_GLFS_PREWARM_VOLUMES);
 }
 
 static bool
@@ -545,6 +623,7 @@ glusterBlockSetupConfig(const char *configPath)
     goto freeConfig;
   }
 
+  cfg->GB_GLFS_VOLFILE_CACHE = 1;
   if (glusterBlockLoadConfig(cfg, false)) {
     LOG("mgmt", GB_LOG_ERROR, "Loading GB config failed for configPath: %s!\n", configPath);
     goto freeConfigPath;
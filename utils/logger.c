@@ -0,0 +1,388 @@
+/*
+  Copyright (c) 2019 Red Hat, Inc. <http://www.redhat.com>
+  This file is part of gluster-block.
+
+  This file is licensed to you under your choice of the GNU Lesser
+  General Public License, version 3 or any later version (LGPLv3 or
+  later), or the GNU General Public License, version 2 (GPLv2), in all
+  cases as published by the Free Software Foundation.
+*/
+
+
+# include  "utils.h"
+
+# include  <stdarg.h>
+# include  <stdint.h>
+# include  <semaphore.h>
+
+
+/*
+ * Asynchronous logger.
+ *
+ * Producers format the whole log line and push it into a bounded lock-free
+ * MPSC ring (Vyukov's bounded queue, one sequence number per slot). A single
+ * writer thread drains the ring into per category FILE handles that stay
+ * open, and reopens them when asked to (SIGHUP, for logrotate). When the ring
+ * is full the message is dropped and counted, producers never block.
+ *
+ * Until gbLogStart() is called (i.e. in the cli and early daemon init) lines
+ * are written synchronously, opening and closing the file each time.
+ */
+
+# define   GB_LOG_RING_SIZE    4096    /* must be a power of 2 */
+# define   GB_LOG_MSG_BUFLEN   512
+
+
+typedef struct gbLogSlot {
+  size_t seq;
+  int cat;
+  char *line;
+} gbLogSlot;
+
+
+static gbLogSlot logRing[GB_LOG_RING_SIZE];
+static size_t logTail;                  /* next slot to be claimed */
+static size_t logHead;                  /* next slot to be written out */
+
+static sem_t logSem;
+static pthread_t logThread;
+static bool logRunning;
+static int logStop;
+static int logReopen;
+static unsigned long logDropped;
+static unsigned long logDroppedReported;
+
+static FILE *logFiles[GB_LOGCAT_MAX];
+
+/* only serializes the synchronous path */
+static pthread_mutex_t logSyncLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static const char *
+gbLogCategoryPath(int cat)
+{
+  switch (cat) {
+  case GB_LOGCAT_MGMT:
+    return gbConf.daemonLogFile;
+  case GB_LOGCAT_CLI:
+    return gbConf.cliLogFile;
+  case GB_LOGCAT_GFAPI:
+    return gbConf.gfapiLogFile;
+  case GB_LOGCAT_CMDLOG:
+    return gbConf.cmdhistoryLogFile;
+  }
+
+  return NULL;
+}
+
+
+static FILE *
+gbLogOpen(int cat)
+{
+  const char *path = gbLogCategoryPath(cat);
+  FILE *fd;
+
+
+  if (!path) {
+    return stderr;
+  }
+
+  fd = fopen(path, "a");
+  if (fd == NULL) {
+    fprintf(stderr, "Error opening log file: %s\n"
+            "Logging to stderr.\n", strerror(errno));
+    fd = stderr;
+  }
+
+  return fd;
+}
+
+
+static void
+gbLogCloseAll(void)
+{
+  int i;
+
+
+  for (i = 0; i < GB_LOGCAT_MAX; i++) {
+    if (logFiles[i] && logFiles[i] != stderr) {
+      fclose(logFiles[i]);
+    }
+    logFiles[i] = NULL;
+  }
+}
+
+
+static int
+gbLogEnqueue(int cat, char *line)
+{
+  gbLogSlot *slot;
+  size_t pos;
+  size_t seq;
+  intptr_t diff;
+
+
+  pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &logRing[pos & (GB_LOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (!diff) {
+      if (__atomic_compare_exchange_n(&logTail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* ring is full */
+      __atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+      return -1;
+    } else {
+      pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->cat = cat;
+  slot->line = line;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  sem_post(&logSem);
+
+  return 0;
+}
+
+
+/* single consumer, only called from the writer thread */
+static bool
+gbLogDequeue(int *cat, char **line)
+{
+  gbLogSlot *slot = &logRing[logHead & (GB_LOG_RING_SIZE - 1)];
+  size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+
+  if ((intptr_t)seq - (intptr_t)(logHead + 1) < 0) {
+    return false;
+  }
+
+  *cat = slot->cat;
+  *line = slot->line;
+  slot->line = NULL;
+  __atomic_store_n(&slot->seq, logHead + GB_LOG_RING_SIZE, __ATOMIC_RELEASE);
+  logHead++;
+
+  return true;
+}
+
+
+static void
+gbLogWrite(int cat, const char *line)
+{
+  if (!logFiles[cat]) {
+    logFiles[cat] = gbLogOpen(cat);
+  }
+  fputs(line, logFiles[cat]);
+}
+
+
+static void
+gbLogReportDropped(void)
+{
+  char timestamp[GB_TIME_STRING_BUFLEN] = {0};
+  unsigned long dropped = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+
+
+  if (dropped == logDroppedReported) {
+    return;
+  }
+
+  logTimeNow(timestamp, GB_TIME_STRING_BUFLEN);
+  if (!logFiles[GB_LOGCAT_MGMT]) {
+    logFiles[GB_LOGCAT_MGMT] = gbLogOpen(GB_LOGCAT_MGMT);
+  }
+  fprintf(logFiles[GB_LOGCAT_MGMT],
+          "[%s] %s: logger dropped %lu messages (%lu in total) [at %s+%d :<%s>]\n",
+          timestamp, LogLevelLookup[GB_LOG_WARNING],
+          dropped - logDroppedReported, dropped, __FILE__, __LINE__,
+          __FUNCTION__);
+  logDroppedReported = dropped;
+}
+
+
+static void *
+gbLogWriter(void *data)
+{
+  char *line;
+  int cat;
+  int i;
+
+
+  while (1) {
+    while (sem_wait(&logSem) < 0 && errno == EINTR)
+      ;
+
+    if (__atomic_exchange_n(&logReopen, 0, __ATOMIC_ACQ_REL)) {
+      gbLogCloseAll();
+    }
+
+    while (gbLogDequeue(&cat, &line)) {
+      gbLogWrite(cat, line);
+      free(line);
+    }
+    gbLogReportDropped();
+
+    for (i = 0; i < GB_LOGCAT_MAX; i++) {
+      if (logFiles[i]) {
+        fflush(logFiles[i]);
+      }
+    }
+
+    if (__atomic_load_n(&logStop, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+
+  gbLogCloseAll();
+
+  return NULL;
+}
+
+
+static void
+gbLogSync(int cat, const char *line)
+{
+  FILE *fd;
+
+
+  LOCK(logSyncLock);
+  fd = gbLogOpen(cat);
+  fputs(line, fd);
+  if (fd != stderr) {
+    fclose(fd);
+  }
+  UNLOCK(logSyncLock);
+}
+
+
+void
+gbLog(int cat, unsigned int level, const char *file, int lineno,
+      const char *func, const char *fmt, ...)
+{
+  char timestamp[GB_TIME_STRING_BUFLEN] = {0};
+  char buf[GB_LOG_MSG_BUFLEN];
+  char *msg = buf;
+  char *line = NULL;
+  va_list ap;
+  int len;
+
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if (len >= (int)sizeof(buf)) {
+    va_start(ap, fmt);
+    len = vasprintf(&msg, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+      return;
+    }
+  }
+
+  logTimeNow(timestamp, GB_TIME_STRING_BUFLEN);
+  if (asprintf(&line, "[%s] %s: %s [at %s+%d :<%s>]\n", timestamp,
+               LogLevelLookup[level], msg, file, lineno, func) < 0) {
+    line = NULL;
+  }
+  if (msg != buf) {
+    free(msg);
+  }
+  if (!line) {
+    return;
+  }
+
+  if (cat < 0 || cat >= GB_LOGCAT_MAX) {
+    cat = GB_LOGCAT_STDERR;
+  }
+
+  if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+    gbLogSync(cat, line);
+    free(line);
+    return;
+  }
+
+  if (gbLogEnqueue(cat, line)) {
+    free(line);
+  }
+}
+
+
+static void
+gbLogStopAtExit(void)
+{
+  gbLogStop();
+}
+
+
+int
+gbLogStart(void)
+{
+  size_t i;
+
+
+  if (logRunning) {
+    return 0;
+  }
+
+  for (i = 0; i < GB_LOG_RING_SIZE; i++) {
+    logRing[i].seq = i;
+  }
+
+  if (sem_init(&logSem, 0, 0) < 0) {
+    return -1;
+  }
+
+  if (pthread_create(&logThread, NULL, gbLogWriter, NULL)) {
+    sem_destroy(&logSem);
+    return -1;
+  }
+  __atomic_store_n(&logRunning, true, __ATOMIC_RELEASE);
+
+  /* don't lose what is still queued when the daemon exits */
+  atexit(gbLogStopAtExit);
+
+  return 0;
+}
+
+
+void
+gbLogStop(void)
+{
+  if (!__atomic_exchange_n(&logRunning, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+
+  __atomic_store_n(&logStop, 1, __ATOMIC_RELEASE);
+  sem_post(&logSem);
+  pthread_join(logThread, NULL);
+}
+
+
+/* async-signal-safe, meant to be called from the SIGHUP handler */
+void
+gbLogReopen(void)
+{
+  if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  __atomic_store_n(&logReopen, 1, __ATOMIC_RELEASE);
+  sem_post(&logSem);
+}
+
+
+unsigned long
+gbLogDroppedCount(void)
+{
+  return __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+}
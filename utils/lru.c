@@ -11,16 +11,91 @@
 # include "lru.h"
 # include "utils.h"
 
+# include <stdint.h>
+
+
+/*
+ * glfs handle cache.
+ *
+ * Entries are indexed by volume name in a small hash table and kept on a
+ * list in LRU order, warmest first. Every handle handed out by queryCache()
+ * holds a reference that is given back with releaseCacheRef(); only entries
+ * without references are evicted, so glfsLruCount is a soft limit when all
+ * the cached handles are busy. Pinned entries are not counted against it.
+ *
+ * While glfs_init() of a volume is in progress the entry is a placeholder
+ * (ready == false), other threads asking for the same volume wait for it
+ * instead of initializing the volume once more.
+ *
+ * Evicted handles are handed to a finalizer thread, so no request waits
+ * for glfs_fini(). The same thread keeps GB_WARM_VOLS_FILE up to date with
+ * the cached volumes, which the daemon warms up again on its next start.
+ *
+ * Each handle also carries the objects of GB_METADIR, GB_STOREDIR and
+ * GB_PRIO_FILE once they are resolved (see cacheGetObject()), they live as
+ * long as the handle does.
+ *
+ * replaceCacheHandle() swaps the handle of a cached volume, e.g. one built
+ * from a saved volfile for one connected through glusterd; the old handle is
+ * finalized once its last user is done.
+ *
+ * When bounds are configured the same thread also resizes the cache every
+ * LRU_ADAPT_INTERVAL seconds: misses on volumes that were evicted recently
+ * (ghost hits) mean the cache is too small, entries nobody used during the
+ * whole interval mean it is too big. Growth is capped by the memory limit,
+ * using the RSS growth observed across glfs_init() as the cost per handle.
+ */
+
+# define   LRU_HASH_BUCKETS     64    /* must be a power of 2 */
+# define   LRU_GHOSTS           64    /* recently evicted volumes remembered */
+# define   LRU_ADAPT_INTERVAL   60    /* seconds */
 
-static struct list_head Cache;
-static int lruCount;
 
 typedef struct Entry {
   char volume[255];
   glfs_t *glfs;
+  unsigned int refs;          /* users of glfs right now */
+  bool ready;                 /* false while glfs_init() is in progress */
+  bool pinned;                /* configured to stay warm, never evicted */
+  time_t lastUsed;
+  struct Entry *retired;      /* handle swapped out by replaceCacheHandle()
+                                 while still in use, refs counts its users */
+  struct glfs_object *objs[GB_OBJ_MAX];  /* resolved once per handle */
+  struct list_head staleObjs; /* invalidated objs, may still be in use */
+
+  struct list_head list;      /* LRU order */
+  struct list_head hash;      /* bucket chain */
+  struct list_head fsHash;    /* bucket chain by glfs, once ready */
+} Entry;
 
+
+typedef struct StaleObj {
+  struct glfs_object *obj;
   struct list_head list;
-} Entry;
+} StaleObj;
+
+
+/* protects everything below; never held across glfs_init/glfs_fini */
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast whenever a placeholder gets ready or is dropped */
+static pthread_cond_t cacheCond = PTHREAD_COND_INITIALIZER;
+static struct list_head Cache;
+static struct list_head Buckets[LRU_HASH_BUCKETS];
+static struct list_head FsBuckets[LRU_HASH_BUCKETS];
+static size_t lruCount;
+static size_t pinnedCount;          /* not subject to glfsLruCount */
+static gbCacheStats stats;          /* counters only, see getCacheStats() */
+static unsigned long windowGhostHits;
+static char ghosts[LRU_GHOSTS][255];
+static size_t ghostNext;
+
+/* finalizer thread state, protected by finiLock */
+static pthread_mutex_t finiLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finiCond = PTHREAD_COND_INITIALIZER;
+static struct list_head finiQueue;
+static bool finiRunning;
+static bool warmDirty;              /* set of cached volumes changed */
+
 
 int
 glusterBlockSetLruCount(const size_t lruCount)
@@ -34,9 +109,9 @@ glusterBlockSetLruCount(const size_t lruCount)
     return -1;
   }
 
-  LOCK(gbConf.lock);
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
   gbConf.glfsLruCount = lruCount;
-  UNLOCK(gbConf.lock);
+  RWUNLOCK(gbConf.cfgLock);
 
   LOG("mgmt", GB_LOG_INFO,
       "glfsLruCount now is %lu\n", lruCount);
@@ -44,92 +119,788 @@ glusterBlockSetLruCount(const size_t lruCount)
 }
 
 
+/* max == 0 turns adaptive sizing off */
+int
+glusterBlockSetLruBounds(size_t min, size_t max, size_t memLimitMiB)
+{
+  if (max && (!min || min > max || max > LRU_COUNT_MAX)) {
+    LOG("mgmt", GB_LOG_ERROR,
+        "glfsLruCount bounds should be 0 < MIN <= MAX <= %d, got %zu..%zu",
+        LRU_COUNT_MAX, min, max);
+    return -1;
+  }
+
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.glfsLruMin = max ? min : 0;
+  gbConf.glfsLruMax = max;
+  gbConf.glfsLruMemLimit = memLimitMiB;
+  RWUNLOCK(gbConf.cfgLock);
+
+  if (max) {
+    LOG("mgmt", GB_LOG_INFO,
+        "glfsLruCount adapts within %zu..%zu, memory limit %zu MiB",
+        min, max, memLimitMiB);
+  }
+  return 0;
+}
+
+
+static size_t
+getLruCount(void)
+{
+  size_t count;
+
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  count = gbConf.glfsLruCount;
+  RWUNLOCK(gbConf.cfgLock);
+
+  return count;
+}
+
+
+/* FNV-1a */
+static struct list_head *
+hashBucket(const char *volname)
+{
+  unsigned int h = 2166136261u;
+
+
+  while (*volname) {
+    h ^= (unsigned char)*volname++;
+    h *= 16777619u;
+  }
+
+  return &Buckets[h & (LRU_HASH_BUCKETS - 1)];
+}
+
+
+static struct list_head *
+fsHashBucket(const glfs_t *fs)
+{
+  uintptr_t h = (uintptr_t)fs;
+
+
+  h ^= h >> 17;
+  h *= 0x9e3779b1u;
+
+  return &FsBuckets[(h >> 8) & (LRU_HASH_BUCKETS - 1)];
+}
+
+
+/* called with cacheLock held, retired handles are found as well */
+static Entry *
+lookupEntryByFs(const glfs_t *fs)
+{
+  struct list_head *bucket = fsHashBucket(fs);
+  Entry *tmp;
+
+
+  list_for_each_entry(tmp, bucket, fsHash) {
+    if (tmp->glfs == fs) {
+      return tmp;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* called with cacheLock held */
+static Entry *
+lookupEntry(const char *volname)
+{
+  struct list_head *bucket = hashBucket(volname);
+  Entry *tmp;
+
+
+  list_for_each_entry(tmp, bucket, hash) {
+    if (!strcmp(tmp->volume, volname)) {
+      return tmp;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* called with cacheLock held */
 static void
-releaseColdEntry(void)
+unlinkEntry(Entry *tmp)
 {
+  list_del(&tmp->list);
+  list_del(&tmp->hash);
+  list_del_init(&tmp->fsHash);
+  lruCount--;
+}
+
+
+/*
+ * Unlink the coldest unused entries until the cache fits in count, moving
+ * them to reaped. Called with cacheLock held, the handles are finalized by
+ * the caller once the lock is dropped.
+ */
+static void
+releaseColdEntries(size_t count, struct list_head *reaped)
+{
+  struct list_head *pos, *prev;
   Entry *tmp;
-  struct list_head *pos, *q = &Cache;
 
 
-  list_for_each_prev(pos, q) {
+  count += pinnedCount;
+  for (pos = Cache.prev; pos != &Cache && lruCount > count; pos = prev) {
+    prev = pos->prev;
     tmp = list_entry(pos, Entry, list);
-    list_del(pos);
+    if (!tmp->ready || tmp->refs || tmp->pinned || tmp->retired) {
+      continue;
+    }
+    unlinkEntry(tmp);
+    list_add(&tmp->list, reaped);
 
-    glfs_fini(tmp->glfs);
-    GB_FREE(tmp);
-    lruCount--;
+    GB_STRCPYSTATIC(ghosts[ghostNext], tmp->volume);
+    ghostNext = (ghostNext + 1) % LRU_GHOSTS;
+    stats.evictions++;
+  }
+}
+
+
+/* called with cacheLock held */
+static bool
+isGhost(const char *volname)
+{
+  size_t i;
+
+
+  for (i = 0; i < LRU_GHOSTS; i++) {
+    if (!strcmp(ghosts[i], volname)) {
+      ghosts[i][0] = '\0';
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static void
+finalizeEntry(Entry *tmp)
+{
+  StaleObj *so, *n;
+  int i;
+
+
+  LOG("gfapi", GB_LOG_DEBUG, "evicting glfs handle of volume %s",
+      tmp->volume);
+  for (i = 0; i < GB_OBJ_MAX; i++) {
+    if (tmp->objs[i]) {
+      glfs_h_close(tmp->objs[i]);
+    }
+  }
+  list_for_each_entry_safe(so, n, &tmp->staleObjs, list) {
+    list_del(&so->list);
+    glfs_h_close(so->obj);
+    GB_FREE(so);
+  }
+  glfs_fini(tmp->glfs);
+  GB_FREE(tmp);
+}
+
+
+/* wake the finalizer; reaped entries (if any) are queued for glfs_fini() */
+static void
+kickFinalizer(struct list_head *reaped, bool changed)
+{
+  Entry *tmp, *n;
+
+
+  LOCK(finiLock);
+  if (finiRunning) {
+    list_splice_init(reaped, finiQueue.prev);
+    warmDirty = warmDirty || changed;
+    pthread_cond_signal(&finiCond);
+    UNLOCK(finiLock);
+    return;
+  }
+  UNLOCK(finiLock);
+
+  /* no finalizer thread (yet), do it ourselves */
+  list_for_each_entry_safe(tmp, n, reaped, list) {
+    list_del(&tmp->list);
+    finalizeEntry(tmp);
+  }
+}
+
+
+/* dump the names of the cached volumes, warmest first */
+static void
+saveWarmVolumes(void)
+{
+  char tmpPath[PATH_MAX];
+  Entry *tmp;
+  FILE *fp;
+
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", GB_WARM_VOLS_FILE);
+  fp = fopen(tmpPath, "w");
+  if (!fp) {
+    LOG("mgmt", GB_LOG_WARNING, "fopen(%s) failed[%s]", tmpPath,
+        strerror(errno));
+    return;
+  }
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  list_for_each_entry(tmp, &Cache, list) {
+    if (tmp->ready) {
+      fprintf(fp, "%s\n", tmp->volume);
+    }
+  }
+  UNLOCK(cacheLock);
+
+  if (fclose(fp) || rename(tmpPath, GB_WARM_VOLS_FILE)) {
+    LOG("mgmt", GB_LOG_WARNING, "saving %s failed[%s]", GB_WARM_VOLS_FILE,
+        strerror(errno));
+    unlink(tmpPath);
+  }
+}
+
+
+/* RSS growth seen across a glfs_init(), feeds the per handle cost */
+void
+cacheAccountInitRss(long deltaKiB)
+{
+  if (deltaKiB <= 0) {
+    return;
+  }
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  if (stats.rssPerHandle) {
+    stats.rssPerHandle = (stats.rssPerHandle * 7 + deltaKiB) / 8;
+  } else {
+    stats.rssPerHandle = deltaKiB;
+  }
+  UNLOCK(cacheLock);
+}
+
+
+/* called from the finalizer thread every LRU_ADAPT_INTERVAL */
+static void
+adaptLruCount(struct list_head *reaped)
+{
+  size_t min, max, memLimit;
+  size_t count, target, byMem;
+  size_t idle = 0;
+  unsigned long ghostHits;
+  time_t now = time(NULL);
+  Entry *tmp;
+
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  min = gbConf.glfsLruMin;
+  max = gbConf.glfsLruMax;
+  memLimit = gbConf.glfsLruMemLimit;
+  count = gbConf.glfsLruCount;
+  RWUNLOCK(gbConf.cfgLock);
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  ghostHits = windowGhostHits;
+  windowGhostHits = 0;
+  if (!max) {
+    UNLOCK(cacheLock);
+    return;
+  }
+
+  list_for_each_entry(tmp, &Cache, list) {
+    if (tmp->ready && !tmp->refs && !tmp->pinned &&
+        now - tmp->lastUsed >= LRU_ADAPT_INTERVAL) {
+      idle++;
+    }
+  }
 
-    break;
+  target = count;
+  if (ghostHits) {
+    target = count + ghostHits;
+  } else if (idle > 1) {
+    target = count - 1;
   }
+  if (memLimit && stats.rssPerHandle) {
+    byMem = memLimit * 1024 / stats.rssPerHandle;
+    if (target > byMem) {
+      target = byMem;
+    }
+  }
+  if (target < min) {
+    target = min;
+  } else if (target > max) {
+    target = max;
+  }
+
+  if (target != count) {
+    if (target > count) {
+      stats.grows++;
+    } else {
+      stats.shrinks++;
+      releaseColdEntries(target, reaped);
+    }
+  }
+  UNLOCK(cacheLock);
+
+  if (target == count) {
+    return;
+  }
+
+  WRLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  gbConf.glfsLruCount = target;
+  RWUNLOCK(gbConf.cfgLock);
+
+  LOG("mgmt", GB_LOG_INFO,
+      "glfsLruCount adapted %zu -> %zu (ghost hits %lu, idle %zu, "
+      "~%lu KiB per handle)", count, target, ghostHits, idle,
+      stats.rssPerHandle);
+}
+
+
+static void *
+cacheFinalizerThread(void *data)
+{
+  struct list_head reaped;
+  struct timespec deadline;
+  Entry *tmp, *n;
+  bool dirty;
+  bool adapt;
+
+
+  INIT_LIST_HEAD(&reaped);
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LRU_ADAPT_INTERVAL;
+
+  while (1) {
+    adapt = false;
+    LOCK(finiLock);
+    while (list_empty(&finiQueue) && !warmDirty) {
+      if (pthread_cond_timedwait(&finiCond, &finiLock, &deadline) == ETIMEDOUT) {
+        adapt = true;
+        break;
+      }
+    }
+    list_splice_init(&finiQueue, &reaped);
+    dirty = warmDirty;
+    warmDirty = false;
+    UNLOCK(finiLock);
+
+    if (adapt) {
+      adaptLruCount(&reaped);
+      dirty = dirty || !list_empty(&reaped);
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += LRU_ADAPT_INTERVAL;
+    }
+
+    list_for_each_entry_safe(tmp, n, &reaped, list) {
+      list_del(&tmp->list);
+      finalizeEntry(tmp);
+    }
+
+    if (dirty) {
+      saveWarmVolumes();
+    }
+  }
+
+  return NULL;
 }
 
 
+/*
+ * Returns a referenced handle for volname, or NULL. In the latter case
+ * *initOwner tells whether the caller now owns a placeholder for volname
+ * and has to initialize the volume and then call appendNewEntry() or
+ * dropNewEntry(); if it is false the placeholder could not be allocated.
+ */
+glfs_t *
+queryCache(const char *volname, bool *initOwner)
+{
+  Entry *tmp;
+  glfs_t *glfs = NULL;
+
+
+  *initOwner = false;
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  while (1) {
+    tmp = lookupEntry(volname);
+    if (!tmp) {
+      if (GB_ALLOC(tmp) < 0) {
+        break;
+      }
+      GB_STRCPYSTATIC(tmp->volume, volname);
+      INIT_LIST_HEAD(&tmp->staleObjs);
+      INIT_LIST_HEAD(&tmp->fsHash);
+      list_add(&tmp->hash, hashBucket(volname));
+      list_add(&tmp->list, &Cache);
+      lruCount++;
+      *initOwner = true;
+      stats.misses++;
+      if (isGhost(volname)) {
+        stats.ghostHits++;
+        windowGhostHits++;
+      }
+      break;
+    }
+
+    if (tmp->ready) {
+      tmp->refs++;
+      tmp->lastUsed = time(NULL);
+      list_move(&tmp->list, &Cache);
+      glfs = tmp->glfs;
+      stats.hits++;
+      break;
+    }
+
+    /* someone else is initializing this volume, wait for it */
+    stats.coalesced++;
+    pthread_cond_wait(&cacheCond, &cacheLock);
+  }
+  UNLOCK(cacheLock);
+
+  return glfs;
+}
+
+
+/* publish the handle initialized for the placeholder of volname, the
+ * caller keeps a reference to it */
 int
 appendNewEntry(const char *volname, glfs_t *fs)
+{
+  struct list_head reaped;
+  size_t count = getLruCount();
+  Entry *tmp;
+  int ret = -1;
+
+
+  INIT_LIST_HEAD(&reaped);
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntry(volname);
+  if (tmp && !tmp->ready) {
+    tmp->glfs = fs;
+    tmp->refs = 1;
+    tmp->ready = true;
+    list_add(&tmp->fsHash, fsHashBucket(fs));
+    tmp->lastUsed = time(NULL);
+    releaseColdEntries(count, &reaped);
+    ret = 0;
+  }
+  pthread_cond_broadcast(&cacheCond);
+  UNLOCK(cacheLock);
+
+  kickFinalizer(&reaped, !ret);
+
+  return ret;
+}
+
+
+/* initialization of volname failed, let the waiters try on their own */
+void
+dropNewEntry(const char *volname)
 {
   Entry *tmp;
 
 
-  LOCK(gbConf.lock);
-  if (lruCount == gbConf.glfsLruCount) {
-    releaseColdEntry();
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntry(volname);
+  if (tmp && !tmp->ready) {
+    unlinkEntry(tmp);
+    GB_FREE(tmp);
   }
+  pthread_cond_broadcast(&cacheCond);
+  UNLOCK(cacheLock);
+}
+
 
-  if (GB_ALLOC(tmp) < 0) {
-    UNLOCK(gbConf.lock);
+void
+releaseCacheRef(const char *volname, glfs_t *fs)
+{
+  struct list_head reaped;
+  size_t count = getLruCount();
+  Entry *tmp;
+
+
+  INIT_LIST_HEAD(&reaped);
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntry(volname);
+  if (tmp && tmp->retired && tmp->retired->glfs == fs) {
+    if (!--tmp->retired->refs) {
+      list_del_init(&tmp->retired->fsHash);
+      list_add(&tmp->retired->list, &reaped);
+      tmp->retired = NULL;
+    }
+    UNLOCK(cacheLock);
+    kickFinalizer(&reaped, false);
+    return;
+  }
+  if (!tmp || tmp->glfs != fs || !tmp->refs) {
+    UNLOCK(cacheLock);
+    LOG("gfapi", GB_LOG_WARNING,
+        "releasing a glfs handle of volume %s that is not referenced", volname);
+    return;
+  }
+
+  tmp->refs--;
+  if (!tmp->refs) {
+    releaseColdEntries(count, &reaped);
+  }
+  UNLOCK(cacheLock);
+
+  if (!list_empty(&reaped)) {
+    kickFinalizer(&reaped, true);
+  }
+}
+
+
+/*
+ * Make fs the cached handle of volname. Current users keep the old handle
+ * until they release it, then it is finalized. Returns -1 if volname is not
+ * cached (anymore) and 1 if its handle is still being initialized or an
+ * earlier replacement is still in use, the caller keeps fs then.
+ */
+int
+replaceCacheHandle(const char *volname, glfs_t *fs)
+{
+  struct list_head reaped;
+  Entry *old;
+  Entry *tmp;
+  int ret = -1;
+
+
+  INIT_LIST_HEAD(&reaped);
+  if (GB_ALLOC(old) < 0) {
     return -1;
   }
-  GB_STRCPYSTATIC(tmp->volume, volname);
-  tmp->glfs = fs;
+  GB_STRCPYSTATIC(old->volume, volname);
+  INIT_LIST_HEAD(&old->staleObjs);
+  INIT_LIST_HEAD(&old->fsHash);
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntry(volname);
+  if (tmp && (!tmp->ready || tmp->retired)) {
+    ret = 1;
+  } else if (tmp) {
+    old->glfs = tmp->glfs;
+    old->refs = tmp->refs;
+    memcpy(old->objs, tmp->objs, sizeof(old->objs));
+    memset(tmp->objs, 0, sizeof(tmp->objs));
+    list_splice_init(&tmp->staleObjs, &old->staleObjs);
+    list_del_init(&tmp->fsHash);
+    if (old->refs) {
+      tmp->retired = old;
+      list_add(&old->fsHash, fsHashBucket(old->glfs));
+    } else {
+      list_add(&old->list, &reaped);
+    }
+    old = NULL;
+    tmp->glfs = fs;
+    tmp->refs = 0;
+    list_add(&tmp->fsHash, fsHashBucket(fs));
+    ret = 0;
+  }
+  UNLOCK(cacheLock);
 
-  list_add(&(tmp->list), &Cache);
+  GB_FREE(old);
+  kickFinalizer(&reaped, false);
 
-  lruCount++;
-  UNLOCK(gbConf.lock);
+  return ret;
+}
 
-  return 0;
+
+/* the object resolved for which on the cached handle fs, if any */
+struct glfs_object *
+cacheGetObject(glfs_t *fs, gbGlfsObj which)
+{
+  struct glfs_object *obj = NULL;
+  Entry *tmp;
+
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntryByFs(fs);
+  if (tmp) {
+    obj = tmp->objs[which];
+  }
+  UNLOCK(cacheLock);
+
+  return obj;
 }
 
 
-static void
-boostEntryWarmness(const char *volname)
+/*
+ * Remember obj as the object for which on the cached handle fs. Returns
+ * the object to use: obj itself if the cache took it over, the one some
+ * other thread resolved first, or NULL if fs is not a cached handle. In
+ * the last two cases obj is still the caller's to close.
+ */
+struct glfs_object *
+cacheSetObject(glfs_t *fs, gbGlfsObj which, struct glfs_object *obj)
 {
   Entry *tmp;
-  struct list_head *pos, *q;
 
 
-  list_for_each_safe(pos, q, &Cache){
-    tmp = list_entry(pos, Entry, list);
-    if (!strcmp(tmp->volume, volname)) {
-      list_del(pos);
-      list_add(&(tmp->list), &Cache);
-      break;
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntryByFs(fs);
+  if (tmp) {
+    if (!tmp->objs[which]) {
+      tmp->objs[which] = obj;
     }
+    obj = tmp->objs[which];
+  } else {
+    obj = NULL;
   }
+  UNLOCK(cacheLock);
+
+  return obj;
 }
 
 
-glfs_t *
-queryCache(const char *volname)
+/*
+ * obj went stale (e.g. the directory was recreated), resolve it again the
+ * next time. Other threads may still be using it, so it is only closed
+ * along with the handle.
+ */
+void
+cacheStaleObject(glfs_t *fs, gbGlfsObj which, struct glfs_object *obj)
 {
+  StaleObj *so;
   Entry *tmp;
-  struct list_head *pos, *q, *r = &Cache;
 
 
-  list_for_each_safe(pos, q, r){
-    tmp = list_entry(pos, Entry, list);
-    if (!strcmp(tmp->volume, volname)) {
-      boostEntryWarmness(volname);
-      return tmp->glfs;
+  if (GB_ALLOC(so) < 0) {
+    return;
+  }
+  so->obj = obj;
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntryByFs(fs);
+  if (tmp && tmp->objs[which] == obj) {
+    tmp->objs[which] = NULL;
+    list_add(&so->list, &tmp->staleObjs);
+    so = NULL;
+  }
+  UNLOCK(cacheLock);
+
+  GB_FREE(so);
+}
+
+
+/* keep the cached handle of volname around for good */
+void
+pinCacheEntry(const char *volname)
+{
+  Entry *tmp;
+
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  tmp = lookupEntry(volname);
+  if (tmp && tmp->ready && !tmp->pinned) {
+    tmp->pinned = true;
+    pinnedCount++;
+  }
+  UNLOCK(cacheLock);
+}
+
+
+/*
+ * Volumes that were cached when the daemon last ran, warmest first.
+ * Returns NULL if there is no such record.
+ */
+strToCharArrayDefPtr
+loadWarmVolumes(void)
+{
+  strToCharArrayDefPtr vols = NULL;
+  char *line = NULL;
+  size_t n = 0;
+  ssize_t len;
+  FILE *fp;
+
+
+  fp = fopen(GB_WARM_VOLS_FILE, "r");
+  if (!fp) {
+    return NULL;
+  }
+
+  if (GB_ALLOC(vols) < 0) {
+    goto out;
+  }
+
+  while ((len = getline(&line, &n, fp)) != -1) {
+    if (len && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (!len || len >= sizeof(((Entry *)0)->volume)) {
+      continue;
     }
+    if (GB_REALLOC_N(vols->data, vols->len + 1) < 0 ||
+        GB_STRDUP(vols->data[vols->len], line) < 0) {
+      strToCharArrayDefFree(vols);
+      vols = NULL;
+      goto out;
+    }
+    vols->len++;
   }
 
-  return NULL;
+ out:
+  GB_FREE(line);
+  fclose(fp);
+
+  return vols;
+}
+
+
+void
+getCacheStats(gbCacheStats *st)
+{
+  Entry *tmp;
+
+
+  LOCK_TIMED(cacheLock, GB_LOCK_GLFS_CACHE);
+  *st = stats;
+  st->cached = lruCount;
+  st->pinned = pinnedCount;
+  st->busy = 0;
+  list_for_each_entry(tmp, &Cache, list) {
+    if (tmp->refs) {
+      st->busy++;
+    }
+  }
+  UNLOCK(cacheLock);
+
+  RDLOCK(gbConf.cfgLock, GB_LOCK_CONFIG);
+  st->limit = gbConf.glfsLruCount;
+  st->limitMin = gbConf.glfsLruMin;
+  st->limitMax = gbConf.glfsLruMax;
+  st->memLimit = gbConf.glfsLruMemLimit;
+  RWUNLOCK(gbConf.cfgLock);
 }
 
 
 void
 initCache(void)
 {
+  pthread_t tid;
+  int i;
+
+
   INIT_LIST_HEAD(&Cache);
+  for (i = 0; i < LRU_HASH_BUCKETS; i++) {
+    INIT_LIST_HEAD(&Buckets[i]);
+    INIT_LIST_HEAD(&FsBuckets[i]);
+  }
+  INIT_LIST_HEAD(&finiQueue);
+
+  if (pthread_create(&tid, NULL, cacheFinalizerThread, NULL)) {
+    LOG("mgmt", GB_LOG_WARNING, "%s",
+        "failed to start the glfs finalizer, evicting synchronously");
+    return;
+  }
+  pthread_detach(tid);
+
+  LOCK(finiLock);
+  finiRunning = true;
+  UNLOCK(finiLock);
 }
@@ -13,6 +13,7 @@
 # define   _LRU_H   1
 
 # include  <glusterfs/api/glfs.h>
+# include  <glusterfs/api/glfs-handles.h>
 
 # include  "common.h"
 # include  "list.h"
@@ -20,17 +21,82 @@
 # define   LRU_COUNT_MAX   512
 # define   LRU_COUNT_DEF   5
 
+/* volumes cached when the daemon last ran, one per line */
+# define   GB_WARM_VOLS_FILE   CONFDIR "/glfs-warm-volumes"
+
+/* objects resolved once per cached glfs handle */
+typedef enum gbGlfsObj {
+  GB_OBJ_METADIR   = 0,       /* GB_METADIR */
+  GB_OBJ_STOREDIR  = 1,       /* GB_STOREDIR */
+  GB_OBJ_PRIOFILE  = 2,       /* GB_PRIO_FILE */
+  GB_OBJ_TRASHDIR  = 3,       /* GB_TRASHDIR */
+
+  GB_OBJ_MAX
+} gbGlfsObj;
+
+typedef struct gbCacheStats {
+  size_t cached;              /* entries, including the ones being initialized */
+  size_t pinned;
+  size_t busy;                /* entries with references */
+  size_t limit;               /* current glfsLruCount */
+  size_t limitMin;            /* adaptive sizing bounds, 0 when off */
+  size_t limitMax;
+  size_t memLimit;            /* MiB, 0 for no limit */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long coalesced;    /* waits on another thread's glfs_init() */
+  unsigned long ghostHits;    /* misses on recently evicted volumes */
+  unsigned long evictions;
+  unsigned long grows;
+  unsigned long shrinks;
+  unsigned long rssPerHandle; /* KiB, moving average */
+} gbCacheStats;
+
+
 void
 initCache(void);
 
 glfs_t *
-queryCache(const char *volname);
+queryCache(const char *volname, bool *initOwner);
 
 int
 appendNewEntry(const char *volname, glfs_t *glfs);
 
+void
+dropNewEntry(const char *volname);
+
+void
+releaseCacheRef(const char *volname, glfs_t *glfs);
+
+int
+replaceCacheHandle(const char *volname, glfs_t *glfs);
+
+struct glfs_object *
+cacheGetObject(glfs_t *fs, gbGlfsObj which);
+
+struct glfs_object *
+cacheSetObject(glfs_t *fs, gbGlfsObj which, struct glfs_object *obj);
+
+void
+cacheStaleObject(glfs_t *fs, gbGlfsObj which, struct glfs_object *obj);
+
+void
+pinCacheEntry(const char *volname);
+
+strToCharArrayDefPtr
+loadWarmVolumes(void);
+
 int
 glusterBlockSetLruCount(const size_t lruCount);
 
+int
+glusterBlockSetLruBounds(size_t min, size_t max, size_t memLimitMiB);
+
+void
+cacheAccountInitRss(long deltaKiB);
+
+void
+getCacheStats(gbCacheStats *st);
+
 
 # endif /* _LRU_H */
@@ -0,0 +1,359 @@
+/*
+  Copyright (c) 2019 Red Hat, Inc. <http://www.redhat.com>
+  This file is part of gluster-block.
+
+  This file is licensed to you under your choice of the GNU Lesser
+  General Public License, version 3 or any later version (LGPLv3 or
+  later), or the GNU General Public License, version 2 (GPLv2), in all
+  cases as published by the Free Software Foundation.
+*/
+
+
+# include  "runner.h"
+
+# include  <fcntl.h>
+# include  <poll.h>
+# include  <signal.h>
+# include  <spawn.h>
+# include  <sys/wait.h>
+
+
+# define   GB_RUNNER_READ_CHUNK    8192
+
+extern char **environ;
+
+static gbRunnerStats runnerStats;
+static pthread_mutex_t runnerStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+gbRunnerArgvToStr(char *const argv[], char *buf, size_t len)
+{
+  size_t off = 0;
+  int i;
+
+
+  buf[0] = '\0';
+  for (i = 0; argv[i] && off < len; i++) {
+    off += snprintf(buf + off, len - off, "%s%s", i ? " " : "", argv[i]);
+  }
+}
+
+
+static void
+gbRunnerUpdateStats(gbRunnerResult *res, bool failed)
+{
+  LOCK(runnerStatsLock);
+  runnerStats.runs++;
+  if (failed) {
+    runnerStats.failures++;
+  }
+  if (res->timedOut) {
+    runnerStats.timeouts++;
+  }
+  runnerStats.spawnUsecTotal += res->spawnUsec;
+  runnerStats.execUsecTotal += res->execUsec;
+  if (res->spawnUsec > runnerStats.spawnUsecMax) {
+    runnerStats.spawnUsecMax = res->spawnUsec;
+  }
+  if (res->execUsec > runnerStats.execUsecMax) {
+    runnerStats.execUsecMax = res->execUsec;
+  }
+  UNLOCK(runnerStatsLock);
+}
+
+
+void
+gbRunnerGetStats(gbRunnerStats *stats)
+{
+  LOCK(runnerStatsLock);
+  *stats = runnerStats;
+  UNLOCK(runnerStatsLock);
+}
+
+
+int
+gbRunnerExitStatus(int exitStatus)
+{
+  if (!WIFEXITED(exitStatus)) {
+    return -1;
+  }
+
+  return WEXITSTATUS(exitStatus);
+}
+
+
+/* read whatever is available on fd into res->out, growing it as needed;
+ * returns 0 on EOF, 1 if more data may follow and -1 on error */
+static int
+gbRunnerReadOutput(int fd, gbRunnerResult *res, size_t *cap)
+{
+  char drain[GB_RUNNER_READ_CHUNK];
+  ssize_t n;
+
+
+  while (1) {
+    if (res->outLen + GB_RUNNER_READ_CHUNK + 1 > *cap) {
+      if (*cap >= GB_RUNNER_OUT_MAX) {
+        /* keep the child moving, but stop buffering */
+        n = read(fd, drain, sizeof(drain));
+        goto check;
+      }
+      if (GB_REALLOC_N(res->out, *cap * 2) < 0) {
+        return -1;
+      }
+      *cap *= 2;
+    }
+
+    n = read(fd, res->out + res->outLen, *cap - res->outLen - 1);
+    if (n > 0) {
+      res->outLen += n;
+      res->out[res->outLen] = '\0';
+    }
+ check:
+    if (n == 0) {
+      return 0;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN) ? 1 : -1;
+    }
+  }
+}
+
+
+/*
+ * Run argv[0] (looked up in PATH) with the given arguments, without a shell.
+ * If input is not NULL it is fed to the child's stdin, otherwise stdin is
+ * /dev/null. stdout is collected in res->out, stderr is inherited.
+ *
+ * The child is placed in its own process group, and the whole group is
+ * SIGKILLed if it does not finish within timeout seconds (0 means wait
+ * forever).
+ *
+ * Returns 0 if the child was reaped (check res->exitStatus), -1 otherwise.
+ * On return res->out is always allocated and must be freed by the caller.
+ */
+int
+gbRunnerExec(char *const argv[], const char *input, unsigned int timeout,
+             gbRunnerResult *res)
+{
+  int outPipe[2] = {-1, -1};
+  int inPipe[2] = {-1, -1};
+  int outFd = -1;
+  int inFd = -1;
+  size_t inLen = input ? strlen(input) : 0;
+  size_t inOff = 0;
+  size_t cap = GB_RUNNER_READ_CHUNK;
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  struct pollfd pfd[2];
+  unsigned long long start;
+  unsigned long long deadline = 0;
+  unsigned long long now;
+  char cmd[1024];
+  pid_t pid = -1;
+  int status;
+  int nfds;
+  int ret = -1;
+
+
+  memset(res, 0, sizeof(*res));
+  res->exitStatus = -1;
+  gbRunnerArgvToStr(argv, cmd, sizeof(cmd));
+
+  if (GB_ALLOC_N(res->out, cap) < 0) {
+    return -1;
+  }
+
+  if (pipe2(outPipe, O_CLOEXEC) < 0 || (input && pipe2(inPipe, O_CLOEXEC) < 0)) {
+    LOG("mgmt", GB_LOG_ERROR, "pipe2() for command '%s' failed[%s]",
+        cmd, strerror(errno));
+    goto closefds;
+  }
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, outPipe[1], STDOUT_FILENO);
+  if (input) {
+    posix_spawn_file_actions_adddup2(&fa, inPipe[0], STDIN_FILENO);
+  } else {
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, DEVNULLPATH, O_RDONLY, 0);
+  }
+
+  /* own process group, clean signal state (the daemon ignores SIGPIPE) */
+  posix_spawnattr_init(&attr);
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  sigaddset(&mask, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &mask);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  start = gbTimeNowUsec();
+  ret = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+  res->spawnUsec = gbTimeNowUsec() - start;
+
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+
+  if (ret) {
+    LOG("mgmt", GB_LOG_ERROR, "posix_spawnp() for command '%s' failed[%s]",
+        cmd, strerror(ret));
+    errno = ret;
+    ret = -1;
+    gbRunnerUpdateStats(res, true);
+    goto closefds;
+  }
+
+  /* close the child ends */
+  close(outPipe[1]);
+  outPipe[1] = -1;
+  outFd = outPipe[0];
+  outPipe[0] = -1;
+  fcntl(outFd, F_SETFL, O_NONBLOCK);
+  if (input) {
+    close(inPipe[0]);
+    inPipe[0] = -1;
+    inFd = inPipe[1];
+    fcntl(inFd, F_SETFL, O_NONBLOCK);
+    if (!inLen) {
+      close(inFd);
+      inFd = -1;
+    }
+    inPipe[1] = -1;
+  }
+
+  if (timeout) {
+    deadline = start + (unsigned long long)timeout * 1000000;
+  }
+
+  while (outFd >= 0) {
+    now = gbTimeNowUsec();
+    if (deadline && now >= deadline) {
+      res->timedOut = true;
+      break;
+    }
+
+    nfds = 0;
+    pfd[nfds].fd = outFd;
+    pfd[nfds].events = POLLIN;
+    pfd[nfds++].revents = 0;
+    if (inFd >= 0) {
+      pfd[nfds].fd = inFd;
+      pfd[nfds].events = POLLOUT;
+      pfd[nfds++].revents = 0;
+    }
+
+    ret = poll(pfd, nfds, deadline ? (int)((deadline - now) / 1000) + 1 : -1);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG("mgmt", GB_LOG_ERROR, "poll() for command '%s' failed[%s]",
+          cmd, strerror(errno));
+      break;
+    }
+
+    if (inFd >= 0 && pfd[1].revents) {
+      ssize_t n = 0;
+
+      if (pfd[1].revents & POLLOUT) {
+        n = write(inFd, input + inOff, inLen - inOff);
+        if (n > 0) {
+          inOff += n;
+        }
+      }
+      if (inOff == inLen || (pfd[1].revents & (POLLERR | POLLHUP)) ||
+          (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(inFd);
+        inFd = -1;
+      }
+    }
+
+    if (pfd[0].revents) {
+      ret = gbRunnerReadOutput(outFd, res, &cap);
+      if (ret <= 0) {
+        if (ret < 0) {
+          LOG("mgmt", GB_LOG_ERROR, "reading output of command '%s' failed[%s]",
+              cmd, strerror(errno));
+        }
+        close(outFd);
+        outFd = -1;
+      }
+    }
+  }
+
+  if (outFd >= 0) {
+    /* timed out or poll failed, take down the whole process group */
+    kill(-pid, SIGKILL);
+    deadline = 0;
+  }
+
+  /* the child may have closed stdout and still be running */
+  while ((ret = waitpid(pid, &status, deadline ? WNOHANG : 0)) <= 0) {
+    if (ret < 0 && errno != EINTR) {
+      status = -1;
+      break;
+    }
+    if (!ret && gbTimeNowUsec() >= deadline) {
+      res->timedOut = true;
+      kill(-pid, SIGKILL);
+      deadline = 0;
+    } else if (!ret) {
+      usleep(1000);
+    }
+  }
+  res->execUsec = gbTimeNowUsec() - start;
+
+  if (res->timedOut) {
+    LOG("mgmt", GB_LOG_ERROR, "command '%s' timed out after %u seconds, killed",
+        cmd, timeout);
+  } else if (status != -1) {
+    res->exitStatus = gbRunnerExitStatus(status);
+  }
+  ret = 0;
+
+  gbRunnerUpdateStats(res, res->exitStatus == -1);
+  LOG("mgmt", GB_LOG_DEBUG,
+      "command '%s': pid %d exit %d spawn %lu usec exec %lu usec output %zu bytes",
+      cmd, pid, res->exitStatus, res->spawnUsec, res->execUsec, res->outLen);
+
+ closefds:
+  if (outFd >= 0) {
+    close(outFd);
+  }
+  if (inFd >= 0) {
+    close(inFd);
+  }
+  for (nfds = 0; nfds < 2; nfds++) {
+    if (outPipe[nfds] >= 0) {
+      close(outPipe[nfds]);
+    }
+    if (inPipe[nfds] >= 0) {
+      close(inPipe[nfds]);
+    }
+  }
+
+  return ret;
+}
+
+
+/* like gbRunnerExec() but only the exit status is of interest */
+int
+gbRunner(char *const argv[], unsigned int timeout)
+{
+  gbRunnerResult res;
+  int ret;
+
+
+  ret = gbRunnerExec(argv, NULL, timeout, &res);
+  GB_FREE(res.out);
+  if (ret) {
+    return -1;
+  }
+
+  return res.exitStatus;
+}
@@ -0,0 +1,60 @@
+/*
+  Copyright (c) 2019 Red Hat, Inc. <http://www.redhat.com>
+  This file is part of gluster-block.
+
+  This file is licensed to you under your choice of the GNU Lesser
+  General Public License, version 3 or any later version (LGPLv3 or
+  later), or the GNU General Public License, version 2 (GPLv2), in all
+  cases as published by the Free Software Foundation.
+*/
+
+
+# ifndef   _RUNNER_H
+# define   _RUNNER_H   1
+
+# include  "utils.h"
+
+/* timeouts in seconds */
+# define   GB_RUNNER_TIMEOUT_DEF   60
+# define   GB_TGCLI_TIMEOUT        180   /* targetcli config batches */
+# define   GB_TGCLI_QUERY_TIMEOUT  60    /* targetcli ls/status queries */
+
+/* never hold more than this much of a child's output */
+# define   GB_RUNNER_OUT_MAX       (4 * 1024 * 1024)
+
+
+typedef struct gbRunnerResult {
+  int exitStatus;             /* -1 on abnormal exit or timeout */
+  bool timedOut;
+  char *out;                  /* stdout of the child, always '\0' terminated */
+  size_t outLen;
+  unsigned long spawnUsec;    /* time taken by posix_spawn() */
+  unsigned long execUsec;     /* time from spawn till the child is reaped */
+} gbRunnerResult;
+
+typedef struct gbRunnerStats {
+  unsigned long runs;
+  unsigned long failures;     /* spawn errors and abnormal exits */
+  unsigned long timeouts;
+  unsigned long long spawnUsecTotal;
+  unsigned long long execUsecTotal;
+  unsigned long spawnUsecMax;
+  unsigned long execUsecMax;
+} gbRunnerStats;
+
+
+int
+gbRunnerExitStatus(int exitStatus);
+
+int
+gbRunnerExec(char *const argv[], const char *input, unsigned int timeout,
+             gbRunnerResult *res);
+
+int
+gbRunner(char *const argv[], unsigned int timeout);
+
+void
+gbRunnerGetStats(gbRunnerStats *stats);
+
+
+# endif /* _RUNNER_H */
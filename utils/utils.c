@@ -10,6 +10,8 @@
 
 
 # include  <dirent.h>
+# include  <stdarg.h>
+# include  <stdint.h>
 # include  <sys/stat.h>
 
 # include "utils.h"
@@ -18,10 +20,16 @@
 
 struct gbConf gbConf = {
   .glfsLruCount = LRU_COUNT_DEF,
+  .glfsVolfileCache = true,
+  .preallocThreads = GB_PREALLOC_THREADS_DEF,
+  .replaceHostParallel = GB_REPLACE_HOST_PARALLEL_DEF,
   .logLevel = GB_LOG_INFO,
-  .logDir = GB_LOGDIR
+  .logDir = GB_LOGDIR,
+  .cfgLock = PTHREAD_RWLOCK_INITIALIZER
 };
 
+static gbLockStats lockStats[GB_LOCK_MAX];
+
 const char *argp_program_version = ""                                 \
   PACKAGE_NAME" ("PACKAGE_VERSION")"                                  \
   "\nRepository rev: https://github.com/gluster/gluster-block.git\n"  \
@@ -40,136 +48,192 @@ glusterBlockSetLogLevel(unsigned int logLevel)
     MSG(stderr, "unknown LOG-LEVEL: '%d'\n", logLevel);
     return -1;
   }
-  LOCK(gbConf.lock);
-  gbConf.logLevel = logLevel;
-  UNLOCK(gbConf.lock);
+  /* read locklessly by every LOG(), so no lock here */
+  __atomic_store_n(&gbConf.logLevel, logLevel, __ATOMIC_RELAXED);
   LOG("mgmt", GB_LOG_INFO,
       "logLevel now is %s\n", LogLevelLookup[logLevel]);
 
   return 0;
 }
 
-int
-glusterBlockCLIOptEnumParse(const char *opt)
-{
-  int i;
+/*
+ * The option, key and status tables are parsed on every metafile line
+ * and every cli/daemon argument, so rather than strcmp()ing through a
+ * lookup table, each table gets a perfect hash: a seed is searched once,
+ * on first use, such that every name of the table lands in its own slot.
+ * A parse then costs one hash over the input and one strcmp().
+ */
+# define  GB_ENUM_HASH_SLOTS  64     /* power of 2, well above any table */
+# define  GB_ENUM_HASH_TRIES  (1 << 20)   /* seeds tried before giving up */
+
+typedef struct gbEnumHash {
+  const char *const *lookup;
+  int max;
+  bool linear;          /* no seed found, strcmp() through the table */
+  uint32_t seed;
+  unsigned char slot[GB_ENUM_HASH_SLOTS];   /* enum + 1, 0 is empty */
+} gbEnumHash;
+
+# define GB_ENUM_HASH_INIT(table, count)   \
+  { .lookup = table, .max = count }
+
+static gbEnumHash cliOptHash =
+  GB_ENUM_HASH_INIT(gbCliCmdlineOptLookup, GB_CLI_OPT_MAX);
+static gbEnumHash cliCreateOptHash =
+  GB_ENUM_HASH_INIT(gbCliCreateOptLookup, GB_CLI_CREATE_OPT_MAX);
+static gbEnumHash daemonOptHash =
+  GB_ENUM_HASH_INIT(gbDaemonCmdlineOptLookup, GB_DAEMON_OPT_MAX);
+static gbEnumHash logLevelHash =
+  GB_ENUM_HASH_INIT(LogLevelLookup, GB_LOG_MAX);
+static gbEnumHash metaKeyHash =
+  GB_ENUM_HASH_INIT(MetakeyLookup, GB_METAKEY_MAX);
+static gbEnumHash metaStatusHash =
+  GB_ENUM_HASH_INIT(MetaStatusLookup, GB_METASTATUS_MAX);
+
+static pthread_once_t gbEnumHashOnceCtl = PTHREAD_ONCE_INIT;
+
+static gbEnumHash *const gbEnumHashes[] = {
+  &cliOptHash, &cliCreateOptHash, &daemonOptHash,
+  &logLevelHash, &metaKeyHash, &metaStatusHash, NULL
+};
 
 
-  if (!opt) {
-    return GB_CLI_OPT_MAX;
-  }
+static uint32_t
+gbEnumHashStr(const char *str, uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ seed;
 
-  for (i = 0; i < GB_CLI_OPT_MAX; i++) {
-    if (!strcmp(opt, gbCliCmdlineOptLookup[i])) {
-      return i;
-    }
+
+  while (*str) {
+    h ^= (unsigned char)*str++;
+    h *= 16777619u;
   }
 
-  return i;
+  return h ^ (h >> 15);
 }
 
 
-int
-glusterBlockCLICreateOptEnumParse(const char *opt)
+static void
+gbEnumHashBuild(gbEnumHash *eh)
 {
+  uint32_t seed;
+  uint32_t s;
   int i;
 
 
-  if (!opt) {
-    return GB_CLI_CREATE_OPT_MAX;
-  }
-
-  for (i = 0; i < GB_CLI_CREATE_OPT_MAX; i++) {
-    if (!strcmp(opt, gbCliCreateOptLookup[i])) {
-      return i;
+  /* a table too big, or with a name twice, never gets a seed */
+  for (seed = 0; eh->max <= GB_ENUM_HASH_SLOTS && seed < GB_ENUM_HASH_TRIES;
+       seed++) {
+    memset(eh->slot, 0, sizeof(eh->slot));
+    for (i = 0; i < eh->max; i++) {
+      s = gbEnumHashStr(eh->lookup[i], seed) & (GB_ENUM_HASH_SLOTS - 1);
+      if (eh->slot[s]) {
+        break;
+      }
+      eh->slot[s] = i + 1;
+    }
+    if (i == eh->max) {
+      eh->seed = seed;
+      return;
     }
   }
 
-  return i;
+  LOG("mgmt", GB_LOG_WARNING, "no perfect hash for the %d names starting "
+      "with '%s', parsing them with a linear scan", eh->max,
+      eh->max ? eh->lookup[0] : "");
+  eh->linear = true;
 }
 
 
-int
-glusterBlockDaemonOptEnumParse(const char *opt)
+static void
+gbEnumHashOnce(void)
 {
   int i;
 
 
-  if (!opt) {
-    return GB_DAEMON_OPT_MAX;
-  }
-
-  for (i = 0; i < GB_DAEMON_OPT_MAX; i++) {
-    /* clip '--' from option */
-    while (*opt == '-') {
-      opt++;
-    }
-    if (!strcmp(opt, gbDaemonCmdlineOptLookup[i])) {
-      return i;
-    }
+  for (i = 0; gbEnumHashes[i]; i++) {
+    gbEnumHashBuild(gbEnumHashes[i]);
   }
-
-  return i;
 }
 
 
-int
-blockLogLevelEnumParse(const char *opt)
+static int
+gbEnumHashParse(gbEnumHash *eh, const char *opt)
 {
+  unsigned char idx;
   int i;
 
 
   if (!opt) {
-    return GB_LOG_MAX;
+    return eh->max;
   }
 
-  for (i = 0; i < GB_LOG_MAX; i++) {
-    if (!strcmp(opt, LogLevelLookup[i])) {
-      return i;
+  pthread_once(&gbEnumHashOnceCtl, gbEnumHashOnce);
+
+  if (eh->linear) {
+    for (i = 0; i < eh->max; i++) {
+      if (!strcmp(opt, eh->lookup[i])) {
+        return i;
+      }
     }
+    return eh->max;
   }
 
-  return i;
+  idx = eh->slot[gbEnumHashStr(opt, eh->seed) & (GB_ENUM_HASH_SLOTS - 1)];
+  if (idx && !strcmp(opt, eh->lookup[idx - 1])) {
+    return idx - 1;
+  }
+
+  return eh->max;
 }
 
 
 int
-blockMetaKeyEnumParse(const char *opt)
+glusterBlockCLIOptEnumParse(const char *opt)
 {
-  int i;
+  return gbEnumHashParse(&cliOptHash, opt);
+}
 
 
-  if (!opt) {
-    return GB_METAKEY_MAX;
-  }
+int
+glusterBlockCLICreateOptEnumParse(const char *opt)
+{
+  return gbEnumHashParse(&cliCreateOptHash, opt);
+}
 
-  for (i = 0; i < GB_METAKEY_MAX; i++) {
-    if (!strcmp(opt, MetakeyLookup[i])) {
-      return i;
+
+int
+glusterBlockDaemonOptEnumParse(const char *opt)
+{
+  if (opt) {
+    /* clip '--' from option */
+    while (*opt == '-') {
+      opt++;
     }
   }
 
-  return i;
+  return gbEnumHashParse(&daemonOptHash, opt);
 }
 
 
 int
-blockMetaStatusEnumParse(const char *opt)
+blockLogLevelEnumParse(const char *opt)
 {
-  int i;
+  return gbEnumHashParse(&logLevelHash, opt);
+}
 
 
-  if (!opt) {
-    return GB_METASTATUS_MAX;
-  }
+int
+blockMetaKeyEnumParse(const char *opt)
+{
+  return gbEnumHashParse(&metaKeyHash, opt);
+}
 
-  for (i = 0; i < GB_METASTATUS_MAX; i++) {
-    if (!strcmp(opt, MetaStatusLookup[i])) {
-      return i;
-    }
-  }
 
-  return i;
+int
+blockMetaStatusEnumParse(const char *opt)
+{
+  return gbEnumHashParse(&metaStatusHash, opt);
 }
 
 int blockRemoteCreateRespEnumParse(const char *opt)
@@ -215,6 +279,514 @@ out:
 }
 
 
+unsigned long long
+gbTimeNowUsec(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* resident set size of this process, -1 if unknown */
+long
+gbProcRssKiB(void)
+{
+  unsigned long size, resident;
+  FILE *fp;
+  int n;
+
+
+  fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return -1;
+  }
+  n = fscanf(fp, "%lu %lu", &size, &resident);
+  fclose(fp);
+  if (n != 2) {
+    return -1;
+  }
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/*
+ * Replace the file at path with the formatted content, through a path.tmp
+ * that is synced before the rename, so that a crash leaves either the old
+ * content or the new. The directory of path is created (0700) if missing.
+ * Returns 0, or -1 with errno set.
+ */
+int
+gbWriteFileAtomic(const char *path, const char *fmt, ...)
+{
+  char tmpPath[PATH_MAX + sizeof(".tmp")];
+  char *slash;
+  va_list ap;
+  FILE *fp;
+  int save;
+  int ret;
+
+
+  ret = snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  if (ret < 0 || (size_t)ret >= sizeof(tmpPath)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  slash = strrchr(tmpPath, '/');
+  if (slash && slash != tmpPath) {
+    *slash = '\0';
+    ret = mkdir(tmpPath, 0700);
+    *slash = '/';
+    if (ret && errno != EEXIST) {
+      return -1;
+    }
+  }
+
+  fp = fopen(tmpPath, "w");
+  if (!fp) {
+    return -1;
+  }
+
+  va_start(ap, fmt);
+  ret = vfprintf(fp, fmt, ap);
+  va_end(ap);
+  if (ret < 0 || fflush(fp) || fsync(fileno(fp))) {
+    save = errno;
+    fclose(fp);
+    goto fail;
+  }
+  if (fclose(fp) || rename(tmpPath, path)) {
+    save = errno;
+    goto fail;
+  }
+
+  return 0;
+
+ fail:
+  unlink(tmpPath);
+  errno = save;
+  return -1;
+}
+
+
+static void
+gbLockAccount(gbLockId id, unsigned long long start, const char *func)
+{
+  gbLockStats *st = &lockStats[id];
+  unsigned long wait = gbTimeNowUsec() - start;
+  unsigned long max = __atomic_load_n(&st->waitUsecMax, __ATOMIC_RELAXED);
+
+
+  __atomic_add_fetch(&st->acquired, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&st->contended, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&st->waitUsecTotal, wait, __ATOMIC_RELAXED);
+  while (wait > max &&
+         !__atomic_compare_exchange_n(&st->waitUsecMax, &max, wait, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  if (wait >= GB_LOCK_WAIT_WARN_USEC) {
+    LOG("mgmt", GB_LOG_WARNING, "%s waited %lu usec for the %s lock",
+        func, wait, gbLockIdLookup[id]);
+  }
+}
+
+
+/* the uncontended case costs a trylock, the clock is read only on waits */
+void
+gbMutexLockTimed(pthread_mutex_t *lk, gbLockId id, const char *func)
+{
+  unsigned long long start;
+
+
+  if (!pthread_mutex_trylock(lk)) {
+    __atomic_add_fetch(&lockStats[id].acquired, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  start = gbTimeNowUsec();
+  pthread_mutex_lock(lk);
+  gbLockAccount(id, start, func);
+}
+
+
+void
+gbRwLockTimed(pthread_rwlock_t *lk, bool write, gbLockId id, const char *func)
+{
+  unsigned long long start;
+  int ret;
+
+
+  ret = write ? pthread_rwlock_trywrlock(lk) : pthread_rwlock_tryrdlock(lk);
+  if (!ret) {
+    __atomic_add_fetch(&lockStats[id].acquired, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  start = gbTimeNowUsec();
+  if (write) {
+    pthread_rwlock_wrlock(lk);
+  } else {
+    pthread_rwlock_rdlock(lk);
+  }
+  gbLockAccount(id, start, func);
+}
+
+
+void
+gbLockGetStats(gbLockId id, gbLockStats *stats)
+{
+  gbLockStats *st = &lockStats[id];
+
+
+  stats->acquired = __atomic_load_n(&st->acquired, __ATOMIC_RELAXED);
+  stats->contended = __atomic_load_n(&st->contended, __ATOMIC_RELAXED);
+  stats->waitUsecTotal = __atomic_load_n(&st->waitUsecTotal, __ATOMIC_RELAXED);
+  stats->waitUsecMax = __atomic_load_n(&st->waitUsecMax, __ATOMIC_RELAXED);
+}
+
+
+void
+gbLockStatsLog(void)
+{
+  gbLockStats st;
+  int i;
+
+
+  for (i = 0; i < GB_LOCK_MAX; i++) {
+    gbLockGetStats(i, &st);
+    LOG("mgmt", GB_LOG_INFO,
+        "lock %s: acquired %lu, contended %lu, waited %llu usec (max %lu)",
+        gbLockIdLookup[i], st.acquired, st.contended, st.waitUsecTotal,
+        st.waitUsecMax);
+  }
+}
+
+
+/*
+ * Allocation accounting. Off, each GB_* allocation pays one relaxed load.
+ * On, every tracked pointer is remembered along with its size, call site
+ * and operation, so that gbFree() can take it off their live counts.
+ * Memory released with plain free() (xdr_free() of rpc results, which
+ * the freeresult hooks untrack) stays counted as live until the address
+ * is handed out again.
+ */
+# define  GB_ALLOC_SITE_BUCKETS   512
+# define  GB_ALLOC_PTR_BUCKETS    4096
+# define  GB_ALLOC_OPS_MAX        64
+
+typedef struct gbAllocSite {
+  gbAllocStats st;
+  struct gbAllocSite *next;
+} gbAllocSite;
+
+typedef struct gbAllocPtr {
+  void *ptr;
+  size_t size;
+  gbAllocSite *site;
+  gbAllocStats *op;
+  struct gbAllocPtr *next;
+} gbAllocPtr;
+
+static bool allocAcct;
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+static gbAllocSite *allocSites[GB_ALLOC_SITE_BUCKETS];
+static gbAllocPtr *allocPtrs[GB_ALLOC_PTR_BUCKETS];
+static gbAllocStats allocOps[GB_ALLOC_OPS_MAX];
+static size_t allocOpsCount;
+static __thread const char *allocOp;
+
+
+void
+gbAllocAcctEnable(bool enable)
+{
+  gbAllocPtr *p;
+  size_t i;
+
+
+  if (__atomic_exchange_n(&allocAcct, enable, __ATOMIC_RELAXED) == enable ||
+      enable) {
+    return;
+  }
+
+  /* frees are not looked at anymore, what is live now can't be told */
+  LOCK(allocLock);
+  for (i = 0; i < GB_ALLOC_PTR_BUCKETS; i++) {
+    while ((p = allocPtrs[i])) {
+      allocPtrs[i] = p->next;
+      p->site->st.live--;
+      p->site->st.liveBytes -= p->size;
+      p->op->live--;
+      p->op->liveBytes -= p->size;
+      free(p);
+    }
+  }
+  UNLOCK(allocLock);
+}
+
+
+bool
+gbAllocAcctEnabled(void)
+{
+  return __atomic_load_n(&allocAcct, __ATOMIC_RELAXED);
+}
+
+
+/* op being served by the calling thread, a string literal, or NULL */
+void
+gbAllocSetOp(const char *op)
+{
+  allocOp = op;
+}
+
+
+static size_t
+gbAllocPtrHash(void *ptr)
+{
+  uintptr_t v = (uintptr_t)ptr >> 4;
+
+
+  return (v ^ (v >> 12)) & (GB_ALLOC_PTR_BUCKETS - 1);
+}
+
+
+/* called with allocLock held */
+static gbAllocPtr *
+gbAllocPtrUnlink(void *ptr)
+{
+  gbAllocPtr **pp = &allocPtrs[gbAllocPtrHash(ptr)];
+  gbAllocPtr *p;
+
+
+  for (; (p = *pp); pp = &p->next) {
+    if (p->ptr == ptr) {
+      *pp = p->next;
+      p->site->st.live--;
+      p->site->st.liveBytes -= p->size;
+      p->op->live--;
+      p->op->liveBytes -= p->size;
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* called with allocLock held; sites and ops are never freed */
+static gbAllocSite *
+gbAllocSiteGet(const char *filename, const char *funcname, size_t linenr)
+{
+  size_t h = ((uintptr_t)filename >> 3) * 31 + linenr;
+  gbAllocSite **bucket = &allocSites[h & (GB_ALLOC_SITE_BUCKETS - 1)];
+  gbAllocSite *site;
+
+
+  for (site = *bucket; site; site = site->next) {
+    if (site->st.line == linenr && !strcmp(site->st.file, filename)) {
+      return site;
+    }
+  }
+
+  site = calloc(1, sizeof(*site));
+  if (!site) {
+    return NULL;
+  }
+  site->st.name = funcname;
+  site->st.file = filename;
+  site->st.line = linenr;
+  site->next = *bucket;
+  *bucket = site;
+
+  return site;
+}
+
+
+/* called with allocLock held */
+static gbAllocStats *
+gbAllocOpGet(const char *op)
+{
+  size_t i;
+
+
+  if (!op) {
+    op = "other";
+  }
+  for (i = 0; i < allocOpsCount; i++) {
+    if (allocOps[i].name == op || !strcmp(allocOps[i].name, op)) {
+      return &allocOps[i];
+    }
+  }
+  if (allocOpsCount == GB_ALLOC_OPS_MAX) {
+    return &allocOps[GB_ALLOC_OPS_MAX - 1];
+  }
+  allocOps[allocOpsCount].name = op;
+
+  return &allocOps[allocOpsCount++];
+}
+
+
+void
+gbAllocTrack(void *ptr, size_t size,
+             const char *filename, const char *funcname, size_t linenr)
+{
+  gbAllocPtr *p;
+
+
+  if (!__atomic_load_n(&allocAcct, __ATOMIC_RELAXED) || !ptr) {
+    return;
+  }
+
+  LOCK(allocLock);
+  /* an address handed out again was freed behind our back */
+  p = gbAllocPtrUnlink(ptr);
+  if (!p) {
+    p = malloc(sizeof(*p));
+  }
+  if (p) {
+    p->site = gbAllocSiteGet(filename, funcname, linenr);
+    p->op = gbAllocOpGet(allocOp);
+  }
+  if (!p || !p->site) {
+    free(p);
+    UNLOCK(allocLock);
+    return;
+  }
+  p->ptr = ptr;
+  p->size = size;
+  p->site->st.allocs++;
+  p->site->st.live++;
+  p->site->st.bytes += size;
+  p->site->st.liveBytes += size;
+  p->op->allocs++;
+  p->op->live++;
+  p->op->bytes += size;
+  p->op->liveBytes += size;
+  p->next = allocPtrs[gbAllocPtrHash(ptr)];
+  allocPtrs[gbAllocPtrHash(ptr)] = p;
+  UNLOCK(allocLock);
+}
+
+
+void
+gbAllocUntrack(void *ptr)
+{
+  if (!__atomic_load_n(&allocAcct, __ATOMIC_RELAXED) || !ptr) {
+    return;
+  }
+
+  LOCK(allocLock);
+  free(gbAllocPtrUnlink(ptr));
+  UNLOCK(allocLock);
+}
+
+
+static int
+gbAllocStatsCmp(const void *a, const void *b)
+{
+  const gbAllocStats *x = a;
+  const gbAllocStats *y = b;
+
+
+  if (x->liveBytes != y->liveBytes) {
+    return x->liveBytes < y->liveBytes ? 1 : -1;
+  }
+
+  return x->bytes < y->bytes ? 1 : (x->bytes > y->bytes ? -1 : 0);
+}
+
+
+/* the max call sites holding the most memory, biggest first */
+size_t
+gbAllocGetSiteStats(gbAllocStats *stats, size_t max)
+{
+  gbAllocStats *all = NULL;
+  gbAllocSite *site;
+  size_t count = 0;
+  size_t n = 0;
+  size_t i;
+
+
+  LOCK(allocLock);
+  for (i = 0; i < GB_ALLOC_SITE_BUCKETS; i++) {
+    for (site = allocSites[i]; site; site = site->next) {
+      count++;
+    }
+  }
+  if (count) {
+    all = malloc(count * sizeof(*all));
+  }
+  for (i = 0; all && i < GB_ALLOC_SITE_BUCKETS; i++) {
+    for (site = allocSites[i]; site; site = site->next) {
+      all[n++] = site->st;
+    }
+  }
+  UNLOCK(allocLock);
+
+  if (!all) {
+    return 0;
+  }
+  qsort(all, n, sizeof(*all), gbAllocStatsCmp);
+  if (n > max) {
+    n = max;
+  }
+  memcpy(stats, all, n * sizeof(*all));
+  free(all);
+
+  return n;
+}
+
+
+size_t
+gbAllocGetOpStats(gbAllocStats *stats, size_t max)
+{
+  size_t n;
+
+
+  LOCK(allocLock);
+  n = allocOpsCount < max ? allocOpsCount : max;
+  memcpy(stats, allocOps, n * sizeof(*stats));
+  UNLOCK(allocLock);
+  qsort(stats, n, sizeof(*stats), gbAllocStatsCmp);
+
+  return n;
+}
+
+
+void
+gbAllocStatsLog(void)
+{
+  gbAllocStats st[GB_ALLOC_OPS_MAX];
+  size_t n;
+  size_t i;
+
+
+  if (!gbAllocAcctEnabled()) {
+    LOG("mgmt", GB_LOG_INFO, "%s", "allocation accounting is off");
+    return;
+  }
+
+  n = gbAllocGetOpStats(st, GB_ALLOC_OPS_MAX);
+  for (i = 0; i < n; i++) {
+    LOG("mgmt", GB_LOG_INFO, "alloc op %s: %lu allocs, %llu bytes, "
+        "live %lu allocs, %llu bytes", st[i].name, st[i].allocs,
+        st[i].bytes, st[i].live, st[i].liveBytes);
+  }
+
+  n = gbAllocGetSiteStats(st, 20);
+  for (i = 0; i < n; i++) {
+    LOG("mgmt", GB_LOG_INFO, "alloc site %s:%zu (%s): %lu allocs, %llu "
+        "bytes, live %lu allocs, %llu bytes", st[i].file, st[i].line,
+        st[i].name, st[i].allocs, st[i].bytes, st[i].live, st[i].liveBytes);
+  }
+}
+
+
 static bool
 glusterBlockLogdirCreate(void)
 {
@@ -290,29 +862,6 @@ initLogging(void)
 }
 
 
-int
-gbRunnerExitStatus(int exitStatus)
-{
-  if (!WIFEXITED(exitStatus)) {
-    return -1;
-  }
-
-  return WEXITSTATUS(exitStatus);
-}
-
-
-int
-gbRunner(char *cmd)
-{
-  int childExitStatus;
-
-
-  childExitStatus = system(cmd);
-
-  return gbRunnerExitStatus(childExitStatus);
-}
-
-
 int
 gbAlloc(void *ptrptr, size_t size,
         const char *filename, const char *funcname, size_t linenr)
@@ -323,6 +872,7 @@ gbAlloc(void *ptrptr, size_t size,
     errno = ENOMEM;
     return -1;
   }
+  gbAllocTrack(*(void **)ptrptr, size, filename, funcname, linenr);
 
   return 0;
 }
@@ -338,6 +888,7 @@ gbAllocN(void *ptrptr, size_t size, size_t count,
     errno = ENOMEM;
     return -1;
   }
+  gbAllocTrack(*(void **)ptrptr, size * count, filename, funcname, linenr);
 
   return 0;
 }
@@ -354,12 +905,14 @@ gbReallocN(void *ptrptr, size_t size, size_t count,
     errno = ENOMEM;
     return -1;
   }
+  gbAllocUntrack(*(void **)ptrptr);
   tmp = realloc(*(void**)ptrptr, size * count);
   if (!tmp && ((size * count) != 0)) {
     errno = ENOMEM;
     return -1;
   }
   *(void**)ptrptr = tmp;
+  gbAllocTrack(tmp, size * count, filename, funcname, linenr);
 
   return 0;
 }
@@ -375,6 +928,7 @@ gbFree(void *ptrptr)
    return;
   }
 
+  gbAllocUntrack(*(void **)ptrptr);
   free(*(void**)ptrptr);
   *(void**)ptrptr = NULL;
   errno = save_errno;
@@ -394,6 +948,7 @@ gbStrdup(char **dest, const char *src,
   if (!(*dest = strdup(src))) {
     return -1;
   }
+  gbAllocTrack(*dest, strlen(*dest) + 1, filename, funcname, linenr);
 
   return 0;
 }
@@ -417,3 +972,255 @@ gbStrcpy(char *dest, const char *src, size_t destbytes,
 
     return ret;
 }
+
+
+# define  GB_ARENA_CHUNK   4096
+# define  GB_ARENA_ALIGN   16
+
+struct gbArenaChunk {
+  struct gbArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__ ((aligned (GB_ARENA_ALIGN)));
+};
+
+
+/*
+ * size bytes from the arena. Requests bigger than a quarter chunk get a
+ * chunk of their own, linked behind the head so what is left of the head
+ * is not wasted.
+ */
+static void *
+gbArenaGet(gbArena *arena, size_t size)
+{
+  gbArenaChunk *chunk = arena->head;
+  size_t csize;
+  void *ptr;
+
+
+  if (size > SIZE_MAX - GB_ARENA_CHUNK) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = (size + GB_ARENA_ALIGN - 1) & ~((size_t)GB_ARENA_ALIGN - 1);
+
+  if (!chunk || chunk->size - chunk->used < size) {
+    csize = size > GB_ARENA_CHUNK / 4 ? size : GB_ARENA_CHUNK;
+    chunk = calloc(1, sizeof(*chunk) + csize);
+    if (!chunk) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    chunk->size = csize;
+    if (arena->head && csize != GB_ARENA_CHUNK) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    } else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
+  }
+
+  ptr = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return ptr;
+}
+
+
+int
+gbArenaAlloc(gbArena *arena, void *ptrptr, size_t size,
+             const char *filename, const char *funcname, size_t linenr)
+{
+  *(void **)ptrptr = gbArenaGet(arena, size);
+
+  return *(void **)ptrptr ? 0 : -1;
+}
+
+
+int
+gbArenaAllocN(gbArena *arena, void *ptrptr, size_t size, size_t count,
+              const char *filename, const char *funcname, size_t linenr)
+{
+  if (xalloc_oversized(count, size)) {
+    *(void **)ptrptr = NULL;
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return gbArenaAlloc(arena, ptrptr, size * count,
+                      filename, funcname, linenr);
+}
+
+
+int
+gbArenaStrdup(gbArena *arena, char **dest, const char *src,
+              const char *filename, const char *funcname, size_t linenr)
+{
+  size_t len;
+
+
+  *dest = NULL;
+  if (!src) {
+    return 0;
+  }
+
+  len = strlen(src) + 1;
+  *dest = gbArenaGet(arena, len);
+  if (!*dest) {
+    return -1;
+  }
+  memcpy(*dest, src, len);
+
+  return 0;
+}
+
+
+/* like asprintf(), formats straight into the arena when it fits */
+int
+gbArenaAsprintf(gbArena *arena, char **ptr, const char *fmt, ...)
+{
+  gbArenaChunk *chunk = arena->head;
+  size_t room = chunk ? chunk->size - chunk->used : 0;
+  va_list ap;
+  int len;
+
+
+  *ptr = NULL;
+  va_start(ap, fmt);
+  len = vsnprintf(room ? chunk->data + chunk->used : NULL, room, fmt, ap);
+  va_end(ap);
+  if (len < 0) {
+    return -1;
+  }
+
+  if ((size_t)len < room) {
+    /* room is a multiple of the alignment, so this is where it went */
+    *ptr = gbArenaGet(arena, len + 1);
+    return len;
+  }
+  if (room) {
+    /* the truncated try is left in free space that must come zeroed */
+    memset(chunk->data + chunk->used, 0, room);
+  }
+
+  *ptr = gbArenaGet(arena, len + 1);
+  if (!*ptr) {
+    return -1;
+  }
+  va_start(ap, fmt);
+  vsnprintf(*ptr, len + 1, fmt, ap);
+  va_end(ap);
+
+  return len;
+}
+
+
+/* release everything taken from arena, which can then be used again */
+void
+gbArenaFree(gbArena *arena)
+{
+  gbArenaChunk *chunk;
+  int save_errno = errno;
+
+
+  while ((chunk = arena->head)) {
+    arena->head = chunk->next;
+    free(chunk);
+  }
+  errno = save_errno;
+}
+
+
+/* make room for need more bytes plus the NUL, doubling the buffer */
+static int
+gbStrBufReserve(gbStrBuf *sb, size_t need)
+{
+  size_t cap = sb->cap ? sb->cap : 64;
+
+
+  if (need > SIZE_MAX / 2 - sb->len) {
+    errno = ENOMEM;
+    return -1;
+  }
+  while (cap < sb->len + need + 1) {
+    cap *= 2;
+  }
+  if (cap == sb->cap) {
+    return 0;
+  }
+
+  /* accounted like the rest, GB_FREE() of the detached string pairs up */
+  if (GB_REALLOC_N(sb->buf, cap) < 0) {
+    return -1;
+  }
+  sb->cap = cap;
+
+  return 0;
+}
+
+
+int
+gbStrBufAppendf(gbStrBuf *sb, const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+
+  va_start(ap, fmt);
+  len = vsnprintf(sb->buf ? sb->buf + sb->len : NULL,
+                  sb->buf ? sb->cap - sb->len : 0, fmt, ap);
+  va_end(ap);
+  if (len < 0) {
+    return -1;
+  }
+
+  if (!sb->buf || sb->len + len >= sb->cap) {
+    if (gbStrBufReserve(sb, len) < 0) {
+      if (sb->buf) {
+        sb->buf[sb->len] = '\0';
+      }
+      return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+  }
+  sb->len += len;
+
+  return 0;
+}
+
+
+/* continue a malloc()ed string, sb takes it over */
+void
+gbStrBufAttach(gbStrBuf *sb, char *str)
+{
+  sb->buf = str;
+  sb->len = str ? strlen(str) : 0;
+  sb->cap = str ? sb->len + 1 : 0;
+}
+
+
+/* the string for the caller to GB_FREE(), sb is left empty */
+char *
+gbStrBufDetach(gbStrBuf *sb)
+{
+  char *str = sb->buf;
+
+
+  sb->buf = NULL;
+  sb->len = 0;
+  sb->cap = 0;
+
+  return str;
+}
+
+
+void
+gbStrBufFree(gbStrBuf *sb)
+{
+  GB_FREE(sb->buf);
+  sb->len = 0;
+  sb->cap = 0;
+}
@@ -47,6 +47,8 @@
 
 # define  GB_METADIR             "/block-meta"
 # define  GB_STOREDIR            "/block-store"
+# define  GB_TRASHDIRNAME        ".trash"
+# define  GB_TRASHDIR            GB_STOREDIR "/" GB_TRASHDIRNAME
 # define  GB_TXLOCKFILE          "meta.lock"
 # define  GB_PRIO_FILENAME       "prio.info"
 # define  GB_PRIO_FILE           GB_METADIR "/" GB_PRIO_FILENAME
@@ -57,6 +59,16 @@
 
 # define  GB_METASTORE_RESERVE   10485760   /* 10 MiB reserve for block-meta */
 
+# define  GB_REBALANCE_PARALLEL_DEF  8      /* blocks switched at a time */
+# define  GB_REBALANCE_PARALLEL_MAX  64
+
+# define  GB_PREALLOC_THREADS_DEF    4      /* fds a block is preallocated through */
+# define  GB_PREALLOC_THREADS_MAX    16
+
+# define  GB_REPLACE_HOST_PARALLEL_DEF  4   /* bulk replace calls in flight per node */
+
+# define  GB_CREATE_SPECULATE_MAX    8      /* extra nodes a create may go to */
+
 # define  GB_DEF_CONFIGPATH      "/etc/sysconfig/gluster-blockd"; /* the default config file */
 
 # define  GB_TIME_STRING_BUFLEN  \
@@ -104,12 +116,28 @@
 /* Config generate */
 # define  FAILED_GENCONFIG          "failed in generation of config"
 
+/* Prio path rebalance */
+# define  FAILED_REBALANCE          "failed in rebalance"
+# define  FAILED_REMOTE_PRIO_PATH   "failed in remote prio path switch"
+
+/* Node drain */
+# define  FAILED_DRAIN              "failed in drain"
+# define  FAILED_UNDRAIN            "failed in undrain"
+
+/* Daemon Status */
+# define  FAILED_STATUS             "failed in status"
+
 # define  FAILED_DEPENDENCY         "failed dependency, check if you have targetcli and tcmu-runner installed"
 
 # define FMT_WARN(fmt...) do { if (0) printf (fmt); } while (0)
 
 # define GB_ASPRINTF(ptr, fmt...) ({FMT_WARN (fmt);                 \
-                int __ret=asprintf(ptr, ##fmt);__ret;})
+                char **__ptr = (ptr);                               \
+                int __ret=asprintf(__ptr, ##fmt);                   \
+                if (__ret >= 0)                                     \
+                  gbAllocTrack(*__ptr, __ret + 1,                   \
+                               __FILE__, __FUNCTION__, __LINE__);   \
+                __ret;})
 
 # define LOCK(x)                                                     \
          do {                                                        \
@@ -121,6 +149,30 @@
             pthread_mutex_unlock(&x);                                \
           } while (0)
 
+/* like LOCK(), but the time spent waiting is accounted against lock id */
+# define LOCK_TIMED(x, id)                                           \
+         do {                                                        \
+            gbMutexLockTimed(&x, id, __FUNCTION__);                  \
+          } while (0)
+
+# define RDLOCK(x, id)                                               \
+         do {                                                        \
+            gbRwLockTimed(&x, false, id, __FUNCTION__);              \
+          } while (0)
+
+# define WRLOCK(x, id)                                               \
+         do {                                                        \
+            gbRwLockTimed(&x, true, id, __FUNCTION__);               \
+          } while (0)
+
+# define RWUNLOCK(x)                                                 \
+         do {                                                        \
+            pthread_rwlock_unlock(&x);                               \
+          } while (0)
+
+/* waits longer than this are logged as they happen */
+# define GB_LOCK_WAIT_WARN_USEC  (100 * 1000)
+
 # define  MSG(fd, fmt, ...)                                          \
           do {                                                       \
             if (fd <= 0)       /* including STDIN_FILENO 0 */        \
@@ -131,13 +183,23 @@
 
 struct gbConf {
   size_t glfsLruCount;
+  size_t glfsLruMin;          /* adaptive glfsLruCount bounds, 0 when off */
+  size_t glfsLruMax;
+  size_t glfsLruMemLimit;     /* MiB */
+  bool glfsVolfileCache;      /* init volumes from GB_VOLFILE_DIR */
+  time_t metaUpcallTtl;       /* secs, 0 when metadata is always read */
+  bool prioLoadAware;         /* weigh prio path candidates by node load */
+  size_t preallocThreads;     /* fds a block is preallocated through */
+  size_t trashReapRate;       /* MiB/s of deleted storage reclaimed, 0 no limit */
+  size_t replaceHostParallel; /* bulk replace calls in flight per node */
+  size_t createSpeculate;     /* spare nodes a create is issued to upfront */
   unsigned int logLevel;
   char logDir[PATH_MAX];
   char daemonLogFile[PATH_MAX];
   char cliLogFile[PATH_MAX];
   char gfapiLogFile[PATH_MAX];
   char configShellLogFile[PATH_MAX];
-  pthread_mutex_t lock;
+  pthread_rwlock_t cfgLock;   /* tunables changed at runtime, logLevel is atomic */
   char cmdhistoryLogFile[PATH_MAX];
   bool noRemoteRpc;
   char volServer[HOST_NAME_MAX];
@@ -145,36 +207,65 @@ struct gbConf {
 
 extern struct gbConf gbConf;
 
+typedef enum gbLockId {
+  GB_LOCK_CONFIG      = 0,
+  GB_LOCK_GLFS_CACHE  = 1,
+
+  GB_LOCK_MAX
+} gbLockId;
+
+static const char *const gbLockIdLookup[] = {
+  [GB_LOCK_CONFIG]      = "config",
+  [GB_LOCK_GLFS_CACHE]  = "glfs-cache",
+
+  [GB_LOCK_MAX]         = NULL,
+};
+
+typedef struct gbLockStats {
+  unsigned long acquired;
+  unsigned long contended;            /* acquisitions that had to wait */
+  unsigned long long waitUsecTotal;
+  unsigned long waitUsecMax;
+} gbLockStats;
+
+/*
+ * Allocation accounting (GB_ALLOC_ACCOUNTING), keyed by the call site the
+ * GB_* allocation macros pass down, and by the rpc being served.
+ */
+typedef struct gbAllocStats {
+  const char *name;                   /* operation, or function of the site */
+  const char *file;                   /* NULL for operations */
+  size_t line;
+  unsigned long allocs;
+  unsigned long live;                 /* not freed yet */
+  unsigned long long bytes;
+  unsigned long long liveBytes;
+} gbAllocStats;
+
+typedef enum gbLogCategory {
+  GB_LOGCAT_MGMT    = 0,
+  GB_LOGCAT_CLI     = 1,
+  GB_LOGCAT_GFAPI   = 2,
+  GB_LOGCAT_CMDLOG  = 3,
+  GB_LOGCAT_STDERR  = 4,
+
+  GB_LOGCAT_MAX
+} gbLogCategory;
+
+/* str is a literal almost everywhere, so the compiler folds these */
+# define  GB_LOG_CATEGORY(str)                                         \
+          (!strcmp(str, "mgmt") ? GB_LOGCAT_MGMT :                     \
+           !strcmp(str, "cli") ? GB_LOGCAT_CLI :                       \
+           !strcmp(str, "gfapi") ? GB_LOGCAT_GFAPI :                   \
+           !strcmp(str, "cmdlog") ? GB_LOGCAT_CMDLOG : GB_LOGCAT_STDERR)
+
 # define  LOG(str, level, fmt, ...)                                    \
           do {                                                         \
-            FILE *fd;                                                  \
-            char timestamp[GB_TIME_STRING_BUFLEN] = {0};               \
-            LOCK(gbConf.lock);                                       \
-            if (level <= gbConf.logLevel) {                            \
-              if (!strcmp(str, "mgmt"))                                \
-                fd = fopen (gbConf.daemonLogFile, "a");                \
-              else if (!strcmp(str, "cli"))                            \
-                fd = fopen (gbConf.cliLogFile, "a");                   \
-              else if (!strcmp(str, "gfapi"))                          \
-                fd = fopen (gbConf.gfapiLogFile, "a");                 \
-              else if (!strcmp(str, "cmdlog"))                         \
-                fd = fopen (gbConf.cmdhistoryLogFile, "a");            \
-              else                                                     \
-                fd = stderr;                                           \
-              if (fd == NULL) {                                        \
-                fprintf(stderr, "Error opening log file: %s\n"         \
-                        "Logging to stderr.\n",                        \
-                        strerror(errno));                              \
-                fd = stderr;                                           \
-              }                                                        \
-              logTimeNow(timestamp, GB_TIME_STRING_BUFLEN);            \
-              fprintf(fd, "[%s] %s: " fmt " [at %s+%d :<%s>]\n",       \
-                      timestamp, LogLevelLookup[level],                \
-                      __VA_ARGS__, __FILE__, __LINE__, __FUNCTION__);  \
-              if (fd != stderr)                                        \
-                fclose(fd);                                            \
+            if (level <= __atomic_load_n(&gbConf.logLevel,             \
+                                         __ATOMIC_RELAXED)) {          \
+              gbLog(GB_LOG_CATEGORY(str), level, __FILE__, __LINE__,   \
+                    __FUNCTION__, fmt, __VA_ARGS__);                   \
             }                                                          \
-	    UNLOCK(gbConf.lock);                                     \
           } while (0)
 
 # define  GB_METALOCK_OR_GOTO(lkfd, volume, errCode, errMsg, label)  \
@@ -199,24 +290,14 @@ extern struct gbConf gbConf;
             char *write;                                                \
             struct glfs_fd *tgmfd;                                      \
             LOCK(lock);                                                 \
-            ret = glfs_chdir (glfs, GB_METADIR);                        \
-            if (ret) {                                                  \
-              GB_ASPRINTF(&errMsg, "Failed to update transaction log "  \
-                "for %s/%s[%s]", volume, fname, strerror(errno));       \
-              LOG("gfapi", GB_LOG_ERROR, "glfs_chdir(%s) on "           \
-                  "volume %s failed[%s]", GB_METADIR, volume,           \
-                  strerror(errno));                                     \
-              UNLOCK(lock);                                             \
-              ret = -1;                                                 \
-              goto label;                                               \
-            }                                                           \
-            tgmfd = glfs_creat(glfs, fname,                             \
-                               O_WRONLY | O_APPEND | O_SYNC,            \
-                               S_IRUSR | S_IWUSR);                      \
+            ret = 0;                                                    \
+            tgmfd = glusterBlockOpenAt(glfs, GB_OBJ_METADIR, fname,     \
+                                       O_WRONLY | O_APPEND | O_SYNC |   \
+                                       O_CREAT, S_IRUSR | S_IWUSR);     \
             if (!tgmfd) {                                               \
               GB_ASPRINTF(&errMsg, "Failed to update transaction log "  \
                 "for %s/%s[%s]", volume, fname, strerror(errno));       \
-              LOG("mgmt", GB_LOG_ERROR, "glfs_creat(%s): on "           \
+              LOG("mgmt", GB_LOG_ERROR, "glfs_h_creat(%s): on "         \
                   "volume %s failed[%s]", fname, volume,                \
                   strerror(errno));                                     \
               UNLOCK(lock);                                             \
@@ -268,33 +349,30 @@ extern struct gbConf gbConf;
             }                                                        \
           } while (0)
 
-# define  GB_CMD_EXEC_AND_VALIDATE(cmd, sr, blk, vol, opt)             \
+# define  GB_CMD_EXEC_AND_VALIDATE(argv, input, timeout, sr, blk, vol, opt) \
           do {                                                         \
-            FILE *fp;                                                  \
+            gbRunnerResult res;                                        \
             char tmp[1024];                                            \
-            LOG("mgmt", GB_LOG_DEBUG, "command, %s", cmd);             \
-            fp = popen(cmd, "r");                                      \
+            LOG("mgmt", GB_LOG_DEBUG, "command, %s %s", argv[0],       \
+                input?input:"");                                       \
             snprintf(tmp, 1024, "%s/%s", vol?vol:"", blk->block_name); \
-            if (fp) {                                                  \
-              size_t newLen = fread(sr->out, sizeof(char), 8192, fp);  \
-              if (ferror( fp ) != 0) {                                 \
-                LOG("mgmt", GB_LOG_ERROR,                              \
-                    "reading command %s output for %s failed(%s)", tmp,\
-                    cmd, strerror(errno));                             \
-                sr->out[0] = '\0';                                     \
-                sr->exit = -1;                                         \
-                pclose(fp);                                            \
-                break;                                                 \
-              } else {                                                 \
-                sr->out[newLen++] = '\0';                              \
-              }                                                        \
+            sr->exit = -1;                                             \
+            if (gbRunnerExec(argv, input, timeout, &res) < 0) {        \
+              LOG("mgmt", GB_LOG_ERROR,                                \
+                  "executing command %s for %s failed(%s)", argv[0],   \
+                  tmp, strerror(errno));                               \
+            } else if (res.timedOut) {                                 \
+              LOG("mgmt", GB_LOG_ERROR,                                \
+                  "command %s for %s timed out", argv[0], tmp);        \
+            }                                                          \
+            if (!res.out) {                                            \
+              break;                                                   \
+            }                                                          \
+            GB_FREE(sr->out);                                          \
+            sr->out = res.out;                                         \
+            if (res.exitStatus != -1) {                                \
               sr->exit = blockValidateCommandOutput(sr->out, opt,      \
                                                     (void*)blk);       \
-              pclose(fp);                                              \
-            } else {                                                   \
-              LOG("mgmt", GB_LOG_ERROR,                                \
-                  "popen(): for %s executing command %s failed(%s)",   \
-                  tmp, cmd, strerror(errno));                          \
             }                                                          \
             LOG("mgmt", GB_LOG_DEBUG, "raw output, %s", sr->out);      \
             LOG("mgmt", GB_LOG_INFO, "command exit code, %d",          \
@@ -319,7 +397,10 @@ extern struct gbConf gbConf;
 
 # define GB_RPC_CALL(op, blk, reply, rqstp, ret)                    \
         do {                                                        \
-          blockResponse *resp = block_##op##_1_svc_st(blk, rqstp);  \
+          blockResponse *resp;                                      \
+          gbAllocSetOp(#op);                                        \
+          resp = block_##op##_1_svc_st(blk, rqstp);                 \
+          gbAllocSetOp(NULL);                                       \
           if (resp) {                                               \
             memcpy(reply, resp, sizeof(*reply));                    \
             GB_FREE(resp);                                          \
@@ -362,6 +443,45 @@ extern struct gbConf gbConf;
 # define  GB_FREE(ptr)                                               \
             gbFree(1 ? (void *) &(ptr) : (ptr))
 
+/*
+ * Request scoped allocations. Whatever a handler takes from its arena lives
+ * until the one gbArenaFree() at the end of the request, so there is no
+ * GB_FREE() to pair with each of them. Memory comes zeroed. Nothing that
+ * outlives the request (reply->out, cached data) may come from an arena.
+ */
+# define  GB_ARENA_ALLOC(arena, ptr)                                 \
+            gbArenaAlloc((arena), &(ptr), sizeof(*(ptr)),            \
+                         __FILE__, __FUNCTION__, __LINE__)
+
+# define  GB_ARENA_ALLOC_N(arena, ptr, count)                        \
+            gbArenaAllocN((arena), &(ptr), sizeof(*(ptr)), (count),  \
+                          __FILE__, __FUNCTION__, __LINE__)
+
+# define  GB_ARENA_STRDUP(arena, dst, src)                           \
+            gbArenaStrdup((arena), &(dst), src,                      \
+                          __FILE__, __FUNCTION__, __LINE__)
+
+# define  GB_ARENA_ASPRINTF(arena, ptr, fmt...)                      \
+            gbArenaAsprintf((arena), (ptr), ##fmt)
+
+typedef struct gbArenaChunk gbArenaChunk;
+
+typedef struct gbArena {
+  gbArenaChunk *head;         /* chunk being carved, then older ones */
+} gbArena;
+
+/*
+ * Growable string for lists and replies built a piece at a time. Appends
+ * are amortized O(1), where re-printing the whole prefix with GB_ASPRINTF()
+ * on every step is quadratic. buf is NUL terminated once anything was
+ * appended, and NULL before. A failed append leaves it as it was.
+ */
+typedef struct gbStrBuf {
+  char *buf;
+  size_t len;
+  size_t cap;
+} gbStrBuf;
+
 
 typedef enum gbCliCmdlineOption {
   GB_CLI_UNKNOWN = 0,
@@ -372,6 +492,10 @@ typedef enum gbCliCmdlineOption {
   GB_CLI_MODIFY,
   GB_CLI_REPLACE,
   GB_CLI_GENCONFIG,
+  GB_CLI_STATUS,
+  GB_CLI_REBALANCE,
+  GB_CLI_DRAIN,
+  GB_CLI_UNDRAIN,
   GB_CLI_HELP,
   GB_CLI_HYPHEN_HELP,
   GB_CLI_VERSION,
@@ -391,6 +515,10 @@ static const char *const gbCliCmdlineOptLookup[] = {
   [GB_CLI_MODIFY]         = "modify",
   [GB_CLI_REPLACE]        = "replace",
   [GB_CLI_GENCONFIG]      = "genconfig",
+  [GB_CLI_STATUS]         = "status",
+  [GB_CLI_REBALANCE]      = "rebalance",
+  [GB_CLI_DRAIN]          = "drain",
+  [GB_CLI_UNDRAIN]        = "undrain",
   [GB_CLI_HELP]           = "help",
   [GB_CLI_HYPHEN_HELP]    = "--help",
   [GB_CLI_VERSION]        = "version",
@@ -479,6 +607,8 @@ typedef enum Metakey {
   GB_META_PASSWD      = 6,
   GB_META_RINGBUFFER  = 7,
   GB_META_PRIOPATH    = 8,
+  GB_META_DRAINPATH   = 9,
+  GB_META_PREALLOC    = 10,
 
   GB_METAKEY_MAX
 } Metakey;
@@ -493,6 +623,8 @@ static const char *const MetakeyLookup[] = {
   [GB_META_PASSWD]      = "PASSWORD",
   [GB_META_RINGBUFFER]  = "RINGBUFFER",
   [GB_META_PRIOPATH]    = "PRIOPATH",
+  [GB_META_DRAINPATH]   = "DRAINPATH",
+  [GB_META_PREALLOC]    = "PREALLOC",
 
   [GB_METAKEY_MAX]      = NULL
 };
@@ -574,6 +706,18 @@ typedef struct gbConfig {
   bool isDynamic;
   char *GB_LOG_LEVEL;
   ssize_t GB_GLFS_LRU_COUNT;
+  ssize_t GB_GLFS_LRU_COUNT_MIN;
+  ssize_t GB_GLFS_LRU_COUNT_MAX;
+  ssize_t GB_GLFS_LRU_MEM_LIMIT;
+  char *GB_GLFS_PREWARM_VOLUMES;    /* read once, at daemon start */
+  ssize_t GB_GLFS_VOLFILE_CACHE;
+  ssize_t GB_META_CACHE_UPCALL_TTL;
+  ssize_t GB_ALLOC_ACCOUNTING;
+  ssize_t GB_PRIO_LOAD_AWARE;
+  ssize_t GB_PREALLOC_THREADS;
+  ssize_t GB_TRASH_REAP_RATE;
+  ssize_t GB_REPLACE_HOST_PARALLEL;
+  ssize_t GB_CREATE_SPECULATE;
 } gbConfig;
 
 int glusterBlockSetLogLevel(unsigned int logLevel);
@@ -594,13 +738,54 @@ int blockRemoteCreateRespEnumParse(const char *opt);
 
 void logTimeNow(char* buf, size_t bufSize);
 
+unsigned long long gbTimeNowUsec(void);
+
+long gbProcRssKiB(void);
+
+int gbWriteFileAtomic(const char *path, const char *fmt, ...)
+                      __attribute__ ((format (printf, 2, 3)));
+
+void gbMutexLockTimed(pthread_mutex_t *lk, gbLockId id, const char *func);
+
+void gbRwLockTimed(pthread_rwlock_t *lk, bool write, gbLockId id,
+                   const char *func);
+
+void gbLockGetStats(gbLockId id, gbLockStats *stats);
+
+void gbLockStatsLog(void);
+
+void gbAllocAcctEnable(bool enable);
+
+bool gbAllocAcctEnabled(void);
+
+void gbAllocSetOp(const char *op);
+
+void gbAllocTrack(void *ptr, size_t size,
+                  const char *filename, const char *funcname, size_t linenr);
+
+void gbAllocUntrack(void *ptr);
+
+size_t gbAllocGetSiteStats(gbAllocStats *stats, size_t max);
+
+size_t gbAllocGetOpStats(gbAllocStats *stats, size_t max);
+
+void gbAllocStatsLog(void);
+
 void fetchGlfsVolServerFromEnv(void);
 
 int initLogging(void);
 
-int gbRunnerExitStatus(int exitStatus);
+void gbLog(int cat, unsigned int level, const char *file, int lineno,
+           const char *func, const char *fmt, ...)
+           __attribute__ ((format (printf, 6, 7)));
+
+int gbLogStart(void);
+
+void gbLogStop(void);
+
+void gbLogReopen(void);
 
-int gbRunner(char *cmd);
+unsigned long gbLogDroppedCount(void);
 
 int gbAlloc(void *ptrptr, size_t size,
             const char *filename, const char *funcname, size_t linenr);
@@ -619,6 +804,29 @@ char* gbStrcpy(char *dest, const char *src, size_t destbytes,
 
 void gbFree(void *ptrptr);
 
+int gbArenaAlloc(gbArena *arena, void *ptrptr, size_t size,
+                 const char *filename, const char *funcname, size_t linenr);
+
+int gbArenaAllocN(gbArena *arena, void *ptrptr, size_t size, size_t count,
+                  const char *filename, const char *funcname, size_t linenr);
+
+int gbArenaStrdup(gbArena *arena, char **dest, const char *src,
+                  const char *filename, const char *funcname, size_t linenr);
+
+int gbArenaAsprintf(gbArena *arena, char **ptr, const char *fmt, ...)
+                    __attribute__ ((format (printf, 3, 4)));
+
+void gbArenaFree(gbArena *arena);
+
+int gbStrBufAppendf(gbStrBuf *sb, const char *fmt, ...)
+                    __attribute__ ((format (printf, 2, 3)));
+
+void gbStrBufAttach(gbStrBuf *sb, char *str);
+
+char *gbStrBufDetach(gbStrBuf *sb);
+
+void gbStrBufFree(gbStrBuf *sb);
+
 void glusterBlockDestroyConfig(struct gbConfig *cfg);
 
 gbConfig *glusterBlockSetupConfig(const char *path);